@@ -0,0 +1,621 @@
+/* virt-alignment-scan
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+#ifdef HAVE_LIBVIRT
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#endif
+
+#include "progname.h"
+
+#define GUESTFS_PRIVATE_FOR_EACH_DISK 1
+
+#include "guestfs.h"
+#include "options.h"
+#include "virt-alignment-scan.h"
+
+#ifdef HAVE_LIBVIRT
+
+/* Limit the number of devices we will ever add to the appliance.  See
+ * the comment in df/domains.c.
+ */
+#define MAX_DISKS 25
+
+/* The list of domains and disks that we build up in
+ * scan_all_domains.
+ */
+struct disk {
+  struct disk *next;
+  char *filename;
+  char *format; /* could be NULL */
+};
+
+struct domain {
+  char *name;
+  char *uuid;
+  struct disk *disks;
+  size_t nr_disks;
+
+  /* Results of the scan, printed once all the threads have finished. */
+  char *output;
+  size_t output_len;
+  int exit_code;                /* from scan, or -1 on error */
+  int not_added;                /* its disks could not be added */
+};
+
+static struct domain *domains = NULL;
+static size_t nr_domains;
+
+/* Domains [first..first+n-1] are scanned with one handle (and at
+ * most one appliance).
+ */
+struct batch {
+  size_t first;
+  size_t n;
+};
+
+static struct batch *batches = NULL;
+static size_t nr_batches;
+
+/* The worker threads take the next batch from the list. */
+static pthread_mutex_t next_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_batch = 0;
+
+/* Settings copied from the handle created in main. */
+static int handle_verbose, handle_trace;
+
+static int
+compare_domain_names (const void *p1, const void *p2)
+{
+  const struct domain *d1 = p1;
+  const struct domain *d2 = p2;
+
+  return strcmp (d1->name, d2->name);
+}
+
+static void
+free_domain (struct domain *domain)
+{
+  struct disk *disk, *next;
+
+  for (disk = domain->disks; disk; disk = next) {
+    next = disk->next;
+    free (disk->filename);
+    free (disk->format);
+    free (disk);
+  }
+
+  free (domain->name);
+  free (domain->uuid);
+  free (domain->output);
+}
+
+static void add_domains_by_id (virConnectPtr conn, int *ids, size_t n);
+static void add_domains_by_name (virConnectPtr conn, char **names, size_t n);
+static void add_domain (virDomainPtr dom);
+static int add_disk (guestfs_h *g, const char *filename, const char *format, int readonly, void *domain_vp);
+static void make_batches (void);
+static size_t estimate_max_threads (void);
+static void *worker_thread (void *arg);
+
+/* Scan every libvirt domain.  Returns the exit code for the program:
+ * the worst alignment found (0, 2 or 3), or 1 if any guest could not
+ * be scanned.
+ */
+int
+scan_all_domains (size_t max_threads)
+{
+  virErrorPtr err;
+  virConnectPtr conn;
+  int n, r;
+  size_t i;
+  int exit_code = 0, errors = 0;
+
+  /* Each thread creates its own handle, but we need the global handle
+   * (created in main) to read the list of disks.
+   */
+  handle_verbose = guestfs_get_verbose (g);
+  handle_trace = guestfs_get_trace (g);
+
+  nr_domains = 0;
+  domains = NULL;
+
+  /* Get the list of all domains. */
+  conn = virConnectOpenReadOnly (libvirt_uri);
+  if (!conn) {
+    err = virGetLastError ();
+    fprintf (stderr,
+             _("%s: could not connect to libvirt (code %d, domain %d): %s"),
+             program_name, err->code, err->domain, err->message);
+    exit (EXIT_FAILURE);
+  }
+
+  n = virConnectNumOfDomains (conn);
+  if (n == -1) {
+    err = virGetLastError ();
+    fprintf (stderr,
+             _("%s: could not get number of running domains (code %d, domain %d): %s"),
+             program_name, err->code, err->domain, err->message);
+    exit (EXIT_FAILURE);
+  }
+
+  int ids[n];
+  n = virConnectListDomains (conn, ids, n);
+  if (n == -1) {
+    err = virGetLastError ();
+    fprintf (stderr,
+             _("%s: could not list running domains (code %d, domain %d): %s"),
+             program_name, err->code, err->domain, err->message);
+    exit (EXIT_FAILURE);
+  }
+
+  add_domains_by_id (conn, ids, n);
+
+  n = virConnectNumOfDefinedDomains (conn);
+  if (n == -1) {
+    err = virGetLastError ();
+    fprintf (stderr,
+             _("%s: could not get number of inactive domains (code %d, domain %d): %s"),
+             program_name, err->code, err->domain, err->message);
+    exit (EXIT_FAILURE);
+  }
+
+  char *names[n];
+  n = virConnectListDefinedDomains (conn, names, n);
+  if (n == -1) {
+    err = virGetLastError ();
+    fprintf (stderr,
+             _("%s: could not list inactive domains (code %d, domain %d): %s"),
+             program_name, err->code, err->domain, err->message);
+    exit (EXIT_FAILURE);
+  }
+
+  add_domains_by_name (conn, names, n);
+
+  /* You must free these even though the libvirt documentation doesn't
+   * mention it.
+   */
+  for (i = 0; i < (size_t) n; ++i)
+    free (names[i]);
+
+  virConnectClose (conn);
+
+  guestfs_close (g);
+  g = NULL;
+
+  /* No domains? */
+  if (nr_domains == 0)
+    return 0;
+
+  /* Sort the domains alphabetically by name for display. */
+  qsort (domains, nr_domains, sizeof (struct domain), compare_domain_names);
+
+  make_batches ();
+
+  if (max_threads == 0)
+    max_threads = estimate_max_threads ();
+  if (max_threads > nr_batches)
+    max_threads = nr_batches;
+  if (verbose)
+    fprintf (stderr, "%s: %zu domains in %zu batches, using %zu threads\n",
+             program_name, nr_domains, nr_batches, max_threads);
+
+  pthread_t threads[max_threads];
+  for (i = 0; i < max_threads; ++i) {
+    r = pthread_create (&threads[i], NULL, worker_thread, NULL);
+    if (r != 0) {
+      fprintf (stderr, "%s: pthread_create: %s\n",
+               program_name, strerror (r));
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < max_threads; ++i) {
+    r = pthread_join (threads[i], NULL);
+    if (r != 0) {
+      fprintf (stderr, "%s: pthread_join: %s\n",
+               program_name, strerror (r));
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Print the results in the order of the domain names, regardless of
+   * which thread finished first.
+   */
+  for (i = 0; i < nr_domains; ++i) {
+    if (domains[i].output)
+      fwrite (domains[i].output, 1, domains[i].output_len, stdout);
+    if (domains[i].exit_code == -1)
+      errors++;
+    else if (domains[i].exit_code > exit_code)
+      exit_code = domains[i].exit_code;
+  }
+
+  /* Free up domains structure. */
+  for (i = 0; i < nr_domains; ++i)
+    free_domain (&domains[i]);
+  free (domains);
+  free (batches);
+
+  return errors > 0 ? 1 : exit_code;
+}
+
+static void
+add_domains_by_id (virConnectPtr conn, int *ids, size_t n)
+{
+  size_t i;
+  virDomainPtr dom;
+
+  for (i = 0; i < n; ++i) {
+    if (ids[i] != 0) {          /* RHBZ#538041 */
+      dom = virDomainLookupByID (conn, ids[i]);
+      if (dom) { /* transient errors are possible here, ignore them */
+        add_domain (dom);
+        virDomainFree (dom);
+      }
+    }
+  }
+}
+
+static void
+add_domains_by_name (virConnectPtr conn, char **names, size_t n)
+{
+  size_t i;
+  virDomainPtr dom;
+
+  for (i = 0; i < n; ++i) {
+    dom = virDomainLookupByName (conn, names[i]);
+    if (dom) { /* transient errors are possible here, ignore them */
+      add_domain (dom);
+      virDomainFree (dom);
+    }
+  }
+}
+
+static void
+add_domain (virDomainPtr dom)
+{
+  struct domain *domain;
+
+  domains = realloc (domains, (nr_domains + 1) * sizeof (struct domain));
+  if (domains == NULL) {
+    perror ("realloc");
+    exit (EXIT_FAILURE);
+  }
+
+  domain = &domains[nr_domains];
+  nr_domains++;
+
+  memset (domain, 0, sizeof *domain);
+
+  domain->name = strdup (virDomainGetName (dom));
+  if (domain->name == NULL) {
+    perror ("strdup");
+    exit (EXIT_FAILURE);
+  }
+
+  char uuid_str[VIR_UUID_STRING_BUFLEN];
+  if (virDomainGetUUIDString (dom, uuid_str) == 0) {
+    domain->uuid = strdup (uuid_str);
+    if (domain->uuid == NULL) {
+      perror ("strdup");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  int n = guestfs___for_each_disk (g, dom, add_disk, domain);
+  if (n == -1)
+    exit (EXIT_FAILURE);
+  domain->nr_disks = n;
+
+  if (domain->nr_disks > MAX_DISKS) {
+    fprintf (stderr,
+             _("%s: ignoring %s, it has too many disks (%zu > %d)"),
+             program_name, domain->name, domain->nr_disks, MAX_DISKS);
+    free_domain (domain);
+    nr_domains--;
+    return;
+  }
+}
+
+static int
+add_disk (guestfs_h *g,
+          const char *filename, const char *format, int readonly,
+          void *domain_vp)
+{
+  struct domain *domain = domain_vp;
+  struct disk *disk;
+
+  disk = malloc (sizeof *disk);
+  if (disk == NULL) {
+    perror ("malloc");
+    return -1;
+  }
+
+  disk->next = domain->disks;
+  domain->disks = disk;
+
+  disk->filename = strdup (filename);
+  if (disk->filename == NULL) {
+    perror ("malloc");
+    return -1;
+  }
+  if (format) {
+    disk->format = strdup (format);
+    if (disk->format == NULL) {
+      perror ("malloc");
+      return -1;
+    }
+  }
+  else
+    disk->format = NULL;
+
+  return 0;
+}
+
+/* To minimize the number of times we have to launch the appliance,
+ * shuffle as many domains together as we can, but not exceeding
+ * MAX_DISKS per handle.
+ */
+static void
+make_batches (void)
+{
+  size_t i, j, nr_disks_added;
+
+  nr_batches = 0;
+  batches = malloc (nr_domains * sizeof (struct batch));
+  if (batches == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < nr_domains; /**/) {
+    nr_disks_added = 0;
+
+    for (j = i; j < nr_domains; ++j) {
+      if (nr_disks_added + domains[j].nr_disks > MAX_DISKS)
+        break;
+      nr_disks_added += domains[j].nr_disks;
+    }
+
+    batches[nr_batches].first = i;
+    batches[nr_batches].n = j-i;
+    nr_batches++;
+
+    i = j;
+  }
+}
+
+/* Each thread may run an appliance, so limit the number of threads to
+ * the number of CPUs, and to what fits in free memory (allowing twice
+ * the appliance memory size for each qemu process).
+ */
+static size_t
+estimate_max_threads (void)
+{
+  long cpus, pages, pagesize;
+  uint64_t mem_per_thread, by_mem;
+  size_t n = 1;
+  guestfs_h *g2;
+  int memsize;
+
+  cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (cpus > 0)
+    n = cpus;
+
+  g2 = guestfs_create ();
+  if (g2 == NULL)
+    return 1;
+  memsize = guestfs_get_memsize (g2);
+  guestfs_close (g2);
+
+  pages = sysconf (_SC_AVPHYS_PAGES);
+  pagesize = sysconf (_SC_PAGESIZE);
+  if (memsize > 0 && pages > 0 && pagesize > 0) {
+    mem_per_thread = (uint64_t) memsize * 2 * 1024 * 1024;
+    by_mem = (uint64_t) pages * pagesize / mem_per_thread;
+    if (by_mem < n)
+      n = by_mem;
+  }
+
+  return n > 0 ? n : 1;
+}
+
+static size_t
+count_strings (char **argv)
+{
+  size_t i;
+
+  for (i = 0; argv[i] != NULL; ++i)
+    ;
+  return i;
+}
+
+static int
+add_disks_to_handle_reverse (guestfs_h *g, struct disk *disk)
+{
+  if (disk == NULL)
+    return 0;
+
+  if (add_disks_to_handle_reverse (g, disk->next) == -1)
+    return -1;
+
+  struct guestfs_add_drive_opts_argv optargs = { .bitmask = 0 };
+
+  optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_READONLY_BITMASK;
+  optargs.readonly = 1;
+
+  if (disk->format) {
+    optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_FORMAT_BITMASK;
+    optargs.format = disk->format;
+  }
+
+  return guestfs_add_drive_opts_argv (g, disk->filename, &optargs);
+}
+
+/* Scan the domain(s) in the batch.  If 'launched' is false, only the
+ * domains where the partition tables can't be read on the host are
+ * left with exit_code == -2, and the caller launches the appliance and
+ * calls this again.  Domains whose disks could not be added to the
+ * handle are skipped.
+ */
+static void
+scan_domains (guestfs_h *g, struct domain *doms, size_t n, int launched)
+{
+  size_t i, nd;
+  char **devices;
+  FILE *fp;
+
+  devices = guestfs_list_devices (g);
+  if (devices == NULL) {
+    for (i = 0; i < n; ++i)
+      if (!doms[i].not_added && (!launched || doms[i].exit_code == -2))
+        doms[i].exit_code = -1;
+    return;
+  }
+
+  nd = 0;
+  for (i = 0; i < n; ++i)
+    if (!doms[i].not_added)
+      nd += doms[i].nr_disks;
+  assert (nd == count_strings (devices));
+
+  nd = 0;
+  for (i = 0; i < n; ++i) {
+    if (doms[i].not_added)
+      continue;
+    if (launched && doms[i].exit_code != -2) {
+      nd += doms[i].nr_disks;
+      continue;
+    }
+
+    /* So that &devices[nd] is a NULL-terminated list of strings. */
+    char *p = devices[nd + doms[i].nr_disks];
+    devices[nd + doms[i].nr_disks] = NULL;
+
+    fp = open_memstream (&doms[i].output, &doms[i].output_len);
+    if (fp == NULL) {
+      perror ("open_memstream");
+      doms[i].exit_code = -1;
+    }
+    else {
+      const char *prefix =
+        uuid && doms[i].uuid ? doms[i].uuid : doms[i].name;
+
+      doms[i].exit_code =
+        scan (g, prefix, &devices[nd], nd, launched, fp);
+      fclose (fp);
+      if (doms[i].exit_code == -2) {
+        free (doms[i].output);
+        doms[i].output = NULL;
+        doms[i].output_len = 0;
+      }
+    }
+
+    /* Restore devices to original. */
+    devices[nd + doms[i].nr_disks] = p;
+    nd += doms[i].nr_disks;
+  }
+
+  free_strings (devices);
+}
+
+static void
+scan_batch (struct batch *batch)
+{
+  struct domain *doms = &domains[batch->first];
+  size_t i;
+  int need_launch = 0;
+  guestfs_h *g;
+
+ again:
+  g = guestfs_create ();
+  if (g == NULL) {
+    fprintf (stderr, _("guestfs_create: failed to create handle\n"));
+    for (i = 0; i < batch->n; ++i)
+      doms[i].exit_code = -1;
+    return;
+  }
+  guestfs_set_verbose (g, handle_verbose);
+  guestfs_set_trace (g, handle_trace);
+
+  /* Add all the disks to the handle (since they were added in reverse
+   * order, we must add them here in reverse too).  This runs in a
+   * worker thread, so if a domain's disks can't be added, record the
+   * error on that domain and start again with a new handle without it
+   * (some of its disks may already be on this handle).
+   */
+  for (i = 0; i < batch->n; ++i) {
+    if (doms[i].not_added)
+      continue;
+    if (add_disks_to_handle_reverse (g, doms[i].disks) == -1) {
+      doms[i].not_added = 1;
+      doms[i].exit_code = -1;
+      guestfs_close (g);
+      goto again;
+    }
+  }
+
+  /* Try to scan every domain without the appliance first. */
+  scan_domains (g, doms, batch->n, 0);
+
+  for (i = 0; i < batch->n; ++i)
+    if (doms[i].exit_code == -2)
+      need_launch = 1;
+
+  if (need_launch) {
+    if (guestfs_launch (g) == -1) {
+      for (i = 0; i < batch->n; ++i)
+        if (doms[i].exit_code == -2)
+          doms[i].exit_code = -1;
+    }
+    else
+      scan_domains (g, doms, batch->n, 1);
+  }
+
+  guestfs_close (g);
+}
+
+static void *
+worker_thread (void *arg)
+{
+  struct batch *batch;
+
+  for (;;) {
+    pthread_mutex_lock (&next_batch_lock);
+    if (next_batch >= nr_batches) {
+      pthread_mutex_unlock (&next_batch_lock);
+      return NULL;
+    }
+    batch = &batches[next_batch++];
+    pthread_mutex_unlock (&next_batch_lock);
+
+    scan_batch (batch);
+  }
+}
+
+#endif
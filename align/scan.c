@@ -39,6 +39,7 @@
 
 #include "guestfs.h"
 #include "options.h"
+#include "virt-alignment-scan.h"
 
 /* These globals are shared with options.c. */
 guestfs_h *g;
@@ -51,9 +52,8 @@ int echo_keys = 0;
 const char *libvirt_uri = NULL;
 int inspector = 0;
 
-static int quiet = 0;           /* --quiet */
-
-static int scan (void);
+int quiet = 0;                  /* --quiet */
+int uuid = 0;                   /* --uuid */
 
 static inline char *
 bad_cast (char const *s)
@@ -74,19 +74,22 @@ usage (int status)
              "Usage:\n"
              "  %s [--options] -d domname\n"
              "  %s [--options] -a disk.img [-a disk.img ...]\n"
+             "  %s [--options]\n"
              "Options:\n"
              "  -a|--add image       Add image\n"
              "  -c|--connect uri     Specify libvirt URI for -d option\n"
              "  -d|--domain guest    Add disks from libvirt guest\n"
              "  --format[=raw|..]    Force disk format for -a option\n"
              "  --help               Display brief help\n"
+             "  -P nr_threads        Scan up to nr_threads guests in parallel\n"
              "  -q|--quiet           No output, just exit code\n"
+             "  --uuid               Print UUIDs instead of names\n"
              "  -v|--verbose         Verbose messages\n"
              "  -V|--version         Display version and exit\n"
              "  -x                   Trace libguestfs API calls\n"
              "For more information, see the manpage %s(1).\n"),
              program_name, program_name, program_name,
-             program_name);
+             program_name, program_name);
   }
   exit (status);
 }
@@ -103,7 +106,7 @@ main (int argc, char *argv[])
 
   enum { HELP_OPTION = CHAR_MAX + 1 };
 
-  static const char *options = "a:c:d:qvVx";
+  static const char *options = "a:c:d:P:qvVx";
   static const struct option long_options[] = {
     { "add", 1, 0, 'a' },
     { "connect", 1, 0, 'c' },
@@ -111,6 +114,7 @@ main (int argc, char *argv[])
     { "format", 2, 0, 0 },
     { "help", 0, 0, HELP_OPTION },
     { "quiet", 0, 0, 'q' },
+    { "uuid", 0, 0, 0 },
     { "verbose", 0, 0, 'v' },
     { "version", 0, 0, 'V' },
     { 0, 0, 0, 0 }
@@ -121,6 +125,8 @@ main (int argc, char *argv[])
   int c;
   int option_index;
   int exit_code;
+  size_t max_threads = 0;
+  char **devices;
 
   g = guestfs_create ();
   if (g == NULL) {
@@ -141,6 +147,8 @@ main (int argc, char *argv[])
           format = NULL;
         else
           format = optarg;
+      } else if (STREQ (long_options[option_index].name, "uuid")) {
+        uuid = 1;
       } else {
         fprintf (stderr, _("%s: unknown long option: %s (%d)\n"),
                  program_name, long_options[option_index].name, option_index);
@@ -160,6 +168,14 @@ main (int argc, char *argv[])
       OPTION_d;
       break;
 
+    case 'P':
+      if (sscanf (optarg, "%zu", &max_threads) != 1 || max_threads == 0) {
+        fprintf (stderr, _("%s: -P option is not numeric and greater than 0\n"),
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case 'q':
       quiet = 1;
       break;
@@ -196,60 +212,164 @@ main (int argc, char *argv[])
   if (optind != argc)
     usage (EXIT_FAILURE);
 
-  /* The user didn't specify any drives to scan. */
-  if (drvs == NULL)
-    usage (EXIT_FAILURE);
+  /* If the user didn't specify any drives, then we ask libvirt for
+   * the full list of guests and drives, which we scan in batches.
+   */
+  if (drvs == NULL) {
+#ifdef HAVE_LIBVIRT
+    exit_code = scan_all_domains (max_threads);
+    exit (exit_code);
+#else
+    fprintf (stderr, _("%s: compiled without support for libvirt.\n"),
+             program_name);
+    exit (EXIT_FAILURE);
+#endif
+  }
 
   /* Add domains/drives from the command line (for a single guest). */
   add_drives (drvs, 'a');
 
-  if (guestfs_launch (g) == -1)
-    exit (EXIT_FAILURE);
-
   /* Free up data structures, no longer needed after this point. */
   free_drives (drvs);
 
-  /* Perform the scan. */
-  exit_code = scan ();
+  /* Perform the scan.  First try to read the partition tables
+   * directly from the disk images, which only works for some image
+   * formats but is much faster than launching the appliance.
+   */
+  devices = guestfs_list_devices (g);
+  if (devices == NULL)
+    exit (EXIT_FAILURE);
+
+  exit_code = scan (g, NULL, devices, 0, 0, stdout);
+  if (exit_code == -2) {
+    free_strings (devices);
+
+    if (guestfs_launch (g) == -1)
+      exit (EXIT_FAILURE);
+
+    devices = guestfs_list_devices (g);
+    if (devices == NULL)
+      exit (EXIT_FAILURE);
 
+    exit_code = scan (g, NULL, devices, 0, 1, stdout);
+  }
+  if (exit_code == -1)
+    exit (EXIT_FAILURE);
+
+  free_strings (devices);
   guestfs_close (g);
 
   exit (exit_code);
 }
 
-static int
-scan (void)
+void
+free_strings (char **argv)
+{
+  size_t i;
+
+  for (i = 0; argv[i] != NULL; ++i)
+    free (argv[i]);
+  free (argv);
+}
+
+/* Read the partition tables of all devices.  If the appliance hasn't
+ * been launched, the library reads them on the host (see
+ * guestfs_part_list).  If that fails then this returns NULL with
+ * *need_launch set, so that the caller can launch and try again.
+ */
+static struct guestfs_partition_list **
+get_partitions (guestfs_h *g, char **devices, int launched, int *need_launch)
+{
+  struct guestfs_partition_list **parts;
+  guestfs_error_handler_cb old_error_cb = NULL;
+  void *old_error_data = NULL;
+  size_t i, n;
+
+  for (n = 0; devices[n] != NULL; ++n)
+    ;
+
+  parts = calloc (n, sizeof *parts);
+  if (parts == NULL) {
+    perror ("calloc");
+    return NULL;
+  }
+
+  if (!launched) {
+    old_error_cb = guestfs_get_error_handler (g, &old_error_data);
+    guestfs_set_error_handler (g, NULL, NULL);
+  }
+
+  for (i = 0; i < n; ++i) {
+    parts[i] = guestfs_part_list (g, devices[i]);
+    if (parts[i] == NULL) {
+      if (!launched) {
+        if (verbose)
+          fprintf (stderr, "%s: %s: launching the appliance\n",
+                   program_name, guestfs_last_error (g));
+        *need_launch = 1;
+      }
+      while (i > 0)
+        guestfs_free_partition_list (parts[--i]);
+      free (parts);
+      parts = NULL;
+      break;
+    }
+  }
+
+  if (!launched)
+    guestfs_set_error_handler (g, old_error_cb, old_error_data);
+
+  return parts;
+}
+
+/* Scan the partitions on 'devices' and write the results to 'fp'.
+ * The device names are printed relative to 'offset' (so that the
+ * first device is always /dev/sda) and prefixed by 'prefix:' if
+ * 'prefix' is not NULL.
+ *
+ * Returns the exit code (0, 2 or 3), or -1 on error.  If 'launched'
+ * is false and the partition tables can't be read without the
+ * appliance, returns -2 without writing anything.
+ */
+int
+scan (guestfs_h *g, const char *prefix, char **devices, int offset,
+      int launched, FILE *fp)
 {
   int exit_code = 0;
-  char **devices;
+  int need_launch = 0;
   size_t i, j;
   size_t alignment;
   uint64_t start;
-  struct guestfs_partition_list *parts;
+  struct guestfs_partition_list **all_parts, *parts;
 
-  devices = guestfs_list_devices (g);
-  if (devices == NULL)
-    exit (EXIT_FAILURE);
+  all_parts = get_partitions (g, devices, launched, &need_launch);
+  if (all_parts == NULL)
+    return need_launch ? -2 : -1;
 
   for (i = 0; devices[i] != NULL; ++i) {
-    parts = guestfs_part_list (g, devices[i]);
-    if (parts == NULL)
-      exit (EXIT_FAILURE);
+    parts = all_parts[i];
 
     /* Canonicalize the name of the device for printing. */
-    if (STRPREFIX (devices[i], "/dev/") &&
-        (devices[i][5] == 'h' || devices[i][5] == 'v') &&
-        devices[i][6] == 'd' &&
-        c_isalpha (devices[i][7]))
-      devices[i][5] = 's';
+    char dev[strlen (devices[i]) + 1];
+    strcpy (dev, devices[i]);
+    if (STRPREFIX (dev, "/dev/") &&
+        (dev[5] == 's' || dev[5] == 'h' || dev[5] == 'v') &&
+        dev[6] == 'd' &&
+        c_isalpha (dev[7])) {
+      dev[5] = 's';
+      dev[7] -= offset;
+    }
 
     for (j = 0; j < parts->len; ++j) {
       /* Start offset of the partition in bytes. */
       start = parts->val[j].part_start;
 
-      if (!quiet)
-        printf ("%s%d %12" PRIu64 " ",
-                devices[i], (int) parts->val[j].part_num, start);
+      if (!quiet) {
+        if (prefix)
+          fprintf (fp, "%s:", prefix);
+        fprintf (fp, "%s%d %12" PRIu64 " ",
+                 dev, (int) parts->val[j].part_num, start);
+      }
 
       /* What's the alignment? */
       if (start == 0)           /* Probably not possible, but anyway. */
@@ -260,32 +380,31 @@ scan (void)
 
       if (!quiet) {
         if (alignment < 10)
-          printf ("%12" PRIu64 "    ", UINT64_C(1) << alignment);
+          fprintf (fp, "%12" PRIu64 "    ", UINT64_C(1) << alignment);
         else if (alignment < 64)
-          printf ("%12" PRIu64 "K   ", UINT64_C(1) << (alignment - 10));
+          fprintf (fp, "%12" PRIu64 "K   ", UINT64_C(1) << (alignment - 10));
         else
-          printf ("- ");
+          fprintf (fp, "- ");
       }
 
       if (alignment < 12) {     /* Bad in general: < 4K alignment */
         exit_code = 3;
         if (!quiet)
-          printf ("bad (%s)\n", _("alignment < 4K"));
+          fprintf (fp, "bad (%s)\n", _("alignment < 4K"));
       } else if (alignment < 16) { /* Bad on NetApps: < 64K alignment */
         if (exit_code < 2)
           exit_code = 2;
         if (!quiet)
-          printf ("bad (%s)\n", _("alignment < 64K"));
+          fprintf (fp, "bad (%s)\n", _("alignment < 64K"));
       } else {
         if (!quiet)
-          printf ("ok\n");
+          fprintf (fp, "ok\n");
       }
     }
 
     guestfs_free_partition_list (parts);
-    free (devices[i]);
   }
-  free (devices);
+  free (all_parts);
 
   return exit_code;
 }
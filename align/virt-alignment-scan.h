@@ -0,0 +1,34 @@
+/* virt-alignment-scan
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef GUESTFS_VIRT_ALIGNMENT_SCAN_
+#define GUESTFS_VIRT_ALIGNMENT_SCAN_
+
+extern int quiet;               /* --quiet */
+extern int uuid;                /* --uuid */
+
+/* scan.c */
+extern int scan (guestfs_h *g, const char *prefix, char **devices, int offset, int launched, FILE *fp);
+extern void free_strings (char **argv);
+
+/* domains.c */
+#ifdef HAVE_LIBVIRT
+extern int scan_all_domains (size_t max_threads);
+#endif
+
+#endif /* GUESTFS_VIRT_ALIGNMENT_SCAN_ */
@@ -501,29 +501,100 @@ do_output_filesystems (void)
   free (fses);
 }
 
+/* Find the topology entry for an LV called /dev/VG/LV.  Returns NULL
+ * if the LV doesn't occupy space on any PV (eg. thin volumes).
+ */
+static struct guestfs_lvm_pvseg *
+find_lv_segment (struct guestfs_lvm_pvseg_list *segs, const char *lv)
+{
+  size_t i, len;
+
+  if (segs == NULL || !STRPREFIX (lv, "/dev/"))
+    return NULL;
+  lv += 5;
+
+  for (i = 0; i < segs->len; ++i) {
+    len = strlen (segs->val[i].pvseg_vg_name);
+    if (segs->val[i].pvseg_lv_name[0] != '\0' &&
+        STREQLEN (lv, segs->val[i].pvseg_vg_name, len) &&
+        lv[len] == '/' &&
+        STREQ (&lv[len+1], segs->val[i].pvseg_lv_name))
+      return &segs->val[i];
+  }
+
+  return NULL;
+}
+
+/* Format a UUID the way that guestfs_lvuuid returns it. */
+static char *
+lvm_uuid_string (const char *uuid)
+{
+  static const int groups[] = { 6, 4, 4, 4, 4, 4, 6 };
+  char *ret, *p;
+  size_t i;
+
+  ret = p = malloc (32 + 6 + 1);
+  if (ret == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < sizeof groups / sizeof groups[0]; ++i) {
+    if (i > 0)
+      *p++ = '-';
+    memcpy (p, uuid, groups[i]);
+    p += groups[i];
+    uuid += groups[i];
+  }
+  *p = '\0';
+
+  return ret;
+}
+
 static void
 do_output_lvs (void)
 {
   char **lvs;
+  struct guestfs_lvm_pvseg_list *segs = NULL;
+  struct guestfs_lvm_pvseg *seg;
   size_t i;
 
   lvs = guestfs_lvs (g);
   if (lvs == NULL)
     exit (EXIT_FAILURE);
 
+  /* Get the size and UUID of all LVs in a single call, rather than
+   * two calls per LV.
+   */
+  if ((columns & (COLUMN_SIZE | COLUMN_UUID))) {
+    segs = guestfs_lvm_topology (g);
+    if (segs == NULL)
+      exit (EXIT_FAILURE);
+  }
+
   for (i = 0; lvs[i] != NULL; ++i) {
     char *uuid = NULL, *parent_name = NULL;
     int64_t size = -1;
 
+    seg = find_lv_segment (segs, lvs[i]);
+
     if ((columns & COLUMN_SIZE)) {
-      size = guestfs_blockdev_getsize64 (g, lvs[i]);
-      if (size == -1)
-        exit (EXIT_FAILURE);
+      if (seg)
+        size = (int64_t) seg->pvseg_lv_size;
+      else {
+        size = guestfs_blockdev_getsize64 (g, lvs[i]);
+        if (size == -1)
+          exit (EXIT_FAILURE);
+      }
     }
     if ((columns & COLUMN_UUID)) {
-      uuid = guestfs_lvuuid (g, lvs[i]);
-      if (uuid == NULL)
-        exit (EXIT_FAILURE);
+      if (seg)
+        uuid = lvm_uuid_string (seg->pvseg_lv_uuid);
+      else {
+        uuid = guestfs_lvuuid (g, lvs[i]);
+        if (uuid == NULL)
+          exit (EXIT_FAILURE);
+      }
     }
     if ((columns & COLUMN_PARENT_NAME)) {
       parent_name = strdup (lvs[i]);
@@ -545,6 +616,8 @@ do_output_lvs (void)
   }
 
   free (lvs);
+  if (segs)
+    guestfs_free_lvm_pvseg_list (segs);
 }
 
 static void
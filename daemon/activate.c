@@ -0,0 +1,239 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "c-ctype.h"
+
+#include "daemon.h"
+#include "actions.h"
+
+/* Lazy storage stack activation (MD arrays and LVM volume groups).
+ *
+ * This used to be done by /init for every disk before the daemon was
+ * started.  Guests with many PVs paid for it on every launch, even if
+ * the caller never looked at LVM.  Now nothing is activated at boot.
+ *
+ * When a call refers to a device which doesn't exist yet, the
+ * RESOLVE_DEVICE macro calls activate_storage_for_device which
+ * activates just the VG named in the path (/dev/VG/LV), or assembles
+ * the MD arrays (/dev/md*).  Calls which list LVM or MD objects call
+ * activate_md or activate_all_storage first, since the caller expects
+ * the listed devices to be usable.
+ *
+ * A VG which appears later (eg. on a LUKS device which has just been
+ * opened) is still activated when one of its LVs is referenced.  But
+ * once the caller has used vg-activate or vg-activate-all they are
+ * managing activation themselves, and we don't activate any VGs
+ * behind their back after that.
+ */
+
+static int md_assembled = 0;
+static int lvm_loaded = 0;
+static int lvm_all_active = 0;
+static int lvm_managed = 0;
+
+/* VGs which have been activated individually. */
+static char **active_vgs = NULL;
+static size_t nr_active_vgs = 0;
+
+static int64_t
+now_us (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+timing (const char *what, int64_t start_us)
+{
+  if (verbose)
+    fprintf (stderr, "guestfsd: activating %s took %" PRIi64 " ms\n",
+             what, (now_us () - start_us) / 1000);
+}
+
+void
+activate_md (void)
+{
+  int64_t start_us;
+
+  if (md_assembled)
+    return;
+  md_assembled = 1;
+
+  if (!prog_exists ("mdadm"))
+    return;
+
+  start_us = now_us ();
+  command (NULL, NULL, "mdadm", "-As", "--auto=yes", "--run", NULL);
+  udev_settle ();
+  timing ("MD arrays", start_us);
+}
+
+static void
+load_dm_mod (void)
+{
+  if (lvm_loaded)
+    return;
+  lvm_loaded = 1;
+  command (NULL, NULL, "modprobe", "dm_mod", NULL);
+}
+
+/* Activate one VG, or all VGs if vg == NULL.  Returns 0 if the VG
+ * could be activated, -1 if not.  No reply is sent.
+ */
+static int
+activate_vg (const char *vg)
+{
+  int64_t start_us;
+  int r;
+
+  load_dm_mod ();
+
+  start_us = now_us ();
+  if (vg == NULL) {
+    command (NULL, NULL, "lvm", "vgscan", "--ignorelockingfailure", NULL);
+    r = command (NULL, NULL, "lvm", "vgchange", "-ay",
+                 "--ignorelockingfailure", NULL);
+  }
+  else
+    r = command (NULL, NULL, "lvm", "vgchange", "-ay",
+                 "--ignorelockingfailure", vg, NULL);
+  udev_settle ();
+  timing (vg ? vg : "all VGs", start_us);
+
+  return r;
+}
+
+void
+activate_all_storage (void)
+{
+  activate_md ();
+
+  if (lvm_all_active || lvm_managed)
+    return;
+  lvm_all_active = 1;
+
+  activate_vg (NULL);
+}
+
+/* The caller is managing VG activation (see do_vg_activate). */
+void
+lvm_activation_managed (void)
+{
+  activate_md ();
+  load_dm_mod ();
+  lvm_managed = 1;
+}
+
+static int
+is_vg_active (const char *vg)
+{
+  size_t i;
+
+  for (i = 0; i < nr_active_vgs; ++i)
+    if (STREQ (active_vgs[i], vg))
+      return 1;
+  return 0;
+}
+
+/* Called from device_name_translation when 'device' cannot be
+ * opened.  Returns 1 if something was activated and it is worth
+ * trying to open the device again, or 0 if not.
+ */
+int
+activate_storage_for_device (const char *device)
+{
+  const char *p, *slash;
+  size_t len;
+
+  if (STRPREFIX (device, "/dev/sd") || STRPREFIX (device, "/dev/hd") ||
+      STRPREFIX (device, "/dev/vd"))
+    return 0;
+
+  if (STRPREFIX (device, "/dev/md")) {
+    if (md_assembled)
+      return 0;
+    activate_md ();
+    return 1;
+  }
+
+  if (lvm_managed)
+    return 0;
+
+  /* /dev/mapper/VG-LV and /dev/dm-N don't simply name the VG. */
+  if (STRPREFIX (device, "/dev/mapper/") || STRPREFIX (device, "/dev/dm-")) {
+    if (lvm_all_active)
+      return 0;
+    activate_all_storage ();
+    return 1;
+  }
+
+  /* /dev/VG/LV */
+  p = device + 5;
+  slash = strchr (p, '/');
+  if (slash == NULL || slash == p || strchr (slash+1, '/') != NULL ||
+      slash[1] == '\0')
+    return 0;
+  len = slash - p;
+
+  char vg[len+1];
+  memcpy (vg, p, len);
+  vg[len] = '\0';
+
+  for (p = vg; *p; ++p)
+    if (!c_isalnum (*p) && !strchr ("+_.-", *p))
+      return 0;
+
+  if (is_vg_active (vg))
+    return 0;
+
+  /* The VG's PVs might be on an MD array which hasn't been assembled. */
+  if (activate_vg (vg) == -1 && !md_assembled) {
+    activate_md ();
+    activate_vg (vg);
+  }
+
+  /* Only remember the VG if it exists, so that a bogus path can't
+   * grow the list.  If it doesn't exist, this call will fail anyway.
+   */
+  if (access (device, F_OK) == 0) {
+    char **p2 = realloc (active_vgs, (nr_active_vgs+1) * sizeof (char *));
+    char *vg_copy = strdup (vg);
+    if (p2 == NULL || vg_copy == NULL) {
+      /* Not fatal: we'll just activate it again next time. */
+      free (vg_copy);
+      if (p2)
+        active_vgs = p2;
+      return 1;
+    }
+    active_vgs = p2;
+    active_vgs[nr_active_vgs++] = vg_copy;
+  }
+
+  return 1;
+}
@@ -97,55 +97,18 @@ do_base64_in (const char *file)
 int
 do_base64_out (const char *file)
 {
+  char *buf;
   int r;
-  FILE *fp;
-  char *cmd;
-  char buf[GUESTFS_MAX_CHUNK_SIZE];
-
-  if (asprintf_nowarn (&cmd, "base64 %R", file) == -1) {
-    reply_with_perror ("asprintf");
-    return -1;
-  }
-
-  if (verbose)
-    fprintf (stderr, "%s\n", cmd);
 
-  fp = popen (cmd, "r");
-  if (fp == NULL) {
-    reply_with_perror ("%s", cmd);
-    free (cmd);
+  buf = sysroot_path (file);
+  if (buf == NULL) {
+    reply_with_perror ("malloc");
     return -1;
   }
-  free (cmd);
 
-  /* Now we must send the reply message, before the file contents.  After
-   * this there is no opportunity in the protocol to send any error
-   * message back.  Instead we can only cancel the transfer.
-   */
-  reply (NULL, NULL);
+  const char *argv[] = { "base64", buf, NULL };
+  r = commandv_out (argv);
+  free (buf);
 
-  while ((r = fread (buf, 1, sizeof buf, fp)) > 0) {
-    if (send_file_write (buf, r) < 0) {
-      pclose (fp);
-      return -1;
-    }
-  }
-
-  if (ferror (fp)) {
-    perror (file);
-    send_file_end (1);		/* Cancel. */
-    pclose (fp);
-    return -1;
-  }
-
-  if (pclose (fp) != 0) {
-    perror (file);
-    send_file_end (1);		/* Cancel. */
-    return -1;
-  }
-
-  if (send_file_end (0))	/* Normal end of file. */
-    return -1;
-
-  return 0;
+  return r;
 }
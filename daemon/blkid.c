@@ -24,15 +24,68 @@
 #include <unistd.h>
 #include <limits.h>
 
+#ifdef HAVE_LIBBLKID
+#include <blkid.h>
+#endif
+
 #include "daemon.h"
 #include "actions.h"
 
+#ifdef HAVE_LIBBLKID
+/* Same as get_blkid_tag below, but probing the superblock directly
+ * with libblkid instead of running the blkid program.
+ */
+static char *
+get_blkid_tag_inprocess (const char *device, const char *tag)
+{
+  blkid_probe pr;
+  const char *value;
+  char *ret;
+  int r;
+
+  pr = blkid_new_probe_from_filename (device);
+  if (pr == NULL) {
+    reply_with_perror ("%s", device);
+    return NULL;
+  }
+
+  blkid_probe_enable_superblocks (pr, 1);
+  blkid_probe_set_superblocks_flags (pr, BLKID_SUBLKS_TYPE |
+                                     BLKID_SUBLKS_LABEL | BLKID_SUBLKS_UUID);
+
+  r = blkid_do_safeprobe (pr);
+  if (r == -1) {
+    reply_with_error ("%s: blkid probe failed", device);
+    blkid_free_probe (pr);
+    return NULL;
+  }
+
+  /* r == 1 means nothing was found, and r == -2 means the probe was
+   * ambiguous.  The blkid program prints nothing in both cases.
+   */
+  if (r == 0 && blkid_probe_lookup_value (pr, tag, &value, NULL) == 0)
+    ret = strdup (value);
+  else
+    ret = strdup ("");
+  if (ret == NULL)
+    reply_with_perror ("strdup");
+
+  blkid_free_probe (pr);
+  return ret;                   /* caller frees */
+}
+#endif
+
 static char *
 get_blkid_tag (const char *device, const char *tag)
 {
   char *out, *err;
   int r;
 
+#ifdef HAVE_LIBBLKID
+  if (inprocess)
+    return get_blkid_tag_inprocess (device, tag);
+#endif
+
   r = commandr (&out, &err,
                 "blkid",
                 /* Adding -c option kills all caching, even on RHEL 5. */
@@ -21,17 +21,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "guestfs_protocol.h"
 #include "daemon.h"
 #include "actions.h"
 
+#include "ignore-value.h"
+
 #define DEST_FILE_FLAGS O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0666
 #define DEST_DEVICE_FLAGS O_WRONLY, 0
 
+/* Buffer size used for sparse copies.  Each buffer is checked for
+ * zeroes before it is written.
+ */
+#define SPARSE_BUFSIZ (64 * 1024)
+
+static int copy_sparse (int src_fd, const char *src, const char *src_display,
+                        int src_is_device, int dest_fd, const char *dest_display,
+                        int64_t srcoffset, int64_t destoffset, int64_t size);
+
 /* NB: We cheat slightly by assuming that optargs_bitmask is
  * compatible for all four of the calls.  This is true provided they
  * all take the same set of optional arguments.
@@ -41,8 +59,8 @@
 static int
 copy (const char *src, const char *src_display,
       const char *dest, const char *dest_display,
-      int wrflags, int wrmode,
-      int64_t srcoffset, int64_t destoffset, int64_t size)
+      int src_is_device, int wrflags, int wrmode,
+      int64_t srcoffset, int64_t destoffset, int64_t size, int sparse)
 {
   int64_t saved_size = size;
   int src_fd, dest_fd;
@@ -77,6 +95,9 @@ copy (const char *src, const char *src_display,
   else
     size = -1;
 
+  if (!(optargs_bitmask & GUESTFS_COPY_DEVICE_TO_DEVICE_SPARSE_BITMASK))
+    sparse = 0;
+
   /* Open source and destination. */
   src_fd = open (src, O_RDONLY);
   if (src_fd == -1) {
@@ -104,6 +125,17 @@ copy (const char *src, const char *src_display,
     return -1;
   }
 
+  if (sparse) {
+    if (copy_sparse (src_fd, src, src_display, src_is_device,
+                     dest_fd, dest_display,
+                     srcoffset, destoffset, size) == -1) {
+      close (src_fd);
+      close (dest_fd);
+      return -1;
+    }
+    size = 0;
+  }
+
   if (size == -1)
     pulse_mode_start ();
 
@@ -165,17 +197,115 @@ copy (const char *src, const char *src_display,
   return 0;
 }
 
+static int
+copy_sparse (int src_fd, const char *src, const char *src_display,
+             int src_is_device, int dest_fd, const char *dest_display,
+             int64_t srcoffset, int64_t destoffset, int64_t size)
+{
+  guestfs_int_extent *extents = NULL, whole;
+  size_t nr_extents, i;
+  uint64_t start, end, pos, extent_end;
+  struct stat statbuf;
+  char *buf;
+  ssize_t r;
+
+  if (size == -1) {
+    off_t src_size = lseek (src_fd, 0, SEEK_END);
+    if (src_size == (off_t) -1) {
+      reply_with_perror ("lseek: %s", src_display);
+      return -1;
+    }
+    size = src_size > srcoffset ? src_size - srcoffset : 0;
+  }
+  start = srcoffset;
+  end = srcoffset + size;
+
+  /* If the source is a filesystem we understand, only its used extents
+   * need to be read.  Otherwise read everything.
+   */
+  if (src_is_device &&
+      get_used_extents (src, &extents, &nr_extents) == -1)
+    return -1;
+  if (extents == NULL) {
+    whole.extent_offset = 0;
+    whole.extent_length = end;
+    extents = &whole;
+    nr_extents = 1;
+  }
+
+  buf = malloc (SPARSE_BUFSIZ);
+  if (buf == NULL) {
+    reply_with_perror ("malloc");
+    goto error;
+  }
+
+  for (i = 0; i < nr_extents; ++i) {
+    pos = MAX (extents[i].extent_offset, start);
+    extent_end = MIN (extents[i].extent_offset + extents[i].extent_length,
+                      end);
+
+    while (pos < extent_end) {
+      size_t n = MIN (extent_end - pos, SPARSE_BUFSIZ);
+
+      r = pread (src_fd, buf, n, pos);
+      if (r == -1) {
+        reply_with_perror ("pread: %s", src_display);
+        goto error;
+      }
+      if (r == 0) {
+        reply_with_error ("%s: input too short", src_display);
+        goto error;
+      }
+
+      if (!is_zero (buf, r) &&
+          pwrite (dest_fd, buf, r, destoffset + pos - start) != r) {
+        reply_with_perror ("pwrite: %s", dest_display);
+        goto error;
+      }
+
+      pos += r;
+      notify_progress (pos - start, (uint64_t) size);
+    }
+  }
+
+  /* Skipped blocks at the end of a file must still extend it. */
+  if (fstat (dest_fd, &statbuf) == -1) {
+    reply_with_perror ("fstat: %s", dest_display);
+    goto error;
+  }
+  if (S_ISREG (statbuf.st_mode) && statbuf.st_size < destoffset + size &&
+      ftruncate (dest_fd, destoffset + size) == -1) {
+    reply_with_perror ("ftruncate: %s", dest_display);
+    goto error;
+  }
+
+  notify_progress ((uint64_t) size, (uint64_t) size);
+
+  free (buf);
+  if (extents != &whole)
+    free (extents);
+  return 0;
+
+ error:
+  free (buf);
+  if (extents != &whole)
+    free (extents);
+  return -1;
+}
+
 int
 do_copy_device_to_device (const char *src, const char *dest,
-                          int64_t srcoffset, int64_t destoffset, int64_t size)
+                          int64_t srcoffset, int64_t destoffset, int64_t size,
+                          int sparse)
 {
-  return copy (src, src, dest, dest, DEST_DEVICE_FLAGS,
-               srcoffset, destoffset, size);
+  return copy (src, src, dest, dest, 1, DEST_DEVICE_FLAGS,
+               srcoffset, destoffset, size, sparse);
 }
 
 int
 do_copy_device_to_file (const char *src, const char *dest,
-                        int64_t srcoffset, int64_t destoffset, int64_t size)
+                        int64_t srcoffset, int64_t destoffset, int64_t size,
+                        int sparse)
 {
   char *dest_buf;
   int r;
@@ -186,8 +316,8 @@ do_copy_device_to_file (const char *src, const char *dest,
     return -1;
   }
 
-  r = copy (src, src, dest_buf, dest, DEST_FILE_FLAGS,
-            srcoffset, destoffset, size);
+  r = copy (src, src, dest_buf, dest, 1, DEST_FILE_FLAGS,
+            srcoffset, destoffset, size, sparse);
   free (dest_buf);
 
   return r;
@@ -195,7 +325,8 @@ do_copy_device_to_file (const char *src, const char *dest,
 
 int
 do_copy_file_to_device (const char *src, const char *dest,
-                        int64_t srcoffset, int64_t destoffset, int64_t size)
+                        int64_t srcoffset, int64_t destoffset, int64_t size,
+                        int sparse)
 {
   char *src_buf;
   int r;
@@ -206,8 +337,8 @@ do_copy_file_to_device (const char *src, const char *dest,
     return -1;
   }
 
-  r = copy (src_buf, src, dest, dest, DEST_DEVICE_FLAGS,
-            srcoffset, destoffset, size);
+  r = copy (src_buf, src, dest, dest, 0, DEST_DEVICE_FLAGS,
+            srcoffset, destoffset, size, sparse);
   free (src_buf);
 
   return r;
@@ -215,7 +346,8 @@ do_copy_file_to_device (const char *src, const char *dest,
 
 int
 do_copy_file_to_file (const char *src, const char *dest,
-                      int64_t srcoffset, int64_t destoffset, int64_t size)
+                      int64_t srcoffset, int64_t destoffset, int64_t size,
+                      int sparse)
 {
   char *src_buf, *dest_buf;
   int r;
@@ -233,10 +365,334 @@ do_copy_file_to_file (const char *src, const char *dest,
     return -1;
   }
 
-  r = copy (src_buf, src, dest_buf, dest, DEST_FILE_FLAGS,
-            srcoffset, destoffset, size);
+  r = copy (src_buf, src, dest_buf, dest, 0, DEST_FILE_FLAGS,
+            srcoffset, destoffset, size, sparse);
   free (src_buf);
   free (dest_buf);
 
   return r;
 }
+
+/* Parallel copy of whole devices (guestfs_copy_devices_to_devices).
+ * Each pair is copied by a forked worker, with up to one worker per
+ * appliance CPU.  Workers send the cumulative number of bytes copied
+ * (or minus errno on failure) back to the daemon over a pipe, and the
+ * daemon sums these to send a single progress bar for the whole call.
+ */
+struct copy_job {
+  const char *src, *dest;
+  int src_fd, dest_fd;
+  uint64_t size;                /* bytes to copy */
+  guestfs_int_extent *extents;  /* used extents, or NULL for all */
+  size_t nr_extents;
+  pid_t pid;
+  int progress_fd;              /* read side of worker pipe, or -1 */
+  uint64_t done;                /* bytes copied so far */
+  int err;                      /* errno from worker */
+};
+
+/* Send progress at most once per this many bytes. */
+#define WORKER_PROGRESS_INTERVAL (1024 * 1024)
+
+static int
+worker_send (int fd, int64_t v)
+{
+  return xwrite (fd, &v, sizeof v);
+}
+
+/* Runs in the worker process.  Returns 0 or errno. */
+static int
+copy_worker (struct copy_job *job, int sparse, int progress_fd)
+{
+  guestfs_int_extent whole;
+  guestfs_int_extent *extents = job->extents;
+  size_t nr_extents = job->nr_extents, i;
+  uint64_t pos, extent_end, last_sent = 0;
+  char *buf;
+  ssize_t r, w, written;
+  int err = 0;
+
+  if (extents == NULL) {
+    whole.extent_offset = 0;
+    whole.extent_length = job->size;
+    extents = &whole;
+    nr_extents = 1;
+  }
+
+  buf = malloc (SPARSE_BUFSIZ);
+  if (buf == NULL)
+    return errno;
+
+  for (i = 0; i < nr_extents; ++i) {
+    pos = extents[i].extent_offset;
+    extent_end = MIN (extents[i].extent_offset + extents[i].extent_length,
+                      job->size);
+
+    while (pos < extent_end) {
+      size_t n = MIN (extent_end - pos, SPARSE_BUFSIZ);
+
+      r = pread (job->src_fd, buf, n, pos);
+      if (r == -1) {
+        err = errno;
+        goto out;
+      }
+      if (r == 0) {
+        err = EIO;
+        goto out;
+      }
+
+      if (!sparse || !is_zero (buf, r)) {
+        /* pwrite may write less than asked, and then it doesn't set
+         * errno.
+         */
+        for (written = 0; written < r; written += w) {
+          w = pwrite (job->dest_fd, buf + written, r - written,
+                      pos + written);
+          if (w == -1) {
+            err = errno;
+            goto out;
+          }
+          if (w == 0) {
+            err = EIO;
+            goto out;
+          }
+        }
+      }
+
+      pos += r;
+      if (pos - last_sent >= WORKER_PROGRESS_INTERVAL) {
+        if (worker_send (progress_fd, pos) == -1) {
+          err = errno;
+          goto out;
+        }
+        last_sent = pos;
+      }
+    }
+  }
+
+  if (fsync (job->dest_fd) == -1) {
+    err = errno;
+    goto out;
+  }
+
+  if (worker_send (progress_fd, job->size) == -1)
+    err = errno;
+
+ out:
+  free (buf);
+  return err;
+}
+
+static int
+start_copy_job (struct copy_job *job, int sparse)
+{
+  int fd[2];
+  int err;
+
+  if (pipe2 (fd, O_CLOEXEC) == -1) {
+    reply_with_perror ("pipe2");
+    return -1;
+  }
+
+  job->pid = fork ();
+  if (job->pid == -1) {
+    reply_with_perror ("fork");
+    close (fd[0]);
+    close (fd[1]);
+    return -1;
+  }
+
+  if (job->pid == 0) {
+    close (fd[0]);
+    err = copy_worker (job, sparse, fd[1]);
+    if (err != 0) {
+      fprintf (stderr, "copy %s to %s: %s\n", job->src, job->dest,
+               strerror (err));
+      ignore_value (worker_send (fd[1], -err));
+    }
+    _exit (err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close (fd[1]);
+  job->progress_fd = fd[0];
+  return 0;
+}
+
+/* Read a message from a worker.  When the worker closes the pipe,
+ * reap it.  Returns -1 only for errors in the daemon itself.
+ */
+static int
+read_copy_job (struct copy_job *job)
+{
+  int64_t v;
+  ssize_t r;
+  int status;
+
+  r = read (job->progress_fd, &v, sizeof v);
+  if (r == -1) {
+    reply_with_perror ("read");
+    return -1;
+  }
+  if (r == sizeof v) {
+    if (v >= 0)
+      job->done = v;
+    else
+      job->err = -v;
+    return 0;
+  }
+
+  /* EOF (a partial message can only mean the worker died). */
+  close (job->progress_fd);
+  job->progress_fd = -1;
+
+  if (waitpid (job->pid, &status, 0) == -1) {
+    reply_with_perror ("waitpid");
+    return -1;
+  }
+  job->pid = 0;
+  if ((!WIFEXITED (status) || WEXITSTATUS (status) != 0) && job->err == 0)
+    job->err = EIO;
+
+  return 0;
+}
+
+/* Takes optional arguments, consult optargs_bitmask. */
+int
+do_copy_devices_to_devices (char *const *srcs, char *const *dests, int sparse)
+{
+  size_t n = count_strings (srcs);
+  struct copy_job *jobs;
+  size_t i, next = 0, running = 0;
+  long workers;
+  uint64_t total = 0, done;
+  int64_t src_size, dest_size;
+  int r = -1, failed = 0;
+  fd_set rset;
+  int max_fd;
+
+  if (!(optargs_bitmask & GUESTFS_COPY_DEVICES_TO_DEVICES_SPARSE_BITMASK))
+    sparse = 0;
+
+  if (n == 0 || n != count_strings (dests)) {
+    reply_with_error ("srcs and dests must be non-empty lists of the same length");
+    return -1;
+  }
+
+  jobs = calloc (n, sizeof *jobs);
+  if (jobs == NULL) {
+    reply_with_perror ("calloc");
+    return -1;
+  }
+  for (i = 0; i < n; ++i) {
+    jobs[i].src_fd = jobs[i].dest_fd = jobs[i].progress_fd = -1;
+  }
+
+  /* Open everything and work out the sizes first, so that errors
+   * are reported before anything is written.
+   */
+  for (i = 0; i < n; ++i) {
+    jobs[i].src = srcs[i];
+    jobs[i].dest = dests[i];
+
+    src_size = do_blockdev_getsize64 (srcs[i]);
+    if (src_size == -1)
+      goto out;
+    dest_size = do_blockdev_getsize64 (dests[i]);
+    if (dest_size == -1)
+      goto out;
+    jobs[i].size = MIN (src_size, dest_size);
+    total += jobs[i].size;
+
+    if (sparse &&
+        get_used_extents (srcs[i], &jobs[i].extents,
+                          &jobs[i].nr_extents) == -1)
+      goto out;
+
+    jobs[i].src_fd = open (srcs[i], O_RDONLY|O_CLOEXEC);
+    if (jobs[i].src_fd == -1) {
+      reply_with_perror ("%s", srcs[i]);
+      goto out;
+    }
+    jobs[i].dest_fd = open (dests[i], O_WRONLY|O_CLOEXEC);
+    if (jobs[i].dest_fd == -1) {
+      reply_with_perror ("%s", dests[i]);
+      goto out;
+    }
+  }
+
+  workers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers < 1)
+    workers = 1;
+  if (verbose)
+    fprintf (stderr, "copying %zu devices using %ld workers\n", n, workers);
+
+  while ((next < n && !failed) || running > 0) {
+    while (next < n && !failed && running < (size_t) workers) {
+      if (start_copy_job (&jobs[next], sparse) == -1)
+        goto out;
+      next++;
+      running++;
+    }
+
+    FD_ZERO (&rset);
+    max_fd = -1;
+    for (i = 0; i < next; ++i) {
+      if (jobs[i].progress_fd >= 0) {
+        FD_SET (jobs[i].progress_fd, &rset);
+        max_fd = MAX (max_fd, jobs[i].progress_fd);
+      }
+    }
+
+    if (select (max_fd+1, &rset, NULL, NULL, NULL) == -1) {
+      if (errno == EINTR)
+        continue;
+      reply_with_perror ("select");
+      goto out;
+    }
+
+    for (i = 0; i < next; ++i) {
+      if (jobs[i].progress_fd >= 0 && FD_ISSET (jobs[i].progress_fd, &rset)) {
+        if (read_copy_job (&jobs[i]) == -1)
+          goto out;
+        if (jobs[i].progress_fd == -1) {
+          running--;
+          if (jobs[i].err != 0)
+            failed = 1;
+        }
+      }
+    }
+
+    done = 0;
+    for (i = 0; i < n; ++i)
+      done += jobs[i].done;
+    notify_progress (done, total);
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (jobs[i].err != 0) {
+      errno = jobs[i].err;
+      reply_with_perror ("copy %s to %s", jobs[i].src, jobs[i].dest);
+      goto out;
+    }
+  }
+
+  r = 0;
+
+ out:
+  for (i = 0; i < n; ++i) {
+    if (jobs[i].pid > 0) {
+      kill (jobs[i].pid, SIGTERM);
+      waitpid (jobs[i].pid, NULL, 0);
+    }
+    if (jobs[i].progress_fd >= 0)
+      close (jobs[i].progress_fd);
+    if (jobs[i].src_fd >= 0)
+      close (jobs[i].src_fd);
+    if (jobs[i].dest_fd >= 0)
+      close (jobs[i].dest_fd);
+    free (jobs[i].extents);
+  }
+  free (jobs);
+
+  return r;
+}
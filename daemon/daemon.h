@@ -35,6 +35,8 @@ extern int verbose;
 
 extern int autosync_umount;
 
+extern int inprocess;
+
 extern const char *sysroot;
 extern size_t sysroot_len;
 
@@ -74,6 +76,10 @@ extern int commandvf (char **stdoutput, char **stderror, int flags,
 extern int commandrvf (char **stdoutput, char **stderror, int flags,
                        char const* const *argv);
 
+/* Streaming variant for FileOut calls, see guestfsd.c. */
+#define commandv_out(argv) commandvf_out(0,(argv))
+extern int commandvf_out (int flags, char const *const *argv);
+
 extern char **split_lines (char *str);
 
 extern void trim (char *str);
@@ -134,10 +140,45 @@ extern int e2prog (char *name); /* Massive hack for RHEL 5. */
 
 /*-- in lvm.c --*/
 extern int lv_canonical (const char *device, char **ret);
+extern void flush_lvm_cache (void);
 
 /*-- in lvm-filter.c --*/
 extern void copy_lvm (void);
 
+/*-- in activate.c --*/
+extern void activate_md (void);
+extern void activate_all_storage (void);
+extern void lvm_activation_managed (void);
+extern int activate_storage_for_device (const char *device);
+
+/*-- in realpath.c --*/
+extern void flush_case_sensitive_path_cache (void);
+
+/*-- in upload.c --*/
+extern void open_data_channels (void);
+
+/*-- in stats.c --*/
+extern void record_call_stats (int proc_nr, int64_t elapsed_us, int failed, uint64_t bytes_sent, uint64_t bytes_received);
+
+/*-- in extents.c --*/
+/* Returns 0 and sets *extents = NULL if the filesystem type is not
+ * supported, without sending a reply.
+ */
+extern int get_used_extents (const char *device, guestfs_int_extent **extents, size_t *len);
+
+/*-- in discard.c --*/
+/* Returns 1 if the range was zeroed without writing, 0 if the caller
+ * has to write zeroes, or -1 on error (a reply has been sent).
+ */
+extern int zero_range (int fd, const char *name, uint64_t offset, uint64_t size);
+
+/*-- in tarstream.c --*/
+/* In-process tar, optionally gzip-compressed (only if HAVE_ZLIB).
+ * These implement a whole FileOut or FileIn call, including the reply.
+ */
+extern int tar_out_native (const char *dir, int gzip);
+extern int tar_in_native (const char *dir, int gzip);
+
 /*-- in proto.c --*/
 extern void main_loop (int sock) __attribute__((noreturn));
 
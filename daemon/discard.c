@@ -0,0 +1,257 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#ifdef HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
+
+#include "daemon.h"
+#include "actions.h"
+
+/* Discarding and zeroing ranges of devices and files without writing
+ * zero bytes.
+ *
+ * zero_range is used by zero, zero_device, fill and dd.  It only
+ * uses a method which is known to be cheap: for files, fallocate
+ * (ZERO_RANGE, or PUNCH_HOLE which leaves a hole), and for block
+ * devices BLKDISCARD if the device says discarded blocks read as
+ * zero, or BLKZEROOUT if the device can zero blocks itself (otherwise
+ * the kernel would write zero pages, which is no better than what the
+ * callers already do).
+ */
+
+#ifdef BLKZEROOUT
+/* Read a number from /sys/dev/block/MAJ:MIN/queue/<name>, or from the
+ * parent device if this is a partition.  Returns 0 if it can't be
+ * read.
+ */
+static uint64_t
+queue_limit (dev_t rdev, const char *name)
+{
+  const char *fmts[] = { "/sys/dev/block/%u:%u/queue/%s",
+                         "/sys/dev/block/%u:%u/../queue/%s" };
+  char path[256];
+  FILE *fp;
+  uint64_t v;
+  size_t i;
+
+  for (i = 0; i < sizeof fmts / sizeof fmts[0]; ++i) {
+    snprintf (path, sizeof path, fmts[i], major (rdev), minor (rdev), name);
+    fp = fopen (path, "r");
+    if (fp == NULL)
+      continue;
+    if (fscanf (fp, "%" SCNu64, &v) != 1)
+      v = 0;
+    fclose (fp);
+    return v;
+  }
+
+  return 0;
+}
+#endif
+
+static int
+zero_range_device (int fd, const char *name, dev_t rdev,
+                   uint64_t offset, uint64_t size)
+{
+#if defined(BLKDISCARD) && defined(BLKDISCARDZEROES) && defined(BLKZEROOUT)
+  uint64_t range[2] = { offset, size };
+  unsigned int discard_zeroes = 0;
+
+  /* The ioctls only work on whole 512 byte sectors. */
+  if ((offset | size) & 511)
+    return 0;
+
+  if (ioctl (fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes &&
+      ioctl (fd, BLKDISCARD, range) == 0)
+    return 1;
+
+  if (queue_limit (rdev, "write_zeroes_max_bytes") > 0 ||
+      queue_limit (rdev, "write_same_max_bytes") > 0) {
+    if (ioctl (fd, BLKZEROOUT, range) == 0)
+      return 1;
+    if (verbose)
+      fprintf (stderr, "guestfsd: BLKZEROOUT: %s: %m\n", name);
+  }
+#endif
+
+  return 0;
+}
+
+static int
+zero_range_file (int fd, const char *name, uint64_t offset, uint64_t size)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+  struct stat statbuf;
+
+#ifdef FALLOC_FL_ZERO_RANGE
+  if (fallocate (fd, FALLOC_FL_ZERO_RANGE, offset, size) == 0)
+    return 1;
+#endif
+
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 offset, size) == -1)
+    return 0;
+
+  /* Punching a hole doesn't extend the file. */
+  if (fstat (fd, &statbuf) == -1) {
+    reply_with_perror ("fstat: %s", name);
+    return -1;
+  }
+  if ((uint64_t) statbuf.st_size < offset + size &&
+      ftruncate (fd, offset + size) == -1) {
+    reply_with_perror ("ftruncate: %s", name);
+    return -1;
+  }
+
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Make bytes [offset, offset+size) of 'fd' read as zero, and (for a
+ * file) make sure the file is at least offset+size bytes long.
+ * Returns 1 if this was done, 0 if it couldn't be done cheaply (the
+ * caller should write zeroes), or -1 on error (a reply has been sent).
+ */
+int
+zero_range (int fd, const char *name, uint64_t offset, uint64_t size)
+{
+  struct stat statbuf;
+
+  if (size == 0)
+    return 1;
+
+  if (fstat (fd, &statbuf) == -1) {
+    reply_with_perror ("fstat: %s", name);
+    return -1;
+  }
+
+  if (S_ISBLK (statbuf.st_mode))
+    return zero_range_device (fd, name, statbuf.st_rdev, offset, size);
+  else if (S_ISREG (statbuf.st_mode))
+    return zero_range_file (fd, name, offset, size);
+  else
+    return 0;
+}
+
+/* Common code for blkdiscard and blkzeroout. */
+static int
+device_range_ioctl (const char *device, int64_t offset, int64_t length,
+                    int offset_set, int length_set,
+                    int request, const char *request_name)
+{
+  uint64_t range[2];
+  int64_t size;
+  int fd;
+
+  size = do_blockdev_getsize64 (device);
+  if (size == -1)
+    return -1;
+
+  if (!offset_set)
+    offset = 0;
+  if (!length_set)
+    length = size - offset;
+
+  if (offset < 0 || offset > size) {
+    reply_with_error ("offset is out of range");
+    return -1;
+  }
+  if (length < 0 || length > size - offset) {
+    reply_with_error ("length is out of range");
+    return -1;
+  }
+  if ((offset | length) & 511) {
+    reply_with_error ("offset and length must be multiples of 512");
+    return -1;
+  }
+
+  fd = open (device, O_WRONLY|O_CLOEXEC);
+  if (fd == -1) {
+    reply_with_perror ("%s", device);
+    return -1;
+  }
+
+  range[0] = offset;
+  range[1] = length;
+  if (ioctl (fd, request, range) == -1) {
+    int err = errno;
+    close (fd);
+    if (err == EOPNOTSUPP)
+      reply_with_error ("%s: %s is not supported by this device",
+                        device, request_name);
+    else
+      reply_with_perror_errno (err, "%s: %s", request_name, device);
+    return -1;
+  }
+
+  if (close (fd) == -1) {
+    reply_with_perror ("close: %s", device);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Takes optional arguments, consult optargs_bitmask. */
+int
+do_blkdiscard (const char *device, int64_t offset, int64_t length)
+{
+#ifdef BLKDISCARD
+  return device_range_ioctl (device, offset, length,
+                             optargs_bitmask & GUESTFS_BLKDISCARD_OFFSET_BITMASK,
+                             optargs_bitmask & GUESTFS_BLKDISCARD_LENGTH_BITMASK,
+                             BLKDISCARD, "BLKDISCARD");
+#else
+  reply_with_error ("blkdiscard is not supported by this version of the daemon");
+  return -1;
+#endif
+}
+
+/* Takes optional arguments, consult optargs_bitmask. */
+int
+do_blkzeroout (const char *device, int64_t offset, int64_t length)
+{
+#ifdef BLKZEROOUT
+  return device_range_ioctl (device, offset, length,
+                             optargs_bitmask & GUESTFS_BLKZEROOUT_OFFSET_BITMASK,
+                             optargs_bitmask & GUESTFS_BLKZEROOUT_LENGTH_BITMASK,
+                             BLKZEROOUT, "BLKZEROOUT");
+#else
+  reply_with_error ("blkzeroout is not supported by this version of the daemon");
+  return -1;
+#endif
+}
@@ -0,0 +1,462 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "guestfs_protocol.h"
+#include "daemon.h"
+#include "c-ctype.h"
+#include "actions.h"
+
+/* List the allocated parts of a filesystem (see
+ * guestfs_filesystem_used_extents).
+ *
+ * Each filesystem type has a parser which finds the *free* extents
+ * using the filesystem's own tools.  These are sorted and the
+ * complement within the device is returned, so that anything we
+ * don't know about (metadata, space past the end of the filesystem)
+ * is reported as used.
+ */
+
+/* Keep the reply well inside GUESTFS_MESSAGE_MAX (each extent is 16
+ * bytes of XDR).  Longer lists are coalesced.
+ */
+#define MAX_EXTENTS 200000
+
+struct free_list {
+  struct free_extent { uint64_t offset, length; } *v;
+  size_t len, alloc;
+};
+
+static int
+add_free (struct free_list *fl, uint64_t offset, uint64_t length)
+{
+  if (length == 0)
+    return 0;
+
+  if (fl->len > 0 &&
+      fl->v[fl->len-1].offset + fl->v[fl->len-1].length == offset) {
+    fl->v[fl->len-1].length += length;
+    return 0;
+  }
+
+  if (fl->len >= fl->alloc) {
+    size_t n = fl->alloc ? fl->alloc * 2 : 1024;
+    struct free_extent *v = realloc (fl->v, n * sizeof *v);
+    if (v == NULL) {
+      reply_with_perror ("realloc");
+      return -1;
+    }
+    fl->v = v;
+    fl->alloc = n;
+  }
+
+  fl->v[fl->len].offset = offset;
+  fl->v[fl->len].length = length;
+  fl->len++;
+  return 0;
+}
+
+static int
+compare_free (const void *av, const void *bv)
+{
+  const struct free_extent *a = av, *b = bv;
+
+  return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/* ext2/3/4: dumpe2fs prints the free blocks of each group as
+ * "  Free blocks: 1-5, 8, 10-20".
+ */
+static int
+ext2_free (const char *device, struct free_list *fl)
+{
+  char prog[] = "dumpe2fs";
+  char *out, *err, *p, *pend;
+  uint64_t blocksize = 0, first, last;
+  int r;
+
+  if (e2prog (prog) == -1)
+    return -1;
+
+  r = command (&out, &err, prog, device, NULL);
+  if (r == -1) {
+    reply_with_error ("%s: %s", device, err);
+    free (out);
+    free (err);
+    return -1;
+  }
+  free (err);
+
+  for (p = out; *p; p = pend) {
+    pend = strchrnul (p, '\n');
+    if (*pend == '\n')
+      *pend++ = '\0';
+
+    if (STRPREFIX (p, "Block size:"))
+      blocksize = strtoull (p + 11, NULL, 10);
+    else if (STRPREFIX (p, "  Free blocks: ")) {
+      char *q = p + 15;
+
+      if (blocksize == 0) {
+        reply_with_error ("%s: dumpe2fs did not print the block size", device);
+        goto error;
+      }
+
+      while (*q) {
+        char *end;
+
+        first = last = strtoull (q, &end, 10);
+        if (end == q)
+          break;
+        if (*end == '-')
+          last = strtoull (end + 1, &end, 10);
+        if (last < first) {
+          reply_with_error ("%s: could not parse dumpe2fs output: %s",
+                            device, p);
+          goto error;
+        }
+        if (add_free (fl, first * blocksize,
+                      (last - first + 1) * blocksize) == -1)
+          goto error;
+
+        q = end;
+        while (*q == ',' || c_isspace (*q))
+          q++;
+      }
+    }
+  }
+
+  free (out);
+  return 0;
+
+ error:
+  free (out);
+  return -1;
+}
+
+/* XFS: 'xfs_db freesp -d' prints each free extent as "agno agbno len"
+ * in filesystem blocks.
+ */
+static int
+xfs_free (const char *device, struct free_list *fl)
+{
+  char *out, *err, **lines;
+  uint64_t blocksize = 0, agblocks = 0;
+  size_t i;
+  int r;
+
+  if (!prog_exists ("xfs_db")) {
+    reply_with_error ("%s: xfs_db is not available", device);
+    return -1;
+  }
+
+  r = command (&out, &err, "xfs_db", "-r",
+               "-c", "sb 0", "-c", "print blocksize agblocks",
+               "-c", "freesp -d", device, NULL);
+  if (r == -1) {
+    reply_with_error ("%s: %s", device, err);
+    free (out);
+    free (err);
+    return -1;
+  }
+  free (err);
+
+  lines = split_lines (out);
+  free (out);
+  if (lines == NULL)
+    return -1;
+
+  for (i = 0; lines[i] != NULL; ++i) {
+    unsigned long agno, agbno, len;
+    int n;
+
+    if (sscanf (lines[i], "blocksize = %" SCNu64, &blocksize) == 1 ||
+        sscanf (lines[i], "agblocks = %" SCNu64, &agblocks) == 1)
+      continue;
+
+    /* Skip the histogram and totals which follow the extents. */
+    if (sscanf (lines[i], "%lu %lu %lu %n", &agno, &agbno, &len, &n) != 3 ||
+        lines[i][n] != '\0')
+      continue;
+
+    if (blocksize == 0 || agblocks == 0) {
+      reply_with_error ("%s: could not read the superblock with xfs_db",
+                        device);
+      free_strings (lines);
+      return -1;
+    }
+    if (add_free (fl, (agno * agblocks + agbno) * blocksize,
+                  len * blocksize) == -1) {
+      free_strings (lines);
+      return -1;
+    }
+  }
+
+  free_strings (lines);
+  return 0;
+}
+
+/* NTFS: the $Bitmap metadata file has one bit per cluster, set if the
+ * cluster is in use.  The cluster size comes from the boot sector.
+ */
+static int
+ntfs_free (const char *device, struct free_list *fl)
+{
+  unsigned char boot[512];
+  uint64_t clustersize, cluster = 0, run_start = 0;
+  int fd, in_run = 0;
+  char *cmd;
+  FILE *fp;
+  unsigned char buf[BUFSIZ];
+  size_t n, i;
+  int bit;
+
+  fd = open (device, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    reply_with_perror ("%s", device);
+    return -1;
+  }
+  if (pread (fd, boot, sizeof boot, 0) != sizeof boot) {
+    reply_with_perror ("%s: read boot sector", device);
+    close (fd);
+    return -1;
+  }
+  close (fd);
+
+  /* Bytes per sector * sectors per cluster, where values of the
+   * latter above 0x80 are negative powers of two.
+   */
+  clustersize = boot[11] | boot[12] << 8;
+  if (boot[13] <= 0x80)
+    clustersize *= boot[13];
+  else
+    clustersize <<= 256 - boot[13];
+  if (clustersize == 0) {
+    reply_with_error ("%s: invalid NTFS boot sector", device);
+    return -1;
+  }
+
+  if (asprintf_nowarn (&cmd, "ntfscat -f %Q '$Bitmap'", device) == -1) {
+    reply_with_perror ("asprintf");
+    return -1;
+  }
+
+  if (verbose)
+    fprintf (stderr, "%s\n", cmd);
+
+  fp = popen (cmd, "r");
+  if (fp == NULL) {
+    reply_with_perror ("%s", cmd);
+    free (cmd);
+    return -1;
+  }
+
+  while ((n = fread (buf, 1, sizeof buf, fp)) > 0) {
+    for (i = 0; i < n; ++i) {
+      for (bit = 0; bit < 8; ++bit, ++cluster) {
+        int used = buf[i] & (1 << bit);
+
+        if (!used && !in_run) {
+          run_start = cluster;
+          in_run = 1;
+        }
+        else if (used && in_run) {
+          if (add_free (fl, run_start * clustersize,
+                        (cluster - run_start) * clustersize) == -1)
+            goto error;
+          in_run = 0;
+        }
+      }
+    }
+  }
+  if (in_run &&
+      add_free (fl, run_start * clustersize,
+                (cluster - run_start) * clustersize) == -1)
+    goto error;
+
+  if (pclose (fp) != 0) {
+    reply_with_error ("%s: command failed", cmd);
+    free (cmd);
+    return -1;
+  }
+  free (cmd);
+
+  return 0;
+
+ error:
+  pclose (fp);
+  free (cmd);
+  return -1;
+}
+
+/* Coalesce used extents separated by gaps of less than gap bytes. */
+static size_t
+coalesce (guestfs_int_extent *v, size_t len, uint64_t gap)
+{
+  size_t i, j;
+
+  if (len == 0)
+    return 0;
+
+  for (i = 1, j = 0; i < len; ++i) {
+    uint64_t end = v[j].extent_offset + v[j].extent_length;
+
+    if (v[i].extent_offset - end < gap)
+      v[j].extent_length = v[i].extent_offset + v[i].extent_length
+        - v[j].extent_offset;
+    else
+      v[++j] = v[i];
+  }
+
+  return j+1;
+}
+
+int
+get_used_extents (const char *device, guestfs_int_extent **extents,
+                  size_t *len_ret)
+{
+  struct free_list fl = { .v = NULL, .len = 0, .alloc = 0 };
+  guestfs_int_extent *v;
+  char *type;
+  int64_t size;
+  uint64_t pos;
+  size_t i, len;
+  int r;
+
+  *extents = NULL;
+  *len_ret = 0;
+
+  size = do_blockdev_getsize64 (device);
+  if (size == -1)
+    return -1;
+
+  type = do_vfs_type (device);
+  if (type == NULL)
+    return -1;
+
+  if (STREQ (type, "ext2") || STREQ (type, "ext3") || STREQ (type, "ext4"))
+    r = ext2_free (device, &fl);
+  else if (STREQ (type, "xfs"))
+    r = xfs_free (device, &fl);
+  else if (STREQ (type, "ntfs"))
+    r = ntfs_free (device, &fl);
+  else {
+    free (type);
+    return 0;
+  }
+  free (type);
+  if (r == -1) {
+    free (fl.v);
+    return -1;
+  }
+
+  qsort (fl.v, fl.len, sizeof fl.v[0], compare_free);
+
+  /* There is at most one used extent before each free extent, plus
+   * one at the end.
+   */
+  v = malloc ((fl.len + 1) * sizeof *v);
+  if (v == NULL) {
+    reply_with_perror ("malloc");
+    free (fl.v);
+    return -1;
+  }
+
+  len = 0;
+  pos = 0;
+  for (i = 0; i < fl.len && pos < (uint64_t) size; ++i) {
+    uint64_t offset = fl.v[i].offset;
+    uint64_t end = offset + fl.v[i].length;
+
+    if (offset > pos) {
+      v[len].extent_offset = pos;
+      v[len].extent_length = MIN (offset, (uint64_t) size) - pos;
+      len++;
+    }
+    if (end > pos)
+      pos = end;
+  }
+  if (pos < (uint64_t) size) {
+    v[len].extent_offset = pos;
+    v[len].extent_length = size - pos;
+    len++;
+  }
+  free (fl.v);
+
+  *extents = v;
+  *len_ret = len;
+  return 0;
+}
+
+/* Takes optional arguments, consult optargs_bitmask. */
+guestfs_int_extent_list *
+do_filesystem_used_extents (const char *device, int64_t mingap)
+{
+  guestfs_int_extent_list *ret;
+  guestfs_int_extent *v;
+  uint64_t gap = 0;
+  size_t len;
+
+  if (optargs_bitmask & GUESTFS_FILESYSTEM_USED_EXTENTS_MINGAP_BITMASK) {
+    if (mingap < 0) {
+      reply_with_error ("mingap < 0");
+      return NULL;
+    }
+    gap = mingap;
+  }
+
+  if (get_used_extents (device, &v, &len) == -1)
+    return NULL;
+  if (v == NULL) {
+    char *type = do_vfs_type (device);
+    if (type == NULL)
+      return NULL;
+    reply_with_error ("%s: filesystem type '%s' is not supported",
+                      device, type);
+    free (type);
+    return NULL;
+  }
+
+  len = coalesce (v, len, gap);
+  while (len > MAX_EXTENTS) {
+    gap = gap ? gap * 2 : 4096;
+    len = coalesce (v, len, gap);
+  }
+
+  ret = malloc (sizeof *ret);
+  if (ret == NULL) {
+    reply_with_perror ("malloc");
+    free (v);
+    return NULL;
+  }
+  ret->guestfs_int_extent_list_len = len;
+  ret->guestfs_int_extent_list_val = v;
+
+  return ret;
+}
@@ -25,6 +25,10 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#ifdef HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
+
 #include "daemon.h"
 #include "actions.h"
 
@@ -86,3 +90,108 @@ do_fallocate64 (const char *path, int64_t len)
 
   return 0;
 }
+
+#ifdef HAVE_FALLOCATE
+/* Parse the mode string of fallocate_range: a comma-separated list of
+ * flags.  Returns -1 if a flag is unknown or not supported by this
+ * version of the daemon (a reply has been sent).
+ */
+static int
+parse_fallocate_mode (const char *mode)
+{
+  static const struct {
+    const char *name;
+    int flag;
+  } flags[] = {
+#ifdef FALLOC_FL_KEEP_SIZE
+    { "keep-size", FALLOC_FL_KEEP_SIZE },
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /* The kernel requires KEEP_SIZE with PUNCH_HOLE. */
+    { "punch-hole", FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE },
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+    { "zero-range", FALLOC_FL_ZERO_RANGE },
+#endif
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    { "collapse-range", FALLOC_FL_COLLAPSE_RANGE },
+#endif
+    { NULL, 0 }
+  };
+  int r = 0;
+  size_t i, len;
+  const char *p = mode;
+
+  while (*p) {
+    len = strcspn (p, ",");
+    if (len > 0) {
+      for (i = 0; flags[i].name != NULL; ++i) {
+        if (strlen (flags[i].name) == len &&
+            STREQLEN (p, flags[i].name, len))
+          break;
+      }
+      if (flags[i].name == NULL) {
+        reply_with_error ("%.*s: unknown or unsupported mode", (int) len, p);
+        return -1;
+      }
+      r |= flags[i].flag;
+    }
+    p += len;
+    if (*p == ',')
+      p++;
+  }
+
+  return r;
+}
+#endif
+
+int
+do_fallocate_range (const char *path, const char *mode,
+                    int64_t offset, int64_t len)
+{
+#ifdef HAVE_FALLOCATE
+  int fd, flags;
+
+  if (offset < 0) {
+    reply_with_error ("offset < 0");
+    return -1;
+  }
+  if (len <= 0) {
+    reply_with_error ("length <= 0");
+    return -1;
+  }
+
+  flags = parse_fallocate_mode (mode);
+  if (flags == -1)
+    return -1;
+
+  CHROOT_IN;
+  fd = open (path, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC, 0666);
+  CHROOT_OUT;
+  if (fd == -1) {
+    reply_with_perror ("open: %s", path);
+    return -1;
+  }
+
+  if (fallocate (fd, flags, offset, len) == -1) {
+    int err = errno;
+    close (fd);
+    if (err == EOPNOTSUPP)
+      reply_with_error ("%s: the filesystem does not support this mode: %s",
+                        path, mode);
+    else
+      reply_with_perror_errno (err, "fallocate: %s", path);
+    return -1;
+  }
+
+  if (close (fd) == -1) {
+    reply_with_perror ("close: %s", path);
+    return -1;
+  }
+
+  return 0;
+#else
+  reply_with_error ("fallocate is not supported by this version of the daemon");
+  return -1;
+#endif
+}
@@ -0,0 +1,102 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "daemon.h"
+#include "actions.h"
+
+/* Takes optional arguments, consult optargs_bitmask. */
+int
+do_fstrim (const char *path,
+           int64_t offset, int64_t length, int64_t minimumfreeextent)
+{
+#ifdef FITRIM
+  struct fstrim_range range = { .start = 0, .len = UINT64_MAX, .minlen = 0 };
+  int fd, r;
+
+  if (optargs_bitmask & GUESTFS_FSTRIM_OFFSET_BITMASK) {
+    if (offset < 0) {
+      reply_with_error ("offset < 0");
+      return -1;
+    }
+    range.start = offset;
+  }
+
+  if (optargs_bitmask & GUESTFS_FSTRIM_LENGTH_BITMASK) {
+    if (length <= 0) {
+      reply_with_error ("length <= 0");
+      return -1;
+    }
+    range.len = length;
+  }
+
+  if (optargs_bitmask & GUESTFS_FSTRIM_MINIMUMFREEEXTENT_BITMASK) {
+    if (minimumfreeextent <= 0) {
+      reply_with_error ("minimumfreeextent <= 0");
+      return -1;
+    }
+    range.minlen = minimumfreeextent;
+  }
+
+  /* Make sure everything freed so far has reached the filesystem's
+   * free space map, otherwise it won't be trimmed.
+   */
+  sync_disks ();
+
+  CHROOT_IN;
+  fd = open (path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  CHROOT_OUT;
+  if (fd == -1) {
+    reply_with_perror ("%s", path);
+    return -1;
+  }
+
+  r = ioctl (fd, FITRIM, &range);
+  if (r == -1) {
+    int err = errno;
+    close (fd);
+    if (err == EOPNOTSUPP)
+      reply_with_error ("%s: the filesystem or the disk does not support discard (see the 'discard' option of guestfs_add_drive_opts)",
+                        path);
+    else
+      reply_with_perror_errno (err, "fstrim: %s", path);
+    return -1;
+  }
+
+  if (close (fd) == -1) {
+    reply_with_perror ("close: %s", path);
+    return -1;
+  }
+
+  return 0;
+#else
+  reply_with_error ("fstrim is not supported by this version of the daemon");
+  return -1;
+#endif
+}
@@ -53,6 +53,7 @@
 #include "daemon.h"
 
 static char *read_cmdline (void);
+static int run_command (char **stdoutput, char **stderror, int flags, char const* const *argv, int (*output_fn) (const char *buf, size_t len, void *opaque), void *opaque);
 
 #ifndef MAX
 # define MAX(a,b) ((a)>(b)?(a):(b))
@@ -108,6 +109,13 @@ size_t sysroot_len = 8;
 /* If set (the default), do 'umount-all' when performing autosync. */
 int autosync_umount = 1;
 
+/* If libraries such as libblkid and liblvm2app were available at
+ * compile time, use them instead of running the equivalent external
+ * programs.  This can be turned off on the kernel command line
+ * (guestfs_noinprocess=1) to test or benchmark the fallbacks.
+ */
+int inprocess = 1;
+
 /* Not used explicitly, but required by the gnulib 'error' module. */
 const char *program_name = "guestfsd";
 
@@ -196,11 +204,23 @@ main (int argc, char *argv[])
   if (verbose)
     printf ("verbose daemon enabled\n");
 
+  if (cmdline && strstr (cmdline, "guestfs_noinprocess=1") != NULL)
+    inprocess = 0;
+
   if (verbose) {
     if (cmdline)
       printf ("linux commmand line: %s\n", cmdline);
     else
       printf ("could not read linux command line\n");
+
+    /* Useful for measuring the boot time of the appliance. */
+    FILE *fp = fopen ("/proc/uptime", "r");
+    if (fp) {
+      char uptime[64];
+      if (fgets (uptime, sizeof uptime, fp))
+        printf ("guestfsd: started, uptime: %s", uptime);
+      fclose (fp);
+    }
   }
 
 #ifndef WIN32
@@ -264,6 +284,9 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  /* Open any optional data channels (see upload.c). */
+  open_data_channels ();
+
   /* Send the magic length message which indicates that
    * userspace is up inside the guest.
    */
@@ -649,15 +672,78 @@ int
 commandrvf (char **stdoutput, char **stderror, int flags,
             char const* const *argv)
 {
-  int so_size = 0, se_size = 0;
+  return run_command (stdoutput, stderror, flags, argv, NULL, NULL);
+}
+
+/* Output is read from the command in chunks of up to this size, and
+ * the pipes are enlarged to match where the kernel allows it.
+ */
+#define COMMAND_READ_SIZE (64 * 1024)
+
+/* Read from fd.  If buf is not NULL, the data is appended to the
+ * buffer *buf (*size bytes used out of *alloc), which is grown
+ * geometrically.  *data is set to point to the new data.  Returns
+ * the number of bytes read, 0 at end of file or -1 on error.
+ */
+static ssize_t
+read_output (int fd, char **buf, size_t *size, size_t *alloc, char **data)
+{
+  static char discard[COMMAND_READ_SIZE];
+  size_t n;
+  char *p;
+  ssize_t r;
+
+  if (buf == NULL) {
+    r = read (fd, discard, sizeof discard);
+    if (r == -1)
+      perror ("read");
+    *data = discard;
+    return r;
+  }
+
+  if (*alloc - *size < COMMAND_READ_SIZE) {
+    n = *alloc > 0 ? *alloc : COMMAND_READ_SIZE;
+    while (n - *size < COMMAND_READ_SIZE)
+      n *= 2;
+    p = realloc (*buf, n);
+    if (p == NULL) {
+      perror ("realloc");
+      return -1;
+    }
+    *buf = p;
+    *alloc = n;
+  }
+
+  r = read (fd, *buf + *size, *alloc - *size);
+  if (r == -1) {
+    perror ("read");
+    return -1;
+  }
+  *data = *buf + *size;
+  *size += r;
+  return r;
+}
+
+/* This does the work for commandrvf and commandvf_out.  If
+ * output_fn is not NULL, then stdout is passed to it as it arrives
+ * instead of being collected in *stdoutput.  If output_fn returns -1,
+ * the command is stopped and this returns -1.
+ */
+static int
+run_command (char **stdoutput, char **stderror, int flags,
+             char const* const *argv,
+             int (*output_fn) (const char *buf, size_t len, void *opaque),
+             void *opaque)
+{
+  size_t so_size = 0, se_size = 0, so_alloc = 0, se_alloc = 0;
   int so_fd[2], se_fd[2];
   int flag_copy_stdin = flags & COMMAND_FLAG_CHROOT_COPY_FILE_TO_STDIN;
   int stdin_fd[2] = { -1, -1 };
   pid_t pid, stdin_pid = -1;
   int r, quit, i;
+  ssize_t n;
   fd_set rset, rset2;
-  char buf[256];
-  char *p;
+  char *data;
 
   if (stdoutput) *stdoutput = NULL;
   if (stderror) *stderror = NULL;
@@ -781,6 +867,14 @@ commandrvf (char **stdoutput, char **stderror, int flags,
   close (so_fd[1]);
   close (se_fd[1]);
 
+#ifdef F_SETPIPE_SZ
+  /* Larger pipes mean fewer, larger reads for commands which produce
+   * a lot of output.  This is only an optimization, so ignore errors.
+   */
+  ignore_value (fcntl (so_fd[0], F_SETPIPE_SZ, COMMAND_READ_SIZE));
+  ignore_value (fcntl (se_fd[0], F_SETPIPE_SZ, COMMAND_READ_SIZE));
+#endif
+
   FD_ZERO (&rset);
   FD_SET (so_fd[0], &rset);
   FD_SET (se_fd[0], &rset);
@@ -812,54 +906,33 @@ commandrvf (char **stdoutput, char **stderror, int flags,
       }
       close (so_fd[0]);
       close (se_fd[0]);
+      if (output_fn)
+        kill (pid, SIGTERM);
       waitpid (pid, NULL, 0);
       if (stdin_pid >= 0) waitpid (stdin_pid, NULL, 0);
       return -1;
     }
 
     if (FD_ISSET (so_fd[0], &rset2)) { /* something on stdout */
-      r = read (so_fd[0], buf, sizeof buf);
-      if (r == -1) {
-        perror ("read");
+      n = read_output (so_fd[0],
+                       stdoutput && !output_fn ? stdoutput : NULL,
+                       &so_size, &so_alloc, &data);
+      if (n == -1)
+        goto quit;
+      if (n == 0) { FD_CLR (so_fd[0], &rset); quit++; }
+
+      if (n > 0 && output_fn && output_fn (data, n, opaque) == -1)
         goto quit;
-      }
-      if (r == 0) { FD_CLR (so_fd[0], &rset); quit++; }
-
-      if (r > 0 && stdoutput) {
-        so_size += r;
-        p = realloc (*stdoutput, so_size);
-        if (p == NULL) {
-          perror ("realloc");
-          goto quit;
-        }
-        *stdoutput = p;
-        memcpy (*stdoutput + so_size - r, buf, r);
-      }
     }
 
     if (FD_ISSET (se_fd[0], &rset2)) { /* something on stderr */
-      r = read (se_fd[0], buf, sizeof buf);
-      if (r == -1) {
-        perror ("read");
+      n = read_output (se_fd[0], stderror, &se_size, &se_alloc, &data);
+      if (n == -1)
         goto quit;
-      }
-      if (r == 0) { FD_CLR (se_fd[0], &rset); quit++; }
-
-      if (r > 0) {
-        if (verbose)
-          ignore_value (write (2, buf, r));
-
-        if (stderror) {
-          se_size += r;
-          p = realloc (*stderror, se_size);
-          if (p == NULL) {
-            perror ("realloc");
-            goto quit;
-          }
-          *stderror = p;
-          memcpy (*stderror + se_size - r, buf, r);
-        }
-      }
+      if (n == 0) { FD_CLR (se_fd[0], &rset); quit++; }
+
+      if (n > 0 && verbose)
+        ignore_value (write (2, data, n));
     }
   }
 
@@ -869,7 +942,7 @@ commandrvf (char **stdoutput, char **stderror, int flags,
   /* Make sure the output buffers are \0-terminated.  Also remove any
    * trailing \n characters from the error buffer (not from stdout).
    */
-  if (stdoutput) {
+  if (stdoutput && !output_fn) {
     void *q = realloc (*stdoutput, so_size+1);
     if (q == NULL) {
       perror ("realloc");
@@ -888,9 +961,8 @@ commandrvf (char **stdoutput, char **stderror, int flags,
     *stderror = q;
     if (*stderror) {
       (*stderror)[se_size] = '\0';
-      se_size--;
-      while (se_size >= 0 && (*stderror)[se_size] == '\n')
-        (*stderror)[se_size--] = '\0';
+      while (se_size > 0 && (*stderror)[se_size-1] == '\n')
+        (*stderror)[--se_size] = '\0';
     }
   }
 
@@ -923,6 +995,103 @@ commandrvf (char **stdoutput, char **stderror, int flags,
     return -1;
 }
 
+/* State for commandvf_out.  Output is collected into full chunks
+ * before being sent.
+ */
+struct command_out {
+  int replied;                  /* reply message has been sent */
+  int failed;                   /* send_file_write failed */
+  size_t len;                   /* bytes in buf */
+  char buf[GUESTFS_MAX_CHUNK_SIZE];
+};
+
+static int
+command_out_write (const char *data, size_t len, void *opaque)
+{
+  struct command_out *out = opaque;
+  size_t n;
+
+  if (!out->replied) {
+    reply (NULL, NULL);
+    out->replied = 1;
+  }
+
+  while (len > 0) {
+    n = MIN (len, sizeof out->buf - out->len);
+    memcpy (out->buf + out->len, data, n);
+    out->len += n;
+    data += n;
+    len -= n;
+
+    if (out->len == sizeof out->buf) {
+      if (send_file_write (out->buf, out->len) < 0) {
+        out->failed = 1;
+        return -1;
+      }
+      out->len = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* Run a command and send its stdout as the file in a FileOut reply,
+ * without collecting it in memory.  This implements the whole FileOut
+ * call including the reply, so the caller should just return the
+ * result.
+ *
+ * The reply message is not sent until the command produces some
+ * output, so if the command fails without printing anything on
+ * stdout, its stderr is returned to the caller as an ordinary error.
+ * After that, failures can only cancel the transfer.
+ */
+int
+commandvf_out (int flags, char const *const *argv)
+{
+  struct command_out *out;
+  char *err = NULL;
+  int r;
+
+  out = calloc (1, sizeof *out);
+  if (out == NULL) {
+    reply_with_perror ("calloc");
+    return -1;
+  }
+
+  r = run_command (NULL, &err, flags, argv, command_out_write, out);
+
+  if (out->failed)
+    goto error;
+
+  if (r != 0) {
+    if (!out->replied)
+      reply_with_error ("%s: %s", argv[0], err);
+    else {
+      fprintf (stderr, "%s: %s\n", argv[0], err);
+      send_file_end (1);        /* Cancel. */
+    }
+    goto error;
+  }
+
+  if (!out->replied)
+    reply (NULL, NULL);
+
+  if (out->len > 0 && send_file_write (out->buf, out->len) < 0)
+    goto error;
+
+  if (send_file_end (0))        /* Normal end of file. */
+    goto error;
+
+  free (err);
+  free (out);
+  return 0;
+
+ error:
+  free (err);
+  free (out);
+  return -1;
+}
+
 /* Split an output string into a NULL-terminated list of lines.
  * Typically this is used where we have run an external command
  * which has printed out a list of things, and we want to return
@@ -1082,6 +1251,15 @@ device_name_translation (char *device)
   if (errno != ENXIO && errno != ENOENT)
     return -1;
 
+  /* It might be an LV or MD device which hasn't been activated yet. */
+  int saved_errno = errno;
+  if (activate_storage_for_device (device)) {
+    fd = open (device, O_RDONLY);
+    if (fd >= 0)
+      goto close_ok;
+  }
+  errno = saved_errno;
+
   /* If the name begins with "/dev/sd" then try the alternatives. */
   if (STRNEQLEN (device, "/dev/sd", 7))
     return -1;
@@ -1136,6 +1314,11 @@ prog_exists (const char *prog)
 void
 udev_settle (void)
 {
+  /* Anything which needs to wait for udev has probably changed the
+   * block devices, so the LVM metadata may have changed.
+   */
+  flush_lvm_cache ();
+
   (void) command (NULL, NULL, "udevadm", "settle", NULL);
   (void) command (NULL, NULL, "udevsettle", NULL);
 }
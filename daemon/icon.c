@@ -0,0 +1,662 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "guestfs_protocol.h"
+#include "daemon.h"
+#include "actions.h"
+
+/* Extract a bitmap resource from a Windows PE executable (such as
+ * explorer.exe) and return it as a PNG.  This is used by
+ * guestfs_inspect_get_icon, which used to download the whole
+ * executable and run wrestool, bmptopnm and pnmtopng on the host.
+ *
+ * Everything read from the guest is untrusted, so all offsets and
+ * sizes are checked before they are used.
+ */
+
+#define RT_BITMAP 2
+
+/* Limits on what we are prepared to parse. */
+#define MAX_SECTIONS 96
+#define MAX_RESOURCE_ENTRIES 4096
+#define MAX_BITMAP_SIZE (4 * 1024 * 1024)
+#define MAX_DIMENSION 1024
+
+struct pe {
+  int fd;
+  const char *path;
+  unsigned char *sections;      /* Section table. */
+  size_t nr_sections;
+  uint32_t rsrc_rva;            /* Resource directory. */
+  uint32_t rsrc_size;
+};
+
+static uint16_t
+le16 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+le32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+put_be32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* Read exactly 'n' bytes at 'offset'.  A short read is an error. */
+static int
+read_at (const struct pe *pe, void *buf, size_t n, uint64_t offset)
+{
+  ssize_t r;
+
+  r = pread (pe->fd, buf, n, offset);
+  if (r == -1) {
+    reply_with_perror ("pread: %s", pe->path);
+    return -1;
+  }
+  if ((size_t) r != n) {
+    reply_with_error ("%s: file is truncated", pe->path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Map the range [rva, rva+len) to an offset in the file. */
+static int
+rva_to_offset (const struct pe *pe, uint32_t rva, uint32_t len,
+               uint64_t *offset_r)
+{
+  size_t i;
+
+  for (i = 0; i < pe->nr_sections; ++i) {
+    const unsigned char *s = &pe->sections[i*40];
+    uint32_t va = le32 (&s[12]);
+    uint32_t raw_size = le32 (&s[16]);
+    uint32_t raw_ptr = le32 (&s[20]);
+
+    if (rva >= va && rva - va <= raw_size && len <= raw_size - (rva - va)) {
+      *offset_r = (uint64_t) raw_ptr + (rva - va);
+      return 0;
+    }
+  }
+
+  reply_with_error ("%s: address 0x%" PRIx32 " is not in any section",
+                    pe->path, rva);
+  return -1;
+}
+
+/* Read 'len' bytes at 'offset' within the resource directory. */
+static int
+read_rsrc (const struct pe *pe, void *buf, uint32_t len, uint32_t offset)
+{
+  uint64_t file_offset;
+
+  if (offset > pe->rsrc_size || len > pe->rsrc_size - offset) {
+    reply_with_error ("%s: corrupt resource directory", pe->path);
+    return -1;
+  }
+  if (rva_to_offset (pe, pe->rsrc_rva + offset, len, &file_offset) == -1)
+    return -1;
+  return read_at (pe, buf, len, file_offset);
+}
+
+static int
+open_pe (struct pe *pe)
+{
+  unsigned char buf[256];
+  uint32_t pe_offset, nr_dirs, dirs;
+  uint16_t opt_size, magic;
+  uint64_t sections_offset;
+
+  /* MS-DOS header, PE signature and COFF header. */
+  if (read_at (pe, buf, 64, 0) == -1)
+    return -1;
+  if (buf[0] != 'M' || buf[1] != 'Z')
+    goto not_pe;
+  pe_offset = le32 (&buf[0x3c]);
+  if (read_at (pe, buf, 24, pe_offset) == -1)
+    return -1;
+  if (memcmp (buf, "PE\0\0", 4) != 0)
+    goto not_pe;
+  pe->nr_sections = le16 (&buf[6]);
+  opt_size = le16 (&buf[20]);
+  if (pe->nr_sections == 0 || pe->nr_sections > MAX_SECTIONS ||
+      opt_size > sizeof buf)
+    goto not_pe;
+
+  /* Optional header, which contains the data directories.  The
+   * resource directory is entry 2.
+   */
+  if (read_at (pe, buf, opt_size, pe_offset + 24) == -1)
+    return -1;
+  if (opt_size < 2)
+    goto not_pe;
+  magic = le16 (&buf[0]);
+  if (magic == 0x10b)           /* PE32 */
+    dirs = 96;
+  else if (magic == 0x20b)      /* PE32+ */
+    dirs = 112;
+  else
+    goto not_pe;
+  if (opt_size < dirs)
+    goto not_pe;
+  nr_dirs = le32 (&buf[dirs-4]);
+  if (nr_dirs < 3 || opt_size < dirs + 3*8) {
+    reply_with_error ("%s: no resources", pe->path);
+    return -1;
+  }
+  pe->rsrc_rva = le32 (&buf[dirs + 2*8]);
+  pe->rsrc_size = le32 (&buf[dirs + 2*8 + 4]);
+  if (pe->rsrc_rva == 0 || pe->rsrc_size < 16) {
+    reply_with_error ("%s: no resources", pe->path);
+    return -1;
+  }
+
+  /* Section table. */
+  sections_offset = (uint64_t) pe_offset + 24 + opt_size;
+  pe->sections = malloc (pe->nr_sections * 40);
+  if (pe->sections == NULL) {
+    reply_with_perror ("malloc");
+    return -1;
+  }
+  if (read_at (pe, pe->sections, pe->nr_sections * 40, sections_offset) == -1)
+    return -1;
+
+  return 0;
+
+ not_pe:
+  reply_with_error ("%s: not a Windows PE executable", pe->path);
+  return -1;
+}
+
+/* Look up 'id' in the resource directory at 'offset'.  If 'id' is -1,
+ * return the first entry (used for the language level).  Returns the
+ * entry's offset field, or -1 on error.
+ */
+static int64_t
+find_resource (const struct pe *pe, uint32_t offset, int64_t id)
+{
+  unsigned char header[16];
+  unsigned char *entries;
+  size_t nr_named, nr_ids, i;
+  int64_t ret = -1;
+
+  if (read_rsrc (pe, header, sizeof header, offset) == -1)
+    return -1;
+  nr_named = le16 (&header[12]);
+  nr_ids = le16 (&header[14]);
+  if (nr_named + nr_ids == 0 || nr_named + nr_ids > MAX_RESOURCE_ENTRIES) {
+    reply_with_error ("%s: resource %" PRIi64 " not found", pe->path, id);
+    return -1;
+  }
+
+  entries = malloc ((nr_named + nr_ids) * 8);
+  if (entries == NULL) {
+    reply_with_perror ("malloc");
+    return -1;
+  }
+  if (read_rsrc (pe, entries, (nr_named + nr_ids) * 8, offset + 16) == -1)
+    goto out;
+
+  if (id == -1)
+    ret = le32 (&entries[4]);
+  else {
+    /* Named entries come first.  We only look for numbered ones. */
+    for (i = nr_named; i < nr_named + nr_ids; ++i) {
+      if (le32 (&entries[i*8]) == id) {
+        ret = le32 (&entries[i*8+4]);
+        break;
+      }
+    }
+    if (ret == -1)
+      reply_with_error ("%s: resource %" PRIi64 " not found", pe->path, id);
+  }
+
+ out:
+  free (entries);
+  return ret;
+}
+
+/* Read the data of the bitmap resource 'id'.  Resources are stored
+ * in three levels: type, name, language.
+ */
+static unsigned char *
+read_bitmap_resource (const struct pe *pe, int id, size_t *size_r)
+{
+  int64_t offset;
+  int level;
+  unsigned char entry[16];
+  uint32_t data_rva, data_size;
+  uint64_t file_offset;
+  unsigned char *data;
+
+  offset = 0;
+  for (level = 0; level < 3; ++level) {
+    offset = find_resource (pe, offset,
+                            level == 0 ? RT_BITMAP : level == 1 ? id : -1);
+    if (offset == -1)
+      return NULL;
+    /* The high bit is set for a subdirectory, which the first two
+     * levels must be, and clear for a data entry.
+     */
+    if (!!(offset & 0x80000000) != (level < 2)) {
+      reply_with_error ("%s: corrupt resource directory", pe->path);
+      return NULL;
+    }
+    offset &= 0x7fffffff;
+  }
+
+  if (read_rsrc (pe, entry, sizeof entry, offset) == -1)
+    return NULL;
+  data_rva = le32 (&entry[0]);
+  data_size = le32 (&entry[4]);
+  if (data_size == 0 || data_size > MAX_BITMAP_SIZE) {
+    reply_with_error ("%s: resource %d has an unreasonable size (%" PRIu32 " bytes)",
+                      pe->path, id, data_size);
+    return NULL;
+  }
+  if (rva_to_offset (pe, data_rva, data_size, &file_offset) == -1)
+    return NULL;
+
+  data = malloc (data_size);
+  if (data == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+  if (read_at (pe, data, data_size, file_offset) == -1) {
+    free (data);
+    return NULL;
+  }
+
+  *size_r = data_size;
+  return data;
+}
+
+/* Scale the bits of 'pixel' selected by 'mask' to 0-255. */
+static unsigned char
+mask_component (uint32_t pixel, uint32_t mask)
+{
+  uint32_t max;
+
+  if (mask == 0)
+    return 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    pixel >>= 1;
+  }
+  max = mask;
+  return ((pixel & mask) * 255 + max / 2) / max;
+}
+
+/* Convert a device independent bitmap (a BMP file without the
+ * BITMAPFILEHEADER, as stored in resources) to RGBA.  If 'height' > 0
+ * only that many rows from the top are kept.  Returns the pixels, with
+ * the dimensions in *width_r and *height_r.  *has_alpha_r is set if
+ * the bitmap has a (non-empty) alpha channel.
+ */
+static unsigned char *
+dib_to_rgba (const char *path, const unsigned char *dib, size_t len,
+             int height, uint32_t *width_r, uint32_t *height_r,
+             int *has_alpha_r)
+{
+  uint32_t header_size, compression, colors_used, masks[4] = { 0 };
+  int32_t w, h;
+  uint16_t bpp;
+  size_t nr_colors, stride, pixels_offset, x, y, rows;
+  const unsigned char *palette, *row;
+  unsigned char *rgba, *p;
+  int bottom_up, has_alpha = 0;
+
+  if (len < 40 || (header_size = le32 (dib)) < 40 || header_size > len)
+    goto bad;
+  w = (int32_t) le32 (&dib[4]);
+  h = (int32_t) le32 (&dib[8]);
+  bpp = le16 (&dib[14]);
+  compression = le32 (&dib[16]);
+  colors_used = le32 (&dib[32]);
+
+  bottom_up = h > 0;
+  if (h < 0)
+    h = -h;
+  if (w <= 0 || w > MAX_DIMENSION || h <= 0 || h > MAX_DIMENSION)
+    goto bad;
+
+  pixels_offset = header_size;
+  if (compression == 0) {       /* BI_RGB */
+    if (bpp == 16) {
+      masks[0] = 0x7c00; masks[1] = 0x03e0; masks[2] = 0x001f;
+    }
+    else if (bpp == 32) {
+      masks[0] = 0x00ff0000; masks[1] = 0x0000ff00; masks[2] = 0x000000ff;
+      masks[3] = 0xff000000;
+    }
+    else if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 24)
+      goto bad;
+  }
+  else if (compression == 3 && (bpp == 16 || bpp == 32)) { /* BI_BITFIELDS */
+    /* The masks follow a BITMAPINFOHEADER, or are part of the
+     * larger headers.
+     */
+    if (header_size == 40)
+      pixels_offset += 12;
+    if (len < 52 || pixels_offset > len)
+      goto bad;
+    masks[0] = le32 (&dib[40]);
+    masks[1] = le32 (&dib[44]);
+    masks[2] = le32 (&dib[48]);
+    if (header_size >= 56)
+      masks[3] = le32 (&dib[52]);
+  }
+  else
+    goto bad;
+
+  /* The colour table. */
+  if (bpp <= 8) {
+    nr_colors = colors_used ? colors_used : 1U << bpp;
+    if (nr_colors > 256)
+      goto bad;
+  }
+  else
+    nr_colors = colors_used;
+  palette = &dib[pixels_offset];
+  if (nr_colors > (len - pixels_offset) / 4)
+    goto bad;
+  pixels_offset += nr_colors * 4;
+
+  stride = ((size_t) w * bpp + 31) / 32 * 4;
+  if (stride * h > len - pixels_offset)
+    goto bad;
+
+  rows = height > 0 && height < h ? (size_t) height : (size_t) h;
+  rgba = malloc (rows * w * 4);
+  if (rgba == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+
+  p = rgba;
+  for (y = 0; y < rows; ++y) {
+    row = &dib[pixels_offset + stride * (bottom_up ? h - 1 - y : y)];
+
+    for (x = 0; x < (size_t) w; ++x) {
+      uint32_t pixel;
+
+      switch (bpp) {
+      case 1: case 4: case 8: {
+        size_t bit = x * bpp;
+        size_t index = (row[bit / 8] >> (8 - bpp - bit % 8)) & ((1 << bpp) - 1);
+        if (index < nr_colors) {
+          p[0] = palette[index*4+2];
+          p[1] = palette[index*4+1];
+          p[2] = palette[index*4];
+        }
+        else
+          p[0] = p[1] = p[2] = 0;
+        p[3] = 255;
+        break;
+      }
+
+      case 24:
+        p[0] = row[x*3+2];
+        p[1] = row[x*3+1];
+        p[2] = row[x*3];
+        p[3] = 255;
+        break;
+
+      default:                  /* 16 and 32 bits, using the masks. */
+        pixel = bpp == 16 ? le16 (&row[x*2]) : le32 (&row[x*4]);
+        p[0] = mask_component (pixel, masks[0]);
+        p[1] = mask_component (pixel, masks[1]);
+        p[2] = mask_component (pixel, masks[2]);
+        p[3] = masks[3] ? mask_component (pixel, masks[3]) : 255;
+        if (p[3] != 0)
+          has_alpha = 1;
+      }
+
+      p += 4;
+    }
+  }
+
+  /* Old 32 bit bitmaps leave the fourth byte as zero, which doesn't
+   * mean the whole image is transparent.
+   */
+  *has_alpha_r = masks[3] != 0 && has_alpha;
+  *width_r = w;
+  *height_r = rows;
+  return rgba;
+
+ bad:
+  reply_with_error ("%s: unsupported or corrupt bitmap", path);
+  return NULL;
+}
+
+static uint32_t
+crc32_update (uint32_t crc, const unsigned char *buf, size_t len)
+{
+  static uint32_t table[256];
+  size_t i;
+  int k;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (k = 0; k < 8; ++k)
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+
+  crc ^= 0xffffffff;
+  for (i = 0; i < len; ++i)
+    crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffff;
+}
+
+/* Compress the PNG image data into a zlib stream. */
+static unsigned char *
+png_deflate (const unsigned char *raw, size_t raw_len, size_t *len_r)
+{
+  unsigned char *out;
+
+#ifdef HAVE_ZLIB
+  uLongf out_len = compressBound (raw_len);
+
+  out = malloc (out_len);
+  if (out == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+  if (compress2 (out, &out_len, raw, raw_len, Z_BEST_COMPRESSION) != Z_OK) {
+    reply_with_error ("compress2 failed");
+    free (out);
+    return NULL;
+  }
+  *len_r = out_len;
+#else
+  /* Without zlib, write the data as uncompressed (stored) deflate
+   * blocks.  Icons are small, so this doesn't matter much.
+   */
+  uint32_t a = 1, b = 0;
+  size_t i, n, pos = 0, nr_blocks = raw_len / 65535 + 1;
+
+  out = malloc (2 + nr_blocks * 5 + raw_len + 4);
+  if (out == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+  out[pos++] = 0x78;
+  out[pos++] = 0x01;
+  i = 0;
+  do {
+    n = raw_len - i < 65535 ? raw_len - i : 65535;
+    out[pos++] = i + n == raw_len; /* BFINAL, BTYPE = stored */
+    out[pos++] = n & 0xff;
+    out[pos++] = n >> 8;
+    out[pos++] = ~n & 0xff;
+    out[pos++] = (~n >> 8) & 0xff;
+    memcpy (&out[pos], &raw[i], n);
+    pos += n;
+    i += n;
+  } while (i < raw_len);
+  for (i = 0; i < raw_len; ++i) {
+    a = (a + raw[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_be32 (&out[pos], (b << 16) | a);
+  pos += 4;
+  *len_r = pos;
+#endif
+
+  return out;
+}
+
+/* Append a PNG chunk to 'p', returning the new end. */
+static unsigned char *
+png_chunk (unsigned char *p, const char *type,
+           const unsigned char *data, size_t len)
+{
+  put_be32 (p, len);
+  memcpy (&p[4], type, 4);
+  if (len > 0)
+    memcpy (&p[8], data, len);
+  put_be32 (&p[8+len], crc32_update (0, &p[4], len + 4));
+  return &p[12+len];
+}
+
+static char *
+rgba_to_png (const unsigned char *rgba, uint32_t w, uint32_t h, int has_alpha,
+             size_t *size_r)
+{
+  static const unsigned char signature[8] =
+    { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  unsigned char ihdr[13];
+  size_t channels = has_alpha ? 4 : 3;
+  size_t row_len = 1 + w * channels, raw_len = h * row_len;
+  size_t idat_len, x, y, c;
+  unsigned char *raw, *idat, *png, *p;
+
+  /* Each row starts with the filter type (0 = none). */
+  raw = malloc (raw_len);
+  if (raw == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+  p = raw;
+  for (y = 0; y < h; ++y) {
+    *p++ = 0;
+    for (x = 0; x < w; ++x)
+      for (c = 0; c < channels; ++c)
+        *p++ = rgba[(y*w + x)*4 + c];
+  }
+
+  idat = png_deflate (raw, raw_len, &idat_len);
+  free (raw);
+  if (idat == NULL)
+    return NULL;
+
+  put_be32 (&ihdr[0], w);
+  put_be32 (&ihdr[4], h);
+  ihdr[8] = 8;                  /* bit depth */
+  ihdr[9] = has_alpha ? 6 : 2;  /* RGBA or RGB */
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  png = malloc (sizeof signature + 12 + sizeof ihdr + 12 + idat_len + 12);
+  if (png == NULL) {
+    reply_with_perror ("malloc");
+    free (idat);
+    return NULL;
+  }
+  memcpy (png, signature, sizeof signature);
+  p = png_chunk (&png[sizeof signature], "IHDR", ihdr, sizeof ihdr);
+  p = png_chunk (p, "IDAT", idat, idat_len);
+  p = png_chunk (p, "IEND", NULL, 0);
+  free (idat);
+
+  *size_r = p - png;
+  return (char *) png;
+}
+
+char *
+do_internal_pe_icon (const char *path, int resourceid, int height,
+                     size_t *size_r)
+{
+  struct pe pe = { .fd = -1, .path = path };
+  unsigned char *dib = NULL, *rgba = NULL;
+  size_t dib_len;
+  uint32_t w, h;
+  int has_alpha;
+  char *ret = NULL;
+
+  if (resourceid < 0 || height < 0) {
+    reply_with_error ("resourceid and height must be >= 0");
+    return NULL;
+  }
+
+  CHROOT_IN;
+  pe.fd = open (path, O_RDONLY|O_CLOEXEC);
+  CHROOT_OUT;
+
+  if (pe.fd == -1) {
+    reply_with_perror ("open: %s", path);
+    return NULL;
+  }
+
+  if (open_pe (&pe) == -1)
+    goto out;
+
+  dib = read_bitmap_resource (&pe, resourceid, &dib_len);
+  if (dib == NULL)
+    goto out;
+
+  rgba = dib_to_rgba (path, dib, dib_len, height, &w, &h, &has_alpha);
+  if (rgba == NULL)
+    goto out;
+
+  ret = rgba_to_png (rgba, w, h, has_alpha, size_r);
+
+ out:
+  free (rgba);
+  free (dib);
+  free (pe.sections);
+  close (pe.fd);
+  return ret;
+}
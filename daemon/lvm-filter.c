@@ -280,6 +280,9 @@ make_filter_string (char *const *devices)
 int
 do_lvm_set_filter (char *const *devices)
 {
+  /* This changes which LVs are visible. */
+  flush_lvm_cache ();
+
   char *filter = make_filter_string (devices);
   if (filter == NULL)
     return -1;
@@ -303,6 +306,9 @@ do_lvm_set_filter (char *const *devices)
 int
 do_lvm_clear_filter (void)
 {
+  /* This changes which LVs are visible. */
+  flush_lvm_cache ();
+
   if (deactivate () == -1)
     return -1;
 
@@ -26,6 +26,10 @@
 #include <sys/stat.h>
 #include <dirent.h>
 
+#ifdef HAVE_LIBLVM2APP
+#include <lvm2app.h>
+#endif
+
 #include "daemon.h"
 #include "c-ctype.h"
 #include "actions.h"
@@ -96,12 +100,137 @@ convert_lvm_output (char *out, const char *prefix)
   return r;
 }
 
-char **
-do_pvs (void)
+#ifdef HAVE_LIBLVM2APP
+/* In-process versions of pvs, vgs and lvs using liblvm2app.  A new
+ * library handle is used each time so that changes to the LVM
+ * configuration (eg. guestfs_lvm_set_filter) are picked up.
+ */
+enum lvm_list { LIST_PVS, LIST_VGS, LIST_LVS };
+
+/* lvm_vg_list_lvs returns every LV, including the internal ones
+ * which 'lvm lvs' hides (and 'lvm lvs -a' shows in brackets): mirror
+ * and RAID images and logs, thin pool data and metadata.  These are
+ * marked by the volume type, the first character of lv_attr.
+ */
+static int
+is_hidden_lv (lv_t lv)
+{
+  struct lvm_property_value attr;
+
+  attr = lvm_lv_get_property (lv, "lv_attr");
+  if (!attr.is_valid || !attr.is_string || attr.value.string == NULL)
+    return 0;
+
+  return attr.value.string[0] != '\0' &&
+    strchr ("iIlTe", attr.value.string[0]) != NULL;
+}
+
+static int
+add_vg_lvs (lvm_t lvm, const char *vgname,
+            char ***r, int *size, int *alloc)
+{
+  vg_t vg;
+  struct dm_list *lvs;
+  struct lvm_lv_list *lvl;
+  char name[256];
+
+  vg = lvm_vg_open (lvm, vgname, "r", 0);
+  if (vg == NULL) {
+    reply_with_error ("%s: %s", vgname, lvm_errmsg (lvm));
+    return -1;
+  }
+
+  lvs = lvm_vg_list_lvs (vg);
+  if (lvs) {
+    dm_list_iterate_items (lvl, lvs) {
+      if (is_hidden_lv (lvl->lv))
+        continue;
+      snprintf (name, sizeof name, "/dev/%s/%s",
+                vgname, lvm_lv_get_name (lvl->lv));
+      if (add_string (r, size, alloc, name) == -1) {
+        lvm_vg_close (vg);
+        return -1;
+      }
+    }
+  }
+
+  lvm_vg_close (vg);
+  return 0;
+}
+
+static char **
+lvm_list_inprocess (enum lvm_list what)
+{
+  lvm_t lvm;
+  struct dm_list *list;
+  struct lvm_str_list *strl;
+  struct lvm_pv_list *pvl;
+  char **r = NULL;
+  int size = 0, alloc = 0;
+
+  lvm = lvm_init (NULL);
+  if (lvm == NULL) {
+    reply_with_error ("lvm_init failed");
+    return NULL;
+  }
+
+  switch (what) {
+  case LIST_PVS:
+    list = lvm_list_pvs (lvm);
+    if (list) {
+      dm_list_iterate_items (pvl, list) {
+        if (add_string (&r, &size, &alloc, lvm_pv_get_name (pvl->pv)) == -1) {
+          lvm_list_pvs_free (list);
+          goto error;
+        }
+      }
+      lvm_list_pvs_free (list);
+    }
+    break;
+
+  case LIST_VGS:
+  case LIST_LVS:
+    list = lvm_list_vg_names (lvm);
+    if (list) {
+      dm_list_iterate_items (strl, list) {
+        if (what == LIST_VGS) {
+          if (add_string (&r, &size, &alloc, strl->str) == -1)
+            goto error;
+        }
+        else if (add_vg_lvs (lvm, strl->str, &r, &size, &alloc) == -1)
+          goto error;
+      }
+    }
+    break;
+  }
+
+  lvm_quit (lvm);
+
+  if (add_string (&r, &size, &alloc, NULL) == -1)
+    return NULL;
+
+  sort_strings (r, size-1);
+  return r;
+
+ error:
+  lvm_quit (lvm);
+  if (r)
+    free_stringslen (r, size);
+  return NULL;
+}
+#endif /* HAVE_LIBLVM2APP */
+
+static char **
+list_pvs (void)
 {
   char *out, *err;
   int r;
 
+#ifdef HAVE_LIBLVM2APP
+  if (inprocess)
+    return lvm_list_inprocess (LIST_PVS);
+#endif
+
   r = command (&out, &err,
                "lvm", "pvs", "-o", "pv_name", "--noheadings", NULL);
   if (r == -1) {
@@ -116,12 +245,17 @@ do_pvs (void)
   return convert_lvm_output (out, NULL);
 }
 
-char **
-do_vgs (void)
+static char **
+list_vgs (void)
 {
   char *out, *err;
   int r;
 
+#ifdef HAVE_LIBLVM2APP
+  if (inprocess)
+    return lvm_list_inprocess (LIST_VGS);
+#endif
+
   r = command (&out, &err,
                "lvm", "vgs", "-o", "vg_name", "--noheadings", NULL);
   if (r == -1) {
@@ -136,12 +270,17 @@ do_vgs (void)
   return convert_lvm_output (out, NULL);
 }
 
-char **
-do_lvs (void)
+static char **
+list_lvs (void)
 {
   char *out, *err;
   int r;
 
+#ifdef HAVE_LIBLVM2APP
+  if (inprocess)
+    return lvm_list_inprocess (LIST_LVS);
+#endif
+
   r = command (&out, &err,
                "lvm", "lvs",
                "-o", "vg_name,lv_name", "--noheadings",
@@ -158,6 +297,83 @@ do_lvs (void)
   return convert_lvm_output (out, "/dev/");
 }
 
+/* The lists returned by pvs, vgs and lvs are cached, since some
+ * callers (eg. lv_canonical) need them repeatedly.  The cache is
+ * flushed by every call which might change the LVM metadata: the LVM
+ * calls themselves and anything which calls udev_settle.  The
+ * generated stubs also flush it before any call which takes a device
+ * argument, except for the read-only calls listed in
+ * generator/generator_daemon.ml.
+ */
+static char **pvs_cache = NULL;
+static char **vgs_cache = NULL;
+static char **lvs_cache = NULL;
+static guestfs_int_lvm_pvseg_list *topology_cache = NULL;
+
+static void free_topology (guestfs_int_lvm_pvseg_list *t);
+
+void
+flush_lvm_cache (void)
+{
+  if (pvs_cache) free_strings (pvs_cache);
+  if (vgs_cache) free_strings (vgs_cache);
+  if (lvs_cache) free_strings (lvs_cache);
+  pvs_cache = vgs_cache = lvs_cache = NULL;
+  if (topology_cache) free_topology (topology_cache);
+  topology_cache = NULL;
+}
+
+/* Return a copy of the cached list, filling the cache first if
+ * necessary.  The caller frees the copy.
+ */
+static char **
+cached_list (char ***cache, char **(*list) (void))
+{
+  char **ret = NULL;
+  int size = 0, alloc = 0;
+  size_t i;
+
+  if (*cache == NULL) {
+    *cache = list ();
+    if (*cache == NULL)
+      return NULL;
+  }
+
+  for (i = 0; (*cache)[i] != NULL; ++i) {
+    if (add_string (&ret, &size, &alloc, (*cache)[i]) == -1)
+      return NULL;
+  }
+  if (add_string (&ret, &size, &alloc, NULL) == -1)
+    return NULL;
+
+  return ret;
+}
+
+/* The PVs might be on MD arrays, so these have to be assembled
+ * before listing PVs or VGs.  The caller of lvs expects to be able
+ * to use the LVs, so they are activated too (see activate.c).
+ */
+char **
+do_pvs (void)
+{
+  activate_md ();
+  return cached_list (&pvs_cache, list_pvs);
+}
+
+char **
+do_vgs (void)
+{
+  activate_md ();
+  return cached_list (&vgs_cache, list_vgs);
+}
+
+char **
+do_lvs (void)
+{
+  activate_all_storage ();
+  return cached_list (&lvs_cache, list_lvs);
+}
+
 /* These were so complex to implement that I ended up auto-generating
  * the code.  That code is in stubs.c, and it is generated as usual
  * by generator.ml.
@@ -165,21 +381,265 @@ do_lvs (void)
 guestfs_int_lvm_pv_list *
 do_pvs_full (void)
 {
+  activate_md ();
   return parse_command_line_pvs ();
 }
 
 guestfs_int_lvm_vg_list *
 do_vgs_full (void)
 {
+  activate_md ();
   return parse_command_line_vgs ();
 }
 
 guestfs_int_lvm_lv_list *
 do_lvs_full (void)
 {
+  activate_all_storage ();
   return parse_command_line_lvs ();
 }
 
+/* The LVM topology is read with a single 'pvs --segments' command
+ * which reports PV, VG and LV fields for every PV segment.  The
+ * output has empty fields for free space and orphan PVs, which is
+ * why we can't use the generated parse_command_line_* functions.
+ */
+#define NR_PVSEG_COLS 13
+static const char lvm_pvseg_cols[] =
+  "pv_name,pv_uuid,pv_size,vg_name,vg_uuid,vg_size,vg_extent_size,"
+  "lv_name,lv_uuid,lv_size,pvseg_start,pvseg_size,seg_start";
+
+static void
+free_topology (guestfs_int_lvm_pvseg_list *t)
+{
+  xdr_free ((xdrproc_t) xdr_guestfs_int_lvm_pvseg_list, (char *) t);
+  free (t);
+}
+
+/* Parse a UUID with or without '-' characters.  An empty field gives
+ * a UUID of all zero bytes.
+ */
+static int
+parse_uuid (const char *tok, char *uuid)
+{
+  size_t i, j;
+
+  memset (uuid, 0, 32);
+  if (*tok == '\0')
+    return 0;
+
+  for (i = j = 0; i < 32; ++j) {
+    if (tok[j] == '\0')
+      return -1;
+    else if (tok[j] != '-')
+      uuid[i++] = tok[j];
+  }
+  return 0;
+}
+
+static int
+parse_bytes (const char *tok, uint64_t *r)
+{
+  if (*tok == '\0') {
+    *r = 0;
+    return 0;
+  }
+  return sscanf (tok, "%" SCNu64, r) == 1 ? 0 : -1;
+}
+
+static int
+tokenize_pvseg (char *line, guestfs_int_lvm_pvseg *r)
+{
+  char *tok[NR_PVSEG_COLS];
+  char *p = line;
+  size_t i;
+  uint64_t extent_size, start, size;
+
+  for (i = 0; i < NR_PVSEG_COLS; ++i) {
+    tok[i] = p;
+    p = strchr (p, ':');
+    if (i < NR_PVSEG_COLS-1) {
+      if (p == NULL)
+        return -1;
+      *p++ = '\0';
+    }
+    else if (p != NULL)
+      return -1;
+  }
+
+  r->pvseg_pv_name = strdup (tok[0]);
+  r->pvseg_vg_name = strdup (tok[3]);
+  r->pvseg_lv_name = strdup (tok[7]);
+  if (r->pvseg_pv_name == NULL || r->pvseg_vg_name == NULL ||
+      r->pvseg_lv_name == NULL) {
+    perror ("strdup");
+    return -1;
+  }
+
+  if (parse_uuid (tok[1], r->pvseg_pv_uuid) == -1 ||
+      parse_uuid (tok[4], r->pvseg_vg_uuid) == -1 ||
+      parse_uuid (tok[8], r->pvseg_lv_uuid) == -1 ||
+      parse_bytes (tok[2], &r->pvseg_pv_size) == -1 ||
+      parse_bytes (tok[5], &r->pvseg_vg_size) == -1 ||
+      parse_bytes (tok[6], &extent_size) == -1 ||
+      parse_bytes (tok[9], &r->pvseg_lv_size) == -1 ||
+      parse_bytes (tok[10], &start) == -1 ||
+      parse_bytes (tok[11], &size) == -1 ||
+      parse_bytes (tok[12], &r->pvseg_lv_start) == -1) {
+    fprintf (stderr, "tokenize_pvseg: could not parse: %s\n", line);
+    return -1;
+  }
+
+  /* pvseg_start and pvseg_size are always in extents. */
+  r->pvseg_start = start * extent_size;
+  r->pvseg_size = size * extent_size;
+
+  return 0;
+}
+
+static guestfs_int_lvm_pvseg_list *
+get_topology (void)
+{
+  guestfs_int_lvm_pvseg_list *ret;
+  guestfs_int_lvm_pvseg *newp;
+  char *out, *err, *p, *pend;
+  size_t n = 0;
+  int r;
+
+  r = command (&out, &err,
+               "lvm", "pvs", "--segments", "-o", lvm_pvseg_cols,
+               "--unbuffered", "--noheadings", "--nosuffix",
+               "--separator", ":", "--units", "b", NULL);
+  if (r == -1) {
+    reply_with_error ("%s", err);
+    free (out);
+    free (err);
+    return NULL;
+  }
+  free (err);
+
+  ret = calloc (1, sizeof *ret);
+  if (ret == NULL) {
+    reply_with_perror ("calloc");
+    free (out);
+    return NULL;
+  }
+
+  for (p = out; p != NULL; p = pend) {
+    pend = strchr (p, '\n');
+    if (pend)
+      *pend++ = '\0';
+
+    while (*p && c_isspace (*p))
+      p++;
+    if (!*p)
+      continue;
+
+    newp = realloc (ret->guestfs_int_lvm_pvseg_list_val,
+                    sizeof (guestfs_int_lvm_pvseg) * (n+1));
+    if (newp == NULL) {
+      reply_with_perror ("realloc");
+      free_topology (ret);
+      free (out);
+      return NULL;
+    }
+    ret->guestfs_int_lvm_pvseg_list_val = newp;
+    memset (&newp[n], 0, sizeof newp[n]);
+    ret->guestfs_int_lvm_pvseg_list_len = ++n;
+
+    if (tokenize_pvseg (p, &newp[n-1]) == -1) {
+      reply_with_error ("failed to parse output of 'pvs --segments' command");
+      free_topology (ret);
+      free (out);
+      return NULL;
+    }
+  }
+
+  free (out);
+  return ret;
+}
+
+/* Fill the topology cache if necessary.  Returns NULL on error
+ * (reply_with_* has been called).
+ */
+static guestfs_int_lvm_pvseg_list *
+cached_topology (void)
+{
+  /* The PVs might be on MD arrays. */
+  activate_md ();
+
+  if (topology_cache == NULL)
+    topology_cache = get_topology ();
+  return topology_cache;
+}
+
+guestfs_int_lvm_pvseg_list *
+do_lvm_topology (void)
+{
+  guestfs_int_lvm_pvseg_list *t, *ret;
+  guestfs_int_lvm_pvseg *src, *dest;
+  size_t i, n;
+
+  t = cached_topology ();
+  if (t == NULL)
+    return NULL;
+  n = t->guestfs_int_lvm_pvseg_list_len;
+
+  /* Return a copy, since the caller frees it. */
+  ret = calloc (1, sizeof *ret);
+  if (ret == NULL ||
+      (n > 0 &&
+       (ret->guestfs_int_lvm_pvseg_list_val = calloc (n, sizeof *dest)) == NULL)) {
+    reply_with_perror ("calloc");
+    free (ret);
+    return NULL;
+  }
+  ret->guestfs_int_lvm_pvseg_list_len = n;
+
+  for (i = 0; i < n; ++i) {
+    src = &t->guestfs_int_lvm_pvseg_list_val[i];
+    dest = &ret->guestfs_int_lvm_pvseg_list_val[i];
+    *dest = *src;
+    dest->pvseg_pv_name = strdup (src->pvseg_pv_name);
+    dest->pvseg_vg_name = strdup (src->pvseg_vg_name);
+    dest->pvseg_lv_name = strdup (src->pvseg_lv_name);
+    if (dest->pvseg_pv_name == NULL || dest->pvseg_vg_name == NULL ||
+        dest->pvseg_lv_name == NULL) {
+      reply_with_perror ("strdup");
+      free_topology (ret);
+      return NULL;
+    }
+  }
+
+  return ret;
+}
+
+/* Format a UUID from the topology the way that lvm prints it. */
+static char *
+lvm_uuid_string (const char *uuid)
+{
+  static const int groups[] = { 6, 4, 4, 4, 4, 4, 6 };
+  char *ret, *p;
+  size_t i;
+
+  ret = p = malloc (32 + 6 + 1);
+  if (ret == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+
+  for (i = 0; i < sizeof groups / sizeof groups[0]; ++i) {
+    if (i > 0)
+      *p++ = '-';
+    memcpy (p, uuid, groups[i]);
+    p += groups[i];
+    uuid += groups[i];
+  }
+  *p = '\0';
+
+  return ret;
+}
+
 int
 do_pvcreate (const char *device)
 {
@@ -270,6 +730,8 @@ do_lvresize (const char *logvol, int mbytes)
 
   snprintf (size, sizeof size, "%d", mbytes);
 
+  flush_lvm_cache ();
+
   r = command (NULL, &err,
                "lvm", "lvresize",
                "--force", "-L", size, logvol, NULL);
@@ -297,6 +759,8 @@ do_lvresize_free (const char *logvol, int percent)
   char size[64];
   snprintf (size, sizeof size, "+%d%%FREE", percent);
 
+  flush_lvm_cache ();
+
   r = command (NULL, &err,
                "lvm", "lvresize", "-l", size, logvol, NULL);
   if (r == -1) {
@@ -455,6 +919,8 @@ do_pvresize (const char *device)
   char *err;
   int r;
 
+  flush_lvm_cache ();
+
   r = command (NULL, &err,
                "lvm", "pvresize", device, NULL);
   if (r == -1) {
@@ -476,6 +942,8 @@ do_pvresize_size (const char *device, int64_t size)
   char buf[32];
   snprintf (buf, sizeof buf, "%" PRIi64 "b", size);
 
+  flush_lvm_cache ();
+
   r = command (NULL, &err,
                "lvm", "pvresize",
                "--setphysicalvolumesize", buf,
@@ -497,6 +965,8 @@ do_vg_activate (int activate, char *const *volgroups)
   int r, i, argc;
   const char **argv;
 
+  lvm_activation_managed ();
+
   argc = count_strings (volgroups) + 4;
   argv = malloc (sizeof (char *) * (argc+1));
   if (argv == NULL) {
@@ -600,21 +1070,76 @@ get_lvm_field (const char *cmd, const char *field, const char *device)
   return out;                   /* Caller frees. */
 }
 
+/* The *uuid calls below are answered from the topology cache where
+ * possible.  If the object isn't found there, fall back to asking
+ * lvm, which produces the proper error message (or finds LVs which
+ * aren't in the topology, such as thin volumes).
+ */
 char *
 do_pvuuid (const char *device)
 {
+  guestfs_int_lvm_pvseg_list *t = cached_topology ();
+  size_t i;
+
+  if (t == NULL)
+    return NULL;
+
+  for (i = 0; i < t->guestfs_int_lvm_pvseg_list_len; ++i) {
+    guestfs_int_lvm_pvseg *seg = &t->guestfs_int_lvm_pvseg_list_val[i];
+    if (STREQ (seg->pvseg_pv_name, device))
+      return lvm_uuid_string (seg->pvseg_pv_uuid);
+  }
+
   return get_lvm_field ("pvs", "pv_uuid", device);
 }
 
 char *
 do_vguuid (const char *vgname)
 {
+  guestfs_int_lvm_pvseg_list *t = cached_topology ();
+  size_t i;
+
+  if (t == NULL)
+    return NULL;
+
+  for (i = 0; i < t->guestfs_int_lvm_pvseg_list_len; ++i) {
+    guestfs_int_lvm_pvseg *seg = &t->guestfs_int_lvm_pvseg_list_val[i];
+    if (STREQ (seg->pvseg_vg_name, vgname))
+      return lvm_uuid_string (seg->pvseg_vg_uuid);
+  }
+
   return get_lvm_field ("vgs", "vg_uuid", vgname);
 }
 
 char *
 do_lvuuid (const char *device)
 {
+  guestfs_int_lvm_pvseg_list *t;
+  const char *vg, *lv;
+  size_t i, vglen;
+
+  /* Only the canonical /dev/VG/LV form is looked up in the cache. */
+  if (STRPREFIX (device, "/dev/")) {
+    vg = device + 5;
+    lv = strchr (vg, '/');
+    if (lv != NULL && strchr (lv+1, '/') == NULL) {
+      vglen = lv - vg;
+      lv++;
+
+      t = cached_topology ();
+      if (t == NULL)
+        return NULL;
+
+      for (i = 0; i < t->guestfs_int_lvm_pvseg_list_len; ++i) {
+        guestfs_int_lvm_pvseg *seg = &t->guestfs_int_lvm_pvseg_list_val[i];
+        if (STREQ (seg->pvseg_lv_name, lv) &&
+            strlen (seg->pvseg_vg_name) == vglen &&
+            STREQLEN (seg->pvseg_vg_name, vg, vglen))
+          return lvm_uuid_string (seg->pvseg_lv_uuid);
+      }
+    }
+  }
+
   return get_lvm_field ("lvs", "lv_uuid", device);
 }
 
@@ -652,7 +1177,42 @@ get_lvm_fields (const char *cmd, const char *field, const char *device)
 char **
 do_vgpvuuids (const char *vgname)
 {
-  return get_lvm_fields ("vgs", "pv_uuid", vgname);
+  guestfs_int_lvm_pvseg_list *t = cached_topology ();
+  char **ret = NULL;
+  int size = 0, alloc = 0;
+  size_t i;
+  const char *last_pv = NULL;
+
+  if (t == NULL)
+    return NULL;
+
+  /* Segments are sorted by PV, so each PV is in one run of entries. */
+  for (i = 0; i < t->guestfs_int_lvm_pvseg_list_len; ++i) {
+    guestfs_int_lvm_pvseg *seg = &t->guestfs_int_lvm_pvseg_list_val[i];
+    if (seg->pvseg_vg_name[0] == '\0' || STRNEQ (seg->pvseg_vg_name, vgname))
+      continue;
+    if (last_pv && STREQ (last_pv, seg->pvseg_pv_name))
+      continue;
+    last_pv = seg->pvseg_pv_name;
+
+    char *uuid = lvm_uuid_string (seg->pvseg_pv_uuid);
+    if (uuid == NULL) {
+      if (ret) free_stringslen (ret, size);
+      return NULL;
+    }
+    if (add_string_nodup (&ret, &size, &alloc, uuid) == -1) {
+      free (uuid);
+      return NULL;
+    }
+  }
+
+  if (size == 0)
+    return get_lvm_fields ("vgs", "pv_uuid", vgname);
+
+  if (add_string_nodup (&ret, &size, &alloc, NULL) == -1)
+    return NULL;
+
+  return ret;
 }
 
 char **
@@ -667,6 +1227,8 @@ do_vgscan (void)
   char *err;
   int r;
 
+  flush_lvm_cache ();
+
   r = command (NULL, &err,
                "lvm", "vgscan", NULL);
   if (r == -1) {
@@ -775,6 +1337,8 @@ do_list_dm_devices (void)
   DIR *dir;
   int r;
 
+  activate_all_storage ();
+
   dir = opendir ("/dev/mapper");
   if (!dir) {
     reply_with_perror ("opendir: /dev/mapper");
@@ -184,6 +184,9 @@ do_list_md_devices (void)
   int size = 0, alloc = 0;
   glob_t mds;
 
+  /* MD arrays are assembled on first use (see activate.c). */
+  activate_md ();
+
   memset(&mds, 0, sizeof(mds));
 
 #define PREFIX "/sys/block/md"
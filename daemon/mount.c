@@ -161,6 +161,8 @@ do_umount (const char *pathordevice)
   if (is_dev)
     RESOLVE_DEVICE (buf, , { free (buf); return -1; });
 
+  flush_case_sensitive_path_cache ();
+
   r = command (NULL, &err, "umount", buf, NULL);
   free (buf);
 
@@ -317,6 +319,8 @@ do_umount_all (void)
 
   qsort (mounts, size, sizeof (char *), compare_longest_first);
 
+  flush_case_sensitive_path_cache ();
+
   /* Unmount them. */
   for (i = 0; i < size; ++i) {
     r = command (NULL, &err, "umount", mounts[i], NULL);
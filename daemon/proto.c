@@ -29,6 +29,7 @@
 #include <sys/param.h>		/* defines MIN */
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <rpc/types.h>
 #include <rpc/xdr.h>
 
@@ -36,6 +37,10 @@
 #include <windows.h>
 #endif
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "c-ctype.h"
 #include "ignore-value.h"
 
@@ -73,9 +78,53 @@ static struct timeval last_progress_t;
 /* Counts the number of progress notifications sent during this call. */
 static int count_progress;
 
+/* While a FileOut call is sending chunks, progress notifications are
+ * not written on their own.  The latest one is kept here and goes out
+ * in the same write(2) as the next chunk (or the reply).  The flag
+ * word and the guestfs_progress struct are 28 bytes when encoded.
+ */
+#define PROGRESS_MESSAGE_LEN 28
+static int sending_file;
+static char pending_progress[PROGRESS_MESSAGE_LEN];
+static size_t pending_progress_len;
+
+/* Bytes sent and received, and whether an error was sent, for the
+ * current call.  These are added to the per-procedure statistics
+ * (see daemon/stats.c) when the call finishes.
+ */
+static uint64_t call_bytes_sent, call_bytes_received;
+static int call_failed;
+
 /* The daemon communications socket. */
 static int sock;
 
+#ifdef HAVE_ZLIB
+/* Set by internal_transfer_compression.  If true, FileOut chunks are
+ * compressed before being sent to the library.  Incoming compressed
+ * chunks are always accepted.
+ */
+static int transfer_compression;
+
+/* Each chunk is compressed independently, but the streams are kept
+ * and reset between chunks to avoid reallocating zlib's state.
+ */
+static z_stream deflate_stream, inflate_stream;
+static int deflate_stream_ok, inflate_stream_ok;
+
+/* Chunks shorter than this are not worth compressing. */
+#define MIN_DEFLATE_CHUNK 128
+
+/* When a chunk doesn't get smaller, don't bother trying to compress
+ * the next few chunks either.  This keeps the overhead low when
+ * sending incompressible data such as disk images.
+ */
+#define DEFLATE_BACKOFF 16
+static int deflate_skip;
+
+static size_t deflate_chunk (const void *buf, size_t len, char *out);
+static int inflate_chunk (const void *buf, size_t len, char *out, size_t *outlen);
+#endif
+
 void
 main_loop (int _sock)
 {
@@ -148,6 +197,11 @@ main_loop (int _sock)
     gettimeofday (&start_t, NULL);
     last_progress_t = start_t;
     count_progress = 0;
+    sending_file = 0;
+    pending_progress_len = 0;
+    call_bytes_sent = 0;
+    call_bytes_received = len + 4;
+    call_failed = 0;
 
     /* Decode the message header. */
     xdrmem_create (&xdr, buf, len, XDR_DECODE);
@@ -193,16 +247,19 @@ main_loop (int _sock)
     dispatch_incoming_message (&xdr);
     /* Note that dispatch_incoming_message will also send a reply. */
 
-    /* In verbose mode, display the time taken to run each command. */
-    if (verbose) {
-      struct timeval end_t;
-      gettimeofday (&end_t, NULL);
+    struct timeval end_t;
+    gettimeofday (&end_t, NULL);
+
+    int64_t start_us, end_us, elapsed_us;
+    start_us = (int64_t) start_t.tv_sec * 1000000 + start_t.tv_usec;
+    end_us = (int64_t) end_t.tv_sec * 1000000 + end_t.tv_usec;
+    elapsed_us = end_us - start_us;
 
-      int64_t start_us, end_us, elapsed_us;
-      start_us = (int64_t) start_t.tv_sec * 1000000 + start_t.tv_usec;
-      end_us = (int64_t) end_t.tv_sec * 1000000 + end_t.tv_usec;
-      elapsed_us = end_us - start_us;
+    record_call_stats (proc_nr, elapsed_us, call_failed,
+                       call_bytes_sent, call_bytes_received);
 
+    /* In verbose mode, display the time taken to run each command. */
+    if (verbose) {
       fprintf (stderr,
 	       "guestfsd: main_loop: proc %d (%s) took %d.%02d seconds\n",
                proc_nr,
@@ -249,19 +306,79 @@ reply_with_perror_errno (int err, const char *fs, ...)
   send_error (err, buf2);
 }
 
+/* Write all of iov to the socket, coping with short writes. */
+static int
+xwritev (int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t r;
+
+  while (iovcnt > 0) {
+    r = writev (fd, iov, iovcnt);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("writev");
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+
+  return 0;
+}
+
+/* Send a message to the library.  'buf' must start with 4 bytes of
+ * space for the length word, followed by the 'len' bytes of the
+ * encoded message.  Any pending progress notification is sent first,
+ * all in a single system call.
+ */
+static int
+send_message (char *buf, uint32_t len)
+{
+  XDR xdr;
+  struct iovec iov[2];
+  int n = 0;
+
+  xdrmem_create (&xdr, buf, 4, XDR_ENCODE);
+  xdr_u_int (&xdr, &len);
+  xdr_destroy (&xdr);
+
+  if (pending_progress_len > 0) {
+    iov[n].iov_base = pending_progress;
+    iov[n].iov_len = pending_progress_len;
+    n++;
+    pending_progress_len = 0;
+  }
+  iov[n].iov_base = buf;
+  iov[n].iov_len = len + 4;
+  n++;
+
+  call_bytes_sent += iov[0].iov_len + (n > 1 ? iov[1].iov_len : 0);
+
+  return xwritev (sock, iov, n);
+}
+
 static void
 send_error (int errnum, const char *msg)
 {
   XDR xdr;
-  char buf[GUESTFS_ERROR_LEN + 200];
-  char lenbuf[4];
+  char buf[4 + GUESTFS_ERROR_LEN + 200];
   struct guestfs_message_header hdr;
   struct guestfs_message_error err;
   unsigned len;
 
   fprintf (stderr, "guestfsd: error: %s\n", msg);
 
-  xdrmem_create (&xdr, buf, sizeof buf, XDR_ENCODE);
+  call_failed = 1;
+
+  xdrmem_create (&xdr, buf + 4, sizeof buf - 4, XDR_ENCODE);
 
   hdr.prog = GUESTFS_PROGRAM;
   hdr.vers = GUESTFS_PROTOCOL_VERSION;
@@ -290,15 +407,7 @@ send_error (int errnum, const char *msg)
   len = xdr_getpos (&xdr);
   xdr_destroy (&xdr);
 
-  xdrmem_create (&xdr, lenbuf, 4, XDR_ENCODE);
-  xdr_u_int (&xdr, &len);
-  xdr_destroy (&xdr);
-
-  if (xwrite (sock, lenbuf, 4) == -1) {
-    fprintf (stderr, "guestfsd: xwrite failed\n");
-    exit (EXIT_FAILURE);
-  }
-  if (xwrite (sock, buf, len) == -1) {
+  if (send_message (buf, len) == -1) {
     fprintf (stderr, "guestfsd: xwrite failed\n");
     exit (EXIT_FAILURE);
   }
@@ -308,12 +417,11 @@ void
 reply (xdrproc_t xdrp, char *ret)
 {
   XDR xdr;
-  char buf[GUESTFS_MESSAGE_MAX];
-  char lenbuf[4];
+  char buf[4 + GUESTFS_MESSAGE_MAX];
   struct guestfs_message_header hdr;
   unsigned len;
 
-  xdrmem_create (&xdr, buf, sizeof buf, XDR_ENCODE);
+  xdrmem_create (&xdr, buf + 4, sizeof buf - 4, XDR_ENCODE);
 
   hdr.prog = GUESTFS_PROGRAM;
   hdr.vers = GUESTFS_PROTOCOL_VERSION;
@@ -342,15 +450,7 @@ reply (xdrproc_t xdrp, char *ret)
   len = xdr_getpos (&xdr);
   xdr_destroy (&xdr);
 
-  xdrmem_create (&xdr, lenbuf, 4, XDR_ENCODE);
-  xdr_u_int (&xdr, &len);
-  xdr_destroy (&xdr);
-
-  if (xwrite (sock, lenbuf, 4) == -1) {
-    fprintf (stderr, "guestfsd: xwrite failed\n");
-    exit (EXIT_FAILURE);
-  }
-  if (xwrite (sock, buf, len) == -1) {
+  if (send_message (buf, len) == -1) {
     fprintf (stderr, "guestfsd: xwrite failed\n");
     exit (EXIT_FAILURE);
   }
@@ -366,6 +466,11 @@ receive_file (receive_cb cb, void *opaque)
   XDR xdr;
   int r;
   uint32_t len;
+  const char *data;
+  size_t data_len;
+#ifdef HAVE_ZLIB
+  static char inflated[GUESTFS_MAX_CHUNK_SIZE];
+#endif
 
   for (;;) {
     if (verbose)
@@ -396,6 +501,7 @@ receive_file (receive_cb cb, void *opaque)
 
     if (xread (sock, buf, len) == -1)
       exit (EXIT_FAILURE);
+    call_bytes_received += len + 4;
 
     xdrmem_create (&xdr, buf, len, XDR_DECODE);
     memset (&chunk, 0, sizeof chunk);
@@ -412,14 +518,15 @@ receive_file (receive_cb cb, void *opaque)
                "guestfsd: receive_file: got chunk: cancel = 0x%x, len = %d, buf = %p\n",
                chunk.cancel, chunk.data.data_len, chunk.data.data_val);
 
-    if (chunk.cancel != 0 && chunk.cancel != 1) {
+    if (chunk.cancel != 0 && chunk.cancel != 1 &&
+        chunk.cancel != GUESTFS_CHUNK_DEFLATE) {
       fprintf (stderr,
-               "guestfsd: receive_file: chunk.cancel != [0|1] ... "
+               "guestfsd: receive_file: chunk.cancel != [0|1|2] ... "
                "continuing even though we have probably lost synchronization with the library\n");
       return -1;
     }
 
-    if (chunk.cancel) {
+    if (chunk.cancel == 1) {
       if (verbose)
         fprintf (stderr,
 	  "guestfsd: receive_file: received cancellation from library\n");
@@ -434,9 +541,30 @@ receive_file (receive_cb cb, void *opaque)
       return 0;			/* end of file */
     }
 
+    data = chunk.data.data_val;
+    data_len = chunk.data.data_len;
+
+    if (chunk.cancel == GUESTFS_CHUNK_DEFLATE) {
+#ifdef HAVE_ZLIB
+      if (inflate_chunk (data, data_len, inflated, &data_len) == -1) {
+        xdr_free ((xdrproc_t) xdr_guestfs_chunk, (char *) &chunk);
+        errno = EINVAL;
+        return -1;
+      }
+      data = inflated;
+#else
+      fprintf (stderr,
+               "guestfsd: receive_file: received a compressed chunk, "
+               "but the daemon was compiled without zlib\n");
+      xdr_free ((xdrproc_t) xdr_guestfs_chunk, (char *) &chunk);
+      errno = ENOTSUP;
+      return -1;
+#endif
+    }
+
     /* Note that the callback can generate progress messages. */
     if (cb)
-      r = cb (opaque, chunk.data.data_val, chunk.data.data_len);
+      r = cb (opaque, data, data_len);
     else
       r = 0;
 
@@ -479,6 +607,10 @@ send_file_write (const void *buf, int len)
 {
   guestfs_chunk chunk;
   int cancel;
+#ifdef HAVE_ZLIB
+  char deflated[GUESTFS_MAX_CHUNK_SIZE];
+  size_t deflated_len;
+#endif
 
   if (len > GUESTFS_MAX_CHUNK_SIZE) {
     fprintf (stderr, "guestfsd: send_file_write: len (%d) > GUESTFS_MAX_CHUNK_SIZE (%d)\n",
@@ -486,6 +618,8 @@ send_file_write (const void *buf, int len)
     return -1;
   }
 
+  sending_file = 1;
+
   cancel = check_for_library_cancellation ();
 
   if (cancel) {
@@ -496,6 +630,17 @@ send_file_write (const void *buf, int len)
     chunk.cancel = 0;
     chunk.data.data_len = len;
     chunk.data.data_val = (char *) buf;
+
+#ifdef HAVE_ZLIB
+    if (transfer_compression) {
+      deflated_len = deflate_chunk (buf, len, deflated);
+      if (deflated_len > 0) {
+        chunk.cancel = GUESTFS_CHUNK_DEFLATE;
+        chunk.data.data_len = deflated_len;
+        chunk.data.data_val = deflated;
+      }
+    }
+#endif
   }
 
   if (send_chunk (&chunk) == -1)
@@ -505,6 +650,102 @@ send_file_write (const void *buf, int len)
   return 0;
 }
 
+#ifdef HAVE_ZLIB
+/* Compress a single chunk into 'out', which must have room for
+ * GUESTFS_MAX_CHUNK_SIZE bytes.  Returns the compressed length, or 0
+ * if the chunk should be sent uncompressed.
+ */
+static size_t
+deflate_chunk (const void *buf, size_t len, char *out)
+{
+  int r;
+
+  if (len < MIN_DEFLATE_CHUNK)
+    return 0;
+
+  if (deflate_skip > 0) {
+    deflate_skip--;
+    return 0;
+  }
+
+  if (!deflate_stream_ok) {
+    if (deflateInit (&deflate_stream, Z_BEST_SPEED) != Z_OK) {
+      fprintf (stderr, "guestfsd: deflateInit failed, "
+               "disabling transfer compression\n");
+      transfer_compression = 0;
+      return 0;
+    }
+    deflate_stream_ok = 1;
+  }
+  else
+    deflateReset (&deflate_stream);
+
+  deflate_stream.next_in = (Bytef *) buf;
+  deflate_stream.avail_in = len;
+  deflate_stream.next_out = (Bytef *) out;
+  /* Only worth sending if it is smaller than the original. */
+  deflate_stream.avail_out = len - 1;
+
+  r = deflate (&deflate_stream, Z_FINISH);
+  if (r != Z_STREAM_END) {
+    deflate_skip = DEFLATE_BACKOFF;
+    return 0;
+  }
+
+  return deflate_stream.total_out;
+}
+
+/* Inflate a compressed chunk received from the library into 'out',
+ * which must have room for GUESTFS_MAX_CHUNK_SIZE bytes.
+ */
+static int
+inflate_chunk (const void *buf, size_t len, char *out, size_t *outlen)
+{
+  int r;
+
+  if (!inflate_stream_ok) {
+    if (inflateInit (&inflate_stream) != Z_OK) {
+      fprintf (stderr, "guestfsd: inflateInit failed\n");
+      return -1;
+    }
+    inflate_stream_ok = 1;
+  }
+  else
+    inflateReset (&inflate_stream);
+
+  inflate_stream.next_in = (Bytef *) buf;
+  inflate_stream.avail_in = len;
+  inflate_stream.next_out = (Bytef *) out;
+  inflate_stream.avail_out = GUESTFS_MAX_CHUNK_SIZE;
+
+  r = inflate (&inflate_stream, Z_FINISH);
+  if (r != Z_STREAM_END) {
+    fprintf (stderr, "guestfsd: inflate_chunk: corrupt compressed chunk "
+             "(zlib error %d)\n", r);
+    return -1;
+  }
+
+  *outlen = inflate_stream.total_out;
+  return 0;
+}
+#endif /* HAVE_ZLIB */
+
+/* Called by the library to enable or disable compression of FileOut
+ * chunks.  See guestfs_set_transfer_compression.
+ */
+int
+do_internal_transfer_compression (int compress)
+{
+#ifdef HAVE_ZLIB
+  transfer_compression = compress;
+  deflate_skip = 0;
+  return 0;
+#else
+  reply_with_error ("transfer compression is not supported because the daemon was compiled without zlib");
+  return -1;
+#endif
+}
+
 static int
 check_for_library_cancellation (void)
 {
@@ -553,18 +794,18 @@ send_file_end (int cancel)
   chunk.cancel = cancel;
   chunk.data.data_len = 0;
   chunk.data.data_val = NULL;
+  sending_file = 0;
   return send_chunk (&chunk);
 }
 
 static int
 send_chunk (const guestfs_chunk *chunk)
 {
-  char buf[GUESTFS_MAX_CHUNK_SIZE + 48];
-  char lenbuf[4];
+  char buf[4 + GUESTFS_MAX_CHUNK_SIZE + 48];
   XDR xdr;
   uint32_t len;
 
-  xdrmem_create (&xdr, buf, sizeof buf, XDR_ENCODE);
+  xdrmem_create (&xdr, buf + 4, sizeof buf - 4, XDR_ENCODE);
   if (!xdr_guestfs_chunk (&xdr, (guestfs_chunk *) chunk)) {
     fprintf (stderr, "guestfsd: send_chunk: failed to encode chunk\n");
     xdr_destroy (&xdr);
@@ -574,12 +815,7 @@ send_chunk (const guestfs_chunk *chunk)
   len = xdr_getpos (&xdr);
   xdr_destroy (&xdr);
 
-  xdrmem_create (&xdr, lenbuf, 4, XDR_ENCODE);
-  xdr_u_int (&xdr, &len);
-  xdr_destroy (&xdr);
-
-  int err = (xwrite (sock, lenbuf, 4) == 0
-             && xwrite (sock, buf, len) == 0 ? 0 : -1);
+  int err = send_message (buf, len);
   if (err) {
     fprintf (stderr, "guestfsd: send_chunk: write failed\n");
     exit (EXIT_FAILURE);
@@ -627,19 +863,11 @@ notify_progress (uint64_t position, uint64_t total)
   count_progress++;
   last_progress_t = now_t;
 
-  /* Send the header word. */
+  /* Encode the flag word and the message into one buffer. */
   XDR xdr;
   char buf[128];
   uint32_t i = GUESTFS_PROGRESS_FLAG;
   size_t len;
-  xdrmem_create (&xdr, buf, 4, XDR_ENCODE);
-  xdr_u_int (&xdr, &i);
-  xdr_destroy (&xdr);
-
-  if (xwrite (sock, buf, 4) == -1) {
-    fprintf (stderr, "guestfsd: xwrite failed\n");
-    exit (EXIT_FAILURE);
-  }
 
   guestfs_progress message = {
     .proc = proc_nr,
@@ -649,7 +877,7 @@ notify_progress (uint64_t position, uint64_t total)
   };
 
   xdrmem_create (&xdr, buf, sizeof buf, XDR_ENCODE);
-  if (!xdr_guestfs_progress (&xdr, &message)) {
+  if (!xdr_u_int (&xdr, &i) || !xdr_guestfs_progress (&xdr, &message)) {
     fprintf (stderr, "guestfsd: xdr_guestfs_progress: failed to encode message\n");
     xdr_destroy (&xdr);
     return;
@@ -657,10 +885,21 @@ notify_progress (uint64_t position, uint64_t total)
   len = xdr_getpos (&xdr);
   xdr_destroy (&xdr);
 
+  /* During a FileOut transfer, piggy-back on the next chunk.  Only
+   * the latest position matters, so this overwrites any earlier
+   * notification which hasn't been sent yet.
+   */
+  if (sending_file && len == PROGRESS_MESSAGE_LEN) {
+    memcpy (pending_progress, buf, len);
+    pending_progress_len = len;
+    return;
+  }
+
   if (xwrite (sock, buf, len) == -1) {
     fprintf (stderr, "guestfsd: xwrite failed\n");
     exit (EXIT_FAILURE);
   }
+  call_bytes_sent += len;
 }
 
 /* "Pulse mode" progress messages. */
@@ -24,9 +24,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 
+#include "c-ctype.h"
+#include "hash.h"
+#include "hash-pjw.h"
+
 #include "daemon.h"
 #include "optgroups.h"
 #include "actions.h"
@@ -66,13 +72,295 @@ do_realpath (const char *path)
 #endif
 }
 
-char *
-do_case_sensitive_path (const char *path)
+/* Case-insensitive lookups of path elements.
+ *
+ * Windows inspection resolves the same paths (and the same huge
+ * directories such as System32) over and over again.  To avoid
+ * rescanning a directory on every lookup, the first scan builds an
+ * index of the directory mapping case-folded names to real names,
+ * and later lookups are answered from the index.
+ *
+ * An index is only used while the directory is unchanged (same
+ * device, inode, mtime and ctime).  Because timestamps have one
+ * second granularity, an index built in the same second that the
+ * directory was last modified is not kept, since a later change
+ * in that second would not be noticed.  All indexes are dropped
+ * when filesystems are unmounted.
+ */
+struct dir_index {
+  char *path;                   /* real path of directory in sysroot */
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  time_t ctime;
+  Hash_table *names;            /* folded name -> struct dir_index_name */
+};
+
+struct dir_index_name {
+  char *folded;
+  char *name;
+};
+
+/* Maximum number of directories indexed at any one time. */
+#define MAX_DIR_INDEXES 1024
+
+static Hash_table *dir_indexes;
+
+static char *
+fold_name (const char *name)
+{
+  char *ret = strdup (name);
+  char *p;
+
+  if (ret == NULL)
+    return NULL;
+  for (p = ret; *p; ++p)
+    *p = c_tolower (*p);
+  return ret;
+}
+
+static size_t
+dir_index_hash (void const *x, size_t table_size)
+{
+  struct dir_index const *p = x;
+  return hash_pjw (p->path, table_size);
+}
+
+static bool
+dir_index_compare (void const *x, void const *y)
+{
+  struct dir_index const *a = x;
+  struct dir_index const *b = y;
+  return STREQ (a->path, b->path);
+}
+
+static void
+dir_index_free (void *x)
+{
+  if (x) {
+    struct dir_index *p = x;
+
+    if (p->names)
+      hash_free (p->names);
+    free (p->path);
+    free (p);
+  }
+}
+
+static size_t
+name_hash (void const *x, size_t table_size)
+{
+  struct dir_index_name const *p = x;
+  return hash_pjw (p->folded, table_size);
+}
+
+static bool
+name_compare (void const *x, void const *y)
+{
+  struct dir_index_name const *a = x;
+  struct dir_index_name const *b = y;
+  return STREQ (a->folded, b->folded);
+}
+
+static void
+name_free (void *x)
+{
+  if (x) {
+    struct dir_index_name *p = x;
+
+    free (p->folded);
+    free (p->name);
+    free (p);
+  }
+}
+
+void
+flush_case_sensitive_path_cache (void)
+{
+  if (dir_indexes) {
+    hash_free (dir_indexes);
+    dir_indexes = NULL;
+  }
+}
+
+/* Scan the directory open on 'fd' and build an index of it.  'fd'
+ * is not closed.  Returns NULL on error, with errno set.
+ */
+static struct dir_index *
+build_dir_index (int fd, const char *path, const struct stat *statbuf)
+{
+  struct dir_index *idx;
+  struct dirent *d;
+  DIR *dir;
+  int fd2, err;
+
+  idx = calloc (1, sizeof *idx);
+  if (idx == NULL)
+    return NULL;
+  idx->path = strdup (path);
+  idx->names = hash_initialize (64, NULL, name_hash, name_compare, name_free);
+  if (idx->path == NULL || idx->names == NULL)
+    goto error;
+  idx->dev = statbuf->st_dev;
+  idx->ino = statbuf->st_ino;
+  idx->mtime = statbuf->st_mtime;
+  idx->ctime = statbuf->st_ctime;
+
+  fd2 = dup (fd); /* because closedir will close it */
+  if (fd2 == -1)
+    goto error;
+  dir = fdopendir (fd2);
+  if (dir == NULL) {
+    err = errno;
+    close (fd2);
+    errno = err;
+    goto error;
+  }
+
+  errno = 0;
+  while ((d = readdir (dir)) != NULL) {
+    struct dir_index_name *n = malloc (sizeof *n);
+    if (n == NULL)
+      goto error_closedir;
+    n->folded = fold_name (d->d_name);
+    n->name = strdup (d->d_name);
+    if (n->folded == NULL || n->name == NULL) {
+      name_free (n);
+      goto error_closedir;
+    }
+
+    /* If two names differ only in case, keep the first one that we
+     * see, which is what scanning the directory would have found.
+     */
+    struct dir_index_name *r = hash_insert (idx->names, n);
+    if (r != n)
+      name_free (n);
+    if (r == NULL)
+      goto error_closedir;
+
+    errno = 0;
+  }
+
+  if (errno != 0)
+    goto error_closedir;
+
+  if (closedir (dir) == -1)
+    goto error;
+
+  return idx;
+
+ error_closedir:
+  err = errno;
+  closedir (dir);
+  errno = err;
+ error:
+  err = errno;
+  dir_index_free (idx);
+  errno = err;
+  return NULL;
+}
+
+/* Find the real name of 'name' in the directory 'path', open on 'fd'.
+ * On success returns 0 and a string which must be freed in '*ret'.
+ * If the name is not found, returns 0 and sets '*ret' to NULL.  On
+ * error, returns -1 with errno set.
+ */
+static int
+lookup_name (int fd, const char *path, const char *name, char **ret)
+{
+  struct dir_index key, *idx;
+  struct dir_index_name nkey, *n;
+  struct stat statbuf;
+  int cache;
+
+  *ret = NULL;
+
+  if (fstat (fd, &statbuf) == -1)
+    return -1;
+
+  if (dir_indexes == NULL) {
+    dir_indexes = hash_initialize (MAX_DIR_INDEXES, NULL,
+                                   dir_index_hash, dir_index_compare,
+                                   dir_index_free);
+    if (dir_indexes == NULL)
+      return -1;
+  }
+
+  key.path = (char *) path;
+  idx = hash_lookup (dir_indexes, &key);
+  if (idx &&
+      (idx->dev != statbuf.st_dev || idx->ino != statbuf.st_ino ||
+       idx->mtime != statbuf.st_mtime || idx->ctime != statbuf.st_ctime)) {
+    if (verbose)
+      fprintf (stderr, "case_sensitive_path: %s changed, rescanning\n", path);
+    dir_index_free (hash_delete (dir_indexes, idx));
+    idx = NULL;
+  }
+
+  cache = 1;
+  if (idx == NULL) {
+    idx = build_dir_index (fd, path, &statbuf);
+    if (idx == NULL)
+      return -1;
+
+    if (time (NULL) <= statbuf.st_mtime || time (NULL) <= statbuf.st_ctime)
+      cache = 0;
+    else if (hash_get_n_entries (dir_indexes) >= MAX_DIR_INDEXES)
+      hash_clear (dir_indexes);
+
+    if (cache && hash_insert (dir_indexes, idx) == NULL) {
+      dir_index_free (idx);
+      return -1;
+    }
+  }
+
+  nkey.folded = fold_name (name);
+  if (nkey.folded == NULL) {
+    if (!cache)
+      dir_index_free (idx);
+    return -1;
+  }
+  n = hash_lookup (idx->names, &nkey);
+  free (nkey.folded);
+
+  if (n) {
+    *ret = strdup (n->name);
+    if (*ret == NULL) {
+      if (!cache)
+        dir_index_free (idx);
+      return -1;
+    }
+  }
+
+  if (!cache)
+    dir_index_free (idx);
+  return 0;
+}
+
+/* Resolve 'path' case-insensitively.  Returns NULL on error, which
+ * has been sent back to the library with reply_with_*.
+ *
+ * If 'not_found' is not NULL, then a path which does not exist is not
+ * an error: *not_found is set to 1 and NULL is returned without
+ * replying.
+ */
+static char *
+case_sensitive_path (const char *path, int *not_found)
 {
   char ret[PATH_MAX+1] = "/";
   size_t next = 1;
   int fd_cwd;
 
+#define CSP_ERROR(...)                                                  \
+  do { reply_with_error (__VA_ARGS__); goto error; } while (0)
+#define CSP_PERROR(...)                                                 \
+  do { reply_with_perror (__VA_ARGS__); goto error; } while (0)
+#define CSP_NOT_FOUND(...)                                              \
+  do {                                                                  \
+    if (not_found) { *not_found = 1; goto error; }                      \
+    CSP_ERROR (__VA_ARGS__);                                            \
+  } while (0)
+
   /* 'fd_cwd' here is a surrogate for the current working directory, so
    * that we don't have to actually call chdir(2).
    */
@@ -93,14 +381,10 @@ do_case_sensitive_path (const char *path)
     }
 
     if ((i == 1 && path[0] == '.') ||
-        (i == 2 && path[0] == '.' && path[1] == '.')) {
-      reply_with_error ("path contained . or .. elements");
-      goto error;
-    }
-    if (i > NAME_MAX) {
-      reply_with_error ("path element too long");
-      goto error;
-    }
+        (i == 2 && path[0] == '.' && path[1] == '.'))
+      CSP_ERROR ("path contained . or .. elements");
+    if (i > NAME_MAX)
+      CSP_ERROR ("path element too long");
 
     char name[NAME_MAX+1];
     memcpy (name, path, i);
@@ -109,75 +393,49 @@ do_case_sensitive_path (const char *path)
     /* Skip to next element in path (for the next loop iteration). */
     path += i;
 
-    /* Read the current directory looking (case insensitively) for
-     * this element of the path.
+    /* Look in the current directory (case insensitively) for this
+     * element of the path.
      */
-    int fd2 = dup (fd_cwd); /* because closedir will close it */
-    if (fd2 == -1) {
-      reply_with_perror ("dup");
-      goto error;
-    }
-    DIR *dir = fdopendir (fd2);
-    if (dir == NULL) {
-      reply_with_perror ("opendir");
-      goto error;
-    }
+    ret[next] = '\0';
+    char *real;
+    if (lookup_name (fd_cwd, ret, name, &real) == -1)
+      CSP_PERROR ("%s", ret);
 
-    struct dirent *d = NULL;
-
-    errno = 0;
-    while ((d = readdir (dir)) != NULL) {
-      if (STRCASEEQ (d->d_name, name))
-        break;
-    }
-
-    if (d == NULL && errno != 0) {
-      reply_with_perror ("readdir");
-      goto error;
-    }
-
-    if (closedir (dir) == -1) {
-      reply_with_perror ("closedir");
-      goto error;
-    }
-
-    if (d == NULL) {
-      reply_with_error ("%s: no file or directory found with this name", name);
-      goto error;
-    }
+    if (real == NULL)
+      CSP_NOT_FOUND ("%s: no file or directory found with this name", name);
 
     /* Add the real name of this path element to the return value. */
     if (next > 1)
       ret[next++] = '/';
 
-    i = strlen (d->d_name);
+    i = strlen (real);
     if (next + i >= PATH_MAX) {
-      reply_with_error ("final path too long");
-      goto error;
+      free (real);
+      CSP_ERROR ("final path too long");
     }
 
-    strcpy (&ret[next], d->d_name);
+    strcpy (&ret[next], real);
     next += i;
+    free (real);
 
     /* Is it a directory?  Try going into it. */
-    fd2 = openat (fd_cwd, d->d_name, O_RDONLY | O_DIRECTORY);
+    int fd2 = openat (fd_cwd, &ret[next-i], O_RDONLY | O_DIRECTORY);
     int err = errno;
     close (fd_cwd);
     fd_cwd = fd2;
     errno = err;
     if (fd_cwd == -1) {
       /* ENOTDIR is OK provided we've reached the end of the path. */
-      if (errno != ENOTDIR) {
-        reply_with_perror ("openat: %s", d->d_name);
-        goto error;
-      }
+      if (errno != ENOTDIR)
+        CSP_PERROR ("openat: %s", &ret[next-i]);
 
-      if (*path) {
-        reply_with_error ("%s: non-directory element in path", d->d_name);
-        goto error;
-      }
+      if (*path)
+        CSP_NOT_FOUND ("%s: non-directory element in path", &ret[next-i]);
     }
   }
+#undef CSP_ERROR
+#undef CSP_PERROR
+#undef CSP_NOT_FOUND
 
   if (fd_cwd >= 0)
     close (fd_cwd);
@@ -196,3 +454,44 @@ do_case_sensitive_path (const char *path)
 
   return NULL;
 }
+
+char *
+do_case_sensitive_path (const char *path)
+{
+  return case_sensitive_path (path, NULL);
+}
+
+char **
+do_case_sensitive_path_list (char *const *paths)
+{
+  char **ret = NULL;
+  int size = 0, alloc = 0;
+  size_t i;
+
+  NEED_ROOT (, return NULL);
+
+  for (i = 0; paths[i] != NULL; ++i) {
+    ABS_PATH (paths[i], , goto error);
+
+    int not_found = 0;
+    char *rpath = case_sensitive_path (paths[i], &not_found);
+    if (rpath == NULL) {
+      if (!not_found)
+        goto error;
+      if (add_string (&ret, &size, &alloc, "") == -1)
+        return NULL;
+    }
+    else if (add_string_nodup (&ret, &size, &alloc, rpath) == -1)
+      return NULL;
+  }
+
+  if (add_string_nodup (&ret, &size, &alloc, NULL) == -1)
+    return NULL;
+
+  return ret;                   /* caller frees */
+
+ error:
+  if (ret)
+    free_stringslen (ret, size);
+  return NULL;
+}
@@ -0,0 +1,126 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "daemon.h"
+#include "actions.h"
+
+/* Per-procedure statistics, collected by main_loop for every call
+ * (see record_call_stats) and returned by internal_call_stats.
+ */
+struct call_stats {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t hist[6];             /* < 1ms, 10ms, 100ms, 1s, 10s, longer */
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+};
+
+static struct call_stats stats[GUESTFS_PROC_NR_PROCS];
+
+void
+record_call_stats (int proc_nr, int64_t elapsed_us, int failed,
+                   uint64_t bytes_sent, uint64_t bytes_received)
+{
+  struct call_stats *s;
+  int64_t limit;
+  size_t i;
+
+  if (proc_nr < 0 || proc_nr >= GUESTFS_PROC_NR_PROCS)
+    return;
+  if (elapsed_us < 0)
+    elapsed_us = 0;
+
+  s = &stats[proc_nr];
+  s->calls++;
+  if (failed)
+    s->errors++;
+  s->total_us += elapsed_us;
+  if ((uint64_t) elapsed_us > s->max_us)
+    s->max_us = elapsed_us;
+  for (i = 0, limit = 1000; i < 5 && elapsed_us >= limit; ++i, limit *= 10)
+    ;
+  s->hist[i]++;
+  s->bytes_sent += bytes_sent;
+  s->bytes_received += bytes_received;
+}
+
+guestfs_int_call_stats_list *
+do_internal_call_stats (void)
+{
+  guestfs_int_call_stats_list *ret;
+  guestfs_int_call_stats *v;
+  size_t i, n;
+
+  ret = malloc (sizeof *ret);
+  if (ret == NULL) {
+    reply_with_perror ("malloc");
+    return NULL;
+  }
+
+  for (i = n = 0; i < GUESTFS_PROC_NR_PROCS; ++i)
+    if (stats[i].calls > 0)
+      n++;
+
+  v = calloc (n, sizeof *v);
+  if (v == NULL && n > 0) {
+    reply_with_perror ("calloc");
+    free (ret);
+    return NULL;
+  }
+  ret->guestfs_int_call_stats_list_len = n;
+  ret->guestfs_int_call_stats_list_val = v;
+
+  for (i = n = 0; i < GUESTFS_PROC_NR_PROCS; ++i) {
+    if (stats[i].calls == 0)
+      continue;
+
+    v[n].stats_name = strdup (function_names[i] ? function_names[i] : "");
+    v[n].stats_side = strdup ("daemon");
+    if (v[n].stats_name == NULL || v[n].stats_side == NULL) {
+      reply_with_perror ("strdup");
+      ret->guestfs_int_call_stats_list_len = n+1;
+      xdr_free ((xdrproc_t) xdr_guestfs_int_call_stats_list, (char *) ret);
+      free (ret);
+      return NULL;
+    }
+    v[n].stats_calls = stats[i].calls;
+    v[n].stats_errors = stats[i].errors;
+    v[n].stats_total_us = stats[i].total_us;
+    v[n].stats_max_us = stats[i].max_us;
+    v[n].stats_hist_1ms = stats[i].hist[0];
+    v[n].stats_hist_10ms = stats[i].hist[1];
+    v[n].stats_hist_100ms = stats[i].hist[2];
+    v[n].stats_hist_1s = stats[i].hist[3];
+    v[n].stats_hist_10s = stats[i].hist[4];
+    v[n].stats_hist_inf = stats[i].hist[5];
+    v[n].stats_bytes_sent = stats[i].bytes_sent;
+    v[n].stats_bytes_received = stats[i].bytes_received;
+    n++;
+  }
+
+  return ret;
+}
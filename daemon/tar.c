@@ -154,14 +154,18 @@ do_tXz_in (const char *dir, const char *filter)
 int
 do_tar_in (const char *dir)
 {
-  return do_tXz_in (dir, "");
+  return tar_in_native (dir, 0);
 }
 
 /* Has one FileIn parameter. */
 int
 do_tgz_in (const char *dir)
 {
+#ifdef HAVE_ZLIB
+  return tar_in_native (dir, 1);
+#else
   return do_tXz_in (dir, "z");
+#endif
 }
 
 /* Has one FileIn parameter. */
@@ -175,72 +179,41 @@ do_txz_in (const char *dir)
 static int
 do_tXz_out (const char *dir, const char *filter)
 {
+  char *buf;
+  char opts[16];
   int r;
-  FILE *fp;
-  char *cmd;
-  char buf[GUESTFS_MAX_CHUNK_SIZE];
-
-  /* "tar -C /sysroot%s -zcf - ." but we have to quote the dir. */
-  if (asprintf_nowarn (&cmd, "tar -C %R -%scf - .", dir, filter) == -1) {
-    reply_with_perror ("asprintf");
-    return -1;
-  }
-
-  if (verbose)
-    fprintf (stderr, "%s\n", cmd);
-
-  fp = popen (cmd, "r");
-  if (fp == NULL) {
-    reply_with_perror ("%s", cmd);
-    free (cmd);
-    return -1;
-  }
-  free (cmd);
-
-  /* Now we must send the reply message, before the file contents.  After
-   * this there is no opportunity in the protocol to send any error
-   * message back.  Instead we can only cancel the transfer.
-   */
-  reply (NULL, NULL);
-
-  while ((r = fread (buf, 1, sizeof buf, fp)) > 0) {
-    if (send_file_write (buf, r) < 0) {
-      pclose (fp);
-      return -1;
-    }
-  }
 
-  if (ferror (fp)) {
-    perror (dir);
-    send_file_end (1);		/* Cancel. */
-    pclose (fp);
+  /* "tar -C /sysroot%s -zcf - ." */
+  buf = sysroot_path (dir);
+  if (buf == NULL) {
+    reply_with_perror ("malloc");
     return -1;
   }
+  snprintf (opts, sizeof opts, "-%scf", filter);
 
-  if (pclose (fp) != 0) {
-    perror (dir);
-    send_file_end (1);		/* Cancel. */
-    return -1;
-  }
+  const char *argv[] = { "tar", "-C", buf, opts, "-", ".", NULL };
+  r = commandv_out (argv);
+  free (buf);
 
-  if (send_file_end (0))	/* Normal end of file. */
-    return -1;
-
-  return 0;
+  return r;
 }
 
 /* Has one FileOut parameter. */
 int
 do_tar_out (const char *dir)
 {
-  return do_tXz_out (dir, "");
+  return tar_out_native (dir, 0);
 }
 
 /* Has one FileOut parameter. */
 int
 do_tgz_out (const char *dir)
 {
+#ifdef HAVE_ZLIB
+  return tar_out_native (dir, 1);
+#else
   return do_tXz_out (dir, "z");
+#endif
 }
 
 /* Has one FileOut parameter. */
@@ -0,0 +1,1847 @@
+/* libguestfs - the guestfsd daemon
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* In-process tar writer and reader, used by tar-out/tgz-out and
+ * tar-in/tgz-in instead of running tar(1) through popen.  The writer
+ * produces POSIX (pax) archives, with extended attributes stored as
+ * SCHILY.xattr.* records like GNU tar and star.  The reader accepts
+ * ustar, pax and the common GNU extensions (long names), which
+ * covers the archives produced by any tar program in use today.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#if defined(HAVE_ATTR_XATTR_H)
+#include <attr/xattr.h>
+#elif defined(HAVE_SYS_XATTR_H)
+#include <sys/xattr.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "fts_.h"
+#include "hash.h"
+
+#include "guestfs_protocol.h"
+#include "daemon.h"
+
+#define BLOCKSIZE 512
+
+/* GNU tar pads archives to a multiple of 20 blocks. */
+#define RECORDSIZE (20 * BLOCKSIZE)
+
+/* Limit on the size of pax and GNU long name headers which we will
+ * read into memory.
+ */
+#define MAX_META_SIZE (1024 * 1024)
+
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+static const char zero_block[BLOCKSIZE];
+
+/* Compute the header checksum, treating the chksum field as spaces. */
+static unsigned
+header_checksum (const struct tar_header *h)
+{
+  const unsigned char *p = (const unsigned char *) h;
+  unsigned sum = 0;
+  size_t i;
+
+  for (i = 0; i < BLOCKSIZE; ++i) {
+    if (i >= offsetof (struct tar_header, chksum) &&
+        i < offsetof (struct tar_header, chksum) + sizeof h->chksum)
+      sum += ' ';
+    else
+      sum += p[i];
+  }
+
+  return sum;
+}
+
+/*----------------------------------------------------------------------*/
+/* Writer. */
+
+struct tar_out {
+  /* Output which has not yet been sent to the library. */
+  char buf[GUESTFS_MAX_CHUNK_SIZE];
+  size_t len;
+
+  uint64_t written;             /* Bytes of tar data written. */
+  int failed;                   /* Some file could not be archived. */
+
+#ifdef HAVE_ZLIB
+  int gzip;
+  z_stream zs;
+#endif
+
+  /* Regular files with more than one link, so that the second and
+   * later occurrences can be written as hard links.
+   */
+  Hash_table *links;
+};
+
+struct link_entry {
+  dev_t dev;
+  ino_t ino;
+  char *name;
+};
+
+static size_t
+link_hash (void const *x, size_t table_size)
+{
+  struct link_entry const *p = x;
+  return (p->ino ^ p->dev) % table_size;
+}
+
+static bool
+link_compare (void const *x, void const *y)
+{
+  struct link_entry const *p = x;
+  struct link_entry const *q = y;
+  return p->ino == q->ino && p->dev == q->dev;
+}
+
+static void
+link_free (void *x)
+{
+  if (x) {
+    struct link_entry *p = x;
+    free (p->name);
+    free (p);
+  }
+}
+
+/* Send the buffered output.  Returns -1 if the transfer has been
+ * cancelled or failed, in which case nothing more must be sent.
+ */
+static int
+out_flush (struct tar_out *o)
+{
+  if (o->len > 0) {
+    if (send_file_write (o->buf, o->len) < 0)
+      return -1;
+    o->len = 0;
+  }
+  return 0;
+}
+
+static int
+out_raw (struct tar_out *o, const char *data, size_t n)
+{
+  size_t m;
+
+  while (n > 0) {
+    m = sizeof o->buf - o->len;
+    if (m > n)
+      m = n;
+    memcpy (o->buf + o->len, data, m);
+    o->len += m;
+    data += m;
+    n -= m;
+
+    if (o->len == sizeof o->buf && out_flush (o) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Run deflate, sending output as the buffer fills. */
+static int
+out_deflate (struct tar_out *o, int flush)
+{
+  int r;
+
+  do {
+    o->zs.next_out = (Bytef *) o->buf + o->len;
+    o->zs.avail_out = sizeof o->buf - o->len;
+    r = deflate (&o->zs, flush);
+    if (r == Z_STREAM_ERROR) {
+      fprintf (stderr, "guestfsd: tar: deflate failed\n");
+      return -1;
+    }
+    o->len = sizeof o->buf - o->zs.avail_out;
+    if (o->len == sizeof o->buf && out_flush (o) == -1)
+      return -1;
+  } while (o->zs.avail_out == 0 ||
+           (flush == Z_FINISH && r != Z_STREAM_END));
+
+  return 0;
+}
+#endif
+
+static int
+out_write (struct tar_out *o, const void *data, size_t n)
+{
+  o->written += n;
+
+#ifdef HAVE_ZLIB
+  if (o->gzip) {
+    o->zs.next_in = (Bytef *) data;
+    o->zs.avail_in = n;
+    return out_deflate (o, Z_NO_FLUSH);
+  }
+#endif
+
+  return out_raw (o, data, n);
+}
+
+static int
+out_pad (struct tar_out *o, uint64_t size)
+{
+  size_t n = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+
+  if (n > 0)
+    return out_write (o, zero_block, n);
+  return 0;
+}
+
+/* Store 'v' as a NUL-terminated octal number.  Returns -1 if it
+ * doesn't fit, in which case the caller must use a pax record.
+ */
+static int
+set_octal (char *field, size_t size, uint64_t v)
+{
+  size_t i = size - 1;
+
+  field[i] = '\0';
+  while (i > 0) {
+    field[--i] = '0' + (v & 7);
+    v >>= 3;
+  }
+
+  return v == 0 ? 0 : -1;
+}
+
+/* Append a "LEN KEY=VALUE\n" pax record, where LEN counts the whole
+ * record including its own digits.
+ */
+static int
+add_pax_record (char **pax, size_t *pax_len,
+                const char *key, const char *value, size_t value_len)
+{
+  size_t n = strlen (key) + value_len + 3; /* ' ' '=' '\n' */
+  size_t len, digits;
+  char *p;
+
+  /* Work out the total length, which depends on its own digits. */
+  for (digits = 1; ; digits++) {
+    char tmp[32];
+    len = n + digits;
+    if ((size_t) snprintf (tmp, sizeof tmp, "%zu", len) == digits)
+      break;
+  }
+
+  p = realloc (*pax, *pax_len + len + 1);
+  if (p == NULL) {
+    perror ("realloc");
+    return -1;
+  }
+  *pax = p;
+  p += *pax_len;
+  p += sprintf (p, "%zu %s=", len, key);
+  memcpy (p, value, value_len);
+  p[value_len] = '\n';
+  *pax_len += len;
+
+  return 0;
+}
+
+static int
+add_pax_number (char **pax, size_t *pax_len, const char *key, uint64_t v)
+{
+  char value[32];
+
+  snprintf (value, sizeof value, "%" PRIu64, v);
+  return add_pax_record (pax, pax_len, key, value, strlen (value));
+}
+
+/* Add SCHILY.xattr.* records for the extended attributes of 'path'. */
+static int
+add_pax_xattrs (char **pax, size_t *pax_len, const char *path)
+{
+#if defined(HAVE_LLISTXATTR) && defined(HAVE_LGETXATTR)
+  ssize_t len, vlen;
+  char *names = NULL, *value = NULL, *key = NULL;
+  size_t i;
+  int ret = -1;
+
+  len = llistxattr (path, NULL, 0);
+  if (len <= 0)
+    return 0;                   /* No xattrs, or not supported. */
+
+  names = malloc (len);
+  if (names == NULL) {
+    perror ("malloc");
+    goto out;
+  }
+  len = llistxattr (path, names, len);
+  if (len == -1) {
+    perror (path);
+    goto out;
+  }
+
+  for (i = 0; i < (size_t) len; i += strlen (&names[i]) + 1) {
+    vlen = lgetxattr (path, &names[i], NULL, 0);
+    if (vlen == -1) {
+      perror (path);
+      goto out;
+    }
+    free (value);
+    value = malloc (vlen + 1);
+    if (value == NULL) {
+      perror ("malloc");
+      goto out;
+    }
+    vlen = lgetxattr (path, &names[i], value, vlen);
+    if (vlen == -1) {
+      perror (path);
+      goto out;
+    }
+
+    free (key);
+    if (asprintf (&key, "SCHILY.xattr.%s", &names[i]) == -1) {
+      perror ("asprintf");
+      key = NULL;
+      goto out;
+    }
+    if (add_pax_record (pax, pax_len, key, value, vlen) == -1)
+      goto out;
+  }
+
+  ret = 0;
+ out:
+  free (names);
+  free (value);
+  free (key);
+  return ret;
+#else
+  return 0;
+#endif
+}
+
+/* Write a header block (and any pax extended header needed before
+ * it) for one archive member.
+ */
+static int
+write_header (struct tar_out *o, const char *name, const char *path,
+              const struct stat *statbuf, char typeflag,
+              const char *linkname, uint64_t size)
+{
+  struct tar_header h;
+  char *pax = NULL;
+  size_t pax_len = 0;
+  size_t name_len = strlen (name);
+  const char *slash;
+  int r = -1;
+
+  memset (&h, 0, sizeof h);
+
+  /* Use the ustar prefix field for long names if possible, otherwise
+   * a pax "path" record.
+   */
+  if (name_len <= sizeof h.name)
+    memcpy (h.name, name, name_len);
+  else {
+    slash = NULL;
+    if (name_len <= sizeof h.prefix + 1 + sizeof h.name) {
+      slash = name + name_len - sizeof h.name - 1;
+      slash = strchr (slash, '/');
+      if (slash && (slash == name || slash - name > (ptrdiff_t) sizeof h.prefix ||
+                    slash[1] == '\0'))
+        slash = NULL;
+    }
+    if (slash) {
+      memcpy (h.prefix, name, slash - name);
+      memcpy (h.name, slash + 1, name_len - (slash - name) - 1);
+    } else {
+      memcpy (h.name, name, sizeof h.name);
+      if (add_pax_record (&pax, &pax_len, "path", name, name_len) == -1)
+        goto out;
+    }
+  }
+
+  if (linkname) {
+    size_t n = strlen (linkname);
+    if (n <= sizeof h.linkname)
+      memcpy (h.linkname, linkname, n);
+    else {
+      memcpy (h.linkname, linkname, sizeof h.linkname);
+      if (add_pax_record (&pax, &pax_len, "linkpath", linkname, n) == -1)
+        goto out;
+    }
+  }
+
+  set_octal (h.mode, sizeof h.mode, statbuf->st_mode & 07777);
+  if (set_octal (h.uid, sizeof h.uid, statbuf->st_uid) == -1) {
+    set_octal (h.uid, sizeof h.uid, 0);
+    if (add_pax_number (&pax, &pax_len, "uid", statbuf->st_uid) == -1)
+      goto out;
+  }
+  if (set_octal (h.gid, sizeof h.gid, statbuf->st_gid) == -1) {
+    set_octal (h.gid, sizeof h.gid, 0);
+    if (add_pax_number (&pax, &pax_len, "gid", statbuf->st_gid) == -1)
+      goto out;
+  }
+  if (set_octal (h.size, sizeof h.size, size) == -1) {
+    set_octal (h.size, sizeof h.size, 0);
+    if (add_pax_number (&pax, &pax_len, "size", size) == -1)
+      goto out;
+  }
+  if (statbuf->st_mtime < 0 ||
+      set_octal (h.mtime, sizeof h.mtime, statbuf->st_mtime) == -1) {
+    char value[32];
+    set_octal (h.mtime, sizeof h.mtime, 0);
+    snprintf (value, sizeof value, "%" PRIi64, (int64_t) statbuf->st_mtime);
+    if (add_pax_record (&pax, &pax_len, "mtime", value, strlen (value)) == -1)
+      goto out;
+  }
+  if (typeflag == '3' || typeflag == '4') {
+    set_octal (h.devmajor, sizeof h.devmajor, major (statbuf->st_rdev));
+    set_octal (h.devminor, sizeof h.devminor, minor (statbuf->st_rdev));
+  }
+  h.typeflag = typeflag;
+  memcpy (h.magic, "ustar", 6);
+  memcpy (h.version, "00", 2);
+
+  if (typeflag != '1' && add_pax_xattrs (&pax, &pax_len, path) == -1)
+    goto out;
+
+  /* Extended header, if any, goes first. */
+  if (pax_len > 0) {
+    struct tar_header x;
+    const char *base = strrchr (name, '/');
+    size_t n;
+
+    base = base && base[1] ? base + 1 : name;
+    memset (&x, 0, sizeof x);
+    memcpy (x.name, "./PaxHeaders/", 13);
+    n = strlen (base);
+    if (n > sizeof x.name - 13)
+      n = sizeof x.name - 13;
+    memcpy (x.name + 13, base, n);
+    set_octal (x.mode, sizeof x.mode, 0644);
+    set_octal (x.uid, sizeof x.uid, 0);
+    set_octal (x.gid, sizeof x.gid, 0);
+    set_octal (x.size, sizeof x.size, pax_len);
+    memcpy (x.mtime, h.mtime, sizeof x.mtime);
+    x.typeflag = 'x';
+    memcpy (x.magic, "ustar", 6);
+    memcpy (x.version, "00", 2);
+    snprintf (x.chksum, sizeof x.chksum, "%06o", header_checksum (&x));
+
+    if (out_write (o, &x, sizeof x) == -1 ||
+        out_write (o, pax, pax_len) == -1 ||
+        out_pad (o, pax_len) == -1)
+      goto out;
+  }
+
+  snprintf (h.chksum, sizeof h.chksum, "%06o", header_checksum (&h));
+  if (out_write (o, &h, sizeof h) == -1)
+    goto out;
+
+  r = 0;
+ out:
+  free (pax);
+  return r;
+}
+
+/* Write the contents of a regular file, which must be exactly 'size'
+ * bytes long (the size in the header).  If the file is shorter than
+ * this when we read it, pad it with zeroes like tar does.
+ */
+static int
+write_file_data (struct tar_out *o, const char *path, int fd, uint64_t size)
+{
+  char buf[GUESTFS_MAX_CHUNK_SIZE];
+  uint64_t done = 0;
+  ssize_t r;
+  size_t n;
+
+  while (done < size) {
+    n = size - done < sizeof buf ? size - done : sizeof buf;
+    r = read (fd, buf, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      if (r == -1)
+        perror (path);
+      else
+        fprintf (stderr, "guestfsd: tar: %s: file shrank while reading\n",
+                 path);
+      o->failed = 1;
+      break;
+    }
+    if (out_write (o, buf, r) == -1)
+      return -1;
+    done += r;
+  }
+
+  while (done < size) {
+    n = size - done < BLOCKSIZE ? size - done : BLOCKSIZE;
+    if (out_write (o, zero_block, n) == -1)
+      return -1;
+    done += n;
+  }
+
+  return out_pad (o, size);
+}
+
+/* Archive one member.  'name' is the name in the archive and 'path'
+ * is the real path.
+ */
+static int
+write_member (struct tar_out *o, const char *name, const char *path,
+              const struct stat *statbuf)
+{
+  char *linkname = NULL;
+  char typeflag;
+  uint64_t size = 0;
+  int fd = -1;
+  int r = -1;
+
+  if (S_ISREG (statbuf->st_mode)) {
+    typeflag = '0';
+    size = statbuf->st_size;
+
+    if (statbuf->st_nlink > 1) {
+      struct link_entry key, *p;
+
+      key.dev = statbuf->st_dev;
+      key.ino = statbuf->st_ino;
+      p = hash_lookup (o->links, &key);
+      if (p) {
+        typeflag = '1';
+        size = 0;
+        linkname = strdup (p->name);
+        if (linkname == NULL) {
+          perror ("strdup");
+          return -1;
+        }
+      }
+    }
+
+    if (typeflag == '0') {
+      fd = open (path, O_RDONLY|O_NOCTTY|O_NOFOLLOW|O_CLOEXEC);
+      if (fd == -1) {
+        perror (path);
+        o->failed = 1;
+        return 0;               /* Skip it, like tar. */
+      }
+
+      if (statbuf->st_nlink > 1) {
+        struct link_entry *p;
+
+        p = malloc (sizeof *p);
+        if (p == NULL || (p->name = strdup (name)) == NULL) {
+          perror ("malloc");
+          free (p);
+          close (fd);
+          return -1;
+        }
+        p->dev = statbuf->st_dev;
+        p->ino = statbuf->st_ino;
+        if (hash_insert (o->links, p) == NULL) {
+          perror ("hash_insert");
+          link_free (p);
+          close (fd);
+          return -1;
+        }
+      }
+    }
+  }
+  else if (S_ISDIR (statbuf->st_mode))
+    typeflag = '5';
+  else if (S_ISLNK (statbuf->st_mode)) {
+    ssize_t n;
+
+    typeflag = '2';
+    linkname = malloc (statbuf->st_size + 1);
+    if (linkname == NULL) {
+      perror ("malloc");
+      return -1;
+    }
+    n = readlink (path, linkname, statbuf->st_size + 1);
+    if (n == -1 || n > statbuf->st_size) {
+      if (n == -1)
+        perror (path);
+      else
+        fprintf (stderr, "guestfsd: tar: %s: symlink changed\n", path);
+      free (linkname);
+      o->failed = 1;
+      return 0;
+    }
+    linkname[n] = '\0';
+  }
+  else if (S_ISCHR (statbuf->st_mode))
+    typeflag = '3';
+  else if (S_ISBLK (statbuf->st_mode))
+    typeflag = '4';
+  else if (S_ISFIFO (statbuf->st_mode))
+    typeflag = '6';
+  else {
+    /* Sockets are ignored by tar too. */
+    if (verbose)
+      fprintf (stderr, "guestfsd: tar: %s: socket ignored\n", path);
+    return 0;
+  }
+
+  if (write_header (o, name, path, statbuf, typeflag, linkname, size) == -1)
+    goto out;
+
+  if (fd >= 0 && write_file_data (o, path, fd, size) == -1)
+    goto out;
+
+  r = 0;
+ out:
+  if (fd >= 0)
+    close (fd);
+  free (linkname);
+  return r;
+}
+
+/* Has one FileOut parameter. */
+int
+tar_out_native (const char *dir, int gzip)
+{
+  struct tar_out *o;
+  struct stat statbuf;
+  char *path;
+  char *paths[2];
+  FTS *fts;
+  FTSENT *ent;
+  size_t rootlen;
+  char *name;
+  int r;
+
+  path = sysroot_path (dir);
+  if (path == NULL) {
+    reply_with_perror ("malloc");
+    return -1;
+  }
+
+  if (stat (path, &statbuf) == -1) {
+    reply_with_perror ("%s", dir);
+    free (path);
+    return -1;
+  }
+  if (!S_ISDIR (statbuf.st_mode)) {
+    reply_with_error ("%s: not a directory", dir);
+    free (path);
+    return -1;
+  }
+
+  /* Don't follow symlinks, except that 'directory' itself may be a
+   * symlink to a directory, as it is for tar.  Never change directory
+   * (see CHROOT_IN in daemon.h).
+   */
+  paths[0] = path;
+  paths[1] = NULL;
+  fts = fts_open (paths, FTS_COMFOLLOW | FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+  if (fts == NULL) {
+    reply_with_perror ("fts_open: %s", dir);
+    free (path);
+    return -1;
+  }
+
+  o = calloc (1, sizeof *o);
+  if (o == NULL) {
+    reply_with_perror ("calloc");
+    fts_close (fts);
+    free (path);
+    return -1;
+  }
+  o->links = hash_initialize (1024, NULL, link_hash, link_compare, link_free);
+  if (o->links == NULL) {
+    reply_with_perror ("hash_initialize");
+    free (o);
+    fts_close (fts);
+    free (path);
+    return -1;
+  }
+
+#ifdef HAVE_ZLIB
+  o->gzip = gzip;
+  if (gzip) {
+    /* windowBits + 16 selects the gzip format. */
+    if (deflateInit2 (&o->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                      15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      reply_with_error ("deflateInit2 failed");
+      hash_free (o->links);
+      free (o);
+      fts_close (fts);
+      free (path);
+      return -1;
+    }
+  }
+#else
+  if (gzip)
+    abort ();
+#endif
+
+  /* Now we must send the reply message, before the file contents.  After
+   * this there is no opportunity in the protocol to send any error
+   * message back.  Instead we can only cancel the transfer.
+   */
+  reply (NULL, NULL);
+
+  /* Members are named "./", "./dir/", "./dir/file" etc. to match
+   * the output of "tar -C dir -cf - .".
+   */
+  rootlen = strlen (path);
+  r = 0;
+  while (r == 0) {
+    errno = 0;
+    ent = fts_read (fts);
+    if (ent == NULL) {
+      if (errno != 0) {
+        perror ("fts_read");
+        o->failed = 1;
+      }
+      break;
+    }
+
+    switch (ent->fts_info) {
+    case FTS_D:
+    case FTS_F:
+    case FTS_SL:
+    case FTS_SLNONE:
+    case FTS_DEFAULT:
+      if (asprintf (&name, ".%s%s",
+                    ent->fts_path + rootlen,
+                    ent->fts_info == FTS_D ? "/" : "") == -1) {
+        perror ("asprintf");
+        r = -1;
+        break;
+      }
+      r = write_member (o, name, ent->fts_accpath, ent->fts_statp);
+      free (name);
+      break;
+
+    case FTS_DP:                /* Directory, postorder. */
+      break;
+
+    case FTS_DNR:
+    case FTS_ERR:
+    case FTS_NS:
+      errno = ent->fts_errno;
+      perror (ent->fts_path);
+      o->failed = 1;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  fts_close (fts);
+  free (path);
+  hash_free (o->links);
+
+  if (r == 0 && !o->failed) {
+    /* End of archive: two zero blocks, padded to a whole record. */
+    uint64_t end = o->written + 2 * BLOCKSIZE;
+    end = (end + RECORDSIZE - 1) / RECORDSIZE * RECORDSIZE;
+    while (r == 0 && o->written < end)
+      r = out_write (o, zero_block, BLOCKSIZE);
+#ifdef HAVE_ZLIB
+    if (r == 0 && o->gzip)
+      r = out_deflate (o, Z_FINISH);
+#endif
+    if (r == 0)
+      r = out_flush (o);
+  }
+
+#ifdef HAVE_ZLIB
+  if (o->gzip)
+    deflateEnd (&o->zs);
+#endif
+
+  if (r == -1) {                /* Transfer was cancelled or failed. */
+    free (o);
+    return -1;
+  }
+
+  if (o->failed) {
+    fprintf (stderr, "guestfsd: tar: %s: some files could not be archived\n",
+             dir);
+    send_file_end (1);          /* Cancel. */
+    free (o);
+    return -1;
+  }
+
+  free (o);
+
+  if (send_file_end (0))        /* Normal end of file. */
+    return -1;
+
+  return 0;
+}
+
+/*----------------------------------------------------------------------*/
+/* Reader. */
+
+enum tar_in_state {
+  IN_HEADER,                    /* Reading a header block. */
+  IN_DATA,                      /* Reading file data. */
+  IN_META,                      /* Reading a pax or GNU long name header. */
+  IN_PAD,                       /* Skipping padding. */
+  IN_END,                       /* After the end of archive marker. */
+};
+
+struct xattr {
+  char *name;
+  char *value;
+  size_t len;
+};
+
+struct deferred_dir {
+  char *path;
+  mode_t mode;
+  struct timespec mtime;
+};
+
+struct deferred_link {
+  char typeflag;                /* '2', or '1' for a link to a symlink. */
+  char *path;
+  char *target;
+  uid_t uid;
+  gid_t gid;
+  struct timespec mtime;
+  struct xattr *xattrs;
+  size_t nr_xattrs;
+};
+
+struct tar_in {
+  const char *dir;              /* Target directory (in the chroot). */
+  char *error;                  /* Error message, if failed. */
+
+  enum tar_in_state state;
+  char block[BLOCKSIZE];        /* Partially received header. */
+  size_t block_len;
+  int zero_blocks;
+  uint64_t remaining;           /* Bytes of data left in this member. */
+  uint64_t pad;                 /* Padding after it. */
+
+  /* Collected pax or GNU long name header. */
+  char meta_type;
+  char *meta;
+  size_t meta_len;
+
+  /* Overrides for the next member, from pax or GNU headers. */
+  char *next_path;
+  char *next_linkpath;
+  int next_have_size, next_have_uid, next_have_gid, next_have_mtime;
+  uint64_t next_size, next_uid, next_gid;
+  int64_t next_mtime;
+  struct xattr *next_xattrs;
+  size_t next_nr_xattrs;
+
+  /* Regular file currently being extracted. */
+  int fd;
+  char *path;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec mtime;
+  struct xattr *xattrs;
+  size_t nr_xattrs;
+
+  /* Directories whose final mode and mtime are set at the end, so
+   * that extracting their contents doesn't change them.
+   */
+  struct deferred_dir *dirs;
+  size_t nr_dirs;
+
+  /* Symbolic links are created after everything else, so that later
+   * members cannot be written through them (eg. "a -> /etc" followed
+   * by "a/passwd").  Hard links to them have to wait too.
+   */
+  struct deferred_link *links;
+  size_t nr_links;
+
+#ifdef HAVE_ZLIB
+  int gzip;
+  z_stream zs;
+#endif
+};
+
+static void in_error (struct tar_in *t, const char *fs, ...)
+  __attribute__((format (printf,2,3)));
+
+static void
+in_error (struct tar_in *t, const char *fs, ...)
+{
+  va_list args;
+
+  if (t->error)
+    return;                     /* Keep the first error. */
+
+  va_start (args, fs);
+  if (vasprintf (&t->error, fs, args) == -1)
+    t->error = NULL;
+  va_end (args);
+}
+
+static void
+in_perror (struct tar_in *t, const char *path)
+{
+  in_error (t, "%s: %m", path);
+}
+
+static void
+free_xattrs (struct xattr *xattrs, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    free (xattrs[i].name);
+    free (xattrs[i].value);
+  }
+  free (xattrs);
+}
+
+static void
+clear_overrides (struct tar_in *t)
+{
+  free (t->next_path);
+  free (t->next_linkpath);
+  free_xattrs (t->next_xattrs, t->next_nr_xattrs);
+  t->next_path = t->next_linkpath = NULL;
+  t->next_have_size = t->next_have_uid = t->next_have_gid = 0;
+  t->next_have_mtime = 0;
+  t->next_xattrs = NULL;
+  t->next_nr_xattrs = 0;
+}
+
+/* Parse a numeric header field, which is either octal or (a GNU
+ * extension) base-256 if the top bit of the first byte is set.
+ */
+static int
+parse_number (const char *field, size_t size, uint64_t *ret)
+{
+  const unsigned char *p = (const unsigned char *) field;
+  uint64_t v = 0;
+  size_t i;
+
+  if (p[0] & 0x80) {
+    v = p[0] & 0x3f;
+    for (i = 1; i < size; ++i) {
+      if (v > UINT64_MAX >> 8)
+        return -1;
+      v = (v << 8) | p[i];
+    }
+    *ret = v;
+    return 0;
+  }
+
+  for (i = 0; i < size && p[i] == ' '; ++i)
+    ;
+  for (; i < size && p[i] >= '0' && p[i] <= '7'; ++i) {
+    if (v > UINT64_MAX >> 3)
+      return -1;
+    v = (v << 3) | (p[i] - '0');
+  }
+  if (i < size && p[i] != ' ' && p[i] != '\0')
+    return -1;
+
+  *ret = v;
+  return 0;
+}
+
+/* Copy a fixed-size, possibly unterminated header string. */
+static char *
+header_string (const char *field, size_t size)
+{
+  char *ret = strndup (field, size);
+  if (ret == NULL)
+    perror ("strndup");
+  return ret;
+}
+
+/* Parse pax records into the overrides for the next member. */
+static int
+parse_pax (struct tar_in *t, const char *p, size_t len)
+{
+  while (len > 0) {
+    const char *end, *key, *eq, *value;
+    size_t reclen = 0, i = 0, vlen;
+    char *s;
+
+    while (i < len && p[i] >= '0' && p[i] <= '9' && reclen <= len) {
+      reclen = reclen * 10 + (p[i] - '0');
+      i++;
+    }
+    if (i == 0 || i >= len || p[i] != ' ' || reclen > len || reclen <= i + 1) {
+      in_error (t, "corrupt pax extended header");
+      return -1;
+    }
+    end = p + reclen;
+    key = p + i + 1;
+    eq = memchr (key, '=', end - key);
+    if (eq == NULL || end[-1] != '\n') {
+      in_error (t, "corrupt pax extended header");
+      return -1;
+    }
+    value = eq + 1;
+    vlen = end - 1 - value;
+
+#define KEY_IS(str) \
+    ((size_t) (eq - key) == strlen (str) && memcmp (key, str, eq - key) == 0)
+
+    if (KEY_IS ("path") || KEY_IS ("linkpath")) {
+      s = strndup (value, vlen);
+      if (s == NULL) {
+        in_perror (t, "strndup");
+        return -1;
+      }
+      if (KEY_IS ("path")) {
+        free (t->next_path);
+        t->next_path = s;
+      } else {
+        free (t->next_linkpath);
+        t->next_linkpath = s;
+      }
+    }
+    else if (KEY_IS ("size") || KEY_IS ("uid") || KEY_IS ("gid") ||
+             KEY_IS ("mtime")) {
+      char buf[32];
+      uint64_t v;
+
+      /* mtime may have a fractional part, which we drop. */
+      if (vlen >= sizeof buf) vlen = sizeof buf - 1;
+      memcpy (buf, value, vlen);
+      buf[vlen] = '\0';
+      if (KEY_IS ("mtime")) {
+        t->next_mtime = strtoll (buf, NULL, 10);
+        t->next_have_mtime = 1;
+      } else {
+        if (sscanf (buf, "%" SCNu64, &v) != 1) {
+          in_error (t, "corrupt pax extended header");
+          return -1;
+        }
+        if (KEY_IS ("size")) {
+          t->next_size = v;
+          t->next_have_size = 1;
+        } else if (KEY_IS ("uid")) {
+          t->next_uid = v;
+          t->next_have_uid = 1;
+        } else {
+          t->next_gid = v;
+          t->next_have_gid = 1;
+        }
+      }
+    }
+    else if ((size_t) (eq - key) > 13 && memcmp (key, "SCHILY.xattr.", 13) == 0) {
+      struct xattr *x;
+
+      x = realloc (t->next_xattrs, (t->next_nr_xattrs + 1) * sizeof *x);
+      if (x == NULL) {
+        in_perror (t, "realloc");
+        return -1;
+      }
+      t->next_xattrs = x;
+      x = &x[t->next_nr_xattrs];
+      x->name = strndup (key + 13, eq - key - 13);
+      x->value = malloc (vlen ? vlen : 1);
+      if (x->name == NULL || x->value == NULL) {
+        free (x->name);
+        free (x->value);
+        in_perror (t, "malloc");
+        return -1;
+      }
+      memcpy (x->value, value, vlen);
+      x->len = vlen;
+      t->next_nr_xattrs++;
+    }
+    /* Other keywords are ignored. */
+
+#undef KEY_IS
+
+    len -= end - p;
+    p = end;
+  }
+
+  return 0;
+}
+
+/* Turn a member name into a path under the target directory.  Like
+ * tar we remove leading '/' and refuse names containing "..".
+ * Returns NULL and sets the error on failure.
+ */
+static char *
+member_path (struct tar_in *t, const char *name)
+{
+  const char *p, *q;
+  char *ret;
+
+  /* "/foo", "./foo" and "foo" are all the same. */
+  for (;;) {
+    while (*name == '/')
+      name++;
+    if (name[0] == '.' && (name[1] == '/' || name[1] == '\0'))
+      name++;
+    else
+      break;
+  }
+
+  for (p = name; *p; p = q) {
+    q = strchr (p, '/');
+    if (q == NULL)
+      q = p + strlen (p);
+    if (q - p == 2 && p[0] == '.' && p[1] == '.') {
+      in_error (t, "%s: member name contains '..'", name);
+      return NULL;
+    }
+    while (*q == '/')
+      q++;
+  }
+
+  if (asprintf (&ret, "%s%s%s", t->dir,
+                STREQ (t->dir, "/") || *name == '\0' ? "" : "/", name) == -1) {
+    in_perror (t, "asprintf");
+    return NULL;
+  }
+
+  /* Remove trailing slashes, but not a lone "/". */
+  for (q = ret + strlen (ret); q > ret + 1 && q[-1] == '/'; --q)
+    ret[q - ret - 1] = '\0';
+
+  return ret;
+}
+
+/* After 'err' from an attempt to create 'path', fix things up so that
+ * the attempt can be retried: create missing parent directories or
+ * remove an existing non-directory, as tar does.  Must be called
+ * inside the chroot.  Returns -1 if it cannot be fixed.
+ */
+static int
+prepare_path (const char *path, int err)
+{
+  struct stat statbuf;
+  char *parent, *p;
+  int r = -1;
+
+  if (err == EEXIST) {
+    if (lstat (path, &statbuf) == -1 || S_ISDIR (statbuf.st_mode))
+      return -1;
+    return unlink (path);
+  }
+
+  if (err != ENOENT)
+    return -1;
+
+  parent = strdup (path);
+  if (parent == NULL)
+    return -1;
+  for (p = parent + 1; *p; ++p) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir (parent, 0777) == -1 && errno != EEXIST)
+      goto out;
+    *p = '/';
+  }
+  r = 0;
+ out:
+  free (parent);
+  return r;
+}
+
+/* Retry 'expr' (which sets 'r') up to twice after prepare_path. */
+#define CREATE_PATH(r, path, expr)                                      \
+  do {                                                                  \
+    int __tries;                                                        \
+    for (__tries = 0; ; ++__tries) {                                    \
+      (r) = (expr);                                                     \
+      if ((r) != -1 || __tries == 2 || prepare_path ((path), errno) == -1) \
+        break;                                                          \
+    }                                                                   \
+  } while (0)
+
+/* Set ownership, mode, xattrs and times.  Must be called inside
+ * the chroot.
+ */
+static int
+set_attributes (struct tar_in *t, const char *path, char typeflag,
+                uid_t uid, gid_t gid, mode_t mode,
+                const struct timespec *mtime,
+                const struct xattr *xattrs, size_t nr_xattrs)
+{
+  struct timespec times[2];
+  size_t i;
+
+  if (lchown (path, uid, gid) == -1) {
+    in_perror (t, path);
+    return -1;
+  }
+
+#ifdef HAVE_LSETXATTR
+  for (i = 0; i < nr_xattrs; ++i) {
+    if (lsetxattr (path, xattrs[i].name, xattrs[i].value, xattrs[i].len,
+                   0) == -1) {
+      /* As with tar, xattrs are dropped if the filesystem (eg. vfat)
+       * or the namespace is not supported.
+       */
+      if (errno == ENOTSUP || errno == EOPNOTSUPP) {
+        if (verbose)
+          fprintf (stderr, "%s: xattr %s not supported, ignored\n",
+                   path, xattrs[i].name);
+        continue;
+      }
+      in_perror (t, path);
+      return -1;
+    }
+  }
+#else
+  (void) i;
+#endif
+
+  if (typeflag == '2')          /* Symlinks have no mode of their own. */
+    ;
+  else if (typeflag == '5') {   /* Directories are done at the end. */
+    struct deferred_dir *d;
+
+    d = realloc (t->dirs, (t->nr_dirs + 1) * sizeof *d);
+    if (d == NULL) {
+      in_perror (t, "realloc");
+      return -1;
+    }
+    t->dirs = d;
+    d = &d[t->nr_dirs];
+    d->path = strdup (path);
+    if (d->path == NULL) {
+      in_perror (t, "strdup");
+      return -1;
+    }
+    d->mode = mode;
+    d->mtime = *mtime;
+    t->nr_dirs++;
+    return 0;
+  }
+  else if (chmod (path, mode) == -1) {
+    in_perror (t, path);
+    return -1;
+  }
+
+  times[0] = *mtime;
+  times[1] = *mtime;
+  if (utimensat (AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+    in_perror (t, path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+finish_file (struct tar_in *t)
+{
+  int r;
+
+  if (close (t->fd) == -1) {
+    in_perror (t, t->path);
+    t->fd = -1;
+    return -1;
+  }
+  t->fd = -1;
+
+  CHROOT_IN;
+  r = set_attributes (t, t->path, '0', t->uid, t->gid, t->mode, &t->mtime,
+                      t->xattrs, t->nr_xattrs);
+  CHROOT_OUT;
+
+  free (t->path);
+  free_xattrs (t->xattrs, t->nr_xattrs);
+  t->path = NULL;
+  t->xattrs = NULL;
+  t->nr_xattrs = 0;
+  return r;
+}
+
+/* Remember a symbolic link, or a hard link to one, to be created by
+ * finish_links.  Takes ownership of 'path' and 'target' even on error.
+ */
+static int
+defer_link (struct tar_in *t, char typeflag, char *path, char *target,
+            uid_t uid, gid_t gid, const struct timespec *mtime)
+{
+  struct deferred_link *l;
+
+  l = realloc (t->links, (t->nr_links + 1) * sizeof *l);
+  if (l == NULL) {
+    in_perror (t, "realloc");
+    free (path);
+    free (target);
+    return -1;
+  }
+  t->links = l;
+  l = &l[t->nr_links++];
+  l->typeflag = typeflag;
+  l->path = path;
+  l->target = target;
+  l->uid = uid;
+  l->gid = gid;
+  l->mtime = *mtime;
+  l->xattrs = t->next_xattrs;
+  l->nr_xattrs = t->next_nr_xattrs;
+  t->next_xattrs = NULL;
+  t->next_nr_xattrs = 0;
+  return 0;
+}
+
+/* Is 'path' a symbolic link which has not been created yet? */
+static int
+is_deferred_symlink (struct tar_in *t, const char *path)
+{
+  size_t i;
+
+  for (i = 0; i < t->nr_links; ++i)
+    if (t->links[i].typeflag == '2' && STREQ (t->links[i].path, path))
+      return 1;
+  return 0;
+}
+
+/* Process a complete header block. */
+static int
+process_header (struct tar_in *t)
+{
+  const struct tar_header *h = (const struct tar_header *) t->block;
+  uint64_t chksum, mode, uid, gid, size, mtime, devmajor, devminor;
+  char *name = NULL, *linkname = NULL, *path = NULL, *target = NULL;
+  struct timespec ts;
+  char typeflag;
+  int r, ret = -1;
+
+  if (memcmp (t->block, zero_block, BLOCKSIZE) == 0) {
+    if (++t->zero_blocks == 2)
+      t->state = IN_END;
+    return 0;
+  }
+  t->zero_blocks = 0;
+
+  if (parse_number (h->chksum, sizeof h->chksum, &chksum) == -1 ||
+      chksum != header_checksum (h)) {
+    in_error (t, "this does not look like a tar archive");
+    return -1;
+  }
+
+  if (parse_number (h->mode, sizeof h->mode, &mode) == -1 ||
+      parse_number (h->uid, sizeof h->uid, &uid) == -1 ||
+      parse_number (h->gid, sizeof h->gid, &gid) == -1 ||
+      parse_number (h->size, sizeof h->size, &size) == -1 ||
+      parse_number (h->mtime, sizeof h->mtime, &mtime) == -1) {
+    in_error (t, "corrupt tar header");
+    return -1;
+  }
+  typeflag = h->typeflag;
+
+  /* pax and GNU long name headers apply to the next member. */
+  if (typeflag == 'x' || typeflag == 'g' || typeflag == 'L' ||
+      typeflag == 'K') {
+    if (size > MAX_META_SIZE) {
+      in_error (t, "tar extended header is too large");
+      return -1;
+    }
+    t->meta_type = typeflag;
+    free (t->meta);
+    t->meta = malloc (size + 1);
+    if (t->meta == NULL) {
+      in_perror (t, "malloc");
+      return -1;
+    }
+    t->meta_len = 0;
+    t->remaining = size;
+    t->pad = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+    t->state = size > 0 ? IN_META : t->pad > 0 ? IN_PAD : IN_HEADER;
+    return 0;
+  }
+
+  if (t->next_have_size) size = t->next_size;
+  if (t->next_have_uid) uid = t->next_uid;
+  if (t->next_have_gid) gid = t->next_gid;
+  ts.tv_sec = t->next_have_mtime ? t->next_mtime : (int64_t) mtime;
+  ts.tv_nsec = 0;
+
+  if (t->next_path) {
+    name = t->next_path;
+    t->next_path = NULL;
+  } else if (h->prefix[0] && memcmp (h->magic, "ustar", 5) == 0 &&
+             h->magic[5] == '\0') {
+    if (asprintf (&name, "%.*s/%.*s",
+                  (int) strnlen (h->prefix, sizeof h->prefix), h->prefix,
+                  (int) strnlen (h->name, sizeof h->name), h->name) == -1) {
+      in_perror (t, "asprintf");
+      name = NULL;
+      goto out;
+    }
+  } else
+    name = header_string (h->name, sizeof h->name);
+  if (t->next_linkpath) {
+    linkname = t->next_linkpath;
+    t->next_linkpath = NULL;
+  } else
+    linkname = header_string (h->linkname, sizeof h->linkname);
+  if (name == NULL || linkname == NULL) {
+    in_perror (t, "malloc");
+    goto out;
+  }
+
+  path = member_path (t, name);
+  if (path == NULL)
+    goto out;
+
+  t->remaining = size;
+  t->pad = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+
+  if (verbose)
+    fprintf (stderr, "guestfsd: tar: %c %s\n", typeflag ? typeflag : '0', path);
+
+  mode &= 07777;
+
+  switch (typeflag) {
+  case '0': case '\0': case '7':  /* Regular file. */
+    CHROOT_IN;
+    CREATE_PATH (r, path,
+                 open (path, O_WRONLY|O_CREAT|O_EXCL|O_NOCTTY|O_NOFOLLOW|O_CLOEXEC,
+                       0600));
+    CHROOT_OUT;
+    if (r == -1) {
+      in_perror (t, path);
+      goto out;
+    }
+    t->fd = r;
+    t->path = path;
+    path = NULL;
+    t->mode = mode;
+    t->uid = uid;
+    t->gid = gid;
+    t->mtime = ts;
+    t->xattrs = t->next_xattrs;
+    t->nr_xattrs = t->next_nr_xattrs;
+    t->next_xattrs = NULL;
+    t->next_nr_xattrs = 0;
+    if (size == 0) {
+      if (finish_file (t) == -1)
+        goto out;
+      t->state = IN_HEADER;
+    } else
+      t->state = IN_DATA;
+    ret = 0;
+    goto out;
+
+  case '5':                     /* Directory. */
+    CHROOT_IN;
+    CREATE_PATH (r, path, mkdir (path, 0700));
+    if (r == -1 && errno == EEXIST) {
+      struct stat statbuf;
+      if (stat (path, &statbuf) == 0 && S_ISDIR (statbuf.st_mode))
+        r = 0;
+      else
+        errno = EEXIST;
+    }
+    CHROOT_OUT;
+    break;
+
+  case '1':                     /* Hard link. */
+    target = member_path (t, linkname);
+    if (target == NULL)
+      goto out;
+    if (is_deferred_symlink (t, target)) {
+      ret = defer_link (t, typeflag, path, target, uid, gid, &ts);
+      path = target = NULL;
+      if (ret == -1)
+        goto out;
+      t->state = size > 0 ? IN_DATA : IN_HEADER;
+      goto out;
+    }
+    CHROOT_IN;
+    CREATE_PATH (r, path, link (target, path));
+    CHROOT_OUT;
+    break;
+
+  case '2':                     /* Symbolic link. */
+    ret = defer_link (t, typeflag, path, linkname, uid, gid, &ts);
+    path = linkname = NULL;
+    if (ret == -1)
+      goto out;
+    t->state = size > 0 ? IN_DATA : IN_HEADER;
+    goto out;
+
+  case '3': case '4': case '6': /* Devices and FIFOs. */
+    if (parse_number (h->devmajor, sizeof h->devmajor, &devmajor) == -1 ||
+        parse_number (h->devminor, sizeof h->devminor, &devminor) == -1) {
+      in_error (t, "corrupt tar header");
+      goto out;
+    }
+    CHROOT_IN;
+    CREATE_PATH (r, path,
+                 mknod (path,
+                        (typeflag == '3' ? S_IFCHR :
+                         typeflag == '4' ? S_IFBLK : S_IFIFO) | mode,
+                        makedev (devmajor, devminor)));
+    CHROOT_OUT;
+    break;
+
+  case 'V':                     /* Volume label, ignored. */
+    r = 0;
+    break;
+
+  default:
+    in_error (t, "%s: unsupported tar member type '%c'", name, typeflag);
+    goto out;
+  }
+
+  if (r == -1) {
+    in_perror (t, path);
+    goto out;
+  }
+
+  if (typeflag != '1' && typeflag != 'V') {
+    CHROOT_IN;
+    r = set_attributes (t, path, typeflag, uid, gid, mode, &ts,
+                        t->next_xattrs, t->next_nr_xattrs);
+    CHROOT_OUT;
+    if (r == -1)
+      goto out;
+  }
+
+  /* Skip any data (there shouldn't be any). */
+  t->state = size > 0 ? IN_DATA : IN_HEADER;
+  ret = 0;
+
+ out:
+  clear_overrides (t);
+  free (name);
+  free (linkname);
+  free (path);
+  free (target);
+  return ret;
+}
+
+/* Process uncompressed tar data. */
+static int
+tar_in_data (struct tar_in *t, const char *buf, size_t len)
+{
+  size_t n;
+
+  while (len > 0) {
+    switch (t->state) {
+    case IN_HEADER:
+      n = BLOCKSIZE - t->block_len;
+      if (n > len) n = len;
+      memcpy (t->block + t->block_len, buf, n);
+      t->block_len += n;
+      buf += n; len -= n;
+      if (t->block_len == BLOCKSIZE) {
+        t->block_len = 0;
+        if (process_header (t) == -1)
+          return -1;
+      }
+      break;
+
+    case IN_DATA:
+    case IN_META:
+      n = t->remaining < len ? t->remaining : len;
+      if (t->state == IN_META) {
+        memcpy (t->meta + t->meta_len, buf, n);
+        t->meta_len += n;
+      }
+      else if (t->fd >= 0 && xwrite (t->fd, buf, n) == -1) {
+        in_perror (t, t->path);
+        return -1;
+      }
+      buf += n; len -= n;
+      t->remaining -= n;
+      if (t->remaining == 0) {
+        if (t->state == IN_META) {
+          t->meta[t->meta_len] = '\0';
+          if (t->meta_type == 'x') {
+            if (parse_pax (t, t->meta, t->meta_len) == -1)
+              return -1;
+          } else if (t->meta_type == 'L') {
+            free (t->next_path);
+            t->next_path = strdup (t->meta);
+            if (t->next_path == NULL) {
+              in_perror (t, "strdup");
+              return -1;
+            }
+          } else if (t->meta_type == 'K') {
+            free (t->next_linkpath);
+            t->next_linkpath = strdup (t->meta);
+            if (t->next_linkpath == NULL) {
+              in_perror (t, "strdup");
+              return -1;
+            }
+          }
+          /* 'g' (pax global header) is ignored. */
+        }
+        else if (t->fd >= 0 && finish_file (t) == -1)
+          return -1;
+        t->state = t->pad > 0 ? IN_PAD : IN_HEADER;
+      }
+      break;
+
+    case IN_PAD:
+      n = t->pad < len ? t->pad : len;
+      buf += n; len -= n;
+      t->pad -= n;
+      if (t->pad == 0)
+        t->state = IN_HEADER;
+      break;
+
+    case IN_END:
+      return 0;                 /* Ignore anything after the end. */
+    }
+  }
+
+  return 0;
+}
+
+static int
+tar_in_cb (void *opaque, const void *buf, size_t len)
+{
+  struct tar_in *t = opaque;
+
+  if (t->error)
+    return -1;
+
+#ifdef HAVE_ZLIB
+  if (t->gzip) {
+    char out[65536];
+    int r;
+
+    t->zs.next_in = (Bytef *) buf;
+    t->zs.avail_in = len;
+    do {
+      t->zs.next_out = (Bytef *) out;
+      t->zs.avail_out = sizeof out;
+      r = inflate (&t->zs, Z_NO_FLUSH);
+      if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+        in_error (t, "gzip: %s", t->zs.msg ? t->zs.msg : "invalid data");
+        return -1;
+      }
+      if (tar_in_data (t, out, sizeof out - t->zs.avail_out) == -1)
+        return -1;
+      /* Concatenated gzip members are allowed. */
+      if (r == Z_STREAM_END)
+        inflateReset (&t->zs);
+    } while ((t->zs.avail_in > 0 || t->zs.avail_out == 0) &&
+             t->state != IN_END);
+    return 0;
+  }
+#endif
+
+  return tar_in_data (t, buf, len) == -1 ? -1 : 0;
+}
+
+/* Create the deferred symbolic links and hard links to them, in
+ * archive order.  This must be done before finish_dirs, since it
+ * changes the mtimes of the parent directories.
+ */
+static int
+finish_links (struct tar_in *t)
+{
+  size_t i;
+  int r = 0;
+
+  CHROOT_IN;
+  for (i = 0; i < t->nr_links; ++i) {
+    struct deferred_link *l = &t->links[i];
+
+    if (l->typeflag == '2')
+      CREATE_PATH (r, l->path, symlink (l->target, l->path));
+    else
+      CREATE_PATH (r, l->path, link (l->target, l->path));
+    if (r == -1) {
+      in_perror (t, l->path);
+      break;
+    }
+    if (l->typeflag == '2') {
+      r = set_attributes (t, l->path, '2', l->uid, l->gid, 0, &l->mtime,
+                          l->xattrs, l->nr_xattrs);
+      if (r == -1)
+        break;
+    }
+  }
+  CHROOT_OUT;
+
+  return r;
+}
+
+/* Set the final mode and mtime on extracted directories, innermost
+ * first.
+ */
+static int
+finish_dirs (struct tar_in *t)
+{
+  struct timespec times[2];
+  size_t i;
+  int r = 0;
+
+  CHROOT_IN;
+  for (i = t->nr_dirs; i > 0; --i) {
+    struct deferred_dir *d = &t->dirs[i-1];
+
+    times[0] = times[1] = d->mtime;
+    if (chmod (d->path, d->mode) == -1 ||
+        utimensat (AT_FDCWD, d->path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+      in_perror (t, d->path);
+      r = -1;
+      break;
+    }
+  }
+  CHROOT_OUT;
+
+  return r;
+}
+
+static void
+free_tar_in (struct tar_in *t)
+{
+  size_t i;
+
+  if (t->fd >= 0)
+    close (t->fd);
+  clear_overrides (t);
+  free (t->path);
+  free_xattrs (t->xattrs, t->nr_xattrs);
+  free (t->meta);
+  for (i = 0; i < t->nr_dirs; ++i)
+    free (t->dirs[i].path);
+  free (t->dirs);
+  for (i = 0; i < t->nr_links; ++i) {
+    free (t->links[i].path);
+    free (t->links[i].target);
+    free_xattrs (t->links[i].xattrs, t->links[i].nr_xattrs);
+  }
+  free (t->links);
+  free (t->error);
+#ifdef HAVE_ZLIB
+  if (t->gzip)
+    inflateEnd (&t->zs);
+#endif
+}
+
+/* Has one FileIn parameter. */
+int
+tar_in_native (const char *dir, int gzip)
+{
+  struct tar_in t;
+  struct stat statbuf;
+  int r;
+
+  memset (&t, 0, sizeof t);
+  t.dir = dir;
+  t.fd = -1;
+
+  CHROOT_IN;
+  r = stat (dir, &statbuf);
+  CHROOT_OUT;
+  if (r == -1 || !S_ISDIR (statbuf.st_mode)) {
+    int err = r == -1 ? errno : ENOTDIR;
+    cancel_receive ();
+    errno = err;
+    reply_with_perror ("%s", dir);
+    return -1;
+  }
+
+#ifdef HAVE_ZLIB
+  t.gzip = gzip;
+  if (gzip) {
+    /* windowBits + 32 detects gzip or zlib headers. */
+    if (inflateInit2 (&t.zs, 15 + 32) != Z_OK) {
+      cancel_receive ();
+      reply_with_error ("inflateInit2 failed");
+      return -1;
+    }
+  }
+#else
+  if (gzip)
+    abort ();
+#endif
+
+  r = receive_file (tar_in_cb, &t);
+  if (r == -1) {                /* write error */
+    cancel_receive ();
+    reply_with_error ("write error on directory: %s: %s", dir,
+                      t.error ? t.error : "(no error)");
+    free_tar_in (&t);
+    return -1;
+  }
+  if (r == -2) {                /* cancellation from library */
+    /* This error is ignored by the library since it initiated the
+     * cancel.  Nevertheless we must send an error reply here.
+     */
+    reply_with_error ("file upload cancelled");
+    free_tar_in (&t);
+    return -1;
+  }
+
+  if (t.state != IN_END && !(t.state == IN_HEADER && t.block_len == 0)) {
+    reply_with_error ("%s: unexpected end of tar file", dir);
+    free_tar_in (&t);
+    return -1;
+  }
+
+  if (finish_links (&t) == -1 || finish_dirs (&t) == -1) {
+    reply_with_error ("%s", t.error ? t.error : dir);
+    free_tar_in (&t);
+    return -1;
+  }
+
+  free_tar_in (&t);
+  return 0;
+}
@@ -22,15 +22,20 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include "guestfs_protocol.h"
 #include "daemon.h"
 #include "actions.h"
 
+#include "ignore-value.h"
+
 struct write_cb_data {
   int fd;                       /* file descriptor */
   uint64_t written;             /* bytes written so far */
@@ -280,3 +285,313 @@ do_download_offset (const char *filename, int64_t offset, int64_t size)
 
   return 0;
 }
+
+/* Optional data channels (see guestfs_set_data_channels in the
+ * library).  These are extra virtio-serial ports which carry the raw
+ * file data of one range of a parallel upload or download, while the
+ * main channel carries only the (small) RPC messages which start and
+ * finish each range.
+ *
+ * Each range is transferred by a child process, so that several
+ * ranges can be in flight at once while the main loop continues to
+ * answer requests.  Channels are numbered from 1.
+ */
+#define DATA_CHANNEL_PREFIX "/dev/virtio-ports/org.libguestfs.data."
+#define MAX_DATA_CHANNELS 16
+#define DATA_CHANNEL_BUFSIZ (128 * 1024)
+
+/* Frame headers sent on a data channel by a download child.  Data is
+ * sent as [length][data], with a zero length marking the end of the
+ * range.  On error the child sends DATA_CHANNEL_ERROR followed by the
+ * errno.  All integers are 32 bit big endian.
+ */
+#define DATA_CHANNEL_ERROR 0xffffffff
+
+static int data_channel_fd[MAX_DATA_CHANNELS+1];
+static pid_t data_channel_pid[MAX_DATA_CHANNELS+1];
+
+void
+open_data_channels (void)
+{
+  size_t i;
+  char path[sizeof DATA_CHANNEL_PREFIX + 16];
+
+  for (i = 1; i <= MAX_DATA_CHANNELS; ++i) {
+    snprintf (path, sizeof path, DATA_CHANNEL_PREFIX "%zu", i);
+    data_channel_fd[i] = open (path, O_RDWR | O_CLOEXEC);
+    if (data_channel_fd[i] == -1) {
+      if (errno != ENOENT)
+        perror (path);
+      break;
+    }
+  }
+
+  if (verbose && i > 1)
+    fprintf (stderr, "opened %zu data channel(s)\n", i-1);
+
+  for (; i <= MAX_DATA_CHANNELS; ++i)
+    data_channel_fd[i] = -1;
+}
+
+static int
+check_data_channel (int channel)
+{
+  if (channel < 1 || channel > MAX_DATA_CHANNELS ||
+      data_channel_fd[channel] == -1) {
+    reply_with_error ("data channel %d is not available", channel);
+    return -1;
+  }
+  if (data_channel_pid[channel] > 0) {
+    reply_with_error ("data channel %d is busy", channel);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+open_range (const char *filename, int flags, int64_t offset, int64_t size)
+{
+  int fd, is_dev;
+
+  if (offset < 0) {
+    reply_with_error ("%s: offset in file is negative", filename);
+    return -1;
+  }
+  if (size < 0) {
+    reply_with_error ("%s: size is negative", filename);
+    return -1;
+  }
+
+  is_dev = STRPREFIX (filename, "/dev/");
+
+  if (!is_dev) CHROOT_IN;
+  fd = open (filename, flags, 0666);
+  if (!is_dev) CHROOT_OUT;
+  if (fd == -1) {
+    reply_with_perror ("%s", filename);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+put_u32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void __attribute__((noreturn))
+download_range (int fd, int chan, int64_t offset, int64_t size)
+{
+  unsigned char *buf;
+  unsigned char err[8];
+  ssize_t r;
+  size_t n;
+
+  buf = malloc (4 + DATA_CHANNEL_BUFSIZ);
+  if (buf == NULL)
+    goto error;
+
+  while (size > 0) {
+    n = size > DATA_CHANNEL_BUFSIZ ? DATA_CHANNEL_BUFSIZ : size;
+    r = pread (fd, buf + 4, n, offset);
+    if (r == -1)
+      goto error;
+    if (r == 0)
+      /* As with download_offset, reading past the end of the file
+       * just returns fewer bytes than requested.
+       */
+      break;
+
+    put_u32 (buf, r);
+    if (xwrite (chan, buf, 4 + r) == -1)
+      _exit (EXIT_FAILURE);
+
+    offset += r;
+    size -= r;
+  }
+
+  put_u32 (buf, 0);
+  if (xwrite (chan, buf, 4) == -1)
+    _exit (EXIT_FAILURE);
+  _exit (EXIT_SUCCESS);
+
+ error:
+  put_u32 (err, DATA_CHANNEL_ERROR);
+  put_u32 (err + 4, errno);
+  perror ("download_range");
+  ignore_value (xwrite (chan, err, sizeof err));
+  _exit (EXIT_FAILURE);
+}
+
+static void __attribute__((noreturn))
+upload_range (int fd, int chan, int64_t offset, int64_t size)
+{
+  unsigned char *buf;
+  unsigned char status[4];
+  ssize_t r;
+  size_t n;
+  int err = 0;
+
+  buf = malloc (DATA_CHANNEL_BUFSIZ);
+  if (buf == NULL)
+    err = errno;
+
+  /* Always read the whole range from the channel, even after an
+   * error, so that the library is not left blocked in write.
+   */
+  while (size > 0) {
+    n = size > DATA_CHANNEL_BUFSIZ ? DATA_CHANNEL_BUFSIZ : size;
+    if (buf == NULL) {
+      char discard[BUFSIZ];
+      n = n > sizeof discard ? sizeof discard : n;
+      r = read (chan, discard, n);
+    }
+    else
+      r = read (chan, buf, n);
+    if (r == -1) {
+      perror ("upload_range: read");
+      _exit (EXIT_FAILURE);
+    }
+    if (r == 0) {
+      fprintf (stderr, "upload_range: unexpected end of file\n");
+      _exit (EXIT_FAILURE);
+    }
+
+    if (!err && pwrite (fd, buf, r, offset) != r) {
+      err = errno ? errno : EIO;
+      perror ("upload_range: pwrite");
+    }
+
+    offset += r;
+    size -= r;
+  }
+
+  if (!err && close (fd) == -1) {
+    err = errno;
+    perror ("upload_range: close");
+  }
+
+  put_u32 (status, err);
+  if (xwrite (chan, status, sizeof status) == -1)
+    _exit (EXIT_FAILURE);
+  _exit (err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int
+start_range (int fd, int channel, int64_t offset, int64_t size,
+             void (*fn) (int, int, int64_t, int64_t))
+{
+  pid_t pid;
+
+  pid = fork ();
+  if (pid == -1) {
+    reply_with_perror ("fork");
+    close (fd);
+    return -1;
+  }
+  if (pid == 0)
+    fn (fd, data_channel_fd[channel], offset, size);
+
+  close (fd);
+  data_channel_pid[channel] = pid;
+  return 0;
+}
+
+int
+do_internal_data_channel_download (const char *filename,
+                                   int64_t offset, int64_t size, int channel)
+{
+  int fd;
+
+  if (check_data_channel (channel) == -1)
+    return -1;
+
+  fd = open_range (filename, O_RDONLY, offset, size);
+  if (fd == -1)
+    return -1;
+
+  return start_range (fd, channel, offset, size, download_range);
+}
+
+int
+do_internal_data_channel_upload (const char *filename,
+                                 int64_t offset, int64_t size, int channel)
+{
+  int fd;
+
+  if (check_data_channel (channel) == -1)
+    return -1;
+
+  fd = open_range (filename, O_WRONLY|O_CREAT|O_NOCTTY, offset, size);
+  if (fd == -1)
+    return -1;
+
+  return start_range (fd, channel, offset, size, upload_range);
+}
+
+int
+do_internal_data_channel_wait (int channel)
+{
+  int status;
+
+  if (channel < 1 || channel > MAX_DATA_CHANNELS ||
+      data_channel_pid[channel] == 0) {
+    reply_with_error ("no transfer is running on data channel %d", channel);
+    return -1;
+  }
+
+  if (waitpid (data_channel_pid[channel], &status, 0) == -1) {
+    reply_with_perror ("waitpid");
+    return -1;
+  }
+  data_channel_pid[channel] = 0;
+
+  /* An upload may have overwritten LVM metadata.  The stub flushed
+   * the cache when the transfer started, but the writes happen in the
+   * child, so a listing made since then may be stale.
+   */
+  flush_lvm_cache ();
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    reply_with_error ("transfer on data channel %d failed", channel);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Called by the library when it could not complete a range, for
+ * example because reading or writing its end of the channel failed.
+ * The child may be blocked on the channel, so kill it rather than
+ * waiting.  Part of the range may still be buffered in the channel,
+ * so it cannot be used again.
+ */
+int
+do_internal_data_channel_cancel (int channel)
+{
+  if (channel < 1 || channel > MAX_DATA_CHANNELS ||
+      data_channel_pid[channel] == 0) {
+    reply_with_error ("no transfer is running on data channel %d", channel);
+    return -1;
+  }
+
+  ignore_value (kill (data_channel_pid[channel], SIGKILL));
+  if (waitpid (data_channel_pid[channel], NULL, 0) == -1) {
+    reply_with_perror ("waitpid");
+    return -1;
+  }
+  data_channel_pid[channel] = 0;
+
+  /* See do_internal_data_channel_wait. */
+  flush_lvm_cache ();
+
+  close (data_channel_fd[channel]);
+  data_channel_fd[channel] = -1;
+
+  return 0;
+}
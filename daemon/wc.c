@@ -20,14 +20,68 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "guestfs_protocol.h"
 #include "daemon.h"
+#include "c-ctype.h"
 #include "actions.h"
 
+/* Count lines, words or bytes (depending on flag) in the file
+ * without running wc.  Always closes fd.
+ */
+static int
+wc_inprocess (const char *flag, const char *path, int fd)
+{
+  char buf[BUFSIZ];
+  ssize_t n, i;
+  int64_t count = 0;
+  int in_word = 0;
+
+  while ((n = read (fd, buf, sizeof buf)) > 0) {
+    switch (flag[1]) {
+    case 'l':
+      for (i = 0; i < n; ++i)
+        if (buf[i] == '\n')
+          count++;
+      break;
+    case 'w':
+      for (i = 0; i < n; ++i) {
+        if (c_isspace (buf[i]))
+          in_word = 0;
+        else if (!in_word) {
+          in_word = 1;
+          count++;
+        }
+      }
+      break;
+    default:
+      count += n;
+    }
+  }
+  if (n == -1) {
+    reply_with_perror ("wc %s: %s", flag, path);
+    close (fd);
+    return -1;
+  }
+
+  if (close (fd) == -1) {
+    reply_with_perror ("wc %s: %s", flag, path);
+    return -1;
+  }
+
+  if (count > INT_MAX) {
+    reply_with_error ("wc %s: %s: count is too large", flag, path);
+    return -1;
+  }
+
+  return count;
+}
+
 static int
 wc (const char *flag, const char *path)
 {
@@ -43,6 +97,9 @@ wc (const char *flag, const char *path)
     return -1;
   }
 
+  if (inprocess)
+    return wc_inprocess (flag, path, fd);
+
   flags = COMMAND_FLAG_CHROOT_COPY_FILE_TO_STDIN | fd;
   r = commandf (&out, &err, flags, "wc", flag, NULL);
   if (r == -1) {
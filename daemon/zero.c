@@ -43,6 +43,15 @@ do_zero (const char *device)
     return -1;
   }
 
+  switch (zero_range (fd, device, 0, 32 * sizeof zero_buf)) {
+  case -1:
+    close (fd);
+    return -1;
+  case 1:
+    notify_progress (32, 32);
+    goto done;
+  }
+
   for (i = 0; i < 32; ++i) {
     offset = i * sizeof zero_buf;
 
@@ -64,6 +73,7 @@ do_zero (const char *device)
     notify_progress ((uint64_t) i, 32);
   }
 
+ done:
   if (close (fd) == -1) {
     reply_with_perror ("close: %s", device);
     return -1;
@@ -90,6 +100,15 @@ do_zero_device (const char *device)
 
   uint64_t pos = 0;
 
+  switch (zero_range (fd, device, 0, size)) {
+  case -1:
+    close (fd);
+    return -1;
+  case 1:
+    pos = size;
+    notify_progress (pos, size);
+  }
+
   while (pos < size) {
     uint64_t n64 = size - pos;
     size_t n;
@@ -34,6 +34,7 @@ struct fd_pid {
   pid_t pid;
 };
 
+static int copy_in_file (const char *local, const char *remote);
 static struct fd_pid make_tar_from_local (const char *local);
 static struct fd_pid make_tar_output (const char *local, const char *basename);
 static int split_path (char *buf, size_t buf_size, const char *path, const char **dirname, const char **basename);
@@ -69,9 +70,22 @@ run_copy_in (const char *cmd, size_t argc, char *argv[])
     return -1;
   }
 
-  /* Upload each local one at a time using tar-in. */
+  /* Upload each local one at a time using tar-in, or if there are
+   * data channels, regular files using upload-parallel.
+   */
   int i;
+  int data_channels = guestfs_get_data_channels (g);
   for (i = 0; i < nr_locals; ++i) {
+    if (data_channels > 0) {
+      int r = copy_in_file (argv[i], remote);
+      if (r == -1) {
+        free (remote);
+        return -1;
+      }
+      if (r == 1)
+        continue;
+    }
+
     struct fd_pid fdpid = make_tar_from_local (argv[i]);
     if (fdpid.fd == -1) {
       free (remote);
@@ -110,6 +124,35 @@ run_copy_in (const char *cmd, size_t argc, char *argv[])
   return 0;
 }
 
+/* Copy a single regular file using guestfs_upload_parallel.  Returns
+ * 0 if local is not a regular file (the caller should use tar-in
+ * instead), 1 if it was copied, or -1 on error.
+ */
+static int
+copy_in_file (const char *local, const char *remote)
+{
+  struct stat statbuf;
+
+  if (stat (local, &statbuf) == -1 || !S_ISREG (statbuf.st_mode))
+    return 0;
+
+  char buf[PATH_MAX];
+  const char *basename;
+  if (split_path (buf, sizeof buf, local, NULL, &basename) == -1)
+    return -1;
+
+  char filename[PATH_MAX];
+  snprintf (filename, sizeof filename, "%s%s%s",
+            remote, STREQ (remote, "/") ? "" : "/", basename);
+
+  if (guestfs_upload_parallel (g, local, filename) == -1)
+    return -1;
+  if (guestfs_chmod (g, statbuf.st_mode & 07777, filename) == -1)
+    return -1;
+
+  return 1;
+}
+
 static void tar_create (const char *dir, const char *path) __attribute__((noreturn));
 
 /* This creates a subprocess which feeds a tar file back to the
@@ -249,7 +292,7 @@ run_copy_out (const char *cmd, size_t argc, char *argv[])
 
       char filename[PATH_MAX];
       snprintf (filename, sizeof filename, "%s/%s", local, basename);
-      if (guestfs_download (g, remote, filename) == -1) {
+      if (guestfs_download_parallel (g, remote, filename) == -1) {
         free (remote);
         return -1;
       }
@@ -0,0 +1,58 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test the add-drive-opts cachemode, aio, iothread and queues options.
+
+set -e
+
+rm -f test1.img test2.img test3.img test.out
+
+truncate -s 1M test1.img test2.img test3.img
+
+../fish/guestfish >test.out <<EOF
+  add test1.img format:raw iface:virtio cachemode:unsafe aio:threads
+  add test2.img format:raw iface:virtio iothread:true queues:0
+  add test3.img format:raw iface:ide readonly:true cachemode:writeback
+  debug-drives
+EOF
+grep -sq "test1.img.*cache=unsafe,aio=threads,format=raw,if=none,id=hd0" test.out
+grep -sq "test2.img.*format=raw,if=none,id=hd1" test.out
+grep -sq "test3.img.*snapshot=on,cache=writeback,format=raw,if=ide" test.out
+
+# Without iothread or queues, virtio drives use if=virtio.
+../fish/guestfish >test.out <<EOF
+  add test1.img format:raw iface:virtio cachemode:unsafe
+  debug-drives
+EOF
+grep -sq "test1.img.*cache=unsafe,format=raw,if=virtio" test.out
+
+# Invalid combinations are rejected.
+! ../fish/guestfish <<EOF
+  add test2.img cachemode:bogus
+EOF
+! ../fish/guestfish <<EOF
+  add test1.img cachemode:unsafe aio:native
+EOF
+! ../fish/guestfish <<EOF
+  add test1.img iface:ide iothread:true
+EOF
+! ../fish/guestfish <<EOF
+  add test1.img iface:virtio queues:-1
+EOF
+
+rm -f test1.img test2.img test3.img test.out
@@ -0,0 +1,63 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test upload-parallel and download-parallel over data channels,
+# including a transfer where some of the ranges fail.
+
+set -e
+
+rm -f test1.img test.data test.out
+
+truncate -s 100M test1.img
+
+# Parallel transfers are only used for files of at least 16 MB.
+dd if=/dev/urandom of=test.data bs=1M count=24 2>/dev/null
+
+output=$(
+../fish/guestfish -a test1.img <<EOF
+data-channels 4
+run
+part-init /dev/sda mbr
+part-add /dev/sda p 64 20479
+part-add /dev/sda p 20480 -64
+mkfs ext2 /dev/sda1
+mkfs ext2 /dev/sda2
+mount /dev/sda2 /
+mkdir /small
+mount /dev/sda1 /small
+# /small is too small for the file, so the later ranges fail.
+-upload-parallel test.data /small/data
+echo failed
+# The channels must still be usable after the failure.
+upload-parallel test.data /data
+download-parallel /data test.out
+filesize /data
+EOF
+)
+
+if [ "$output" != \
+"failed
+25165824" ]; then
+    echo "$0: error: unexpected output from guestfish"
+    echo "$output"
+    exit 1
+fi
+
+cmp test.data test.out
+
+rm -f test1.img test.data test.out
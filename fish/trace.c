@@ -0,0 +1,173 @@
+/* guestfish - the filesystem interactive shell
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+
+#include "fish.h"
+
+/* Decode the files written by guestfs_dump_trace_buffer.  The format
+ * is described in src/trace.c.  This deliberately doesn't use the
+ * handle: the file contains its own table of function names.
+ */
+
+#define TRACE_MAGIC 0x47465452  /* "GFTR" */
+#define TRACE_VERSION 1
+
+static int decode_file (const char *filename);
+
+int
+run_trace_decode (const char *cmd, size_t argc, char *argv[])
+{
+  size_t i;
+
+  if (argc < 1) {
+    fprintf (stderr, _("use '%s filename' to decode a binary trace dump\n"),
+             cmd);
+    return -1;
+  }
+
+  for (i = 0; i < argc; ++i) {
+    if (argc > 1)
+      printf ("%s%s:\n", i > 0 ? "\n" : "", argv[i]);
+    if (decode_file (argv[i]) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+static void
+print_record (char **names, uint32_t nr_names,
+              int64_t timestamp_us, uint32_t duration_us,
+              uint32_t function, uint32_t failed,
+              int32_t proc_nr, int32_t serial,
+              uint64_t arg_bytes, int64_t result)
+{
+  time_t t = timestamp_us / 1000000;
+  struct tm tm;
+  char tbuf[32];
+
+  if (localtime_r (&t, &tm) == NULL ||
+      strftime (tbuf, sizeof tbuf, "%Y-%m-%d %H:%M:%S", &tm) == 0)
+    snprintf (tbuf, sizeof tbuf, "%" PRIi64, (int64_t) t);
+
+  printf ("%s.%06d %10.6f %-24s ",
+          tbuf, (int) (timestamp_us % 1000000), duration_us / 1e6,
+          function < nr_names ? names[function] : "?");
+  if (proc_nr >= 0)
+    printf ("%4" PRIi32 " %8" PRIi32, proc_nr, serial);
+  else
+    printf ("%4s %8s", "-", "-");
+  printf (" %10" PRIu64 " ", arg_bytes);
+  if (failed)
+    printf ("ERROR\n");
+  else
+    printf ("%" PRIi64 "\n", result);
+}
+
+static int
+decode_file (const char *filename)
+{
+  FILE *fp;
+  XDR xdr;
+  uint32_t magic, version, nr_names = 0, nr_records, i;
+  uint64_t total;
+  char **names = NULL;
+  int r = -1;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    perror (filename);
+    return -1;
+  }
+
+  xdrstdio_create (&xdr, fp, XDR_DECODE);
+
+  if (!xdr_uint32_t (&xdr, &magic) || magic != TRACE_MAGIC ||
+      !xdr_uint32_t (&xdr, &version)) {
+    fprintf (stderr, _("%s: not a libguestfs trace dump\n"), filename);
+    goto out;
+  }
+  if (version != TRACE_VERSION) {
+    fprintf (stderr, _("%s: unsupported trace dump version %" PRIu32 "\n"),
+             filename, version);
+    goto out;
+  }
+
+  if (!xdr_uint32_t (&xdr, &nr_names))
+    goto truncated;
+  names = calloc (nr_names, sizeof (char *));
+  if (names == NULL) {
+    perror ("calloc");
+    goto out;
+  }
+  for (i = 0; i < nr_names; ++i)
+    if (!xdr_string (&xdr, &names[i], ~0))
+      goto truncated;
+
+  if (!xdr_uint64_t (&xdr, &total) || !xdr_uint32_t (&xdr, &nr_records))
+    goto truncated;
+
+  printf (_("%" PRIu32 " of %" PRIu64 " calls recorded\n"), nr_records, total);
+
+  for (i = 0; i < nr_records; ++i) {
+    int64_t timestamp_us, result;
+    uint32_t duration_us, function, failed;
+    int32_t proc_nr, serial;
+    uint64_t arg_bytes;
+
+    if (!xdr_int64_t (&xdr, &timestamp_us) ||
+        !xdr_uint32_t (&xdr, &duration_us) ||
+        !xdr_uint32_t (&xdr, &function) ||
+        !xdr_uint32_t (&xdr, &failed) ||
+        !xdr_int32_t (&xdr, &proc_nr) ||
+        !xdr_int32_t (&xdr, &serial) ||
+        !xdr_uint64_t (&xdr, &arg_bytes) ||
+        !xdr_int64_t (&xdr, &result))
+      goto truncated;
+
+    print_record (names, nr_names, timestamp_us, duration_us, function,
+                  failed, proc_nr, serial, arg_bytes, result);
+  }
+
+  r = 0;
+  goto out;
+
+ truncated:
+  fprintf (stderr, _("%s: trace dump is truncated or corrupt\n"), filename);
+ out:
+  if (names) {
+    for (i = 0; i < nr_names; ++i)
+      free (names[i]);
+    free (names);
+  }
+  xdr_destroy (&xdr);
+  fclose (fp);
+  return r;
+}
@@ -493,6 +493,74 @@ C<guestfs_set_event_callback>).");
    "\
 Return the command trace flag.");
 
+  ("set_trace_buffer", (RErr, [Int "entries"], []), -1, [FishAlias "trace-buffer"],
+   [InitNone, Always, TestOutputInt (
+      [["set_trace_buffer"; "100"];
+       ["get_trace_buffer"]], 100)],
+   "enable or disable the binary trace buffer",
+   "\
+This enables a ring buffer which records the last C<entries>
+calls made on the handle.  Each entry is a small fixed-size
+record of the start time, duration, function, daemon procedure
+number and serial, the total size of the arguments and the
+result (or error) of the call.
+
+Unlike C<guestfs_set_trace> the arguments and return values
+are not formatted, and recording a call does not allocate
+memory, so the buffer is cheap enough to leave enabled in
+production.  Use C<guestfs_dump_trace_buffer> or
+C<guestfs_set_trace_dump_file> to save the buffer to a file,
+and the guestfish C<trace-decode> command to read it.
+
+Setting C<entries> to C<0> (the default) disables the buffer.
+Changing the size discards any entries already recorded.
+
+You can also change this by setting the environment variable
+C<LIBGUESTFS_TRACE_BUFFER> before the handle is created.");
+
+  ("get_trace_buffer", (RInt "entries", [], []), -1, [],
+   [],
+   "get the size of the binary trace buffer",
+   "\
+Return the number of entries in the binary trace buffer,
+or C<0> if it is disabled.  See C<guestfs_set_trace_buffer>.");
+
+  ("dump_trace_buffer", (RErr, [String "filename"], []), -1, [],
+   [],
+   "write the binary trace buffer to a file",
+   "\
+Write the entries in the binary trace buffer to the local
+file C<filename>, oldest first.  The buffer is not cleared.
+
+The file can be decoded with the guestfish C<trace-decode>
+command.  It contains the names of the functions, so it can
+be decoded by a different version of libguestfs.
+
+This fails if the buffer is not enabled
+(see C<guestfs_set_trace_buffer>).");
+
+  ("set_trace_dump_file", (RErr, [OptString "filename"], []), -1, [FishAlias "trace-dump-file"],
+   [],
+   "dump the binary trace buffer when a call fails",
+   "\
+If C<filename> is set and the binary trace buffer is
+enabled (see C<guestfs_set_trace_buffer>), then the buffer
+is written to C<filename> every time a call fails, so that
+the file always shows the calls leading up to the most
+recent error.  Errors writing the file are ignored.
+
+Pass C<NULL> to disable this.
+
+You can also change this by setting the environment variable
+C<LIBGUESTFS_TRACE_DUMP> before the handle is created.");
+
+  ("get_trace_dump_file", (RConstOptString "filename", [], []), -1, [],
+   [],
+   "get the binary trace dump file",
+   "\
+Return the file set by C<guestfs_set_trace_dump_file>,
+or C<NULL> if none is set.");
+
   ("set_direct", (RErr, [Bool "direct"], []), -1, [FishAlias "direct"],
    [InitNone, Always, TestOutputFalse (
       [["set_direct"; "false"];
@@ -518,6 +586,33 @@ The default is disabled.");
    "\
 Return the direct appliance mode flag.");
 
+  ("set_thread_safe", (RErr, [Bool "threadsafe"], []), -1, [FishAlias "thread-safe"],
+   [InitNone, Always, TestOutputTrue (
+      [["set_thread_safe"; "true"];
+       ["get_thread_safe"]])],
+   "allow the handle to be shared between threads",
+   "\
+If this flag is set to true, then the handle may be used by
+several threads at the same time.  Each call waits until any
+call running in another thread has finished, so the threads
+share one appliance.  Calls are still executed one at a time
+by the appliance.
+
+In this mode L</guestfs_last_error> and L</guestfs_last_errno>
+return the last error seen by the calling thread.
+
+The flag must be set before the handle is shared, and
+L</guestfs_close> must not be called while another thread is
+using the handle.  The default is false.
+
+See also L<guestfs(3)/MULTIPLE HANDLES AND MULTIPLE THREADS>.");
+
+  ("get_thread_safe", (RBool "threadsafe", [], []), -1, [],
+   [],
+   "get the thread-safe flag",
+   "\
+Return the thread-safe flag.  See L</guestfs_set_thread_safe>.");
+
   ("set_recovery_proc", (RErr, [Bool "recoveryproc"], []), -1, [FishAlias "recovery-proc"],
    [InitNone, Always, TestOutputTrue (
       [["set_recovery_proc"; "true"];
@@ -1011,7 +1106,7 @@ be mountable but require special options.  Filesystems may
 not all belong to a single logical operating system
 (use C<guestfs_inspect_os> to look for OSes).");
 
-  ("add_drive_opts", (RErr, [String "filename"], [OBool "readonly"; OString "format"; OString "iface"; OString "name"]), -1, [FishAlias "add"],
+  ("add_drive_opts", (RErr, [String "filename"], [OBool "readonly"; OString "format"; OString "iface"; OString "name"; OString "discard"; OString "cachemode"; OString "aio"; OBool "iothread"; OInt "queues"]), -1, [FishAlias "add"],
    [],
    "add an image to examine or modify",
    "\
@@ -1059,7 +1154,79 @@ deprecated C<guestfs_add_drive_with_if> call (q.v.)
 The name the drive had in the original guest, e.g. /dev/sdb. This is used as a
 hint to the guest inspection process if it is available.
 
-=back");
+=item C<discard>
+
+Whether discard (trim) requests from the appliance are passed through
+to the disk image, so that C<guestfs_fstrim> can make the image
+sparse.  The possible values are:
+
+=over 4
+
+=item C<disable>
+
+Discard requests are ignored.  This is the default.
+
+=item C<enable>
+
+Discard requests are passed through.  C<guestfs_launch> fails if
+qemu does not support this.
+
+=item C<besteffort>
+
+Discard requests are passed through if qemu supports it, and
+otherwise ignored.
+
+=back
+
+Even when discard is enabled, the disk image only becomes sparse if
+the image format supports it (eg. raw files on a host filesystem
+that can punch holes, or qcow2) and the drive interface supports it.
+The default C<virtio> interface does not support discard in current
+versions of qemu, so use C<iface> C<ide> with this option.
+
+=item C<cachemode>
+
+The qemu host cache mode for the drive.  The possible values are
+C<writeback>, C<writethrough>, C<none>, C<directsync> and C<unsafe>
+(see the C<cache> option in L<qemu(1)>).
+
+If this is not given, writable drives use C<none> (the host page
+cache is bypassed, and writes are safe if the host crashes) when the
+file can be opened with C<O_DIRECT>, and otherwise the qemu default.
+
+C<unsafe> ignores flush requests from the appliance.  It is much
+faster for writing, but the disk image may be corrupt if the host
+crashes before the handle is closed, so it should only be used for
+scratch images which can be recreated.  C<none> and C<directsync>
+fail if the file cannot be opened with C<O_DIRECT> (eg. on tmpfs).
+
+=item C<aio>
+
+The qemu asynchronous I/O backend: C<threads> or C<native> (Linux
+AIO).  C<native> usually has higher throughput for large sequential
+copies, but requires C<cachemode> C<none> or C<directsync> (or a
+writable drive using the default cache mode on a filesystem that
+supports C<O_DIRECT>).
+
+=item C<iothread>
+
+If true, I/O for this drive is handled by a dedicated qemu iothread
+instead of the main qemu thread.  This helps when several drives are
+busy at the same time.  This requires C<iface> C<virtio> and a
+version of qemu with iothread support.
+
+=item C<queues>
+
+The number of virtio-blk request queues for this drive.  Use C<0>
+to get one queue per appliance vCPU (see C<guestfs_set_smp>).  By
+default the drive has a single queue.  This requires C<iface>
+C<virtio> and a version of qemu with virtio-blk multiqueue support.
+
+=back
+
+C<cachemode>, C<aio>, C<iothread> and C<queues> only change how qemu
+performs I/O on the host, and not the contents of the disk.  Use
+them to trade crash safety for throughput.");
 
   ("inspect_get_windows_systemroot", (RString "systemroot", [Device "root"], []), -1, [],
    [],
@@ -1597,10 +1764,10 @@ required size.
 
 =item *
 
-Extracting icons from Windows guests requires the external
-C<wrestool> program from the C<icoutils> package, and
-several programs (C<bmptopnm>, C<pnmtopng>, C<pamcut>)
-from the C<netpbm> package.  These must be installed separately.
+The icon is cached with the other inspection data, so calling
+this again for the same root and optional arguments returns the
+same icon without reading the guest, until C<guestfs_inspect_os>
+is called again.
 
 =item *
 
@@ -1644,6 +1811,226 @@ This function must be called before C<guestfs_launch>.");
    "\
 This returns the number of virtual CPUs assigned to the appliance.");
 
+  ("inspect_get_applications_token", (RString "token", [Device "root"], []), -1, [],
+   [],
+   "get a token describing the state of the application inventory",
+   "\
+Return an opaque token which describes the current state of the
+package database(s) that C<guestfs_inspect_list_applications>
+reads for this root.
+
+The token is computed from the file metadata of the package
+databases (the RPM C<Packages> and C<Name> databases, the dpkg
+C<status> file or the Windows C<HKLM\\SOFTWARE> hive).  If any of
+the underlying databases changes, the token changes.
+
+The handle remembers the list of applications matching each token
+it returns, so the token can later be passed to
+C<guestfs_inspect_list_application_changes> on the same handle.  If
+that list has not been read yet (by this call or by
+C<guestfs_inspect_list_applications>), this call reads it.
+Otherwise no package database is downloaded or parsed.  The lists
+are forgotten when C<guestfs_inspect_os> is called again or the
+handle is closed.
+
+Tokens should be compared only for equality.  Their format is not
+defined and may change between versions of libguestfs.
+
+If the guest uses a package format for which applications cannot
+be listed, this returns an empty string C<\"\">.
+
+As with C<guestfs_inspect_list_applications>, the guest's disks
+must be mounted before calling this.");
+
+  ("inspect_list_application_changes", (RStructList ("changes", "application_change"), [Device "root"; String "token"], []), -1, [],
+   [],
+   "get changes to the applications installed since a previous token",
+   "\
+Return the list of applications which have been added, removed
+or changed since the application inventory described by C<token>
+(a string previously returned by
+C<guestfs_inspect_get_applications_token>).
+
+If the package databases are unchanged since C<token> was
+obtained, this returns an empty list immediately, without
+downloading or parsing any package database.
+
+Otherwise the current list of applications is compared to the
+list which this handle read when it returned C<token>.  If C<token>
+is an empty string, every application is returned as C<added>.
+
+Tokens can only be used with the handle that returned them, and
+only until C<guestfs_inspect_os> is called again.  Any other token
+which does not match the current state of the package databases
+is rejected with an error.
+
+Each element of the returned list has the following fields:
+
+=over 4
+
+=item C<change_type>
+
+One of C<added>, C<removed> or C<changed>.
+
+=item C<change_name>
+
+The name of the application (see C<app_name> in
+C<guestfs_inspect_list_applications>).
+
+=item C<change_old_epoch>
+
+=item C<change_old_version>
+
+=item C<change_old_release>
+
+The epoch, version and release of the application before the
+change.  For C<added> applications these are C<0> and empty strings.
+
+=item C<change_new_epoch>
+
+=item C<change_new_version>
+
+=item C<change_new_release>
+
+The epoch, version and release of the application after the
+change.  For C<removed> applications these are C<0> and empty
+strings.
+
+=back
+
+The list is sorted by application name.  Call
+C<guestfs_inspect_get_applications_token> again to get the token
+for the current inventory.
+
+As with C<guestfs_inspect_list_applications>, the guest's disks
+must be mounted before calling this.
+
+Please read L<guestfs(3)/INSPECTION> for more details.");
+
+  ("set_transfer_compression", (RErr, [Bool "compress"], []), -1, [FishAlias "transfer-compression"],
+   [],
+   "compress file transfers to and from the appliance",
+   "\
+If C<compress> is true, then file data sent between the library
+and the appliance (by calls such as C<guestfs_upload>,
+C<guestfs_download>, C<guestfs_download_offset>, C<guestfs_tar_in>
+and C<guestfs_tar_out>) is compressed on the wire.  This is
+transparent to callers: the files written and read are not
+compressed.
+
+Compression helps when transferring text and other compressible
+data, particularly when the appliance has few CPUs or the transfer
+is slowed by the virtio-serial channel.  Chunks of data which do
+not compress (such as already compressed files or encrypted disk
+images) are sent as they are, so the cost is small for those.
+
+This can be called before or after C<guestfs_launch>.  It fails
+if libguestfs was built without zlib.
+
+The default is false.");
+
+  ("get_transfer_compression", (RBool "compress", [], []), -1, [],
+   [],
+   "get transfer compression flag",
+   "\
+This returns the transfer compression flag.  See
+C<guestfs_set_transfer_compression>.");
+
+  ("set_data_channels", (RErr, [Int "channels"], []), -1, [FishAlias "data-channels"],
+   [],
+   "set number of data channels for parallel transfers",
+   "\
+Set the number of extra virtio-serial data channels created
+between the library and the appliance.  These are used by
+C<guestfs_download_parallel> and C<guestfs_upload_parallel> to
+transfer several ranges of a large file at the same time.
+
+The default is C<0> (no data channels), in which case those calls
+behave the same as C<guestfs_download> and C<guestfs_upload>.  The
+maximum is C<16>.  Transfers are only faster if the appliance has
+more than one virtual CPU (see C<guestfs_set_smp>) and the source
+and destination can keep up.
+
+This function must be called before C<guestfs_launch>.  Data
+channels are not available with the C<unix:> attach method.
+
+If a parallel transfer fails part way through, or is cancelled
+with C<guestfs_user_cancel>, the data channels are closed and later
+transfers on this handle use the main channel.");
+
+  ("get_data_channels", (RInt "channels", [], []), -1, [],
+   [],
+   "get number of data channels for parallel transfers",
+   "\
+This returns the number of data channels that were requested
+with C<guestfs_set_data_channels>.");
+
+  ("download_parallel", (RErr, [Dev_or_Path "remotefilename"; FileOut "filename"], []), -1, [],
+   (let md5 = Digest.to_hex (Digest.file "COPYING.LIB") in
+    [InitScratchFS, Always, TestOutput (
+       [["mkdir"; "/download_parallel"];
+        ["upload"; "../../COPYING.LIB"; "/download_parallel/COPYING.LIB"];
+        ["download_parallel"; "/download_parallel/COPYING.LIB"; "testdownload.tmp"];
+        ["upload_parallel"; "testdownload.tmp"; "/download_parallel/upload"];
+        ["checksum"; "md5"; "/download_parallel/upload"]], md5)]),
+   "download a file using parallel data channels",
+   "\
+Download file C<remotefilename> and save it as C<filename>
+on the local machine.
+
+If data channels were configured (see C<guestfs_set_data_channels>)
+then the file is split into ranges which are sent over the data
+channels at the same time.  Otherwise, and for small files and
+non-regular local files, this is the same as C<guestfs_download>.
+
+See also C<guestfs_download_offset>.");
+
+  ("upload_parallel", (RErr, [FileIn "filename"; Dev_or_Path "remotefilename"], []), -1, [],
+   (let md5 = Digest.to_hex (Digest.file "COPYING.LIB") in
+    [InitScratchFS, Always, TestOutput (
+       [["upload_parallel"; "../../COPYING.LIB"; "/upload_parallel"];
+        ["checksum"; "md5"; "/upload_parallel"]], md5)]),
+   "upload a file using parallel data channels",
+   "\
+Upload local file C<filename> to C<remotefilename> on the
+filesystem.
+
+If data channels were configured (see C<guestfs_set_data_channels>)
+then the file is split into ranges which are sent over the data
+channels at the same time.  Otherwise, and for small files and
+non-regular local files, this is the same as C<guestfs_upload>.
+
+See also C<guestfs_upload_offset>.");
+
+  ("get_stats", (RStructList ("stats", "call_stats"), [], []), -1, [FishAlias "stats"],
+   [InitEmpty, Always, TestRun (
+      [["get_stats"]])],
+   "get per-call statistics",
+   "\
+Return statistics about the calls made on this handle, so you can
+find which calls dominate a long running job without enabling
+debugging or tracing.
+
+There is one entry for each call which has been made at least
+once.  C<stats_name> is the name of the call, and C<stats_side>
+is C<library> or C<daemon>.  The C<library> entries measure the
+whole call as seen by the caller, from sending the request to
+receiving the last reply or file chunk.  The C<daemon> entries
+measure just the time spent running the call inside the appliance,
+and are only returned if the handle has been launched.
+
+C<stats_calls> and C<stats_errors> are the number of calls and the
+number of those which failed.  C<stats_total_us> and C<stats_max_us>
+are the total and longest elapsed time in microseconds.  The
+C<stats_hist_*> fields count the calls which took less than 1ms,
+10ms, 100ms, 1s or 10s, and longer than that (C<stats_hist_inf>).
+C<stats_bytes_sent> and C<stats_bytes_received> are the bytes
+sent and received over the main appliance channel by that side,
+including file transfers and progress messages.
+
+Calls which are handled entirely in the library (such as this one)
+are not counted.");
+
 ]
 
 (* daemon_functions are any functions which cause some action
@@ -1753,6 +2140,9 @@ List all the block devices.
 
 The full block device names are returned, eg. C</dev/sda>.
 
+This can be called before C<guestfs_launch>, in which case it
+returns the names that the added drives will have in the appliance.
+
 See also C<guestfs_list_filesystems>.");
 
   ("list_partitions", (RStringList "partitions", [], []), 8, [],
@@ -2829,12 +3219,24 @@ To upload a compressed tarball, use C<guestfs_tgz_in>
 or C<guestfs_txz_in>.");
 
   ("tar_out", (RErr, [String "directory"; FileOut "tarfile"], []), 70, [],
-   [],
+   [InitScratchFS, Always, TestOutput (
+      [["mkdir"; "/tar_out"];
+       ["mkdir"; "/tar_out/dir"];
+       ["write"; "/tar_out/dir/hello"; "hello\n"];
+       ["ln_s"; "hello"; "/tar_out/dir/link"];
+       ["tar_out"; "/tar_out/dir"; "testtar.tmp"];
+       ["mkdir"; "/tar_out/copy"];
+       ["tar_in"; "testtar.tmp"; "/tar_out/copy"];
+       ["cat"; "/tar_out/copy/link"]], "hello\n")],
    "pack directory into tarfile",
    "\
 This command packs the contents of C<directory> and downloads
 it to local file C<tarfile>.
 
+The tar file is in POSIX (pax) format.  Extended attributes are
+stored in it using C<SCHILY.xattr> records, as used by GNU tar
+and star.
+
 To download a compressed tarball, use C<guestfs_tgz_out>
 or C<guestfs_txz_out>.");
 
@@ -2851,7 +3253,13 @@ I<gzip compressed> tar file) into C<directory>.
 To upload an uncompressed tarball, use C<guestfs_tar_in>.");
 
   ("tgz_out", (RErr, [Pathname "directory"; FileOut "tarball"], []), 72, [],
-   [],
+   [InitScratchFS, Always, TestOutput (
+      [["mkdir"; "/tgz_out"];
+       ["write"; "/tgz_out/hello"; "hello\n"];
+       ["tgz_out"; "/tgz_out"; "testtgz.tmp"];
+       ["mkdir"; "/tgz_out/copy"];
+       ["tgz_in"; "testtgz.tmp"; "/tgz_out/copy"];
+       ["cat"; "/tgz_out/copy/hello"]], "hello\n")],
    "pack directory into compressed tarball",
    "\
 This command packs the contents of C<directory> and downloads
@@ -5154,7 +5562,15 @@ End of the partition in bytes.
 
 Size of the partition in bytes.
 
-=back");
+=back
+
+This can be called before C<guestfs_launch>.  In that case the
+partition table is read directly from the disk image on the host,
+which is much faster than launching the appliance.  Only raw and
+qcow2 images containing MBR or GPT partition tables can be read
+this way, and 512 byte sectors are assumed.  For any other image
+this fails with errno C<ENOTSUP> (see C<guestfs_last_errno>), and
+you have to launch the appliance and call it again.");
 
   ("part_get_parttype", (RString "parttype", [Device "device"], []), 214, [],
    [InitEmpty, Always, TestOutput (
@@ -5708,11 +6124,38 @@ If the filesystem does not have a UUID, this returns the empty string.
 To find a filesystem from the UUID, use C<guestfs_findfs_uuid>.");
 
   ("lvm_set_filter", (RErr, [DeviceList "devices"], []), 255, [Optional "lvm2"],
-   (* Can't be tested with the current framework because
-    * the VG is being used by the mounted filesystem, so
-    * the vgchange -an command we do first will fail.
+   (* The first lvs call fills the daemon's cache of LVM listings,
+    * which the filter change must flush.  InitEmpty is needed
+    * because the vgchange -an command done first fails if a VG
+    * contains a mounted filesystem.
     *)
-    [],
+   [InitEmpty, Always, TestOutputList (
+      [["part_init"; "/dev/sda"; "mbr"];
+       ["part_add"; "/dev/sda"; "p"; "64"; "204799"];
+       ["part_add"; "/dev/sda"; "p"; "204800"; "-64"];
+       ["pvcreate"; "/dev/sda1"];
+       ["pvcreate"; "/dev/sda2"];
+       ["vgcreate"; "VG1"; "/dev/sda1"];
+       ["vgcreate"; "VG2"; "/dev/sda2"];
+       ["lvcreate"; "LV1"; "VG1"; "50"];
+       ["lvcreate"; "LV2"; "VG2"; "50"];
+       ["lvs"];
+       ["lvm_set_filter"; "/dev/sda1"];
+       ["lvs"]], ["/dev/VG1/LV1"]);
+    InitEmpty, Always, TestOutputList (
+      [["part_init"; "/dev/sda"; "mbr"];
+       ["part_add"; "/dev/sda"; "p"; "64"; "204799"];
+       ["part_add"; "/dev/sda"; "p"; "204800"; "-64"];
+       ["pvcreate"; "/dev/sda1"];
+       ["pvcreate"; "/dev/sda2"];
+       ["vgcreate"; "VG1"; "/dev/sda1"];
+       ["vgcreate"; "VG2"; "/dev/sda2"];
+       ["lvcreate"; "LV1"; "VG1"; "50"];
+       ["lvcreate"; "LV2"; "VG2"; "50"];
+       ["lvm_set_filter"; "/dev/sda1"];
+       ["lvs"];
+       ["lvm_clear_filter"];
+       ["lvs"]], ["/dev/VG1/LV1"; "/dev/VG2/LV2"])],
    "set LVM device filter",
    "\
 This sets the LVM device filter so that LVM will only be
@@ -5739,7 +6182,7 @@ contains a mounted filesystem), even if you are not
 filtering out that VG.");
 
   ("lvm_clear_filter", (RErr, [], []), 256, [],
-   [], (* see note on lvm_set_filter *)
+   [], (* tested by lvm_set_filter *)
    "clear LVM device filter",
    "\
 This undoes the effect of C<guestfs_lvm_set_filter>.  LVM
@@ -6307,7 +6750,7 @@ from C<guestfs_list_partitions>.
 
 See also C<guestfs_part_to_dev>.");
 
-  ("copy_device_to_device", (RErr, [Device "src"; Device "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"]), 294, [Progress],
+  ("copy_device_to_device", (RErr, [Device "src"; Device "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"; OBool "sparse"]), 294, [Progress],
    [],
    "copy from source device to destination device",
    "\
@@ -6328,28 +6771,44 @@ The source and destination may be the same object.  However
 overlapping regions may not be copied correctly.
 
 If the destination is a file, it is created if required.  If
-the destination file is not large enough, it is extended.");
+the destination file is not large enough, it is extended.
 
-  ("copy_device_to_file", (RErr, [Device "src"; Pathname "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"]), 295, [Progress],
+If the C<sparse> flag is true, then parts of the source which
+are unused are not written to the destination.  The destination
+must already contain zeroes (or be a new or sparse file) in those
+places, for example a freshly created disk image.  Unused parts
+are blocks containing only zero bytes, and, when the source is a
+device containing a filesystem supported by
+C<guestfs_filesystem_used_extents>, the free space in that
+filesystem.  Skipped parts of a destination file are left as
+holes.");
+
+  ("copy_device_to_file", (RErr, [Device "src"; Pathname "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"; OBool "sparse"]), 295, [Progress],
    [],
    "copy from source device to destination file",
    "\
 See C<guestfs_copy_device_to_device> for a general overview
 of this call.");
 
-  ("copy_file_to_device", (RErr, [Pathname "src"; Device "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"]), 296, [Progress],
+  ("copy_file_to_device", (RErr, [Pathname "src"; Device "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"; OBool "sparse"]), 296, [Progress],
    [],
    "copy from source file to destination device",
    "\
 See C<guestfs_copy_device_to_device> for a general overview
 of this call.");
 
-  ("copy_file_to_file", (RErr, [Pathname "src"; Pathname "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"]), 297, [Progress],
+  ("copy_file_to_file", (RErr, [Pathname "src"; Pathname "dest"], [OInt64 "srcoffset"; OInt64 "destoffset"; OInt64 "size"; OBool "sparse"]), 297, [Progress],
    [InitScratchFS, Always, TestOutputBuffer (
       [["mkdir"; "/copyff"];
        ["write"; "/copyff/src"; "hello, world"];
-       ["copy_file_to_file"; "/copyff/src"; "/copyff/dest"; ""; ""; ""];
-       ["read_file"; "/copyff/dest"]], "hello, world")],
+       ["copy_file_to_file"; "/copyff/src"; "/copyff/dest"; ""; ""; ""; ""];
+       ["read_file"; "/copyff/dest"]], "hello, world");
+    InitScratchFS, Always, TestOutputBuffer (
+      [["mkdir"; "/copyff_sparse"];
+       ["write"; "/copyff_sparse/src"; "hello, world"];
+       ["truncate_size"; "/copyff_sparse/src"; "1048576"];
+       ["copy_file_to_file"; "/copyff_sparse/src"; "/copyff_sparse/dest"; ""; ""; ""; "true"];
+       ["pread"; "/copyff_sparse/dest"; "12"; "0"]], "hello, world")],
    "copy from source file to destination file",
    "\
 See C<guestfs_copy_device_to_device> for a general overview
@@ -6597,6 +7056,323 @@ The usage of this device, for example C<filesystem> or C<raid>.
 
 =back");
 
+  ("case_sensitive_path_list", (RStringList "rpaths", [StringList "paths"], []), 304, [],
+   [InitISOFS, Always, TestOutputList (
+      [["case_sensitive_path_list"; "/DIRECTORY /Known-1 /notexist /DIRECTORY/"]], ["/directory"; "/known-1"; ""; "/directory"]);
+    InitScratchFS, Always, TestOutputList (
+      [["mkdir"; "/case_sensitive_path_list"];
+       ["mkdir"; "/case_sensitive_path_list/bbb"];
+       ["touch"; "/case_sensitive_path_list/bbb/c"];
+       ["case_sensitive_path_list"; "/CASE_SENSITIVE_path_list/bbB/C /case_sensitive_path_list/BBB/D"];
+       ["touch"; "/case_sensitive_path_list/bbb/d"];
+       ["case_sensitive_path_list"; "/CASE_SENSITIVE_path_list/bbB/C /case_sensitive_path_list/BBB/D"]], ["/case_sensitive_path_list/bbb/c"; "/case_sensitive_path_list/bbb/d"]);
+    InitISOFS, Always, TestLastFail (
+      [["case_sensitive_path_list"; "/Known-1 /DIRECTORY/../known-1"]])],
+   "return true paths of a list of paths on case-insensitive filesystem",
+   "\
+This is the same as C<guestfs_case_sensitive_path>, but it
+resolves a list of paths in a single call.
+
+The returned list has one element for each element of C<paths>,
+in the same order.  If a path does not exist (some element of it
+is not found, or is not a directory) then the corresponding
+element is an empty string C<\"\">.  Other errors, such as a
+path containing C<.> or C<..> elements or an I/O error, cause
+the whole call to fail.
+
+Directories scanned while resolving paths are indexed by the
+daemon, so repeated lookups in the same large directories (such
+as C<System32> in Windows guests) are fast.  This also applies
+to C<guestfs_case_sensitive_path>.");
+
+  ("internal_transfer_compression", (RErr, [Bool "compress"], []), 305, [NotInFish; NotInDocs],
+   [],
+   "enable or disable compressed file transfers",
+   "\
+This tells the daemon whether it may send compressed file chunks
+to the library.  You should not call this command directly.
+Instead, use C<guestfs_set_transfer_compression>.");
+
+  ("internal_data_channel_download", (RErr, [Dev_or_Path "remotefilename"; Int64 "offset"; Int64 "size"; Int "channel"], []), 306, [NotInFish; NotInDocs],
+   [],
+   "start sending part of a file over a data channel",
+   "\
+This starts sending C<size> bytes of C<remotefilename> from
+C<offset> over data channel C<channel>, and returns at once.
+You should not call this command directly.  Instead, use
+C<guestfs_download_parallel>.");
+
+  ("internal_data_channel_upload", (RErr, [Dev_or_Path "remotefilename"; Int64 "offset"; Int64 "size"; Int "channel"], []), 307, [NotInFish; NotInDocs],
+   [],
+   "start receiving part of a file over a data channel",
+   "\
+This starts writing C<size> bytes received on data channel
+C<channel> to C<remotefilename> at C<offset>, and returns at once.
+You should not call this command directly.  Instead, use
+C<guestfs_upload_parallel>.");
+
+  ("internal_data_channel_wait", (RErr, [Int "channel"], []), 308, [NotInFish; NotInDocs],
+   [],
+   "wait for a data channel transfer to finish",
+   "\
+This waits for the transfer started on data channel C<channel> by
+C<guestfs_internal_data_channel_download> or
+C<guestfs_internal_data_channel_upload> to finish, and returns
+an error if it failed.  You should not call this command directly.");
+
+  ("fstrim", (RErr, [Pathname "mountpoint"], [OInt64 "offset"; OInt64 "length"; OInt64 "minimumfreeextent"]), 309, [],
+   [],
+   "trim free space in a filesystem",
+   "\
+Trim the free space in the filesystem mounted on C<mountpoint>.
+The filesystem must be mounted read-write.
+
+The filesystem contents are not affected, but any free space
+in the filesystem is \"trimmed\", that is, given back to the host
+device.  If the disk image is sparse (raw files) or thin-provisioned
+(qcow2), this makes it smaller on the host.
+
+This only works if the drive was added with discard enabled (see
+the C<discard> option of C<guestfs_add_drive_opts>), and if the
+filesystem supports trimming.
+
+The optional arguments are:
+
+=over 4
+
+=item C<offset>
+
+=item C<length>
+
+Only trim the part of the filesystem starting at byte C<offset>
+and C<length> bytes long.  The default is the whole filesystem.
+
+=item C<minimumfreeextent>
+
+Free extents smaller than this (in bytes) are not trimmed.  The
+filesystem may round this up.
+
+=back
+
+See also L<fstrim(8)>.");
+
+  ("filesystem_used_extents", (RStructList ("extents", "extent"), [Device "device"], [OInt64 "mingap"]), 310, [],
+   [InitBasicFS, Always, TestRun (
+      [["filesystem_used_extents"; "/dev/sda1"; ""]])],
+   "list the allocated extents of a filesystem",
+   "\
+List the parts of the filesystem on C<device> which are in use.
+
+The result is a list of extents.  Each extent is a run of
+C<extent_length> bytes starting C<extent_offset> bytes from the
+start of C<device>, sorted by offset.  Anything not covered by the
+list is free space in the filesystem, which a caller copying the
+device (such as L<virt-sparsify(1)> or L<virt-resize(1)>) can skip.
+
+Filesystem metadata, and any part of the device after the end of
+the filesystem, is always reported as in use.  The filesystem
+should be unmounted, or at least not being written to, while
+this runs and while the result is being used.
+
+This currently supports ext2/3/4, XFS and NTFS.  For other
+filesystem types an error is returned, and the caller should
+treat the whole device as in use.
+
+The optional C<mingap> argument merges extents separated by
+free space smaller than C<mingap> bytes, to make the list shorter.
+If the list would be too long to return, it is merged in this
+way automatically.  The result always covers every block which
+is in use.");
+
+  ("copy_devices_to_devices", (RErr, [DeviceList "srcs"; DeviceList "dests"], [OBool "sparse"]), 311, [Progress],
+   [InitEmpty, Always, TestRun (
+      [["part_init"; "/dev/sda"; "mbr"];
+       ["part_add"; "/dev/sda"; "p"; "64"; "20479"];
+       ["part_add"; "/dev/sda"; "p"; "20480"; "40959"];
+       ["part_add"; "/dev/sda"; "p"; "40960"; "61439"];
+       ["part_add"; "/dev/sda"; "p"; "61440"; "81919"];
+       ["mkfs"; "ext4"; "/dev/sda1"];
+       ["mkfs"; "ext4"; "/dev/sda2"];
+       ["copy_devices_to_devices"; "/dev/sda1 /dev/sda2"; "/dev/sda3 /dev/sda4"; "true"];
+       ["fsck"; "ext4"; "/dev/sda3"];
+       ["fsck"; "ext4"; "/dev/sda4"]])],
+   "copy several devices in parallel",
+   "\
+Copy each device in the list C<srcs> to the device in the
+same position in the list C<dests>.  The two lists must be the
+same length.  For each pair, the smaller of the two device sizes
+is copied, starting at the beginning of both devices.
+
+The copies are done in parallel, using up to one worker per
+appliance CPU (see C<guestfs_set_smp>), so the devices must be
+independent of each other, for example different partitions.
+A single progress bar covers all of the copies.
+
+The optional C<sparse> flag has the same meaning as for
+C<guestfs_copy_device_to_device>.");
+
+  ("lvm_topology", (RStructList ("segments", "lvm_pvseg"), [], []), 312, [Optional "lvm2"],
+   [InitBasicFSonLVM, Always, TestRun (
+      [["lvm_topology"]])],
+   "list LVM physical volumes, volume groups and logical volumes",
+   "\
+List the whole LVM topology in a single call: every physical
+volume segment, together with the PV it is on, and the VG and LV
+it belongs to.  This is the equivalent of
+C<pvs --segments> with all the PV, VG and LV fields, and is
+much faster than calling C<guestfs_pvs_full>,
+C<guestfs_pvuuid>, C<guestfs_vgpvuuids> and so on separately.
+
+Each entry describes C<pvseg_size> bytes starting
+C<pvseg_start> bytes from the start of the PV
+C<pvseg_pv_name>.  If the segment is allocated to a logical
+volume, C<pvseg_lv_name> is the name of the LV (without the VG
+name) and the segment is mapped at C<pvseg_lv_start> bytes from
+the start of the LV.  For free space C<pvseg_lv_name> is the empty
+string, and for a PV which is not in a volume group
+C<pvseg_vg_name> is the empty string.  In either case the other LV
+or VG fields should be ignored.
+
+Logical volumes which don't occupy space on any PV (such as thin
+volumes) don't appear in this list.  Use C<guestfs_lvs> to list
+all logical volumes.
+
+The result is cached in the appliance until the next call
+which could change the LVM metadata, so calling this repeatedly
+is cheap.");
+
+  ("internal_call_stats", (RStructList ("stats", "call_stats"), [], []), 313, [NotInFish; NotInDocs],
+   [],
+   "get daemon call statistics",
+   "\
+This returns the daemon's per-call statistics.  You should not
+call this command directly.  Instead, use C<guestfs_get_stats>.");
+
+  ("fallocate_range", (RErr, [Pathname "path"; String "mode"; Int64 "offset"; Int64 "len"], []), 314, [],
+   (* The scratch filesystem is ext2, which doesn't support these modes. *)
+   [InitEmpty, Always, TestOutputStruct (
+      [["part_disk"; "/dev/sda"; "mbr"];
+       ["mkfs"; "ext4"; "/dev/sda1"];
+       ["mount"; "/dev/sda1"; "/"];
+       ["fallocate64"; "/fallocate_range"; "1000000"];
+       ["fallocate_range"; "/fallocate_range"; "punch-hole"; "0"; "65536"];
+       ["stat"; "/fallocate_range"]], [CompareWithInt ("size", 1_000_000)]);
+    InitEmpty, Always, TestOutputStruct (
+      [["part_disk"; "/dev/sda"; "mbr"];
+       ["mkfs"; "ext4"; "/dev/sda1"];
+       ["mount"; "/dev/sda1"; "/"];
+       ["touch"; "/fallocate_range2"];
+       ["fallocate_range"; "/fallocate_range2"; "keep-size"; "0"; "65536"];
+       ["stat"; "/fallocate_range2"]], [CompareWithInt ("size", 0)])],
+   "allocate, deallocate or zero part of a file",
+   "\
+This calls L<fallocate(2)> on the range of C<len> bytes
+starting at C<offset> in the file C<path>.  The file is
+created if it doesn't exist, but it is not truncated.
+
+C<mode> is a comma-separated list of flags, or the empty
+string:
+
+=over 4
+
+=item C<\"\">
+
+Allocate disk blocks for the range, extending the file
+if necessary.  The contents of any existing data are
+not changed.
+
+=item C<keep-size>
+
+Don't change the size of the file, even if the range
+extends past the end.  This can be used to preallocate
+space for appending to a file.
+
+=item C<punch-hole>
+
+Deallocate the range, so that it reads as zeroes.  The
+size of the file is not changed.
+
+=item C<zero-range>
+
+Make the range read as zeroes, by allocating zeroed
+extents rather than writing zeroes.
+
+=item C<collapse-range>
+
+Remove the range from the file, moving the data after it
+down and making the file smaller.  Most filesystems
+require C<offset> and C<len> to be multiples of the
+filesystem block size.
+
+=back
+
+The filesystem must support the requested mode, and
+some modes need a recent kernel.  For example C<punch-hole>
+is not supported by ext3.
+
+See also C<guestfs_fallocate64>, C<guestfs_truncate_size>.");
+
+  ("blkdiscard", (RErr, [Device "device"], [OInt64 "offset"; OInt64 "length"]), 315, [],
+   [],
+   "discard blocks on a device",
+   "\
+This discards (trims) the blocks on C<device>, telling the
+host that the data is no longer needed.  If the disk image
+is sparse (raw files) or thin-provisioned (qcow2), this makes
+it smaller on the host.  The contents of the discarded range
+are undefined afterwards.
+
+By default the whole device is discarded.  Use the optional
+arguments C<offset> and C<length> to discard part of the
+device.  Both must be multiples of 512.
+
+This only works if the drive was added with discard enabled (see
+the C<discard> option of C<guestfs_add_drive_opts>).
+
+See also C<guestfs_blkzeroout>, C<guestfs_fstrim>.");
+
+  ("blkzeroout", (RErr, [Device "device"], [OInt64 "offset"; OInt64 "length"]), 316, [],
+   [InitEmpty, Always, TestOutputTrue (
+      [["pwrite_device"; "/dev/sda"; "abcdefgh"; "4096"];
+       ["blkzeroout"; "/dev/sda"; ""; ""];
+       ["is_zero_device"; "/dev/sda"]]);
+    InitEmpty, Always, TestOutputBuffer (
+      [["pwrite_device"; "/dev/sda"; "abcdefgh"; "4096"];
+       ["blkzeroout"; "/dev/sda"; "0"; "1048576"];
+       ["pread_device"; "/dev/sda"; "8"; "4096"]], "\000\000\000\000\000\000\000\000")],
+   "zero blocks on a device",
+   "\
+This zeroes the blocks on C<device> using the C<BLKZEROOUT>
+ioctl.  If the device supports it, the blocks are zeroed by
+the device (or the host) without sending zeroes from the
+appliance, which is much faster than C<guestfs_zero_device>.
+Otherwise the kernel writes the zeroes.
+
+By default the whole device is zeroed.  Use the optional
+arguments C<offset> and C<length> to zero part of the
+device.  Both must be multiples of 512.
+
+See also C<guestfs_blkdiscard>, C<guestfs_zero_device>.");
+
+  ("internal_pe_icon", (RBufferOut "png", [Pathname "path"; Int "resourceid"; Int "height"], []), 317, [NotInFish; NotInDocs],
+   [],
+   "extract a bitmap resource from a Windows executable as PNG",
+   "\
+This internal call is used by C<guestfs_inspect_get_icon>.  It
+finds the bitmap resource (C<RT_BITMAP>) with the numeric ID
+C<resourceid> in the Windows PE executable C<path>, and returns it
+converted to a PNG image.
+
+If C<height> is greater than 0, only that many rows from the top
+of the bitmap are returned.");
+
+  ("internal_data_channel_cancel", (RErr, [Int "channel"], []), 318, [NotInFish; NotInDocs],
+   [],
+   "cancel a data channel transfer",
+   "\
+This kills the transfer started on data channel C<channel>, which
+the library could not complete, and stops using that channel.
+You should not call this command directly.")
 ]
 
 let all_functions = non_daemon_functions @ daemon_functions
@@ -6648,7 +7424,10 @@ prepared disk image, see L</PREPARED DISK IMAGES>.");
 C<copy-in> copies local files or directories recursively into the disk
 image, placing them in the directory called C</remotedir> (which must
 exist).  This guestfish meta-command turns into a sequence of
-L</tar-in> and other commands as necessary.
+L</tar-in> and other commands as necessary.  If data channels are
+enabled (see L</set-data-channels>), regular files are copied with
+L</upload-parallel> instead, and keep their permissions but not their
+owner or times.
 
 Multiple local files and directories can be specified, but the last
 parameter must always be a remote directory.  Wildcards cannot be
@@ -6661,8 +7440,8 @@ used.");
 C<copy-out> copies remote files or directories recursively out of the
 disk image, placing them on the host disk in a local directory called
 C<localdir> (which must exist).  This guestfish meta-command turns
-into a sequence of L</download>, L</tar-out> and other commands as
-necessary.
+into a sequence of L</download-parallel>, L</tar-out> and other
+commands as necessary.
 
 Multiple remote files and directories can be specified, but the last
 parameter must always be a local directory.  To download to the
@@ -6880,6 +7659,20 @@ See also L<guestfs(3)/AVAILABILITY>.");
 Run the command as usual, but print the elapsed time afterwards.  This
 can be useful for benchmarking operations.");
 
+  ("trace_decode", (RErr,[], []), -1, [], [],
+   "decode a binary trace dump",
+   " trace-decode filename [filename ...]
+
+Print the calls recorded in a file written by C<dump-trace-buffer>
+or C<trace-dump-file>, one line per call, oldest first.  Each line
+shows the time the call started, its duration, the function name,
+the daemon procedure number and serial (or C<-> for calls which
+don't go to the daemon), the total size of the arguments in bytes,
+and the result, or C<ERROR> if the call failed.
+
+The file does not need to have been written by the same version
+of libguestfs.");
+
   ("unsetenv", (RErr,[], []), -1, [], [],
    "unset an environment variable",
    "  unsetenv VAR
@@ -34,6 +34,12 @@ open Generator_events
 
 type optarg_proto = Dots | VA | Argv
 
+(* Daemon functions which, if called before launch, are implemented
+ * in the library by reading the disk images on the host.  For each
+ * there is a function guestfs___host_<name> in src/host_part.c.
+ *)
+let host_side_functions = [ "list_devices"; "part_list" ]
+
 (* Generate a C function prototype. *)
 let rec generate_prototype ?(extern = true) ?(static = false)
     ?(semicolon = true)
@@ -668,6 +674,18 @@ and generate_client_actions () =
 #include \"guestfs_protocol.h\"
 #include \"errnostring.h\"
 
+/* Names of all functions, indexed by the function number which is
+ * stored in binary trace records (see src/trace.c).
+ */
+const char *const guestfs___trace_function_names[] = {
+";
+  List.iter (
+    fun (shortname, _, _, _, _, _, _) -> pr "  \"%s\",\n" shortname
+  ) all_functions_sorted;
+  pr "\
+};
+const size_t guestfs___trace_nr_function_names = %d;
+
 /* Check the return message from a call for validity. */
 static int
 check_reply_header (guestfs_h *g,
@@ -752,13 +770,17 @@ trace_send_line (guestfs_h *g)
   }
 }
 
-";
+" (List.length all_functions_sorted);
 
-  (* Generate code for enter events. *)
+  (* Generate code for enter events.  This also starts the clock for
+   * the binary trace record.
+   *)
   let enter_event shortname =
     pr "  guestfs___call_callbacks_message (g, GUESTFS_EVENT_ENTER,\n";
     pr "                                    \"%s\", %d);\n"
-      shortname (String.length shortname)
+      shortname (String.length shortname);
+    pr "  if (g->trace_ring)\n";
+    pr "    trace_ring_start = guestfs___trace_now ();\n"
   in
 
   (* Generate code to check String-like parameters are not passed in
@@ -929,9 +951,64 @@ trace_send_line (guestfs_h *g)
     pr "\n";
   in
 
-  let trace_return ?(indent = 2) shortname (ret, _, _) rv =
+  (* Generate code to add a record to the binary trace ring buffer
+   * (see src/trace.c).  'result' is a C expression, and is only
+   * evaluated if the ring buffer is enabled.
+   *)
+  let trace_ring_record ~indent shortname (_, args, _) result failed =
+    let index =
+      let rec loop i = function
+        | [] -> assert false
+        | (n, _, _, _, _, _, _) :: _ when n = shortname -> i
+        | _ :: rest -> loop (i+1) rest
+      in
+      loop 0 all_functions_sorted in
+    let proc_nr, serial =
+      try
+        let _, _, proc_nr, _, _, _, _ =
+          List.find (fun (n, _, _, _, _, _, _) -> n = shortname)
+            daemon_functions in
+        proc_nr, "serial"
+      with Not_found -> -1, "0" in
+    let arg_sizes =
+      List.map (
+        function
+        | String n | Device n | Pathname n | Dev_or_Path n
+        | FileIn n | FileOut n -> sprintf "strlen (%s)" n
+        | Key _ -> "0" (* don't reveal the length of keys *)
+        | OptString n -> sprintf "(%s ? strlen (%s) : 0)" n n
+        | StringList n | DeviceList n ->
+            sprintf "guestfs___trace_strings_size (%s)" n
+        | Bool _ | Int _ -> "sizeof (int)"
+        | Int64 _ -> "sizeof (int64_t)"
+        | BufferIn n -> sprintf "%s_size" n
+        | Pointer _ -> "sizeof (void *)"
+      ) args in
+    let arg_sizes =
+      if arg_sizes = [] then "0" else String.concat " + " arg_sizes in
+
+    pr "%sif (g->trace_ring)\n" indent;
+    pr "%s  guestfs___trace_record (g, %d, %d, %s,\n" indent index proc_nr serial;
+    pr "%s                          %s,\n" indent arg_sizes;
+    pr "%s                          %s, %d, trace_ring_start);\n"
+      indent result (if failed then 1 else 0)
+  in
+
+  let trace_return ?(indent = 2) shortname ((ret, _, _) as style) rv =
     let indent = spaces indent in
 
+    let result =
+      match ret with
+      | RErr | RInt _ | RBool _ | RInt64 _ -> rv
+      | RConstString _ | RString _ -> sprintf "strlen (%s)" rv
+      | RConstOptString _ -> sprintf "(%s ? strlen (%s) : 0)" rv rv
+      | RBufferOut _ -> "*size_r"
+      | RStringList _ | RHashtable _ ->
+          sprintf "guestfs___trace_count_strings (%s)" rv
+      | RStruct _ -> "1"
+      | RStructList _ -> sprintf "%s->len" rv in
+    trace_ring_record ~indent shortname style result false;
+
     pr "%sif (trace_flag) {\n" indent;
 
     let needs_i =
@@ -984,9 +1061,11 @@ trace_send_line (guestfs_h *g)
     pr "\n";
   in
 
-  let trace_return_error ?(indent = 2) shortname (ret, _, _) errcode =
+  let trace_return_error ?(indent = 2) shortname style errcode =
     let indent = spaces indent in
 
+    trace_ring_record ~indent shortname style "-1" true;
+
     pr "%sif (trace_flag)\n" indent;
 
     pr "%s  guestfs___trace (g, \"%%s = %%s (error)\",\n" indent;
@@ -994,20 +1073,61 @@ trace_send_line (guestfs_h *g)
       indent shortname (string_of_errcode errcode)
   in
 
+  (* The public entry point of every function takes the handle lock
+   * (only if the handle is thread-safe, see src/guestfs.c) and calls
+   * the static unlocked_* function containing the real body.
+   *)
+  let generate_locked_wrapper shortname (ret, _, optargs as style) =
+    if optargs = [] then
+      generate_prototype ~extern:false ~semicolon:false ~newline:true
+        ~handle:"g" ~prefix:"guestfs_" shortname style
+    else
+      generate_prototype ~extern:false ~semicolon:false ~newline:true
+        ~handle:"g" ~prefix:"guestfs_" ~suffix:"_argv" ~optarg_proto:Argv
+        shortname style;
+    pr "{\n";
+    (match ret with
+     | RErr | RInt _ | RBool _ ->
+         pr "  int r;\n"
+     | RInt64 _ ->
+         pr "  int64_t r;\n"
+     | RConstString _ | RConstOptString _ ->
+         pr "  const char *r;\n"
+     | RString _ | RBufferOut _ ->
+         pr "  char *r;\n"
+     | RStringList _ | RHashtable _ ->
+         pr "  char **r;\n"
+     | RStruct (_, typ) ->
+         pr "  struct guestfs_%s *r;\n" typ
+     | RStructList (_, typ) ->
+         pr "  struct guestfs_%s_list *r;\n" typ
+    );
+    pr "  int locked = guestfs___lock_handle (g);\n";
+    pr "\n";
+    pr "  r = unlocked_%s%s " shortname (if optargs = [] then "" else "_argv");
+    generate_c_call_args ~handle:"g" ~implicit_size_ptr:"size_r" style;
+    pr ";\n";
+    pr "  guestfs___unlock_handle (g, locked);\n";
+    pr "  return r;\n";
+    pr "}\n";
+    pr "\n"
+  in
+
   (* For non-daemon functions, generate a wrapper around each function. *)
   List.iter (
     fun (shortname, (ret, _, optargs as style), _, _, _, _, _) ->
       if optargs = [] then
-        generate_prototype ~extern:false ~semicolon:false ~newline:true
-          ~handle:"g" ~prefix:"guestfs_"
+        generate_prototype ~extern:false ~static:true ~semicolon:false
+          ~newline:true ~handle:"g" ~prefix:"unlocked_"
           shortname style
       else
-        generate_prototype ~extern:false ~semicolon:false ~newline:true
-          ~handle:"g" ~prefix:"guestfs_" ~suffix:"_argv" ~optarg_proto:Argv
-          shortname style;
+        generate_prototype ~extern:false ~static:true ~semicolon:false
+          ~newline:true ~handle:"g" ~prefix:"unlocked_" ~suffix:"_argv"
+          ~optarg_proto:Argv shortname style;
       pr "{\n";
       pr "  int trace_flag = g->trace;\n";
       pr "  FILE *trace_fp;\n";
+      pr "  int64_t trace_ring_start = 0;\n";
       (match ret with
        | RErr | RInt _ | RBool _ ->
            pr "  int r;\n"
@@ -1048,7 +1168,9 @@ trace_send_line (guestfs_h *g)
       pr "\n";
       pr "  return r;\n";
       pr "}\n";
-      pr "\n"
+      pr "\n";
+
+      generate_locked_wrapper shortname style
   ) non_daemon_functions;
 
   (* Client-side stubs for each function. *)
@@ -1062,11 +1184,11 @@ trace_send_line (guestfs_h *g)
 
       (* Generate the action stub. *)
       if optargs = [] then
-        generate_prototype ~extern:false ~semicolon:false ~newline:true
-          ~handle:"g" ~prefix:"guestfs_" shortname style
+        generate_prototype ~extern:false ~static:true ~semicolon:false
+          ~newline:true ~handle:"g" ~prefix:"unlocked_" shortname style
       else
-        generate_prototype ~extern:false ~semicolon:false ~newline:true
-          ~handle:"g" ~prefix:"guestfs_" ~suffix:"_argv"
+        generate_prototype ~extern:false ~static:true ~semicolon:false
+          ~newline:true ~handle:"g" ~prefix:"unlocked_" ~suffix:"_argv"
           ~optarg_proto:Argv shortname style;
 
       pr "{\n";
@@ -1090,10 +1212,11 @@ trace_send_line (guestfs_h *g)
             pr "  struct %s_ret ret;\n" name;
             true in
 
-      pr "  int serial;\n";
+      pr "  int serial = 0;\n";
       pr "  int r;\n";
       pr "  int trace_flag = g->trace;\n";
       pr "  FILE *trace_fp;\n";
+      pr "  int64_t trace_ring_start = 0;\n";
       (match ret with
        | RErr | RInt _ | RBool _ ->
            pr "  int ret_v;\n"
@@ -1138,6 +1261,23 @@ trace_send_line (guestfs_h *g)
         | _ -> ()
       ) args;
 
+      (* A few calls can be answered before launch by reading the
+       * disk images directly (see src/host_part.c).
+       *)
+      if List.mem shortname host_side_functions then (
+        pr "  if (guestfs__is_config (g)) {\n";
+        pr "    ret_v = guestfs___host_%s (g%s);\n" shortname
+          (String.concat "" (List.map (fun arg -> ", " ^ name_of_argt arg) args));
+        pr "    if (ret_v == %s) {\n" (string_of_errcode errcode);
+        trace_return_error ~indent:6 shortname style errcode;
+        pr "      return %s;\n" (string_of_errcode errcode);
+        pr "    }\n";
+        trace_return ~indent:4 shortname style "ret_v";
+        pr "    return ret_v;\n";
+        pr "  }\n";
+        pr "\n"
+      );
+
       (* Check we are in the right state for sending a request. *)
       pr "  if (check_state (g, \"%s\") == -1) {\n" shortname;
       trace_return_error ~indent:4 shortname style errcode;
@@ -1340,7 +1480,9 @@ trace_send_line (guestfs_h *g)
       );
       trace_return shortname style "ret_v";
       pr "  return ret_v;\n";
-      pr "}\n\n"
+      pr "}\n\n";
+
+      generate_locked_wrapper shortname style
   ) daemon_functions;
 
   (* Functions to free structures. *)
@@ -29,6 +29,21 @@ open Generator_actions
 open Generator_structs
 open Generator_c
 
+(* Calls which take a device but can't change the LVM metadata on it.
+ * The stubs for all other calls with device arguments flush the cache
+ * of LVM listings (see daemon/lvm.c).  These are the calls used
+ * repeatedly by inspection, which would otherwise keep refilling it.
+ *)
+let keeps_lvm_cache = [
+  "blockdev_getro"; "blockdev_getsize64"; "blockdev_getss";
+  "is_lv"; "lvm_canonical_lv_name"; "lvuuid"; "pvuuid";
+  "mount"; "mount_options"; "mount_ro"; "mount_vfs"; "umount";
+  "part_get_mbr_id"; "part_get_parttype"; "part_list";
+  "part_to_dev"; "part_to_partnum";
+  "pread_device"; "is_zero_device"; "checksum_device";
+  "vfs_label"; "vfs_type"; "vfs_uuid";
+]
+
 (* Generate daemon/actions.h. *)
 let generate_daemon_actions_h () =
   generate_header CStyle GPLv2plus;
@@ -220,6 +235,12 @@ and generate_daemon_actions () =
           (if is_filein then "cancel_receive ()" else "");
       );
 
+      (* The call may write to a device, changing the LVM metadata. *)
+      if not (List.mem name keeps_lvm_cache) &&
+         List.exists (function Device _ | Dev_or_Path _ | DeviceList _ -> true
+                     | _ -> false) args then
+        pr "  flush_lvm_cache ();\n";
+
       (* Don't want to call the impl with any FileIn or FileOut
        * parameters, since these go "outside" the RPC protocol.
        *)
@@ -621,6 +621,7 @@ logvols = g.lvs ()
 \"\"\"
 
 import libguestfsmod
+import threading
 
 ";
 
@@ -634,6 +635,49 @@ import libguestfsmod
 class ClosedHandle(ValueError):
     pass
 
+class AsyncCall:
+    \"\"\"The result of one of the GuestFS *_async methods.
+
+    Long-running calls (such as launch, inspect_os, upload and
+    download) have a variant with the suffix _async, which makes
+    the call in a new thread and returns an AsyncCall immediately.
+    The handle must not be used for anything else until the call
+    has finished, unless set_thread_safe has been called.
+    \"\"\"
+
+    def __init__ (self, fn, args, kwargs):
+        self._result = None
+        self._exception = None
+        self._thread = threading.Thread (target=self._run,
+                                         args=(fn, args, kwargs))
+        self._thread.daemon = True
+        self._thread.start ()
+
+    def _run (self, fn, args, kwargs):
+        try:
+            self._result = fn (*args, **kwargs)
+        except Exception as e:
+            self._exception = e
+
+    def done (self):
+        \"\"\"Return True if the call has finished.\"\"\"
+        return not self._thread.is_alive ()
+
+    def wait (self, timeout=None):
+        \"\"\"Wait for the call to finish and return its result.
+
+        If the call failed, its exception is raised here.  If
+        timeout (in seconds) is given and the call has not finished
+        by then, this returns None; use done() to tell the cases
+        apart.
+        \"\"\"
+        self._thread.join (timeout)
+        if self._thread.is_alive ():
+            return None
+        if self._exception is not None:
+            raise self._exception
+        return self._result
+
 class GuestFS:
     \"\"\"Instances of this class are libguestfs API handles.\"\"\"
 
@@ -697,7 +741,7 @@ class GuestFS:
 ";
 
   List.iter (
-    fun (name, (ret, args, optargs), _, flags, _, _, longdesc) ->
+    fun (name, (ret, args, optargs), _, flags, _, _, longdesc as f) ->
       pr "    def %s (self" name;
       List.iter (fun arg -> pr ", %s" (name_of_argt arg)) args;
       List.iter (
@@ -752,4 +796,12 @@ class GuestFS:
       List.iter (fun arg -> pr ", %s" (name_of_argt arg))
         (args @ args_of_optargs optargs);
       pr ")\n\n";
+
+      if is_long_running f then (
+        pr "    def %s_async (self, *args, **kwargs):\n" name;
+        pr "        \"\"\"Run %s in a new thread, returning an AsyncCall.\"\"\"\n"
+          name;
+        pr "        self._check_not_closed ()\n";
+        pr "        return AsyncCall (self.%s, args, kwargs)\n\n" name
+      )
   ) all_functions
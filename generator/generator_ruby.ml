@@ -45,6 +45,16 @@ let rec generate_ruby_c () =
 
 #include \"extconf.h\"
 
+/* Release the GVL (global VM lock) while libguestfs calls run, so
+ * that other Ruby threads can run while we wait for the appliance.
+ * This needs Ruby >= 2.0.  With older versions of Ruby the GVL is
+ * held for the whole call, as before.
+ */
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && defined(HAVE_RB_THREAD_CALL_WITH_GVL)
+#include <ruby/thread.h>
+#define RELEASE_GVL 1
+#endif
+
 /* For Ruby < 1.9 */
 #ifndef RARRAY_LEN
 #define RARRAY_LEN(r) (RARRAY((r))->len)
@@ -64,6 +74,7 @@ static VALUE c_guestfs;			/* guestfs_h handle */
 static VALUE e_Error;			/* used for all errors */
 
 static void ruby_event_callback_wrapper (guestfs_h *g, void *data, uint64_t event, int event_handle, int flags, const char *buf, size_t buf_len, const uint64_t *array, size_t array_len);
+static void *ruby_event_callback_with_gvl (void *argsv);
 static VALUE ruby_event_callback_wrapper_wrapper (VALUE argv);
 static VALUE ruby_event_callback_handle_exception (VALUE not_used, VALUE exn);
 static VALUE **get_all_event_callbacks (guestfs_h *g, size_t *len_rtn);
@@ -82,6 +93,9 @@ ruby_guestfs_free (void *gvp)
     size_t len, i;
     VALUE **roots = get_all_event_callbacks (g, &len);
 
+    /* The close callbacks run in this thread, which holds the GVL. */
+    guestfs_set_private (g, \"_ruby_holding_gvl\", (void *) 1);
+
     /* Close the handle: this could invoke callbacks from the list
      * above, which is why we don't want to delete them before
      * closing the handle.
@@ -214,6 +228,16 @@ ruby_delete_event_callback (VALUE gv, VALUE event_handlev)
   return Qnil;
 }
 
+struct ruby_event_callback_args {
+  void *data;
+  uint64_t event;
+  int event_handle;
+  const char *buf;
+  size_t buf_len;
+  const uint64_t *array;
+  size_t array_len;
+};
+
 static void
 ruby_event_callback_wrapper (guestfs_h *g,
                              void *data,
@@ -223,23 +247,46 @@ ruby_event_callback_wrapper (guestfs_h *g,
                              const char *buf, size_t buf_len,
                              const uint64_t *array, size_t array_len)
 {
+  struct ruby_event_callback_args args = {
+    .data = data, .event = event, .event_handle = event_handle,
+    .buf = buf, .buf_len = buf_len, .array = array, .array_len = array_len
+  };
+
+#ifdef RELEASE_GVL
+  /* Events are normally generated during a call, when this thread
+   * doesn't hold the GVL, so we have to take it back before calling
+   * into Ruby.  The exception is guestfs_close in ruby_guestfs_free.
+   */
+  if (guestfs_get_private (g, \"_ruby_holding_gvl\") == NULL) {
+    rb_thread_call_with_gvl (ruby_event_callback_with_gvl, &args);
+    return;
+  }
+#endif
+
+  ruby_event_callback_with_gvl (&args);
+}
+
+static void *
+ruby_event_callback_with_gvl (void *argsv)
+{
+  struct ruby_event_callback_args *args = argsv;
   size_t i;
   VALUE eventv, event_handlev, bufv, arrayv;
   VALUE argv[5];
 
-  eventv = ULL2NUM (event);
-  event_handlev = INT2NUM (event_handle);
+  eventv = ULL2NUM (args->event);
+  event_handlev = INT2NUM (args->event_handle);
 
-  bufv = rb_str_new (buf, buf_len);
+  bufv = rb_str_new (args->buf, args->buf_len);
 
-  arrayv = rb_ary_new2 (array_len);
-  for (i = 0; i < array_len; ++i)
-    rb_ary_push (arrayv, ULL2NUM (array[i]));
+  arrayv = rb_ary_new2 (args->array_len);
+  for (i = 0; i < args->array_len; ++i)
+    rb_ary_push (arrayv, ULL2NUM (args->array[i]));
 
   /* This is a crap limitation of rb_rescue.
    * http://blade.nagaokaut.ac.jp/cgi-bin/scat.rb/~poffice/mail/ruby-talk/65698
    */
-  argv[0] = * (VALUE *) data; /* function */
+  argv[0] = * (VALUE *) args->data; /* function */
   argv[1] = eventv;
   argv[2] = event_handlev;
   argv[3] = bufv;
@@ -247,6 +294,8 @@ ruby_event_callback_wrapper (guestfs_h *g,
 
   rb_rescue (ruby_event_callback_wrapper_wrapper, (VALUE) argv,
              ruby_event_callback_handle_exception, Qnil);
+
+  return NULL;
 }
 
 static VALUE
@@ -340,10 +389,97 @@ ruby_user_cancel (VALUE gv)
   return Qnil;
 }
 
+#ifdef RELEASE_GVL
+/* Called by Ruby, in another thread, if a thread which is inside a
+ * libguestfs call is interrupted (eg. by Thread#raise or Thread#kill).
+ * Cancel any file transfer so the call returns sooner.
+ */
+static void
+ruby_guestfs_unblock (void *gv)
+{
+  guestfs_user_cancel (gv);
+}
+#endif
+
+/* Run a libguestfs call, releasing the GVL if we can. */
+static void
+ruby_guestfs_call_without_gvl (void *(*fn) (void *), void *call,
+                               guestfs_h *g)
+{
+#ifdef RELEASE_GVL
+  rb_thread_call_without_gvl (fn, call, ruby_guestfs_unblock, g);
+#else
+  fn (call);
+#endif
+}
+
 ";
 
   List.iter (
     fun (name, (ret, args, optargs as style), _, flags, _, shortdesc, longdesc) ->
+      (* The arguments and result of the call, so that it can be
+       * made from ruby_guestfs_call_without_gvl.
+       *)
+      pr "struct ruby_guestfs_%s_call {\n" name;
+      pr "  guestfs_h *g;\n";
+      List.iter (
+        function
+        | Pathname n | Device n | Dev_or_Path n | String n | Key n
+        | FileIn n | FileOut n | OptString n ->
+            pr "  const char *%s;\n" n
+        | BufferIn n ->
+            pr "  const char *%s;\n" n;
+            pr "  size_t %s_size;\n" n
+        | StringList n | DeviceList n ->
+            pr "  char **%s;\n" n
+        | Bool n | Int n ->
+            pr "  int %s;\n" n
+        | Int64 n ->
+            pr "  long long %s;\n" n
+        | Pointer (t, n) ->
+            pr "  %s %s;\n" t n
+      ) args;
+      if optargs <> [] then
+        pr "  struct guestfs_%s_argv *optargs;\n" name;
+      (match ret with
+       | RErr | RInt _ | RBool _ -> pr "  int r;\n"
+       | RInt64 _ -> pr "  int64_t r;\n"
+       | RConstString _ | RConstOptString _ ->
+           pr "  const char *r;\n"
+       | RString _ -> pr "  char *r;\n"
+       | RStringList _ | RHashtable _ -> pr "  char **r;\n"
+       | RStruct (_, typ) -> pr "  struct guestfs_%s *r;\n" typ
+       | RStructList (_, typ) ->
+           pr "  struct guestfs_%s_list *r;\n" typ
+       | RBufferOut _ ->
+           pr "  char *r;\n";
+           pr "  size_t size;\n"
+      );
+      pr "};\n";
+      pr "\n";
+      pr "static void *\n";
+      pr "ruby_guestfs_%s_nogvl (void *callv)\n" name;
+      pr "{\n";
+      pr "  struct ruby_guestfs_%s_call *call = callv;\n" name;
+      pr "\n";
+      if optargs = [] then
+        pr "  call->r = guestfs_%s (call->g" name
+      else
+        pr "  call->r = guestfs_%s_argv (call->g" name;
+      List.iter (
+        function
+        | BufferIn n -> pr ", call->%s, call->%s_size" n n
+        | arg -> pr ", call->%s" (name_of_argt arg)
+      ) args;
+      (match ret with
+       | RBufferOut _ -> pr ", &call->size"
+       | _ -> ());
+      if optargs <> [] then pr ", call->optargs";
+      pr ");\n";
+      pr "  return NULL;\n";
+      pr "}\n";
+      pr "\n";
+
       (* Generate rdoc. *)
       if not (List.mem NotInDocs flags); then (
         let doc = replace_str longdesc "C<guestfs_" "C<g." in
@@ -503,12 +639,26 @@ ruby_user_cancel (VALUE gv)
       );
       pr "\n";
 
-      if optargs = [] then
-        pr "  r = guestfs_%s " name
-      else
-        pr "  r = guestfs_%s_argv " name;
-      generate_c_call_args ~handle:"g" style;
-      pr ";\n";
+      pr "  struct ruby_guestfs_%s_call call;\n" name;
+      pr "  call.g = g;\n";
+      List.iter (
+        function
+        | BufferIn n ->
+            pr "  call.%s = %s;\n" n n;
+            pr "  call.%s_size = %s_size;\n" n n
+        | arg ->
+            let n = name_of_argt arg in
+            pr "  call.%s = %s;\n" n n
+      ) args;
+      if optargs <> [] then
+        pr "  call.optargs = optargs;\n";
+      pr "  ruby_guestfs_call_without_gvl (ruby_guestfs_%s_nogvl, &call, g);\n"
+        name;
+      pr "  r = call.r;\n";
+      (match ret with
+       | RBufferOut _ -> pr "  size = call.size;\n"
+       | _ -> ());
+      pr "\n";
 
       List.iter (
         function
@@ -623,6 +773,16 @@ void Init__guestfs ()
       pr "  rb_define_method (c_guestfs, \"%s\",\n" name;
       pr "        ruby_guestfs_%s, %d);\n" name nr_args
   ) all_functions;
+  pr "\n";
+
+  (* The _async variants of these are defined in lib/guestfs.rb. *)
+  pr "  VALUE async_methods = rb_ary_new ();\n";
+  List.iter (
+    fun (name, _, _, _, _, _, _ as f) ->
+      if is_long_running f then
+        pr "  rb_ary_push (async_methods, rb_str_new2 (\"%s\"));\n" name
+  ) all_functions;
+  pr "  rb_define_const (c_guestfs, \"ASYNC_METHODS\", async_methods);\n";
 
   pr "}\n"
 
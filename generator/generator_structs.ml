@@ -191,6 +191,58 @@ let structs = [
     "app_summary", FString;
     "app_description", FString;
   ];
+
+  (* Change between two application inventories. *)
+  "application_change", [
+    "change_type", FString;
+    "change_name", FString;
+    "change_old_epoch", FInt32;
+    "change_old_version", FString;
+    "change_old_release", FString;
+    "change_new_epoch", FInt32;
+    "change_new_version", FString;
+    "change_new_release", FString;
+  ];
+
+  (* Extent of a block device. *)
+  "extent", [
+    "extent_offset", FBytes;
+    "extent_length", FBytes;
+  ];
+
+  (* LVM physical volume segment, with the PV, VG and LV it belongs to. *)
+  "lvm_pvseg", [
+    "pvseg_pv_name", FString;
+    "pvseg_pv_uuid", FUUID;
+    "pvseg_pv_size", FBytes;
+    "pvseg_vg_name", FString;
+    "pvseg_vg_uuid", FUUID;
+    "pvseg_vg_size", FBytes;
+    "pvseg_lv_name", FString;
+    "pvseg_lv_uuid", FUUID;
+    "pvseg_lv_size", FBytes;
+    "pvseg_start", FBytes;
+    "pvseg_size", FBytes;
+    "pvseg_lv_start", FBytes;
+  ];
+
+  (* Per-procedure call statistics. *)
+  "call_stats", [
+    "stats_name", FString;
+    "stats_side", FString;
+    "stats_calls", FUInt64;
+    "stats_errors", FUInt64;
+    "stats_total_us", FUInt64;
+    "stats_max_us", FUInt64;
+    "stats_hist_1ms", FUInt64;
+    "stats_hist_10ms", FUInt64;
+    "stats_hist_100ms", FUInt64;
+    "stats_hist_1s", FUInt64;
+    "stats_hist_10s", FUInt64;
+    "stats_hist_inf", FUInt64;
+    "stats_bytes_sent", FBytes;
+    "stats_bytes_received", FBytes;
+  ];
 ] (* end of structs *)
 
 (* For bindings which want camel case *)
@@ -207,6 +259,10 @@ let camel_structs = [
   "inotify_event", "INotifyEvent";
   "partition", "Partition";
   "application", "Application";
+  "application_change", "ApplicationChange";
+  "extent", "Extent";
+  "lvm_pvseg", "PVSeg";
+  "call_stats", "CallStats";
 ]
 
 let camel_name_of_struct typ =
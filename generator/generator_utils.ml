@@ -340,6 +340,12 @@ let pod2text ?width ?(trim = true) ?(discard = true) name longdesc =
 (* Compare two actions (for sorting). *)
 let action_compare (n1,_,_,_,_,_,_) (n2,_,_,_,_,_,_) = compare n1 n2
 
+(* Calls which can take a long time. *)
+let is_long_running (name, (_, args, _), _, flags, _, _, _) =
+  List.mem Progress flags ||
+  List.exists (function FileIn _ | FileOut _ -> true | _ -> false) args ||
+  List.mem name [ "inspect_os" ]
+
 let chars c n =
   let str = String.create n in
   for i = 0 to n-1 do
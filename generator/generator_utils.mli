@@ -123,6 +123,11 @@ val pod2text : ?width:int -> ?trim:bool -> ?discard:bool -> string -> string ->
 val action_compare : Generator_types.action -> Generator_types.action -> int
   (** Compare the names of two actions, for sorting. *)
 
+val is_long_running : Generator_types.action -> bool
+(** Returns true if the action can take a long time (it sends
+    progress messages, transfers files, or is [inspect_os]).  The
+    language bindings generate asynchronous variants of these. *)
+
 val chars : char -> int -> string
 (** [chars c n] creates a string containing character c repeated n times. *)
 
@@ -202,8 +202,16 @@ struct guestfs_message_header {
 
 const GUESTFS_MAX_CHUNK_SIZE = 8192;
 
+/* If the 'cancel' field of a chunk is GUESTFS_CHUNK_DEFLATE then the
+ * transfer is not cancelled, but 'data' holds a zlib-compressed
+ * block which inflates to at most GUESTFS_MAX_CHUNK_SIZE bytes.  The
+ * daemon only sends these after the library has enabled them by
+ * calling internal_transfer_compression.
+ */
+const GUESTFS_CHUNK_DEFLATE = 2;
+
 struct guestfs_chunk {
-  int cancel;			     /* if non-zero, transfer is cancelled */
+  int cancel;			     /* if 1, transfer is cancelled */
   /* data size is 0 bytes if the transfer has finished successfully */
   opaque data<GUESTFS_MAX_CHUNK_SIZE>;
 };
@@ -0,0 +1,41 @@
+# libguestfs Python bindings
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+import os
+import guestfs
+
+g = guestfs.GuestFS()
+f = open ("test.img", "w")
+f.truncate (100 * 1024 * 1024)
+f.close ()
+g.add_drive ("test.img")
+
+a = g.launch_async ()
+a.wait ()
+if not a.done ():
+    raise Exception ("launch_async: call has not finished after wait()")
+
+a = g.download_async ("/nosuchfile", "/dev/null")
+try:
+    a.wait ()
+    raise Exception ("download_async: expected an error")
+except RuntimeError:
+    pass
+
+g.close ()
+
+os.unlink ("test.img")
@@ -30,14 +30,34 @@ external progress_bar_reset : progress_bar -> unit
 external progress_bar_set : progress_bar -> int64 -> int64 -> unit
   = "virt_resize_progress_bar_set"
 
+(* When several calls are being aggregated into one progress bar
+ * (see aggregate_progress below), agg_total is the total for all of
+ * them, agg_base is the amount completed by earlier calls, and
+ * agg_last is the total reported by the current call.
+ *)
+let agg_total = ref 0L
+let agg_base = ref 0L
+let agg_last = ref 0L
+
+let bar = ref None
+
 let set_up_progress_bar ?(machine_readable = false) (g : Guestfs.guestfs) =
   (* Initialize the C mini library. *)
-  let bar = progress_bar_init ~machine_readable in
+  let b = progress_bar_init ~machine_readable in
+  bar := Some b;
 
-  (* Reset the progress bar before every libguestfs function. *)
+  (* Reset the progress bar before every libguestfs function, unless
+   * we are aggregating.
+   *)
   let enter_callback g event evh buf array =
-    if event = G.EVENT_ENTER then
-      progress_bar_reset bar
+    if event = G.EVENT_ENTER then (
+      if !agg_total = 0L then
+        progress_bar_reset b
+      else (
+        agg_base := Int64.add !agg_base !agg_last;
+        agg_last := 0L
+      )
+    )
   in
 
   (* A progress event: move the progress bar. *)
@@ -46,9 +66,24 @@ let set_up_progress_bar ?(machine_readable = false) (g : Guestfs.guestfs) =
       let position = array.(2)
       and total = array.(3) in
 
-      progress_bar_set bar position total
+      if !agg_total = 0L then
+        progress_bar_set b position total
+      else (
+        agg_last := total;
+        let position = min (Int64.add !agg_base position) !agg_total in
+        progress_bar_set b position !agg_total
+      )
     )
   in
 
   ignore (g#set_event_callback enter_callback [G.EVENT_ENTER]);
   ignore (g#set_event_callback progress_callback [G.EVENT_PROGRESS])
+
+let aggregate_progress total f =
+  (match !bar with Some b -> progress_bar_reset b | None -> ());
+  agg_total := total;
+  agg_base := 0L;
+  agg_last := 0L;
+  let r = try f () with exn -> agg_total := 0L; raise exn in
+  agg_total := 0L;
+  r
@@ -17,3 +17,8 @@
  *)
 
 val set_up_progress_bar : ?machine_readable:bool -> Guestfs.guestfs -> unit
+
+val aggregate_progress : int64 -> (unit -> 'a) -> 'a
+(** [aggregate_progress total f] runs [f ()], showing the progress
+    of all the libguestfs calls it makes as a single progress bar
+    for [total] bytes. *)
@@ -34,7 +34,7 @@ let infile, outfile, align_first, alignment, copy_boot_loader,
   debug, debug_gc, deletes,
   dryrun, expand, expand_content, extra_partition, format, ignores,
   lv_expands, machine_readable, ntfsresize_force, output_format,
-  quiet, resizes, resizes_force, shrink =
+  quiet, resizes, resizes_force, shrink, sparse =
   let display_version () =
     let g = new G.guestfs () in
     let version = g#version () in
@@ -70,6 +70,7 @@ let infile, outfile, align_first, alignment, copy_boot_loader,
   let resizes = ref [] in
   let resizes_force = ref [] in
   let shrink = ref "" in
+  let sparse = ref false in
   let set_shrink s =
     if s = "" then error "empty --shrink option"
     else if !shrink <> "" then error "--shrink option given twice"
@@ -104,6 +105,8 @@ let infile, outfile, align_first, alignment, copy_boot_loader,
     "--resize",  Arg.String (add resizes),  "part=size Resize partition";
     "--resize-force", Arg.String (add resizes_force), "part=size Forcefully resize partition";
     "--shrink",  Arg.String set_shrink,     "part Shrink partition";
+    "--sparse",  Arg.Set sparse,            " Don't copy free space (output must be blank)";
+    "--no-sparse", Arg.Clear sparse,        " Copy free space in filesystems (default)";
     "-V",        Arg.Unit display_version,  " Display version and exit";
     "--version", Arg.Unit display_version,  " -\"-";
   ] in
@@ -145,6 +148,7 @@ read the man page virt-resize(1).
   let resizes = List.rev !resizes in
   let resizes_force = List.rev !resizes_force in
   let shrink = match !shrink with "" -> None | str -> Some str in
+  let sparse = !sparse in
 
   if alignment < 1 then
     error "alignment cannot be < 1";
@@ -170,6 +174,7 @@ read the man page virt-resize(1).
     printf "128-sector-alignment\n";
     printf "alignment\n";
     printf "align-first\n";
+    printf "sparse\n";
     let g = new G.guestfs () in
     g#add_drive_opts "/dev/null";
     g#launch ();
@@ -191,16 +196,23 @@ read the man page virt-resize(1).
   debug, debug_gc, deletes,
   dryrun, expand, expand_content, extra_partition, format, ignores,
   lv_expands, machine_readable, ntfsresize_force, output_format,
-  quiet, resizes, resizes_force, shrink
+  quiet, resizes, resizes_force, shrink, sparse
 
 (* Default to true, since NTFS and btrfs support are usually available. *)
 let ntfs_available = ref true
 let btrfs_available = ref true
 
+(* Number of appliance CPUs, which is also the number of partitions
+ * which are copied in parallel.  Copying is mostly I/O bound, so
+ * there is little point having more than a few.
+ *)
+let max_smp = 4
+
 (* Add in and out disks to the handle and launch. *)
 let connect_both_disks () =
   let g = new G.guestfs () in
   if debug then g#set_trace true;
+  g#set_smp (min max_smp (host_cpus ()));
   g#add_drive_opts ?format ~readonly:true infile;
   g#add_drive_opts ?format:output_format ~readonly:false outfile;
   if not quiet then Progress.set_up_progress_bar ~machine_readable g;
@@ -989,44 +1001,147 @@ let () =
       g#part_add "/dev/sdb" "primary" p.p_target_start p.p_target_end
   ) partitions
 
+(* Filesystems which guestfs_filesystem_used_extents understands, so
+ * that only the used parts need to be copied.
+ *)
+let sparse_filesystems = [ "ext2"; "ext3"; "ext4"; "xfs"; "ntfs" ]
+
+(* Number of bytes in the first 'size' bytes of the device which
+ * are covered by the extents.
+ *)
+let used_bytes extents size =
+  Array.fold_left (
+    fun total { G.extent_offset = offset; extent_length = len } ->
+      if offset >= size then total
+      else total +^ min len (size -^ offset)
+  ) 0L extents
+
 (* Copy over the data. *)
 let () =
-  List.iter (
-    fun p ->
-      match p.p_operation with
-      | OpCopy | OpResize _ ->
-        (* XXX Old code had 'when target_partnum > 0', but it appears
-         * to have served no purpose since the field could never be 0
-         * at this point.
-         *)
+  let copies =
+    List.filter (
+      fun p ->
+        match p.p_operation with
+        | OpCopy | OpResize _ -> true
+        | OpIgnore | OpDelete -> false
+    ) partitions in
+
+  let copysize p =
+    let oldsize = p.p_part.G.part_size in
+    let newsize =
+      match p.p_operation with OpResize s -> s | _ -> oldsize in
+    if newsize < oldsize then newsize else oldsize
+  in
+  let target p = sprintf "/dev/sdb%d" p.p_target_partnum in
+
+  (* Free space which a sparse copy will skip, if known. *)
+  let skipped p =
+    let known =
+      match p.p_type with
+      | ContentFS (fs, _) -> List.mem fs sparse_filesystems
+      | ContentUnknown | ContentPV _ | ContentExtendedPartition -> false in
+    if known then (
+      try
+        let extents = g#filesystem_used_extents p.p_name in
+        Some (copysize p -^ used_bytes extents (copysize p))
+      with G.Error msg ->
+        if debug then
+          eprintf "%s: filesystem_used_extents failed: %s\n%!" p.p_name msg;
+        None
+    )
+    else None
+  in
+  let print_skipped p = function
+    | Some skipped when not quiet ->
+      printf "Skipped %s of free space in %s\n%!" (human_size skipped) p.p_name
+    | _ -> ()
+  in
 
-        let oldsize = p.p_part.G.part_size in
-        let newsize =
-          match p.p_operation with OpResize s -> s | _ -> oldsize in
+  let copy_one p =
+    let source = p.p_name in
+    let target = target p in
+    let copysize = copysize p in
 
-        let copysize = if newsize < oldsize then newsize else oldsize in
+    if not quiet then
+      printf "Copying %s ...\n%!" source;
 
-        let source = p.p_name in
-        let target = sprintf "/dev/sdb%d" p.p_target_partnum in
+    match p.p_type with
+    | ContentFS _ | ContentUnknown | ContentPV _ ->
+      (* Sparse copies rely on the target being blank, and are only
+       * done for filesystems whose used extents are known.  Blocks of
+       * zeroes in PVs or unknown content may be live data.  If the
+       * sparse copy fails, copy everything.
+       *)
+      (match if sparse then skipped p else None with
+       | Some _ as skipped ->
+         (try
+            g#copy_device_to_device ~size:copysize ~sparse:true source target;
+            print_skipped p skipped
+          with G.Error msg ->
+            if debug then
+              eprintf "%s: sparse copy failed, copying everything: %s\n%!"
+                source msg;
+            g#copy_device_to_device ~size:copysize source target
+         )
+       | None ->
+         g#copy_device_to_device ~size:copysize source target
+      )
 
-        if not quiet then
-          printf "Copying %s ...\n%!" source;
-
-        (match p.p_type with
-         | ContentUnknown | ContentPV _ | ContentFS _ ->
-           g#copy_device_to_device ~size:copysize source target
-
-         | ContentExtendedPartition ->
-           (* You can't just copy an extended partition by name, eg.
-            * source = "/dev/sda2", because the device name only covers
-            * the first 1K of the partition.  Instead, copy the
-            * source bytes from the parent disk (/dev/sda).
-            *)
-           let srcoffset = p.p_part.G.part_start in
-           g#copy_device_to_device ~srcoffset ~size:copysize "/dev/sda" target
-        )
-      | _ -> ()
-  ) partitions
+    | ContentExtendedPartition ->
+      (* You can't just copy an extended partition by name, eg.
+       * source = "/dev/sda2", because the device name only covers
+       * the first 1K of the partition.  Instead, copy the
+       * source bytes from the parent disk (/dev/sda).
+       *)
+      let srcoffset = p.p_part.G.part_start in
+      g#copy_device_to_device ~srcoffset ~size:copysize "/dev/sda" target
+  in
+
+  (* Partitions are disjoint, so several can be copied at the same
+   * time by copy_devices_to_devices, which uses a worker per
+   * appliance CPU.  Extended partitions have to be copied from the
+   * parent disk, so are always done on their own.  If the parallel
+   * copy fails, fall back to copying one at a time.
+   *)
+  let parallel, serial =
+    List.partition (
+      fun p -> p.p_type <> ContentExtendedPartition
+    ) copies in
+  let parallel, serial =
+    if g#get_smp () > 1 && List.length parallel > 1 then parallel, serial
+    else [], copies in
+
+  let total = List.fold_left (fun total p -> total +^ copysize p) 0L copies in
+  Progress.aggregate_progress total (
+    fun () ->
+      let serial =
+        if parallel = [] then serial
+        else (
+          let skipped =
+            List.map (fun p -> if sparse then skipped p else None) parallel in
+          (* copy_devices_to_devices takes a single sparse flag, so
+           * only use it if every partition is a filesystem whose used
+           * extents are known.
+           *)
+          let sparse =
+            sparse && List.for_all (fun s -> s <> None) skipped in
+          if not quiet then
+            printf "Copying %s ...\n%!"
+              (String.concat ", " (List.map (fun p -> p.p_name) parallel));
+          try
+            let srcs = Array.of_list (List.map (fun p -> p.p_name) parallel) in
+            let dests = Array.of_list (List.map target parallel) in
+            g#copy_devices_to_devices ~sparse srcs dests;
+            if sparse then List.iter2 print_skipped parallel skipped;
+            serial
+          with G.Error msg ->
+            if debug then
+              eprintf "parallel copy failed, copying one at a time: %s\n%!"
+                msg;
+            copies
+        ) in
+      List.iter copy_one serial
+  )
 
 (* Set bootable and MBR IDs.  Do this *after* copying over the data,
  * so that we can magically change the primary partition to an extended
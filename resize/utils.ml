@@ -100,6 +100,24 @@ let feature_available (g : Guestfs.guestfs) names =
   try g#available names; true
   with G.Error _ -> false
 
+(* Number of CPUs on the host, from /proc/cpuinfo.  Returns 1 if
+ * this cannot be determined.
+ *)
+let host_cpus () =
+  try
+    let chan = open_in "/proc/cpuinfo" in
+    let n = ref 0 in
+    (try
+       while true do
+         let line = input_line chan in
+         if String.length line >= 9 && String.sub line 0 9 = "processor" then
+           incr n
+       done
+     with End_of_file -> ());
+    close_in chan;
+    max 1 !n
+  with Sys_error _ -> 1
+
 (* Parse the size field from --resize and --resize-force options. *)
 let parse_size =
   let const_re = Str.regexp "^\\([.0-9]+\\)\\([bKMG]\\)$"
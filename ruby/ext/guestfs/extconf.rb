@@ -29,5 +29,9 @@ unless have_library("guestfs", "guestfs_create", "guestfs.h")
   raise "libguestfs not found"
 end
 
+# Used to release the GVL during calls (Ruby >= 2.0).
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("rb_thread_call_with_gvl", "ruby/thread.h")
+
 create_header
 create_makefile(extension_name)
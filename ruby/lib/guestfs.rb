@@ -16,3 +16,23 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
 require '_guestfs'
+
+module Guestfs
+  class Guestfs
+    # For each long-running call, such as +launch+, +inspect_os+ or
+    # +download+, there is a variant with the suffix +_async+ which
+    # makes the call in a new thread and returns the Thread
+    # immediately.  Thread#value waits for the call to finish and
+    # returns its result, or raises its exception.
+    #
+    # Calls don't hold the interpreter lock while they run, so other
+    # threads (eg. an event loop) keep running in the meantime.  Don't
+    # use the handle for anything else until the call has finished,
+    # unless you have called set_thread_safe.
+    ASYNC_METHODS.each do |name|
+      define_method("#{name}_async") do |*args|
+        Thread.new { send(name, *args) }
+      end
+    end
+  end
+end
@@ -0,0 +1,56 @@
+# libguestfs Ruby bindings -*- ruby -*-
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+require 'test/unit'
+$:.unshift(File::join(File::dirname(__FILE__), "..", "lib"))
+$:.unshift(File::join(File::dirname(__FILE__), "..", "ext", "guestfs"))
+require 'guestfs'
+
+class TestLoad < Test::Unit::TestCase
+  def test_async
+    g = Guestfs::create()
+
+    File.open("test.img", "w") {
+      |f| f.seek(100*1024*1024); f.write("\0")
+    }
+
+    g.add_drive("test.img")
+
+    # Other threads must keep running while the appliance launches.
+    ticks = 0
+    t = g.launch_async()
+    while t.alive?
+      ticks += 1
+      sleep(0.01)
+    end
+    t.value
+    if ticks == 0
+      raise "main thread did not run during launch"
+    end
+
+    # Errors are raised by Thread#value.
+    t = g.download_async("/nosuchfile", "/dev/null")
+    begin
+      t.value
+      raise "download_async should have failed"
+    rescue Guestfs::Error
+    end
+
+    g.close()
+    File.unlink("test.img")
+  end
+end
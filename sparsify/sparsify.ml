@@ -29,7 +29,7 @@ let () = Random.self_init ()
 let prog = Filename.basename Sys.executable_name
 
 let indisk, outdisk, compress, convert, debug_gc,
-  format, ignores, machine_readable,
+  format, ignores, in_place, machine_readable,
   option, quiet, verbose, trace =
   let display_version () =
     let g = new G.guestfs () in
@@ -46,6 +46,7 @@ let indisk, outdisk, compress, convert, debug_gc,
   let debug_gc = ref false in
   let format = ref "" in
   let ignores = ref [] in
+  let in_place = ref false in
   let machine_readable = ref false in
   let option = ref "" in
   let quiet = ref false in
@@ -58,6 +59,7 @@ let indisk, outdisk, compress, convert, debug_gc,
     "--debug-gc", Arg.Set debug_gc,         " Debug GC and memory allocations";
     "--format",  Arg.Set_string format,     "format Format of input disk";
     "--ignore",  Arg.String (add ignores),  "fs Ignore filesystem";
+    "--in-place", Arg.Set in_place,         " Sparsify the disk in place";
     "--machine-readable", Arg.Set machine_readable, " Make output machine readable";
     "-o",        Arg.Set_string option,     "option Add qemu-img options";
     "-q",        Arg.Set quiet,             " Quiet output";
@@ -75,6 +77,7 @@ let indisk, outdisk, compress, convert, debug_gc,
 %s: sparsify a virtual machine disk
 
  virt-sparsify [--options] indisk outdisk
+ virt-sparsify [--options] --in-place disk
 
 A short summary of the options is given below.  For detailed help please
 read the man page virt-sparsify(1).
@@ -88,6 +91,7 @@ read the man page virt-sparsify(1).
   let debug_gc = !debug_gc in
   let format = match !format with "" -> None | str -> Some str in
   let ignores = List.rev !ignores in
+  let in_place = !in_place in
   let machine_readable = !machine_readable in
   let option = match !option with "" -> None | str -> Some str in
   let quiet = !quiet in
@@ -109,12 +113,19 @@ read the man page virt-sparsify(1).
     exit 0
   );
 
-  (* Verify we got exactly 2 disks. *)
+  (* Verify we got exactly 2 disks, or 1 disk for --in-place. *)
   let indisk, outdisk =
-    match List.rev !disks with
-    | [indisk; outdisk] -> indisk, outdisk
-    | _ ->
-        error "usage is: %s [--options] indisk outdisk" prog in
+    match in_place, List.rev !disks with
+    | false, [indisk; outdisk] -> indisk, outdisk
+    | true, [disk] -> disk, disk
+    | false, _ ->
+        error "usage is: %s [--options] indisk outdisk" prog
+    | true, _ ->
+        error "usage is: %s [--options] --in-place disk" prog in
+
+  (* These options only apply to the output of qemu-img convert. *)
+  if in_place && (compress || convert <> None || option <> None) then
+    error "--in-place cannot be used with --compress, --convert or -o";
 
   (* The input disk must be an absolute path, so we can store the name
    * in the overlay disk.
@@ -133,34 +144,38 @@ read the man page virt-sparsify(1).
     error "input filename '%s' contains a comma; qemu-img command line syntax prevents us from using such an image" indisk;
 
   indisk, outdisk, compress, convert,
-    debug_gc, format, ignores, machine_readable,
+    debug_gc, format, ignores, in_place, machine_readable,
     option, quiet, verbose, trace
 
-let () =
-  if not quiet then
-    printf "Create overlay file to protect source disk ...\n%!"
-
-(* Create the temporary overlay file. *)
+(* Create the temporary overlay file.  This is not needed in
+ * --in-place mode, where the source disk is modified directly.
+ *)
 let overlaydisk =
-  let tmp = Filename.temp_file "sparsify" ".qcow2" in
-
-  (* Unlink on exit. *)
-  at_exit (fun () -> try unlink tmp with _ -> ());
-
-  (* Create it with the indisk as the backing file. *)
-  let cmd =
-    sprintf "qemu-img create -f qcow2 -o backing_file=%s%s %s > /dev/null"
-      (Filename.quote indisk)
-      (match format with
-      | None -> ""
-      | Some fmt -> sprintf ",backing_fmt=%s" (Filename.quote fmt))
-      (Filename.quote tmp) in
-  if verbose then
-    printf "%s\n%!" cmd;
-  if Sys.command cmd <> 0 then
-    error "external command failed: %s" cmd;
-
-  tmp
+  if in_place then None
+  else (
+    if not quiet then
+      printf "Create overlay file to protect source disk ...\n%!";
+
+    let tmp = Filename.temp_file "sparsify" ".qcow2" in
+
+    (* Unlink on exit. *)
+    at_exit (fun () -> try unlink tmp with _ -> ());
+
+    (* Create it with the indisk as the backing file. *)
+    let cmd =
+      sprintf "qemu-img create -f qcow2 -o backing_file=%s%s %s > /dev/null"
+        (Filename.quote indisk)
+        (match format with
+        | None -> ""
+        | Some fmt -> sprintf ",backing_fmt=%s" (Filename.quote fmt))
+        (Filename.quote tmp) in
+    if verbose then
+      printf "%s\n%!" cmd;
+    if Sys.command cmd <> 0 then
+      error "external command failed: %s" cmd;
+
+    Some tmp
+  )
 
 let () =
   if not quiet then
@@ -172,8 +187,18 @@ let g =
   if trace then g#set_trace true;
   if verbose then g#set_verbose true;
 
-  (* Note that the temporary overlay disk is always qcow2 format. *)
-  g#add_drive_opts ~format:"qcow2" ~readonly:false overlaydisk;
+  (match overlaydisk with
+  | Some overlaydisk ->
+    (* Note that the temporary overlay disk is always qcow2 format. *)
+    g#add_drive_opts ~format:"qcow2" ~readonly:false overlaydisk
+  | None ->
+    (* In place: free space is trimmed, and qemu turns the discard
+     * requests into holes in the disk image.  virtio-blk cannot pass
+     * discard requests through, so use IDE.
+     *)
+    g#add_drive_opts ?format ~readonly:false ~iface:"ide" ~discard:"enable"
+      indisk
+  );
 
   if not quiet then Progress.set_up_progress_bar ~machine_readable g;
   g#launch ();
@@ -201,7 +226,16 @@ let () =
           try g#mount_options "" fs "/"; true
           with _ -> false in
 
-        if mounted then (
+        if mounted && in_place then (
+          if not quiet then
+            printf "Trim free space in %s ...\n%!" fs;
+
+          (* Not all filesystems support trimming, so just warn. *)
+          try g#fstrim "/"
+          with G.Error msg ->
+            eprintf "%s: %s: %s (ignored)\n%!" prog fs msg
+        )
+        else if mounted then (
           if not quiet then
             printf "Fill free space in %s with zero ...\n%!" fs;
 
@@ -224,41 +258,61 @@ let () =
       )
   ) filesystems
 
-(* Fill unused space in volume groups. *)
+(* Fill unused space in volume groups.  This is not done in --in-place
+ * mode, since it would write zeroes to the real disk.
+ *)
 let () =
-  let vgs = g#vgs () in
-  let vgs = Array.to_list vgs in
-  let vgs = List.sort compare vgs in
-  List.iter (
-    fun vg ->
-      if not (List.mem vg ignores) then (
-        let lvname = string_random8 () in
-        let lvdev = "/dev/" ^ vg ^ "/" ^ lvname in
-
-        let created =
-          try g#lvcreate lvname vg 32; true
-          with _ -> false in
-
-        if created then (
-          if not quiet then
-            printf "Fill free space in volgroup %s with zero ...\n%!" vg;
-
-          (* XXX Don't have lvcreate -l 100%FREE.  Fake it. *)
-          g#lvresize_free lvdev 100;
-
-          (* This command is expected to fail. *)
-          (try g#dd "/dev/zero" lvdev with _ -> ());
-
-           g#sync ();
-           g#lvremove lvdev
+  if not in_place then (
+    let vgs = g#vgs () in
+    let vgs = Array.to_list vgs in
+    let vgs = List.sort compare vgs in
+    List.iter (
+      fun vg ->
+        if not (List.mem vg ignores) then (
+          let lvname = string_random8 () in
+          let lvdev = "/dev/" ^ vg ^ "/" ^ lvname in
+
+          let created =
+            try g#lvcreate lvname vg 32; true
+            with _ -> false in
+
+          if created then (
+            if not quiet then
+              printf "Fill free space in volgroup %s with zero ...\n%!" vg;
+
+            (* XXX Don't have lvcreate -l 100%FREE.  Fake it. *)
+            g#lvresize_free lvdev 100;
+
+            (* This command is expected to fail. *)
+            (try g#dd "/dev/zero" lvdev with _ -> ());
+
+             g#sync ();
+             g#lvremove lvdev
+          )
         )
-      )
-  ) vgs
+    ) vgs
+  )
 
-(* Don't need libguestfs now. *)
+(* Don't need libguestfs now.  In --in-place mode, this also waits
+ * for qemu to flush the disk.
+ *)
 let () =
   g#close ()
 
+(* In --in-place mode we are done. *)
+let () =
+  if in_place then (
+    if not quiet then (
+      print_newline ();
+      wrap "Sparsify in-place operation completed with no errors.\n";
+    );
+
+    if debug_gc then
+      Gc.compact ();
+
+    exit 0
+  )
+
 (* What should the output format be?  If the user specified an
  * input format, use that, else detect it from the source image.
  *)
@@ -41,6 +41,13 @@
 #include "guestfs-internal-actions.h"
 #include "guestfs_protocol.h"
 
+/* The lock on the checksum file (see below) is an fcntl lock, which
+ * is held by the process, not the thread.  Closing any descriptor of
+ * the file drops it.  Threads in one process which launch handles at
+ * the same time are serialized by this mutex instead.
+ */
+gl_lock_define_initialized (static, appliance_lock);
+
 /* Old-style appliance is going to be obsoleted. */
 static const char *kernel_name = "vmlinuz." host_cpu;
 static const char *initrd_name = "initramfs." host_cpu ".img";
@@ -110,7 +117,10 @@ static void print_febootstrap_command_line (guestfs_h *g, const char *argv[]);
  *   $TMPDIR/.guestfs-$UID/initrd.$PID
  *   $TMPDIR/.guestfs-$UID/root.$PID
  *
- * A lock is taken on "checksum" while we perform the link.
+ * A lock is taken on "checksum" while we perform the link.  The link
+ * is made under a temporary name and renamed into place, so another
+ * thread of the same process which is starting qemu on the previous
+ * link never sees the name missing.
  *
  * Linked files are deleted by a garbage collection sweep which can be
  * initiated by any libguestfs process with the same UID when the
@@ -142,10 +152,13 @@ guestfs___build_appliance (guestfs_h *g,
     /* Step (2): calculate checksum. */
     char *checksum = calculate_supermin_checksum (g, supermin_path);
     if (checksum) {
+      gl_lock_lock (appliance_lock);
+
       /* Step (3): cached appliance exists? */
       r = check_for_cached_appliance (g, supermin_path, checksum, uid,
                                       kernel, initrd, appliance);
       if (r != 0) {
+        gl_lock_unlock (appliance_lock);
         free (supermin_path);
         free (checksum);
         return r == 1 ? 0 : -1;
@@ -154,6 +167,7 @@ guestfs___build_appliance (guestfs_h *g,
       /* Step (4): build supermin appliance. */
       r = build_supermin_appliance (g, supermin_path, checksum, uid,
                                     kernel, initrd, appliance);
+      gl_lock_unlock (appliance_lock);
       free (supermin_path);
       free (checksum);
       return r;
@@ -568,7 +582,36 @@ build_supermin_appliance (guestfs_h *g,
   return 0;
 }
 
-/* NB: lock on checksum file must be held when this is called. */
+/* Make 'linkname' a hard link to 'filename', replacing any previous
+ * link atomically.  NB: appliance_lock must be held, since the
+ * temporary name is only unique to the process.
+ */
+static int
+replace_link (guestfs_h *g, const char *filename, const char *linkname)
+{
+  size_t len = strlen (linkname) + 5;
+  char tmpname[len];
+  snprintf (tmpname, len, "%s.tmp", linkname);
+
+  (void) unlink (tmpname);
+  if (link (filename, tmpname) == -1) {
+    perrorf (g, "link: %s %s", filename, tmpname);
+    return -1;
+  }
+  if (rename (tmpname, linkname) == -1) {
+    perrorf (g, "rename: %s %s", tmpname, linkname);
+    (void) unlink (tmpname);
+    return -1;
+  }
+  /* If linkname was already a link to filename, rename does nothing. */
+  (void) unlink (tmpname);
+
+  return 0;
+}
+
+/* NB: lock on checksum file and appliance_lock must be held when this
+ * is called.
+ */
 static int
 hard_link_to_cached_appliance (guestfs_h *g,
                                const char *cachedir,
@@ -586,27 +629,18 @@ hard_link_to_cached_appliance (guestfs_h *g,
 
   char filename[len];
   snprintf (filename, len, "%s/kernel", cachedir);
-  (void) unlink (*kernel);
-  if (link (filename, *kernel) == -1) {
-    perrorf (g, "link: %s %s", filename, *kernel);
+  if (replace_link (g, filename, *kernel) == -1)
     goto error;
-  }
   (void) lutimes (filename, NULL); /* lutimes because it's a symlink */
 
   snprintf (filename, len, "%s/initrd", cachedir);
-  (void) unlink (*initrd);
-  if (link (filename, *initrd) == -1) {
-    perrorf (g, "link: %s %s", filename, *initrd);
+  if (replace_link (g, filename, *initrd) == -1)
     goto error;
-  }
   (void) utime (filename, NULL);
 
   snprintf (filename, len, "%s/root", cachedir);
-  (void) unlink (*appliance);
-  if (link (filename, *appliance) == -1) {
-    perrorf (g, "link: %s %s", filename, *appliance);
+  if (replace_link (g, filename, *appliance) == -1)
     goto error;
-  }
   (void) utime (filename, NULL);
 
   return 0;
@@ -0,0 +1,606 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "guestfs.h"
+#include "guestfs-internal.h"
+#include "guestfs-internal-actions.h"
+#include "guestfs_protocol.h"
+
+/* Parallel uploads and downloads over extra virtio-serial data
+ * channels (see guestfs_set_data_channels).
+ *
+ * A large file is split into one range per channel.  Each range is
+ * started with a short RPC on the main channel
+ * (guestfs_internal_data_channel_download or _upload), which makes
+ * the daemon fork a process to stream that range over its data
+ * channel.  The library then services all the data channels at once
+ * and finally calls guestfs_internal_data_channel_wait for each one.
+ *
+ * Downloads are framed by the daemon as [length][data] ... [0], or
+ * [DATA_CHANNEL_ERROR][errno] on error.  Uploads are sent raw (the
+ * daemon knows the length of the range) and the daemon replies with
+ * a single errno, 0 meaning success.  All integers are 32 bit big
+ * endian.  See also daemon/upload.c.
+ */
+
+#define DATA_CHANNEL_ERROR 0xffffffff
+
+/* Files smaller than this are sent over the main channel, since the
+ * extra round trips would cost more than they gain.
+ */
+#define MIN_PARALLEL_SIZE (16 * 1024 * 1024)
+
+/* Ranges are aligned to this, to keep reads and writes in the
+ * appliance aligned to filesystem blocks.
+ */
+#define RANGE_ALIGN (1024 * 1024)
+
+#define DATA_BUFSIZ (128 * 1024)
+
+enum range_state { RANGE_DATA, RANGE_STATUS, RANGE_DONE };
+
+struct range {
+  int sock;                     /* Data channel socket. */
+  int channel;                  /* Data channel number (from 1). */
+  uint64_t offset;              /* Next byte of the file to transfer. */
+  uint64_t remaining;           /* Bytes of the range not yet read. */
+  enum range_state state;
+  unsigned char hdr[8];         /* Frame header or status. */
+  size_t hdr_len;
+  uint32_t frame;               /* Bytes left in the current frame. */
+  char *buf;                    /* Upload buffer. */
+  size_t buf_pos, buf_len;
+  int err;                      /* errno reported by the daemon. */
+  int failed;                   /* Channel failed, range must be cancelled. */
+};
+
+static uint32_t
+get_u32 (const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int
+guestfs___listen_data_channels (guestfs_h *g)
+{
+  size_t i;
+  int sock;
+  struct sockaddr_un addr;
+
+  g->nr_data_socks = 0;
+
+  for (i = 1; i <= (size_t) g->data_channels; ++i) {
+    addr.sun_family = AF_UNIX;
+    if (snprintf (addr.sun_path, UNIX_PATH_MAX, "%s/data%zu.sock",
+                  g->tmpdir, i) >= UNIX_PATH_MAX) {
+      error (g, _("data channel socket path is too long"));
+      return -1;
+    }
+    unlink (addr.sun_path);
+
+    sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+      perrorf (g, "socket");
+      return -1;
+    }
+    g->data_sock[g->nr_data_socks++] = sock;
+
+    if (fcntl (sock, F_SETFL, O_NONBLOCK) == -1) {
+      perrorf (g, "fcntl");
+      return -1;
+    }
+
+    if (bind (sock, &addr, sizeof addr) == -1) {
+      perrorf (g, "bind");
+      return -1;
+    }
+
+    if (listen (sock, 1) == -1) {
+      perrorf (g, "listen");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Replace each listening socket with the connection from qemu. */
+int
+guestfs___accept_data_channels (guestfs_h *g)
+{
+  size_t i;
+  int sock;
+
+  for (i = 0; i < g->nr_data_socks; ++i) {
+    sock = accept (g->data_sock[i], NULL, NULL);
+    if (sock == -1) {
+      perrorf (g, "accept: data channel %zu", i+1);
+      return -1;
+    }
+    close (g->data_sock[i]);
+    g->data_sock[i] = sock;
+
+    if (fcntl (sock, F_SETFL, O_NONBLOCK) == -1) {
+      perrorf (g, "fcntl");
+      return -1;
+    }
+  }
+
+  if (g->nr_data_socks > 0)
+    debug (g, "connected %zu data channel(s)", g->nr_data_socks);
+
+  return 0;
+}
+
+void
+guestfs___close_data_channels (guestfs_h *g)
+{
+  size_t i;
+
+  for (i = 0; i < g->nr_data_socks; ++i)
+    close (g->data_sock[i]);
+  g->nr_data_socks = 0;
+}
+
+static int64_t
+remote_size (guestfs_h *g, const char *remotefilename)
+{
+  if (STRPREFIX (remotefilename, "/dev/"))
+    return guestfs_blockdev_getsize64 (g, remotefilename);
+  else
+    return guestfs_filesize (g, remotefilename);
+}
+
+/* Split size bytes into one range per data channel.  Returns the
+ * number of ranges, which may be less than the number of channels.
+ */
+static size_t
+split_ranges (guestfs_h *g, uint64_t size, struct range *ranges)
+{
+  size_t i, n = g->nr_data_socks;
+  uint64_t per, offset = 0;
+
+  per = (size + n - 1) / n;
+  per = (per + RANGE_ALIGN - 1) & ~((uint64_t) RANGE_ALIGN - 1);
+
+  for (i = 0; i < n && offset < size; ++i) {
+    memset (&ranges[i], 0, sizeof ranges[i]);
+    ranges[i].sock = g->data_sock[i];
+    ranges[i].channel = i+1;
+    ranges[i].offset = offset;
+    ranges[i].remaining = size - offset < per ? size - offset : per;
+    offset += ranges[i].remaining;
+  }
+
+  return i;
+}
+
+/* Progress events for parallel transfers are generated by the
+ * library, since each daemon call only starts a range.  They are
+ * sent about once per percent, with proc and serial set to 0.
+ */
+static void
+send_progress (guestfs_h *g, uint64_t position, uint64_t total,
+               uint64_t *last)
+{
+  uint64_t array[4];
+
+  if (position < total && position - *last < total / 100)
+    return;
+  *last = position;
+
+  array[0] = 0;
+  array[1] = 0;
+  array[2] = position;
+  array[3] = total;
+  guestfs___call_callbacks_array (g, GUESTFS_EVENT_PROGRESS,
+                                  array, sizeof array / sizeof array[0]);
+}
+
+/* Read from a download channel.  Returns the number of data bytes
+ * received, or -1 if the channel failed.
+ */
+static ssize_t
+receive_range (guestfs_h *g, int fd, struct range *rg, char *buf,
+               int *write_err)
+{
+  ssize_t n;
+  size_t want;
+  uint32_t len;
+
+  if (rg->frame == 0) {
+    /* Reading a frame header. */
+    want = rg->hdr_len >= 4 ? 8 : 4;
+    n = read (rg->sock, rg->hdr + rg->hdr_len, want - rg->hdr_len);
+    if (n <= 0)
+      goto read_error;
+    rg->hdr_len += n;
+    if (rg->hdr_len < 4)
+      return 0;
+
+    len = get_u32 (rg->hdr);
+    if (len == DATA_CHANNEL_ERROR) {
+      if (rg->hdr_len == 8) {
+        rg->err = get_u32 (rg->hdr + 4);
+        rg->state = RANGE_DONE;
+      }
+      return 0;
+    }
+
+    rg->hdr_len = 0;
+    if (len == 0)
+      rg->state = RANGE_DONE;
+    rg->frame = len;
+    return 0;
+  }
+
+  n = read (rg->sock, buf, rg->frame < DATA_BUFSIZ ? rg->frame : DATA_BUFSIZ);
+  if (n <= 0)
+    goto read_error;
+
+  if (!*write_err && pwrite (fd, buf, n, rg->offset) != n) {
+    perrorf (g, "pwrite");
+    *write_err = 1;
+  }
+  rg->offset += n;
+  rg->frame -= n;
+  return n;
+
+ read_error:
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if (n == -1)
+    perrorf (g, "read: data channel %d", rg->channel);
+  else
+    error (g, _("data channel %d: unexpected end of file"), rg->channel);
+  return -1;
+}
+
+/* Write to an upload channel, or read the status once the whole
+ * range has been sent.  Returns the number of data bytes sent, or -1
+ * if the channel failed.
+ */
+static ssize_t
+send_range (guestfs_h *g, int fd, struct range *rg, int *read_err)
+{
+  ssize_t n;
+
+  if (rg->state == RANGE_STATUS) {
+    n = read (rg->sock, rg->hdr + rg->hdr_len, 4 - rg->hdr_len);
+    if (n <= 0) {
+      if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+      if (n == -1)
+        perrorf (g, "read: data channel %d", rg->channel);
+      else
+        error (g, _("data channel %d: unexpected end of file"), rg->channel);
+      return -1;
+    }
+    rg->hdr_len += n;
+    if (rg->hdr_len == 4) {
+      rg->err = get_u32 (rg->hdr);
+      rg->state = RANGE_DONE;
+    }
+    return 0;
+  }
+
+  if (rg->buf_pos == rg->buf_len) {
+    size_t len = rg->remaining < DATA_BUFSIZ ? rg->remaining : DATA_BUFSIZ;
+
+    n = pread (fd, rg->buf, len, rg->offset);
+    if (n <= 0) {
+      /* The daemon expects the whole range, so send zeroes in place
+       * of anything we could not read and fail at the end.
+       */
+      if (!*read_err) {
+        if (n == -1)
+          perrorf (g, "pread");
+        else
+          error (g, _("file changed size during upload"));
+      }
+      *read_err = 1;
+      memset (rg->buf, 0, len);
+      n = len;
+    }
+    rg->buf_pos = 0;
+    rg->buf_len = n;
+    rg->offset += n;
+    rg->remaining -= n;
+  }
+
+  n = write (rg->sock, rg->buf + rg->buf_pos, rg->buf_len - rg->buf_pos);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perrorf (g, "write: data channel %d", rg->channel);
+    return -1;
+  }
+  rg->buf_pos += n;
+
+  if (rg->remaining == 0 && rg->buf_pos == rg->buf_len)
+    rg->state = RANGE_STATUS;
+
+  return n;
+}
+
+/* Service all the data channels until every range is done. */
+static int
+transfer_ranges (guestfs_h *g, int fd, struct range *ranges, size_t n,
+                 uint64_t total, int upload)
+{
+  size_t i, active = n;
+  uint64_t position = 0, last = 0;
+  int err = 0, r = 0;
+  char *buf = NULL;
+  fd_set rset, wset;
+  int max_fd;
+  ssize_t len;
+
+  if (!upload)
+    buf = safe_malloc (g, DATA_BUFSIZ);
+
+  send_progress (g, 0, total, &last);
+
+  while (active > 0) {
+    /* guestfs_user_cancel: abandon the ranges which are still running.
+     * Their channels must be cancelled (see check_ranges).
+     */
+    if (g->user_cancel) {
+      guestfs_error_errno (g, EINTR, _("operation cancelled by user"));
+      for (i = 0; i < n; ++i) {
+        if (ranges[i].state != RANGE_DONE) {
+          ranges[i].state = RANGE_DONE;
+          ranges[i].failed = 1;
+        }
+      }
+      r = -1;
+      break;
+    }
+
+    FD_ZERO (&rset);
+    FD_ZERO (&wset);
+    max_fd = -1;
+    for (i = 0; i < n; ++i) {
+      if (ranges[i].state == RANGE_DONE)
+        continue;
+      if (ranges[i].state == RANGE_DATA && upload)
+        FD_SET (ranges[i].sock, &wset);
+      else
+        FD_SET (ranges[i].sock, &rset);
+      max_fd = MAX (max_fd, ranges[i].sock);
+    }
+
+    if (select (max_fd+1, &rset, &wset, NULL, NULL) == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      perrorf (g, "select");
+      r = -1;
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (ranges[i].state == RANGE_DONE ||
+          !(FD_ISSET (ranges[i].sock, &rset) ||
+            FD_ISSET (ranges[i].sock, &wset)))
+        continue;
+
+      if (upload)
+        len = send_range (g, fd, &ranges[i], &err);
+      else
+        len = receive_range (g, fd, &ranges[i], buf, &err);
+
+      if (len == -1) {
+        ranges[i].state = RANGE_DONE;
+        ranges[i].failed = 1;
+        r = -1;
+      }
+      else
+        position += len;
+
+      if (ranges[i].state == RANGE_DONE)
+        active--;
+    }
+
+    send_progress (g, position, total, &last);
+  }
+
+  free (buf);
+  return err ? -1 : r;
+}
+
+static int
+check_ranges (guestfs_h *g, const char *filename,
+              struct range *ranges, size_t n)
+{
+  size_t i;
+  int r = 0, cancelled = 0;
+
+  /* Always wait for every range, so the daemon reaps its children,
+   * but prefer the errno sent on the channel as the error message.
+   * A range whose channel failed was not read or written to the end,
+   * so its child may be blocked on the channel and is killed instead.
+   */
+  for (i = 0; i < n; ++i) {
+    if (ranges[i].failed) {
+      guestfs_internal_data_channel_cancel (g, ranges[i].channel);
+      cancelled = 1;
+      r = -1;
+      continue;
+    }
+    if (guestfs_internal_data_channel_wait (g, ranges[i].channel) == -1)
+      r = -1;
+    if (ranges[i].err) {
+      guestfs_error_errno (g, ranges[i].err, "%s: %s",
+                           filename, strerror (ranges[i].err));
+      r = -1;
+    }
+  }
+
+  /* Unread frames from a cancelled range would be mistaken for the
+   * next transfer, so stop using the data channels.  Later transfers
+   * go over the main channel.
+   */
+  if (cancelled) {
+    debug (g, "data channel failed, disabling parallel transfers");
+    guestfs___close_data_channels (g);
+  }
+
+  return r;
+}
+
+int
+guestfs__download_parallel (guestfs_h *g,
+                            const char *remotefilename, const char *filename)
+{
+  struct stat statbuf;
+  struct range ranges[MAX_DATA_CHANNELS];
+  size_t i, n, started;
+  int64_t size;
+  int fd, r;
+
+  if (g->nr_data_socks == 0 ||
+      (stat (filename, &statbuf) == 0 && !S_ISREG (statbuf.st_mode)))
+    return guestfs_download (g, remotefilename, filename);
+
+  size = remote_size (g, remotefilename);
+  if (size == -1)
+    return -1;
+  if (size < MIN_PARALLEL_SIZE)
+    return guestfs_download (g, remotefilename, filename);
+
+  fd = open (filename, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_CLOEXEC, 0666);
+  if (fd == -1) {
+    perrorf (g, "open: %s", filename);
+    return -1;
+  }
+
+  if (ftruncate (fd, size) == -1) {
+    perrorf (g, "ftruncate: %s", filename);
+    close (fd);
+    return -1;
+  }
+
+  g->user_cancel = 0;
+
+  n = split_ranges (g, size, ranges);
+  for (started = 0; started < n; ++started) {
+    i = started;
+    if (guestfs_internal_data_channel_download (g, remotefilename,
+                                                ranges[i].offset,
+                                                ranges[i].remaining,
+                                                ranges[i].channel) == -1)
+      break;
+  }
+
+  /* Ranges that were started must be read to the end, even if
+   * starting a later one failed, to keep the channels in step.
+   */
+  r = transfer_ranges (g, fd, ranges, started, size, 0);
+  if (check_ranges (g, remotefilename, ranges, started) == -1)
+    r = -1;
+  if (started < n)
+    r = -1;
+
+  if (close (fd) == -1) {
+    perrorf (g, "close: %s", filename);
+    r = -1;
+  }
+
+  return r;
+}
+
+int
+guestfs__upload_parallel (guestfs_h *g,
+                          const char *filename, const char *remotefilename)
+{
+  struct stat statbuf;
+  struct range ranges[MAX_DATA_CHANNELS];
+  size_t i, n, started;
+  int fd, r;
+
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    perrorf (g, "open: %s", filename);
+    return -1;
+  }
+
+  if (fstat (fd, &statbuf) == -1) {
+    perrorf (g, "fstat: %s", filename);
+    close (fd);
+    return -1;
+  }
+
+  if (g->nr_data_socks == 0 || !S_ISREG (statbuf.st_mode) ||
+      statbuf.st_size < MIN_PARALLEL_SIZE) {
+    close (fd);
+    return guestfs_upload (g, filename, remotefilename);
+  }
+
+  /* Create or truncate the remote file, as guestfs_upload would.
+   * Devices are written in place.
+   */
+  if (!STRPREFIX (remotefilename, "/dev/") &&
+      guestfs_write (g, remotefilename, "", 0) == -1) {
+    close (fd);
+    return -1;
+  }
+
+  g->user_cancel = 0;
+
+  n = split_ranges (g, statbuf.st_size, ranges);
+  for (i = 0; i < n; ++i)
+    ranges[i].buf = safe_malloc (g, DATA_BUFSIZ);
+
+  for (started = 0; started < n; ++started) {
+    i = started;
+    if (guestfs_internal_data_channel_upload (g, remotefilename,
+                                              ranges[i].offset,
+                                              ranges[i].remaining,
+                                              ranges[i].channel) == -1)
+      break;
+  }
+
+  /* The daemon waits for the whole of each range that was started. */
+  r = transfer_ranges (g, fd, ranges, started, statbuf.st_size, 1);
+  if (check_ranges (g, remotefilename, ranges, started) == -1)
+    r = -1;
+  if (started < n)
+    r = -1;
+
+  for (i = 0; i < n; ++i)
+    free (ranges[i].buf);
+  close (fd);
+
+  return r;
+}
@@ -34,6 +34,20 @@
 #include "guestfs.h"
 #include "guestfs-internal.h"
 
+/* Recalculate g->events_mask, which lets the functions below (and
+ * callers which would have to do work to build the event payload)
+ * cheaply check whether anyone is listening for an event.
+ */
+static void
+update_events_mask (guestfs_h *g)
+{
+  size_t i;
+
+  g->events_mask = 0;
+  for (i = 0; i < g->nr_events; ++i)
+    g->events_mask |= g->events[i].event_bitmask;
+}
+
 int
 guestfs_set_event_callback (guestfs_h *g,
                             guestfs_event_callback cb,
@@ -51,8 +65,11 @@ guestfs_set_event_callback (guestfs_h *g,
    * callbacks then we'd want to look at using an alternate data
    * structure in place of a linear list.
    */
+  int locked = guestfs___lock_handle (g);
+
   if (g->nr_events >= 1000) {
     error (g, "too many event callbacks registered");
+    guestfs___unlock_handle (g, locked);
     return -1;
   }
 
@@ -66,20 +83,26 @@ guestfs_set_event_callback (guestfs_h *g,
   g->events[event_handle].cb = cb;
   g->events[event_handle].opaque = opaque;
   g->events[event_handle].opaque2 = NULL;
+  g->events_mask |= event_bitmask;
 
+  guestfs___unlock_handle (g, locked);
   return event_handle;
 }
 
 void
 guestfs_delete_event_callback (guestfs_h *g, int event_handle)
 {
-  if (event_handle < 0 || event_handle >= (int) g->nr_events)
-    return;
+  int locked = guestfs___lock_handle (g);
 
-  /* Set the event_bitmask to 0, which will ensure that this callback
-   * cannot match any event and therefore cannot be called.
-   */
-  g->events[event_handle].event_bitmask = 0;
+  if (event_handle >= 0 && event_handle < (int) g->nr_events) {
+    /* Set the event_bitmask to 0, which will ensure that this callback
+     * cannot match any event and therefore cannot be called.
+     */
+    g->events[event_handle].event_bitmask = 0;
+    update_events_mask (g);
+  }
+
+  guestfs___unlock_handle (g, locked);
 }
 
 /* Functions to generate an event with various payloads. */
@@ -89,6 +112,9 @@ guestfs___call_callbacks_void (guestfs_h *g, uint64_t event)
 {
   size_t i;
 
+  if ((g->events_mask & event) == 0)
+    return;
+
   for (i = 0; i < g->nr_events; ++i)
     if ((g->events[i].event_bitmask & event) != 0)
       g->events[i].cb (g, g->events[i].opaque, event, i, 0, NULL, 0, NULL, 0);
@@ -104,7 +130,7 @@ guestfs___call_callbacks_message (guestfs_h *g, uint64_t event,
 {
   size_t i, count = 0;
 
-  for (i = 0; i < g->nr_events; ++i)
+  for (i = 0; (g->events_mask & event) != 0 && i < g->nr_events; ++i)
     if ((g->events[i].event_bitmask & event) != 0) {
       g->events[i].cb (g, g->events[i].opaque, event, i, 0,
                        buf, buf_len, NULL, 0);
@@ -179,6 +205,9 @@ guestfs___call_callbacks_array (guestfs_h *g, uint64_t event,
 {
   size_t i;
 
+  if ((g->events_mask & event) == 0)
+    return;
+
   for (i = 0; i < g->nr_events; ++i)
     if ((g->events[i].event_bitmask & event) != 0)
       g->events[i].cb (g, g->events[i].opaque, event, i, 0,
@@ -238,6 +267,7 @@ replace_old_style_event_callback (guestfs_h *g,
   g->events[i].cb = cb;
   g->events[i].opaque = opaque;
   g->events[i].opaque2 = opaque2;
+  update_events_mask (g);
 }
 
 static void
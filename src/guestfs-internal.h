@@ -24,6 +24,9 @@
 
 #include <pcre.h>
 
+#include "glthread/lock.h"
+#include "glthread/tls.h"
+
 #define STREQ(a,b) (strcmp((a),(b)) == 0)
 #define STRCASEEQ(a,b) (strcasecmp((a),(b)) == 0)
 #define STRNEQ(a,b) (strcmp((a),(b)) != 0)
@@ -107,9 +110,6 @@
  */
 #define MAX_PKG_DB_SIZE       (300 * 1000 * 1000)
 
-/* Maximum size of Windows explorer.exe.  2.6MB on Windows 7. */
-#define MAX_WINDOWS_EXPLORER_SIZE (4 * 1000 * 1000)
-
 /* Network configuration of the appliance.  Note these addresses are
  * only meaningful within the context of the running appliance.  QEMU
  * translates network connections to these magic addresses into
@@ -131,12 +131,20 @@
 #define NETWORK "169.254.0.0/16"
 #define ROUTER "169.254.2.2"
 
+/* Maximum number of extra data channels (see guestfs_set_data_channels).
+ * The daemon has the same limit.
+ */
+#define MAX_DATA_CHANNELS 16
+
 /* GuestFS handle and connection. */
 enum state { CONFIG, LAUNCHING, READY, BUSY, NO_HANDLE };
 
 /* Attach method. */
 enum attach_method { ATTACH_METHOD_APPLIANCE = 0, ATTACH_METHOD_UNIX };
 
+/* Discard option of guestfs_add_drive_opts. */
+enum discard { DISCARD_DISABLE = 0, DISCARD_ENABLE, DISCARD_BESTEFFORT };
+
 /* Event. */
 struct event {
   uint64_t event_bitmask;
@@ -149,6 +157,37 @@ struct event {
   void *opaque2;
 };
 
+/* The last error seen by one thread on a thread-safe handle. */
+struct error_data {
+  struct error_data *next;
+  char *last_error;
+  int last_errnum;
+};
+
+/* One record in the binary trace ring buffer (see src/trace.c). */
+struct trace_record {
+  int64_t timestamp_us;         /* start of call, microseconds since epoch */
+  uint32_t duration_us;
+  uint16_t function;            /* index into guestfs___trace_function_names */
+  uint16_t failed;
+  int32_t proc_nr;              /* -1 for calls handled in the library */
+  int32_t serial;
+  uint64_t arg_bytes;           /* total size of the arguments */
+  int64_t result;               /* result, size of result, or -1 on error */
+};
+
+/* Call statistics for one procedure (see src/stats.c). */
+struct call_stats {
+  const char *name;             /* static string, NULL if not known yet */
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t hist[6];             /* < 1ms, 10ms, 100ms, 1s, 10s, longer */
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+};
+
 /* Linked list of drives added to the handle. */
 struct drive {
   struct drive *next;
@@ -160,12 +199,23 @@ struct drive {
   char *iface;
   char *name;
   int use_cache_off;
+  enum discard discard;
+  char *cachemode;              /* NULL means cache=off if possible */
+  char *aio;                    /* NULL means the qemu default */
+  int iothread;                 /* If true, give the drive an iothread. */
+  int queues;                   /* -1 = default, 0 = one per vCPU */
 };
 
 struct guestfs_h
 {
   struct guestfs_h *next;	/* Linked list of open handles. */
 
+  /* If thread_safe is set, every API call holds this lock (see
+   * guestfs___lock_handle in src/guestfs.c).
+   */
+  gl_recursive_lock_define (, lock);
+  int thread_safe;
+
   /* State: see the state machine diagram in the man page guestfs(3). */
   enum state state;
 
@@ -173,6 +223,15 @@ struct guestfs_h
 
   int fd[2];			/* Stdin/stdout of qemu. */
   int sock;			/* Daemon communications socket. */
+
+  /* Data read from the daemon socket but not yet consumed (see
+   * src/proto.c).  Reading in large blocks means that several small
+   * messages, such as file chunks and progress notifications, are
+   * picked up by a single read(2).
+   */
+  char *recv_buf;
+  size_t recv_buf_start, recv_buf_end;
+
   pid_t pid;			/* Qemu PID. */
   pid_t recoverypid;		/* Recovery process PID. */
 
@@ -207,17 +266,49 @@ struct guestfs_h
 
   int smp;                      /* If > 1, -smp flag passed to qemu. */
 
+  /* Transfer compression (see guestfs_set_transfer_compression).  The
+   * zlib streams are allocated on first use and reset for each chunk.
+   */
+  int transfer_compression;
+  struct z_stream_s *deflate_stream;
+  struct z_stream_s *inflate_stream;
+  int deflate_skip;             /* Don't try compressing next N chunks. */
+
+  /* Parallel transfer data channels (see guestfs_set_data_channels).
+   * data_channels is the number requested.  After launch, data_sock
+   * holds the connected sockets for channels 1..nr_data_socks.
+   */
+  int data_channels;
+  int data_sock[MAX_DATA_CHANNELS];
+  size_t nr_data_socks;
+
   char *last_error;
   int last_errnum;              /* errno, or 0 if there was no errno */
 
+  /* If thread_safe is set, the last error is stored per thread in
+   * error_data instead.  error_data_list links every per-thread
+   * struct so they can be freed when the handle is closed.
+   */
+  gl_tls_key_t error_data;
+  struct error_data *error_data_list;
+
   /* Callbacks. */
   guestfs_abort_cb           abort_cb;
   guestfs_error_handler_cb   error_cb;
   void *                     error_cb_data;
 
+  /* Per-procedure call statistics (see src/stats.c).  call_stats is
+   * indexed by proc_nr and allocated on the first call.  stats_proc
+   * is the procedure currently being called, or -1.
+   */
+  struct call_stats *call_stats;
+  int stats_proc;
+  int64_t stats_start_us;
+
   /* Events. */
   struct event *events;
   size_t nr_events;
+  uint64_t events_mask;         /* OR of the event_bitmask of all events */
 
   int msg_next_serial;
 
@@ -236,6 +327,16 @@ struct guestfs_h
   char *trace_buf;
   size_t trace_len;
 
+  /* Binary trace ring buffer (see src/trace.c).  trace_ring is NULL
+   * if it is disabled.  trace_ring_total counts all records ever
+   * added, so the next record goes in slot
+   * trace_ring_total % trace_ring_size.
+   */
+  struct trace_record *trace_ring;
+  size_t trace_ring_size;
+  uint64_t trace_ring_total;
+  char *trace_dump_file;        /* dump the ring here on error */
+
   /* User cancelled transfer.  Not signal-atomic, but it doesn't
    * matter for this case because we only care if it is != 0.
    */
@@ -344,6 +445,10 @@ struct inspect_fs {
   int is_multipart_disk;
   struct inspect_fstab_entry *fstab;
   size_t nr_fstab;
+  struct inspect_apps_entry *apps; /* Cached lists, see inspect_apps.c */
+  size_t nr_apps;
+  char *icons[3];               /* Cached icons, see inspect_icon.c */
+  size_t icon_sizes[3];
 };
 
 struct inspect_fstab_entry {
@@ -351,6 +456,12 @@ struct inspect_fstab_entry {
   char *mountpoint;
 };
 
+struct inspect_apps_entry {
+  char *token;                  /* Package databases state. */
+  int issued;                   /* Token was returned to the caller. */
+  struct guestfs_application_list *apps;
+};
+
 struct guestfs_message_header;
 struct guestfs_message_error;
 struct guestfs_progress;
@@ -378,6 +489,8 @@ extern void guestfs___remove_tmpdir (const char *dir);
 extern void guestfs___print_timestamped_message (guestfs_h *g, const char *fs, ...);
 extern void guestfs___free_inspect_info (guestfs_h *g);
 extern void guestfs___free_drives (struct drive **drives);
+extern int guestfs___lock_handle (guestfs_h *g);
+extern void guestfs___unlock_handle (guestfs_h *g, int locked);
 extern int guestfs___set_busy (guestfs_h *g);
 extern int guestfs___end_busy (guestfs_h *g);
 extern int guestfs___send (guestfs_h *g, int proc_nr, uint64_t progress_hint, uint64_t optargs_bitmask, xdrproc_t xdrp, char *args);
@@ -385,6 +498,21 @@ extern int guestfs___recv (guestfs_h *g, const char *fn, struct guestfs_message_
 extern int guestfs___recv_discard (guestfs_h *g, const char *fn);
 extern int guestfs___send_file (guestfs_h *g, const char *filename);
 extern int guestfs___recv_file (guestfs_h *g, const char *filename);
+extern void guestfs___stats_start (guestfs_h *g, int proc_nr);
+extern const char *const guestfs___trace_function_names[];
+extern const size_t guestfs___trace_nr_function_names;
+extern int64_t guestfs___trace_now (void);
+extern void guestfs___trace_record (guestfs_h *g, int function, int proc_nr, int serial, uint64_t arg_bytes, int64_t result, int failed, int64_t start_us);
+extern uint64_t guestfs___trace_strings_size (char *const *argv);
+extern int64_t guestfs___trace_count_strings (char *const *argv);
+extern void guestfs___free_trace_ring (guestfs_h *g);
+extern void guestfs___stats_end (guestfs_h *g);
+extern void guestfs___free_transfer_compression (guestfs_h *g);
+extern int guestfs___listen_data_channels (guestfs_h *g);
+extern int guestfs___accept_data_channels (guestfs_h *g);
+extern void guestfs___close_data_channels (guestfs_h *g);
+extern char **guestfs___host_list_devices (guestfs_h *g);
+extern struct guestfs_partition_list *guestfs___host_part_list (guestfs_h *g, const char *device);
 extern int guestfs___send_to_daemon (guestfs_h *g, const void *v_buf, size_t n);
 extern int guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn);
 extern int guestfs___accept_from_daemon (guestfs_h *g);
@@ -408,6 +536,7 @@ extern int guestfs___is_file_nocase (guestfs_h *g, const char *);
 extern int guestfs___is_dir_nocase (guestfs_h *g, const char *);
 extern char *guestfs___download_to_tmp (guestfs_h *g, struct inspect_fs *fs, const char *filename, const char *basename, int64_t max_size);
 extern char *guestfs___case_sensitive_path_silently (guestfs_h *g, const char *);
+extern char **guestfs___case_sensitive_path_list_silently (guestfs_h *g, const char *const *paths);
 extern struct inspect_fs *guestfs___search_for_root (guestfs_h *g, const char *root);
 
 #if defined(HAVE_HIVEX)
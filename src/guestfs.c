@@ -73,6 +73,7 @@
 
 static void default_error_cb (guestfs_h *g, void *data, const char *msg);
 static void close_handles (void);
+static void free_error_data_list (guestfs_h *g);
 
 gl_lock_define_initialized (static, handles_lock);
 static guestfs_h *handles = NULL;
@@ -91,10 +92,15 @@ guestfs_create (void)
 
   g->state = CONFIG;
 
+  gl_recursive_lock_init (g->lock);
+  gl_tls_key_init (g->error_data, NULL);
+
   g->fd[0] = -1;
   g->fd[1] = -1;
   g->sock = -1;
 
+  g->stats_proc = -1;
+
   g->abort_cb = abort;
   g->error_cb = default_error_cb;
   g->error_cb_data = NULL;
@@ -108,6 +114,23 @@ guestfs_create (void)
   str = getenv ("LIBGUESTFS_TRACE");
   g->trace = str != NULL && STREQ (str, "1");
 
+  str = getenv ("LIBGUESTFS_TRACE_BUFFER");
+  if (str) {
+    int entries;
+
+    if (sscanf (str, "%d", &entries) != 1 ||
+        guestfs__set_trace_buffer (g, entries) == -1) {
+      warning (g, "invalid value for LIBGUESTFS_TRACE_BUFFER");
+      goto error;
+    }
+  }
+
+  str = getenv ("LIBGUESTFS_TRACE_DUMP");
+  if (str) {
+    g->trace_dump_file = strdup (str);
+    if (!g->trace_dump_file) goto error;
+  }
+
   str = getenv ("LIBGUESTFS_PATH");
   g->path = str != NULL ? strdup (str) : strdup (GUESTFS_DEFAULT_PATH);
   if (!g->path) goto error;
@@ -161,9 +184,12 @@ guestfs_create (void)
   return g;
 
  error:
+  guestfs___free_trace_ring (g);
   free (g->path);
   free (g->qemu);
   free (g->append);
+  gl_tls_key_destroy (g->error_data);
+  gl_recursive_lock_destroy (g->lock);
   free (g);
   return NULL;
 }
@@ -206,6 +232,8 @@ guestfs_close (guestfs_h *g)
 
   guestfs___free_inspect_info (g);
   guestfs___free_drives (&g->drives);
+  guestfs___free_transfer_compression (g);
+  guestfs___close_data_channels (g);
 
   /* Close sockets. */
   if (g->fd[0] >= 0)
@@ -217,6 +245,9 @@ guestfs_close (guestfs_h *g)
   g->fd[0] = -1;
   g->fd[1] = -1;
   g->sock = -1;
+  free (g->recv_buf);
+  free (g->call_stats);
+  guestfs___free_trace_ring (g);
 
   /* Wait for subprocess(es) to exit. */
   if (g->pid > 0) waitpid (g->pid, NULL, 0);
@@ -252,6 +283,9 @@ guestfs_close (guestfs_h *g)
   if (g->pda)
     hash_free (g->pda);
   free (g->last_error);
+  free_error_data_list (g);
+  gl_tls_key_destroy (g->error_data);
+  gl_recursive_lock_destroy (g->lock);
   free (g->path);
   free (g->qemu);
   free (g->append);
@@ -267,21 +301,124 @@ close_handles (void)
   while (handles) guestfs_close (handles);
 }
 
+/* Thread-safe handles.
+ *
+ * Normally a handle may only be used by one thread at a time.  If
+ * guestfs_set_thread_safe is enabled, the generated entry point of
+ * every API call (src/actions.c) holds g->lock around the call, so
+ * several threads can share a handle and its appliance.  The lock
+ * is recursive because many calls are implemented using other calls.
+ *
+ * Calls are serialized rather than multiplexed over the socket: the
+ * daemon handles one request at a time anyway, and a call needs the
+ * socket to itself from sending the request until it has read the
+ * reply and any file chunks.
+ *
+ * guestfs___lock_handle returns whether it took the lock, and that
+ * is passed to guestfs___unlock_handle, so that a call which changes
+ * the flag (ie. guestfs_set_thread_safe) still unlocks correctly.
+ */
+int
+guestfs___lock_handle (guestfs_h *g)
+{
+  if (!g->thread_safe)
+    return 0;
+
+  gl_recursive_lock_lock (g->lock);
+  return 1;
+}
+
+void
+guestfs___unlock_handle (guestfs_h *g, int locked)
+{
+  if (locked)
+    gl_recursive_lock_unlock (g->lock);
+}
+
+int
+guestfs__set_thread_safe (guestfs_h *g, int threadsafe)
+{
+  g->thread_safe = !!threadsafe;
+  return 0;
+}
+
+int
+guestfs__get_thread_safe (guestfs_h *g)
+{
+  return g->thread_safe;
+}
+
+/* On a thread-safe handle, another thread could overwrite or free
+ * g->last_error before this thread calls guestfs_last_error, so the
+ * error is stored per thread.  The per-thread structs are only freed
+ * when the handle is closed.
+ */
+static struct error_data *
+get_error_data (guestfs_h *g)
+{
+  struct error_data *ret = gl_tls_get (g->error_data);
+
+  if (ret == NULL) {
+    ret = safe_malloc (g, sizeof *ret);
+    ret->last_error = NULL;
+    ret->last_errnum = 0;
+
+    gl_recursive_lock_lock (g->lock);
+    ret->next = g->error_data_list;
+    g->error_data_list = ret;
+    gl_recursive_lock_unlock (g->lock);
+
+    gl_tls_set (g->error_data, ret);
+  }
+
+  return ret;
+}
+
+static void
+free_error_data_list (guestfs_h *g)
+{
+  struct error_data *p, *next;
+
+  for (p = g->error_data_list; p != NULL; p = next) {
+    next = p->next;
+    free (p->last_error);
+    free (p);
+  }
+  g->error_data_list = NULL;
+}
+
 const char *
 guestfs_last_error (guestfs_h *g)
 {
+  if (g->thread_safe) {
+    struct error_data *error_data = gl_tls_get (g->error_data);
+    return error_data ? error_data->last_error : NULL;
+  }
   return g->last_error;
 }
 
 int
 guestfs_last_errno (guestfs_h *g)
 {
+  if (g->thread_safe) {
+    struct error_data *error_data = gl_tls_get (g->error_data);
+    return error_data ? error_data->last_errnum : 0;
+  }
   return g->last_errnum;
 }
 
 static void
 set_last_error (guestfs_h *g, int errnum, const char *msg)
 {
+  if (g->thread_safe) {
+    struct error_data *error_data = get_error_data (g);
+
+    free (error_data->last_error);
+    error_data->last_error = strdup (msg);
+    error_data->last_errnum = errnum;
+    return;
+  }
+
   free (g->last_error);
   g->last_error = strdup (msg);
   g->last_errnum = errnum;
@@ -530,8 +667,11 @@ guestfs_get_out_of_memory_handler (guestfs_h *g)
 void
 guestfs_set_error_handler (guestfs_h *g, guestfs_error_handler_cb cb, void *data)
 {
+  int locked = guestfs___lock_handle (g);
+
   g->error_cb = cb;
   g->error_cb_data = data;
+  guestfs___unlock_handle (g, locked);
 }
 
 guestfs_error_handler_cb
@@ -783,6 +923,59 @@ guestfs__get_pgroup (guestfs_h *g)
   return g->pgroup;
 }
 
+int
+guestfs__set_transfer_compression (guestfs_h *g, int v)
+{
+  v = !!v;
+
+#ifdef HAVE_ZLIB
+  /* If the appliance is already running, tell the daemon now,
+   * otherwise guestfs_launch will do it.
+   */
+  if (g->state == READY &&
+      guestfs_internal_transfer_compression (g, v) == -1)
+    return -1;
+
+  g->transfer_compression = v;
+  return 0;
+#else
+  if (v) {
+    error (g, _("transfer compression is not supported because libguestfs was compiled without zlib"));
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+int
+guestfs__get_transfer_compression (guestfs_h *g)
+{
+  return g->transfer_compression;
+}
+
+int
+guestfs__set_data_channels (guestfs_h *g, int v)
+{
+  if (g->state != CONFIG) {
+    error (g, _("data channels must be set before launch"));
+    return -1;
+  }
+  if (v < 0 || v > MAX_DATA_CHANNELS) {
+    error (g, _("invalid data channels parameter: %d (must be 0..%d)"),
+           v, MAX_DATA_CHANNELS);
+    return -1;
+  }
+
+  g->data_channels = v;
+  return 0;
+}
+
+int
+guestfs__get_data_channels (guestfs_h *g)
+{
+  return g->data_channels;
+}
+
 int
 guestfs__set_smp (guestfs_h *g, int v)
 {
@@ -838,6 +1031,8 @@ freer (void *x)
 void
 guestfs_set_private (guestfs_h *g, const char *key, void *data)
 {
+  int locked = guestfs___lock_handle (g);
+
   if (g->pda == NULL) {
     g->pda = hash_initialize (16, NULL, hasher, comparator, freer);
     if (g->pda == NULL)
@@ -855,6 +1050,8 @@ guestfs_set_private (guestfs_h *g, const char *key, void *data)
   if (entry == NULL)
     g->abort_cb ();
   assert (entry == new_entry);
+
+  guestfs___unlock_handle (g, locked);
 }
 
 static inline char *
@@ -866,15 +1063,20 @@ bad_cast (char const *s)
 void *
 guestfs_get_private (guestfs_h *g, const char *key)
 {
+  int locked;
+  void *ret = NULL;
+
   if (g->pda == NULL)
     return NULL;                /* no keys have been set */
 
+  locked = guestfs___lock_handle (g);
   const struct pda_entry k = { .key = bad_cast (key) };
   struct pda_entry *entry = hash_lookup (g->pda, &k);
   if (entry)
-    return entry->data;
-  else
-    return NULL;
+    ret = entry->data;
+  guestfs___unlock_handle (g, locked);
+
+  return ret;
 }
 
 /* Iterator. */
@@ -974,6 +1176,8 @@ guestfs___free_drives (struct drive **drives)
     free (i->format);
     free (i->iface);
     free (i->name);
+    free (i->cachemode);
+    free (i->aio);
     free (i);
 
     i = next;
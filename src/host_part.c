@@ -0,0 +1,604 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#include "c-ctype.h"
+
+#include "guestfs.h"
+#include "guestfs-internal.h"
+#include "guestfs-internal-actions.h"
+
+/* Reading partition tables on the host, without the appliance.
+ *
+ * Some callers (eg. virt-alignment-scan) only want to know where the
+ * partitions are.  Launching the appliance to run parted takes
+ * seconds, but the information is in the first few sectors of the
+ * disk image.  So if guestfs_list_devices or guestfs_part_list is
+ * called before launch, the generated wrappers call the functions
+ * here instead of returning an error.
+ *
+ * Only raw and qcow2 images are understood.  For qcow2 we follow the
+ * L1/L2 tables to find the clusters we need; compressed clusters,
+ * encrypted images and images with a backing file where the cluster
+ * isn't allocated in the top layer are not supported.  Anything we
+ * can't read fails with errno ENOTSUP, so that the caller can launch
+ * the appliance and ask again.
+ *
+ * We only parse MBR (including logical partitions) and GPT, and
+ * assume 512 byte sectors.  The partition numbers, start, end and
+ * size are the same as parted reports in the appliance.
+ */
+
+#define SECTOR_SIZE 512
+
+#define QCOW2_MAGIC 0x514649fb  /* "QFI\xfb" */
+#define QCOW2_OFFSET_MASK UINT64_C(0x00fffffffffffe00)
+#define QCOW2_COMPRESSED (UINT64_C(1) << 62)
+#define QCOW2_ZERO UINT64_C(1)
+
+/* Maximum number of logical partitions we will follow, in case the
+ * chain of extended boot records contains a loop.
+ */
+#define MAX_LOGICAL_PARTITIONS 1024
+
+/* Maximum size of the GPT partition entry array we will read. */
+#define MAX_GPT_ENTRIES_SIZE (1024 * 1024)
+
+struct image {
+  guestfs_h *g;
+  const char *filename;
+  int fd;
+  int is_qcow2;
+
+  /* qcow2 only. */
+  int has_backing_file;
+  unsigned cluster_bits;
+  uint64_t l1_offset;
+  uint32_t l1_size;
+  uint64_t size;
+};
+
+/* Formats which qemu would detect, but which we can't read. */
+static const struct {
+  size_t len;
+  const char *magic;
+  const char *format;
+} other_formats[] = {
+  { 4, "KDMV", "vmdk" },
+  { 8, "conectix", "vpc" },
+  { 8, "vhdxfile", "vhdx" },
+  { 4, "QFI\xfe", "qcow" },       /* qcow version 1 has a different magic */
+  { 0 },
+};
+
+static int
+read_at (struct image *img, void *buf, size_t n, uint64_t offset)
+{
+  ssize_t r;
+  char *p = buf;
+
+  while (n > 0) {
+    r = pread (img->fd, p, n, offset);
+    if (r == -1) {
+      perrorf (img->g, "pread: %s", img->filename);
+      return -1;
+    }
+    if (r == 0) {
+      /* Past the end of a raw or sparse image: reads as zeroes. */
+      memset (p, 0, n);
+      return 0;
+    }
+    p += r;
+    n -= r;
+    offset += r;
+  }
+
+  return 0;
+}
+
+static int
+read_be64_at (struct image *img, uint64_t *v, uint64_t offset)
+{
+  if (read_at (img, v, sizeof *v, offset) == -1)
+    return -1;
+  *v = be64toh (*v);
+  return 0;
+}
+
+static int
+unsupported (struct image *img, const char *reason)
+{
+  guestfs_error_errno (img->g, ENOTSUP,
+                       _("%s: cannot read this image without the appliance: %s"),
+                       img->filename, reason);
+  return -1;
+}
+
+static int
+open_qcow2 (struct image *img, const unsigned char *hdr)
+{
+  uint32_t version, crypt_method;
+  uint64_t incompatible_features;
+
+  version = be32toh (* (uint32_t *) &hdr[4]);
+  if (version != 2 && version != 3)
+    return unsupported (img, _("unknown qcow2 version"));
+
+  img->has_backing_file = be64toh (* (uint64_t *) &hdr[8]) != 0;
+  img->cluster_bits = be32toh (* (uint32_t *) &hdr[20]);
+  img->size = be64toh (* (uint64_t *) &hdr[24]);
+  crypt_method = be32toh (* (uint32_t *) &hdr[32]);
+  img->l1_size = be32toh (* (uint32_t *) &hdr[36]);
+  img->l1_offset = be64toh (* (uint64_t *) &hdr[40]);
+
+  if (img->cluster_bits < 9 || img->cluster_bits > 21) {
+    error (img->g, _("%s: qcow2 header has invalid cluster_bits (%u)"),
+           img->filename, img->cluster_bits);
+    return -1;
+  }
+  if (crypt_method != 0)
+    return unsupported (img, _("encrypted qcow2 image"));
+
+  /* Version 3 images can use features which change the layout.  The
+   * only one we can ignore is the dirty bit, which just means the
+   * refcounts may be wrong.
+   */
+  if (version == 3) {
+    incompatible_features = be64toh (* (uint64_t *) &hdr[72]);
+    if ((incompatible_features & ~UINT64_C(1)) != 0)
+      return unsupported (img, _("qcow2 image uses incompatible features"));
+  }
+
+  img->is_qcow2 = 1;
+  return 0;
+}
+
+static int
+open_image (guestfs_h *g, struct drive *drv, struct image *img)
+{
+  unsigned char hdr[SECTOR_SIZE];
+  size_t i;
+
+  memset (img, 0, sizeof *img);
+  img->g = g;
+  img->filename = drv->path;
+
+  if (drv->format && STRNEQ (drv->format, "raw") &&
+      STRNEQ (drv->format, "qcow2")) {
+    guestfs_error_errno (g, ENOTSUP,
+                         _("%s: cannot read %s images without the appliance"),
+                         drv->path, drv->format);
+    return -1;
+  }
+
+  img->fd = open (drv->path, O_RDONLY|O_CLOEXEC);
+  if (img->fd == -1) {
+    perrorf (g, "open: %s", drv->path);
+    return -1;
+  }
+
+  if (read_at (img, hdr, sizeof hdr, 0) == -1)
+    goto err;
+
+  if (drv->format == NULL || STREQ (drv->format, "qcow2")) {
+    if (be32toh (* (uint32_t *) hdr) == QCOW2_MAGIC) {
+      if (open_qcow2 (img, hdr) == -1)
+        goto err;
+      return 0;
+    }
+    if (drv->format) {
+      error (g, _("%s: not a qcow2 image"), drv->path);
+      goto err;
+    }
+  }
+
+  /* Format autodetection: make sure this isn't something which qemu
+   * would open as a different format.
+   */
+  if (drv->format == NULL) {
+    for (i = 0; other_formats[i].len > 0; ++i) {
+      if (memcmp (hdr, other_formats[i].magic, other_formats[i].len) == 0) {
+        guestfs_error_errno (g, ENOTSUP,
+                             _("%s: cannot read %s images without the appliance"),
+                             drv->path, other_formats[i].format);
+        goto err;
+      }
+    }
+  }
+
+  return 0;
+
+ err:
+  close (img->fd);
+  return -1;
+}
+
+static void
+close_image (struct image *img)
+{
+  close (img->fd);
+}
+
+/* Read from the virtual disk.  For qcow2, each cluster is looked up
+ * in the L1 and L2 tables.
+ */
+static int
+read_image (struct image *img, void *buf, size_t n, uint64_t offset)
+{
+  char *p = buf;
+  uint64_t cluster_size, l2_entries, l1_index, l2_index, l2_offset;
+  uint64_t entry, in_cluster;
+  size_t len;
+
+  if (!img->is_qcow2)
+    return read_at (img, buf, n, offset);
+
+  cluster_size = UINT64_C(1) << img->cluster_bits;
+  l2_entries = cluster_size / sizeof (uint64_t);
+
+  while (n > 0) {
+    in_cluster = offset & (cluster_size - 1);
+    len = n;
+    if (len > cluster_size - in_cluster)
+      len = cluster_size - in_cluster;
+
+    if (offset >= img->size) {
+      memset (p, 0, len);
+      goto next;
+    }
+
+    l1_index = (offset >> img->cluster_bits) / l2_entries;
+    l2_index = (offset >> img->cluster_bits) & (l2_entries - 1);
+
+    if (l1_index >= img->l1_size)
+      entry = 0;
+    else {
+      if (read_be64_at (img, &entry,
+                        img->l1_offset + l1_index * sizeof (uint64_t)) == -1)
+        return -1;
+      l2_offset = entry & QCOW2_OFFSET_MASK;
+      if (l2_offset == 0)
+        entry = 0;
+      else if (read_be64_at (img, &entry,
+                             l2_offset + l2_index * sizeof (uint64_t)) == -1)
+        return -1;
+    }
+
+    if (entry & QCOW2_COMPRESSED)
+      return unsupported (img, _("compressed qcow2 cluster"));
+
+    if ((entry & QCOW2_ZERO) || (entry & QCOW2_OFFSET_MASK) != 0) {
+      if (entry & QCOW2_ZERO)
+        memset (p, 0, len);
+      else if (read_at (img, p, len,
+                        (entry & QCOW2_OFFSET_MASK) + in_cluster) == -1)
+        return -1;
+    }
+    else {
+      /* Unallocated cluster. */
+      if (img->has_backing_file)
+        return unsupported (img, _("data is in the backing file"));
+      memset (p, 0, len);
+    }
+
+  next:
+    p += len;
+    n -= len;
+    offset += len;
+  }
+
+  return 0;
+}
+
+/* Map a device name such as /dev/sda to the drive which was added to
+ * the handle.  The appliance may use /dev/hd* or /dev/vd* names, but
+ * we accept any of them, like the daemon does.
+ */
+static struct drive *
+find_drive (guestfs_h *g, const char *device)
+{
+  const char *p;
+  size_t index = 0;
+  struct drive *drv;
+
+  if (!STRPREFIX (device, "/dev/") ||
+      (device[5] != 's' && device[5] != 'h' && device[5] != 'v') ||
+      device[6] != 'd' || !c_islower (device[7]))
+    goto bad;
+
+  /* sda..sdz, sdaa..sdzz, ... */
+  for (p = &device[7]; *p; ++p) {
+    if (!c_islower (*p))
+      goto bad;
+    index = index * 26 + (*p - 'a' + 1);
+  }
+  index--;
+
+  for (drv = g->drives; drv != NULL; drv = drv->next) {
+    if (index == 0)
+      return drv;
+    index--;
+  }
+
+ bad:
+  error (g, _("%s: no such whole device"), device);
+  return NULL;
+}
+
+static void
+add_partition (guestfs_h *g, struct guestfs_partition_list *r,
+               int part_num, uint64_t start_sector, uint64_t nr_sectors)
+{
+  struct guestfs_partition *part;
+
+  r->val = safe_realloc (g, r->val, (r->len + 1) * sizeof *r->val);
+  part = &r->val[r->len++];
+  part->part_num = part_num;
+  part->part_start = start_sector * SECTOR_SIZE;
+  part->part_size = nr_sectors * SECTOR_SIZE;
+  part->part_end = part->part_start + part->part_size - 1;
+}
+
+/* The CRC-32 used by GPT (the same as zlib's crc32). */
+static uint32_t
+gpt_crc32 (const unsigned char *buf, size_t len)
+{
+  uint32_t crc = 0xffffffff;
+  size_t i;
+  int j;
+
+  for (i = 0; i < len; ++i) {
+    crc ^= buf[i];
+    for (j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+static int
+parse_gpt (struct image *img, struct guestfs_partition_list *r)
+{
+  unsigned char hdr[SECTOR_SIZE];
+  unsigned char *entries, *e;
+  uint64_t entries_lba, first_lba, last_lba;
+  uint32_t hdr_size, hdr_crc, entries_crc, nr_entries, entry_size, i;
+  static const unsigned char unused[16];
+
+  if (read_image (img, hdr, sizeof hdr, SECTOR_SIZE) == -1)
+    return -1;
+
+  if (memcmp (hdr, "EFI PART", 8) != 0) {
+    error (img->g, _("%s: protective MBR found, but no GPT header"),
+           img->filename);
+    return -1;
+  }
+
+  /* A damaged primary header or entry array would make parted use
+   * the backup GPT, which we don't read.  The checksum is calculated
+   * with its own field set to zero.
+   */
+  hdr_size = le32toh (* (uint32_t *) &hdr[12]);
+  hdr_crc = le32toh (* (uint32_t *) &hdr[16]);
+  if (hdr_size < 92 || hdr_size > sizeof hdr)
+    goto bad_crc;
+  memset (&hdr[16], 0, 4);
+  if (gpt_crc32 (hdr, hdr_size) != hdr_crc)
+    goto bad_crc;
+
+  entries_lba = le64toh (* (uint64_t *) &hdr[72]);
+  nr_entries = le32toh (* (uint32_t *) &hdr[80]);
+  entry_size = le32toh (* (uint32_t *) &hdr[84]);
+  entries_crc = le32toh (* (uint32_t *) &hdr[88]);
+
+  if (entry_size < 128 || (uint64_t) nr_entries * entry_size > MAX_GPT_ENTRIES_SIZE) {
+    error (img->g, _("%s: GPT header has invalid partition entry size"),
+           img->filename);
+    return -1;
+  }
+
+  entries = safe_malloc (img->g, nr_entries * entry_size);
+  if (read_image (img, entries, nr_entries * entry_size,
+                  entries_lba * SECTOR_SIZE) == -1) {
+    free (entries);
+    return -1;
+  }
+
+  if (gpt_crc32 (entries, nr_entries * entry_size) != entries_crc) {
+    free (entries);
+    goto bad_crc;
+  }
+
+  for (i = 0; i < nr_entries; ++i) {
+    e = &entries[i * entry_size];
+    if (memcmp (e, unused, sizeof unused) == 0)
+      continue;
+    first_lba = le64toh (* (uint64_t *) &e[32]);
+    last_lba = le64toh (* (uint64_t *) &e[40]);
+    if (last_lba < first_lba)
+      continue;
+    add_partition (img->g, r, i+1, first_lba, last_lba - first_lba + 1);
+  }
+
+  free (entries);
+  return 0;
+
+ bad_crc:
+  guestfs_error_errno (img->g, ENOTSUP,
+                       _("%s: GPT header or partition entries are damaged"),
+                       img->filename);
+  return -1;
+}
+
+static int
+is_extended (unsigned char type)
+{
+  return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/* Follow the chain of extended boot records.  The first entry in each
+ * EBR is the logical partition (relative to the EBR), the second entry
+ * points to the next EBR (relative to the start of the extended
+ * partition).
+ */
+static int
+parse_logical (struct image *img, struct guestfs_partition_list *r,
+               uint64_t extended_start)
+{
+  unsigned char ebr[SECTOR_SIZE];
+  uint64_t ebr_lba = extended_start;
+  uint32_t start, nr_sectors;
+  int part_num;
+
+  for (part_num = 5; part_num < 5 + MAX_LOGICAL_PARTITIONS; ++part_num) {
+    if (read_image (img, ebr, sizeof ebr, ebr_lba * SECTOR_SIZE) == -1)
+      return -1;
+    if (ebr[510] != 0x55 || ebr[511] != 0xaa)
+      return 0;
+
+    start = le32toh (* (uint32_t *) &ebr[446 + 8]);
+    nr_sectors = le32toh (* (uint32_t *) &ebr[446 + 12]);
+    if (ebr[446 + 4] != 0 && nr_sectors > 0)
+      add_partition (img->g, r, part_num, ebr_lba + start, nr_sectors);
+
+    start = le32toh (* (uint32_t *) &ebr[462 + 8]);
+    if (!is_extended (ebr[462 + 4]) || start == 0)
+      return 0;
+    ebr_lba = extended_start + start;
+  }
+
+  error (img->g, _("%s: too many logical partitions"), img->filename);
+  return -1;
+}
+
+static int
+parse_mbr (struct image *img, struct guestfs_partition_list *r,
+           const unsigned char *mbr)
+{
+  size_t i;
+  const unsigned char *e;
+  uint32_t start, nr_sectors;
+  uint64_t extended_start = 0;
+
+  for (i = 0; i < 4; ++i) {
+    e = &mbr[446 + i*16];
+    start = le32toh (* (uint32_t *) &e[8]);
+    nr_sectors = le32toh (* (uint32_t *) &e[12]);
+    if (e[4] == 0 || nr_sectors == 0)
+      continue;
+    add_partition (img->g, r, i+1, start, nr_sectors);
+    if (is_extended (e[4]) && extended_start == 0)
+      extended_start = start;
+  }
+
+  if (extended_start > 0)
+    return parse_logical (img, r, extended_start);
+
+  return 0;
+}
+
+struct guestfs_partition_list *
+guestfs___host_part_list (guestfs_h *g, const char *device)
+{
+  struct drive *drv;
+  struct image img;
+  unsigned char mbr[SECTOR_SIZE];
+  struct guestfs_partition_list *r;
+  size_t i;
+  int gpt = 0;
+
+  drv = find_drive (g, device);
+  if (drv == NULL)
+    return NULL;
+
+  if (open_image (g, drv, &img) == -1)
+    return NULL;
+
+  r = safe_malloc (g, sizeof *r);
+  r->len = 0;
+  r->val = NULL;
+
+  if (read_image (&img, mbr, sizeof mbr, 0) == -1)
+    goto err;
+
+  if (mbr[510] != 0x55 || mbr[511] != 0xaa) {
+    error (g, _("%s: unrecognised disk label"), device);
+    goto err;
+  }
+
+  for (i = 0; i < 4; ++i)
+    if (mbr[446 + i*16 + 4] == 0xee)
+      gpt = 1;
+
+  if ((gpt ? parse_gpt (&img, r) : parse_mbr (&img, r, mbr)) == -1)
+    goto err;
+
+  debug (g, "%s: read %" PRIu32 " partitions from %s without the appliance",
+         device, r->len, drv->path);
+
+  close_image (&img);
+  return r;
+
+ err:
+  close_image (&img);
+  guestfs_free_partition_list (r);
+  return NULL;
+}
+
+char **
+guestfs___host_list_devices (guestfs_h *g)
+{
+  struct drive *drv;
+  size_t i, n = 0;
+  char **ret;
+  char name[64];
+
+  for (drv = g->drives; drv != NULL; drv = drv->next)
+    n++;
+
+  ret = safe_malloc (g, (n+1) * sizeof (char *));
+  for (i = 0; i < n; ++i) {
+    /* sda..sdz, sdaa..sdzz, ... (the inverse of find_drive above) */
+    char suffix[16];
+    size_t j = sizeof suffix - 1, k = i + 1;
+
+    suffix[j] = '\0';
+    while (k > 0) {
+      k--;
+      suffix[--j] = 'a' + k % 26;
+      k /= 26;
+    }
+    snprintf (name, sizeof name, "/dev/sd%s", &suffix[j]);
+    ret[i] = safe_strdup (g, name);
+  }
+  ret[n] = NULL;
+
+  return ret;
+}
@@ -686,6 +686,13 @@ guestfs___free_inspect_info (guestfs_h *g)
     free (g->fses[i].fstab);
     if (g->fses[i].drive_mappings)
       guestfs___free_string_list (g->fses[i].drive_mappings);
+    for (j = 0; j < g->fses[i].nr_apps; ++j) {
+      free (g->fses[i].apps[j].token);
+      guestfs_free_application_list (g->fses[i].apps[j].apps);
+    }
+    free (g->fses[i].apps);
+    for (j = 0; j < 3; ++j)
+      free (g->fses[i].icons[j]);
   }
   free (g->fses);
   g->nr_fses = 0;
@@ -54,8 +54,24 @@ static struct guestfs_application_list *list_applications_windows (guestfs_h *g,
 static void add_application (guestfs_h *g, struct guestfs_application_list *, const char *name, const char *display_name, int32_t epoch, const char *version, const char *release, const char *install_path, const char *publisher, const char *url, const char *description);
 static void sort_applications (struct guestfs_application_list *);
 
+static struct guestfs_application_list *list_applications (guestfs_h *g, struct inspect_fs *fs);
+static char *applications_token (guestfs_h *g, struct inspect_fs *fs);
+static void forget_downloads (guestfs_h *g, struct inspect_fs *fs);
+static struct inspect_apps_entry *lookup_applications (struct inspect_fs *fs, const char *token);
+static void cache_applications (guestfs_h *g, struct inspect_fs *fs, char *token, const struct guestfs_application_list *apps);
+static struct guestfs_application_list *copy_applications (guestfs_h *g, const struct guestfs_application_list *apps);
+static void add_change (guestfs_h *g, struct guestfs_application_change_list *changes, const char *type, const char *name, const struct guestfs_application *old_app, const struct guestfs_application *new_app);
+
 /* Unlike the simple inspect-get-* calls, this one assumes that the
  * disks are mounted up, and reads files from the mounted disks.
+ *
+ * The list is cached in the inspect_fs struct, together with a token
+ * describing the state of the package databases it was read from.
+ * If the token is unchanged on a later call, the cached list is
+ * returned without downloading or parsing anything.  Lists whose
+ * token was returned by inspect_get_applications_token are kept
+ * until the next inspection, so that changes can be reported
+ * against them.
  */
 struct guestfs_application_list *
 guestfs__inspect_list_applications (guestfs_h *g, const char *root)
@@ -64,6 +80,213 @@ guestfs__inspect_list_applications (guestfs_h *g, const char *root)
   if (!fs)
     return NULL;
 
+  struct guestfs_application_list *ret;
+  struct inspect_apps_entry *e;
+  char *token;
+
+  token = applications_token (g, fs);
+  if (token && (e = lookup_applications (fs, token)) != NULL) {
+    free (token);
+    return copy_applications (g, e->apps);
+  }
+
+  /* If the package databases changed, the copies which were
+   * downloaded to the temporary directory are stale too.
+   */
+  if (fs->nr_apps > 0)
+    forget_downloads (g, fs);
+
+  ret = list_applications (g, fs);
+  if (ret == NULL) {
+    free (token);
+    return NULL;
+  }
+
+  cache_applications (g, fs, token, ret);
+
+  return ret;
+}
+
+char *
+guestfs__inspect_get_applications_token (guestfs_h *g, const char *root)
+{
+  struct inspect_fs *fs = guestfs___search_for_root (g, root);
+  if (!fs)
+    return NULL;
+
+  struct guestfs_application_list *apps;
+  struct inspect_apps_entry *e;
+  char *token = applications_token (g, fs);
+  if (token == NULL)
+    return safe_strdup (g, "");
+
+  /* Make sure the list matching this token is cached and kept, so
+   * that inspect_list_application_changes can compare against it.
+   */
+  if (lookup_applications (fs, token) == NULL) {
+    apps = guestfs__inspect_list_applications (g, root);
+    if (apps == NULL) {
+      free (token);
+      return NULL;
+    }
+    guestfs_free_application_list (apps);
+  }
+
+  e = lookup_applications (fs, token);
+  if (e == NULL) {
+    /* The databases changed while they were being read. */
+    error (g, _("package databases of %s changed while being read"), root);
+    free (token);
+    return NULL;
+  }
+  e->issued = 1;
+
+  return token;
+}
+
+struct guestfs_application_change_list *
+guestfs__inspect_list_application_changes (guestfs_h *g, const char *root,
+                                           const char *token)
+{
+  struct inspect_fs *fs = guestfs___search_for_root (g, root);
+  if (!fs)
+    return NULL;
+
+  struct guestfs_application_change_list *ret;
+  struct guestfs_application_list *old_apps = NULL, *new_apps;
+  struct inspect_apps_entry *e;
+  char *current;
+  char *old_done, *new_done;
+  size_t i, j;
+
+  /* Nothing changed?  Then we don't need to read anything. */
+  current = applications_token (g, fs);
+  if (current && STRNEQ (token, "") && STREQ (current, token)) {
+    free (current);
+    ret = safe_malloc (g, sizeof *ret);
+    ret->len = 0;
+    ret->val = NULL;
+    return ret;
+  }
+  free (current);
+
+  /* The baseline is the list which was read when the caller got the
+   * token.  An empty token means there is no baseline.
+   */
+  if (STRNEQ (token, "")) {
+    e = lookup_applications (fs, token);
+    if (e == NULL) {
+      error (g, _("%s: unknown applications token (tokens can only be used with the handle that returned them, until the next inspection)"),
+             root);
+      return NULL;
+    }
+    old_apps = copy_applications (g, e->apps);
+  }
+
+  new_apps = guestfs__inspect_list_applications (g, root);
+  if (new_apps == NULL) {
+    if (old_apps)
+      guestfs_free_application_list (old_apps);
+    return NULL;
+  }
+
+  ret = safe_malloc (g, sizeof *ret);
+  ret->len = 0;
+  ret->val = NULL;
+
+  if (old_apps == NULL) {
+    for (j = 0; j < new_apps->len; ++j)
+      add_change (g, ret, "added", new_apps->val[j].app_name,
+                  NULL, &new_apps->val[j]);
+    guestfs_free_application_list (new_apps);
+    return ret;
+  }
+
+  /* Both lists are sorted by name.  Walk them in step, one group of
+   * same-named entries at a time (there can be several, eg. for
+   * multilib RPMs).  Within a group, entries present in both lists
+   * are unchanged; remaining entries are paired up as changes, and
+   * any left over are additions or removals.
+   */
+  old_done = safe_calloc (g, old_apps->len + 1, 1);
+  new_done = safe_calloc (g, new_apps->len + 1, 1);
+  i = j = 0;
+  while (i < old_apps->len || j < new_apps->len) {
+    const char *name;
+    size_t i_end, j_end, k, l;
+    int cmp;
+
+    if (i >= old_apps->len)
+      cmp = 1;
+    else if (j >= new_apps->len)
+      cmp = -1;
+    else
+      cmp = strcmp (old_apps->val[i].app_name, new_apps->val[j].app_name);
+
+    name = cmp <= 0 ? old_apps->val[i].app_name : new_apps->val[j].app_name;
+
+    i_end = i;
+    if (cmp <= 0)
+      while (i_end < old_apps->len && STREQ (old_apps->val[i_end].app_name, name))
+        i_end++;
+    j_end = j;
+    if (cmp >= 0)
+      while (j_end < new_apps->len && STREQ (new_apps->val[j_end].app_name, name))
+        j_end++;
+
+    /* Mark identical entries, which are not reported. */
+    for (k = i; k < i_end; ++k) {
+      for (l = j; l < j_end; ++l) {
+        const struct guestfs_application *o = &old_apps->val[k];
+        const struct guestfs_application *n = &new_apps->val[l];
+
+        if (!new_done[l] &&
+            o->app_epoch == n->app_epoch &&
+            STREQ (o->app_version, n->app_version) &&
+            STREQ (o->app_release, n->app_release)) {
+          old_done[k] = new_done[l] = 1;
+          break;
+        }
+      }
+    }
+
+    k = i;
+    l = j;
+    for (;;) {
+      while (k < i_end && old_done[k])
+        k++;
+      while (l < j_end && new_done[l])
+        l++;
+      if (k >= i_end && l >= j_end)
+        break;
+
+      if (k < i_end && l < j_end)
+        add_change (g, ret, "changed", name,
+                    &old_apps->val[k++], &new_apps->val[l++]);
+      else if (k < i_end)
+        add_change (g, ret, "removed", name, &old_apps->val[k++], NULL);
+      else
+        add_change (g, ret, "added", name, NULL, &new_apps->val[l++]);
+    }
+
+    i = i_end;
+    j = j_end;
+  }
+
+  free (old_done);
+  free (new_done);
+  guestfs_free_application_list (old_apps);
+  guestfs_free_application_list (new_apps);
+
+  return ret;
+}
+
+/* Read the list of applications from the guest, without looking at
+ * the cache.  The returned list is sorted.
+ */
+static struct guestfs_application_list *
+list_applications (guestfs_h *g, struct inspect_fs *fs)
+{
   struct guestfs_application_list *ret = NULL;
 
   /* Presently we can only list applications for installed disks.  It
@@ -126,6 +349,221 @@ guestfs__inspect_list_applications (guestfs_h *g, const char *root)
   return ret;
 }
 
+/* Append the metadata of one package database file to the token.
+ * The inode change time cannot be set by guest userspace, so any
+ * rewrite of the database is visible here, even if the file size
+ * and modification time are preserved.
+ */
+static int
+add_file_to_token (guestfs_h *g, char **token, const char *filename)
+{
+  struct guestfs_stat *st;
+  char *p;
+
+  st = guestfs_lstat (g, filename);
+  if (st == NULL)
+    return -1;
+
+  p = safe_asprintf (g, "%s%s%" PRIi64 ".%" PRIi64 ".%" PRIi64 ".%" PRIi64,
+                     *token ? *token : "1", *token ? ":" : "/",
+                     st->ino, st->size, st->mtime, st->ctime);
+  guestfs_free_stat (st);
+  free (*token);
+  *token = p;
+
+  return 0;
+}
+
+/* Compute the token describing the package databases of this root.
+ * Returns NULL if the package format is not supported or the
+ * databases could not be found.  No error is set in the handle.
+ */
+static char *
+applications_token (guestfs_h *g, struct inspect_fs *fs)
+{
+  char *token = NULL;
+  char *software_path = NULL;
+  int r = -1;
+
+  if (fs->format != OS_FORMAT_INSTALLED)
+    return NULL;
+
+  /* Temporarily replace the error handler, since a missing package
+   * database just means that this root can't be cached.
+   */
+  guestfs_error_handler_cb old_error_cb = g->error_cb;
+  g->error_cb = NULL;
+
+  switch (fs->type) {
+  case OS_TYPE_LINUX:
+  case OS_TYPE_HURD:
+    switch (fs->package_format) {
+    case OS_PACKAGE_FORMAT_RPM:
+#ifdef DB_DUMP
+      r = add_file_to_token (g, &token, "/var/lib/rpm/Name");
+      if (r == 0)
+        r = add_file_to_token (g, &token, "/var/lib/rpm/Packages");
+#endif
+      break;
+
+    case OS_PACKAGE_FORMAT_DEB:
+      r = add_file_to_token (g, &token, "/var/lib/dpkg/status");
+      break;
+
+    case OS_PACKAGE_FORMAT_PACMAN:
+    case OS_PACKAGE_FORMAT_EBUILD:
+    case OS_PACKAGE_FORMAT_PISI:
+    case OS_PACKAGE_FORMAT_PKGSRC:
+    case OS_PACKAGE_FORMAT_UNKNOWN:
+    default:
+      /* nothing - keep GCC happy */;
+    }
+    break;
+
+  case OS_TYPE_WINDOWS: {
+    size_t len = strlen (fs->windows_systemroot) + 64;
+    char software[len];
+    snprintf (software, len, "%s/system32/config/software",
+              fs->windows_systemroot);
+
+    software_path = guestfs___case_sensitive_path_silently (g, software);
+    if (software_path)
+      r = add_file_to_token (g, &token, software_path);
+    break;
+  }
+
+  case OS_TYPE_FREEBSD:
+  case OS_TYPE_NETBSD:
+  case OS_TYPE_UNKNOWN:
+  default:
+    /* nothing - keep GCC happy */;
+  }
+
+  g->error_cb = old_error_cb;
+  free (software_path);
+
+  if (r == -1) {
+    free (token);
+    return NULL;
+  }
+
+  return token;
+}
+
+/* Remove the package databases cached by guestfs___download_to_tmp. */
+static void
+forget_downloads (guestfs_h *g, struct inspect_fs *fs)
+{
+  static const char *basenames[] =
+    { "rpm_Name", "rpm_Packages", "status", "software" };
+  size_t i;
+
+  for (i = 0; i < sizeof basenames / sizeof basenames[0]; ++i) {
+    char *tmp = safe_asprintf (g, "%s/%td-%s",
+                               g->tmpdir, fs - g->fses, basenames[i]);
+    unlink (tmp);
+    free (tmp);
+  }
+}
+
+static struct inspect_apps_entry *
+lookup_applications (struct inspect_fs *fs, const char *token)
+{
+  size_t i;
+
+  for (i = 0; i < fs->nr_apps; ++i)
+    if (STREQ (fs->apps[i].token, token))
+      return &fs->apps[i];
+
+  return NULL;
+}
+
+/* Remember the list of applications just read, and the token
+ * describing the databases it came from.  Ownership of 'token'
+ * passes to this function.  The newest list replaces the previous
+ * one, unless the previous token was returned to the caller.
+ */
+static void
+cache_applications (guestfs_h *g, struct inspect_fs *fs, char *token,
+                    const struct guestfs_application_list *apps)
+{
+  struct inspect_apps_entry *e;
+
+  if (token == NULL)
+    return;
+
+  if (fs->nr_apps > 0 && !fs->apps[fs->nr_apps-1].issued) {
+    e = &fs->apps[fs->nr_apps-1];
+    free (e->token);
+    guestfs_free_application_list (e->apps);
+  }
+  else {
+    fs->apps = safe_realloc (g, fs->apps,
+                             (fs->nr_apps + 1) * sizeof (struct inspect_apps_entry));
+    e = &fs->apps[fs->nr_apps++];
+  }
+
+  e->token = token;
+  e->issued = 0;
+  e->apps = copy_applications (g, apps);
+}
+
+static struct guestfs_application_list *
+copy_applications (guestfs_h *g, const struct guestfs_application_list *apps)
+{
+  struct guestfs_application_list *ret;
+  size_t i;
+
+  ret = safe_malloc (g, sizeof *ret);
+  ret->len = apps->len;
+  ret->val = NULL;
+  if (apps->len > 0)
+    ret->val = safe_malloc (g, apps->len * sizeof (struct guestfs_application));
+
+  for (i = 0; i < apps->len; ++i) {
+    const struct guestfs_application *a = &apps->val[i];
+    struct guestfs_application *r = &ret->val[i];
+
+    r->app_name = safe_strdup (g, a->app_name);
+    r->app_display_name = safe_strdup (g, a->app_display_name);
+    r->app_epoch = a->app_epoch;
+    r->app_version = safe_strdup (g, a->app_version);
+    r->app_release = safe_strdup (g, a->app_release);
+    r->app_install_path = safe_strdup (g, a->app_install_path);
+    r->app_trans_path = safe_strdup (g, a->app_trans_path);
+    r->app_publisher = safe_strdup (g, a->app_publisher);
+    r->app_url = safe_strdup (g, a->app_url);
+    r->app_source_package = safe_strdup (g, a->app_source_package);
+    r->app_summary = safe_strdup (g, a->app_summary);
+    r->app_description = safe_strdup (g, a->app_description);
+  }
+
+  return ret;
+}
+
+static void
+add_change (guestfs_h *g, struct guestfs_application_change_list *changes,
+            const char *type, const char *name,
+            const struct guestfs_application *old_app,
+            const struct guestfs_application *new_app)
+{
+  struct guestfs_application_change *c;
+
+  changes->len++;
+  changes->val = safe_realloc (g, changes->val,
+                               changes->len *
+                               sizeof (struct guestfs_application_change));
+  c = &changes->val[changes->len-1];
+  c->change_type = safe_strdup (g, type);
+  c->change_name = safe_strdup (g, name);
+  c->change_old_epoch = old_app ? old_app->app_epoch : 0;
+  c->change_old_version = safe_strdup (g, old_app ? old_app->app_version : "");
+  c->change_old_release = safe_strdup (g, old_app ? old_app->app_release : "");
+  c->change_new_epoch = new_app ? new_app->app_epoch : 0;
+  c->change_new_version = safe_strdup (g, new_app ? new_app->app_version : "");
+  c->change_new_release = safe_strdup (g, new_app ? new_app->app_release : "");
+}
+
 #ifdef DB_DUMP
 
 /* This data comes from the Name database, and contains the application
@@ -616,4 +1054,17 @@ guestfs__inspect_list_applications (guestfs_h *g, const char *root)
   NOT_IMPL(NULL);
 }
 
+char *
+guestfs__inspect_get_applications_token (guestfs_h *g, const char *root)
+{
+  NOT_IMPL(NULL);
+}
+
+struct guestfs_application_change_list *
+guestfs__inspect_list_application_changes (guestfs_h *g, const char *root,
+                                           const char *token)
+{
+  NOT_IMPL(NULL);
+}
+
 #endif /* no hivex at compile time */
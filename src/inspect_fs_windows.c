@@ -110,38 +110,38 @@ int
 guestfs___has_windows_systemroot (guestfs_h *g)
 {
   size_t i;
-  char *systemroot, *p;
+  char **roots;
   char path[256];
+  int ret = -1;
 
-  for (i = 0; i < sizeof systemroots / sizeof systemroots[0]; ++i) {
-    systemroot = guestfs___case_sensitive_path_silently (g, systemroots[i]);
-    if (!systemroot)
-      continue;
+  /* Resolve all the candidates in a single round trip. */
+  roots = guestfs___case_sensitive_path_list_silently (g, systemroots);
+  if (!roots)
+    return -1;
 
-    snprintf (path, sizeof path, "%s/system32", systemroot);
-    if (!guestfs___is_dir_nocase (g, path)) {
-      free (systemroot);
+  for (i = 0; roots[i] != NULL; ++i) {
+    if (STREQ (roots[i], ""))
       continue;
-    }
 
-    snprintf (path, sizeof path, "%s/system32/config", systemroot);
-    if (!guestfs___is_dir_nocase (g, path)) {
-      free (systemroot);
+    snprintf (path, sizeof path, "%s/system32", roots[i]);
+    if (!guestfs___is_dir_nocase (g, path))
       continue;
-    }
 
-    snprintf (path, sizeof path, "%s/system32/cmd.exe", systemroot);
-    if (!guestfs___is_file_nocase (g, path)) {
-      free (systemroot);
+    snprintf (path, sizeof path, "%s/system32/config", roots[i]);
+    if (!guestfs___is_dir_nocase (g, path))
       continue;
-    }
 
-    free (systemroot);
+    snprintf (path, sizeof path, "%s/system32/cmd.exe", roots[i]);
+    if (!guestfs___is_file_nocase (g, path))
+      continue;
 
-    return (int)i;
+    ret = (int)i;
+    break;
   }
 
-  return -1; /* not found */
+  guestfs___free_string_list (roots);
+
+  return ret; /* -1 if not found */
 }
 
 int
@@ -582,3 +582,17 @@ guestfs___case_sensitive_path_silently (guestfs_h *g, const char *path)
   g->error_cb = old_error_cb;
   return ret;
 }
+
+/* Resolve a NULL-terminated list of paths in one call.  Paths which
+ * cannot be resolved are returned as empty strings.
+ */
+char **
+guestfs___case_sensitive_path_list_silently (guestfs_h *g,
+                                             const char *const *paths)
+{
+  guestfs_error_handler_cb old_error_cb = g->error_cb;
+  g->error_cb = NULL;
+  char **ret = guestfs_case_sensitive_path_list (g, (char * const *) paths);
+  g->error_cb = old_error_cb;
+  return ret;
+}
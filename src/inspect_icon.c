@@ -33,7 +33,7 @@
 #include "guestfs-internal-actions.h"
 #include "guestfs_protocol.h"
 
-static int read_whole_file (guestfs_h *g, const char *filename, char **data_r, size_t *size_r);
+static char *get_icon (guestfs_h *g, struct inspect_fs *fs, int favicon, int highquality, size_t *size_r);
 
 /* All these icon_*() functions return the same way.  One of:
  *
@@ -68,15 +68,20 @@ static char *NOT_FOUND = (char *) "not_found";
  * returned in *size_r.
  *
  * Check optargs for the optional argument.
+ *
+ * The icon (or the fact that there isn't one) is cached in the
+ * inspect_fs struct, one for each combination of optional arguments,
+ * so later calls don't have to read anything from the guest.  The
+ * cache lasts as long as the rest of the inspection data.
  */
 char *
 guestfs__inspect_get_icon (guestfs_h *g, const char *root, size_t *size_r,
                            const struct guestfs_inspect_get_icon_argv *optargs)
 {
   struct inspect_fs *fs;
-  char *r = NOT_FOUND;
+  char *r;
   int favicon, highquality;
-  size_t size;
+  size_t slot;
 
   fs = guestfs___search_for_root (g, root);
   if (!fs)
@@ -95,6 +100,28 @@ guestfs__inspect_get_icon (guestfs_h *g, const char *root, size_t *size_r,
   if (highquality)
     favicon = 0;
 
+  slot = highquality ? 2 : favicon ? 1 : 0;
+  if (fs->icons[slot] == NULL) {
+    r = get_icon (g, fs, favicon, highquality, &fs->icon_sizes[slot]);
+    if (r == NULL)
+      return NULL;
+    fs->icons[slot] = r;
+  }
+
+  /* The buffer is allocated with at least 1 byte (see get_icon). */
+  r = safe_malloc (g, fs->icon_sizes[slot] > 0 ? fs->icon_sizes[slot] : 1);
+  memcpy (r, fs->icons[slot], fs->icon_sizes[slot]);
+  *size_r = fs->icon_sizes[slot];
+  return r;
+}
+
+static char *
+get_icon (guestfs_h *g, struct inspect_fs *fs, int favicon, int highquality,
+          size_t *size_r)
+{
+  char *r = NOT_FOUND;
+  size_t size;
+
   /* Try looking for a favicon first. */
   if (favicon) {
     r = icon_favicon (g, fs, &size);
@@ -185,7 +212,7 @@ guestfs__inspect_get_icon (guestfs_h *g, const char *root, size_t *size_r,
 }
 
 /* Check that the named file 'filename' is a PNG file and is reasonable.
- * If it is, download and return it.
+ * If it is, read and return it.
  */
 static char *
 get_png (guestfs_h *g, struct inspect_fs *fs, const char *filename,
@@ -193,7 +220,7 @@ get_png (guestfs_h *g, struct inspect_fs *fs, const char *filename,
 {
   char *ret = NOT_FOUND;
   char *type = NULL;
-  char *local = NULL;
+  int64_t size;
   int r, w, h;
 
   r = guestfs_exists (g, filename);
@@ -217,17 +244,18 @@ get_png (guestfs_h *g, struct inspect_fs *fs, const char *filename,
   if (max_size == 0)
     max_size = 4 * w * h;
 
-  local = guestfs___download_to_tmp (g, fs, filename, "icon", max_size);
-  if (!local) goto out;
-
-  /* Successfully passed checks and downloaded.  Read it into memory. */
-  if (read_whole_file (g, local, &ret, size_r) == -1) {
-    ret = NULL;
+  size = guestfs_filesize (g, filename);
+  if (size == -1) goto out;
+  if ((uint64_t) size > max_size) {
+    debug (g, "size of %s is unreasonably large (%" PRIi64 " bytes)",
+           filename, size);
     goto out;
   }
 
+  /* Successfully passed checks.  Read it into memory. */
+  ret = guestfs_read_file (g, filename, size_r);
+
  out:
-  free (local);
   free (type);
 
   return ret;
@@ -328,103 +356,35 @@ icon_opensuse (guestfs_h *g, struct inspect_fs *fs, size_t *size_r)
 /* Windows, as usual, has to be much more complicated and stupid than
  * anything else.
  *
- * We have to download %systemroot%\explorer.exe and use a special
- * program called 'wrestool' to extract the icons from this file.  For
- * each version of Windows, the icon we want is in a different place.
- * The icon is in a stupid format (BMP), and in some cases multiple
- * icons are in a single BMP file so we have to do some manipulation
- * on the file.
+ * The icons are bitmap resources in %systemroot%\explorer.exe.  For
+ * each version of Windows, the icon we want is in a different place,
+ * and in some cases multiple icons are in a single bitmap so we only
+ * want the top part of it.  The daemon extracts the resource and
+ * converts it to PNG (see daemon/icon.c), so only the icon itself is
+ * transferred.
  *
  * XXX I've only bothered with this nonsense for a few versions of
  * Windows that I have handy.  Please send patches to support other
  * versions.
  */
-
-static char *
-icon_windows_xp (guestfs_h *g, struct inspect_fs *fs, const char *explorer,
-                 size_t *size_r)
-{
-  char *ret;
-  char *pngfile;
-  char *cmd;
-  int r;
-
-  pngfile = safe_asprintf (g, "%s/windows-xp-icon.png", g->tmpdir);
-
-  cmd = safe_asprintf (g,
-                       "wrestool -x --type=2 --name=143 %s | "
-                       "bmptopnm | pnmtopng > %s",
-          explorer, pngfile);
-  r = system (cmd);
-  if (r == -1 || WEXITSTATUS (r) != 0) {
-    debug (g, "external command failed: %s", cmd);
-    free (cmd);
-    free (pngfile);
-    return NOT_FOUND;
-  }
-
-  free (cmd);
-
-  if (read_whole_file (g, pngfile, &ret, size_r) == -1) {
-    free (pngfile);
-    return NULL;
-  }
-
-  free (pngfile);
-
-  return ret;
-}
-
-static char *
-icon_windows_7 (guestfs_h *g, struct inspect_fs *fs, const char *explorer,
-                size_t *size_r)
-{
-  char *ret;
-  char *pngfile;
-  char *cmd;
-  int r;
-
-  pngfile = safe_asprintf (g, "%s/windows-7-icon.png", g->tmpdir);
-
-  cmd = safe_asprintf (g,
-                       "wrestool -x --type=2 --name=6801 %s | "
-                       "bmptopnm | pamcut -bottom 54 | pnmtopng > %s",
-          explorer, pngfile);
-  r = system (cmd);
-  if (r == -1 || WEXITSTATUS (r) != 0) {
-    debug (g, "external command failed: %s", cmd);
-    free (cmd);
-    free (pngfile);
-    return NOT_FOUND;
-  }
-
-  free (cmd);
-
-  if (read_whole_file (g, pngfile, &ret, size_r) == -1) {
-    free (pngfile);
-    return NULL;
-  }
-
-  free (pngfile);
-
-  return ret;
-}
-
 static char *
 icon_windows (guestfs_h *g, struct inspect_fs *fs, size_t *size_r)
 {
-  char *(*fn) (guestfs_h *g, struct inspect_fs *fs, const char *explorer,
-               size_t *size_r);
-  char *filename1, *filename2, *filename3;
+  int resourceid, height;
+  char *filename1, *filename2;
   char *ret;
 
   /* Windows XP. */
-  if (fs->major_version == 5 && fs->minor_version == 1)
-    fn = icon_windows_xp;
+  if (fs->major_version == 5 && fs->minor_version == 1) {
+    resourceid = 143;
+    height = 0;
+  }
 
-  /* Windows 7 */
-  else if (fs->major_version == 6 && fs->minor_version == 1)
-    fn = icon_windows_7;
+  /* Windows 7: the same as 'pamcut -bottom 54'. */
+  else if (fs->major_version == 6 && fs->minor_version == 1) {
+    resourceid = 6801;
+    height = 55;
+  }
 
   /* Not (yet) a supported version of Windows. */
   else return NOT_FOUND;
@@ -432,79 +392,23 @@ icon_windows (guestfs_h *g, struct inspect_fs *fs, size_t *size_r)
   if (fs->windows_systemroot == NULL)
     return NOT_FOUND;
 
-  /* Download %systemroot%\explorer.exe */
   filename1 = safe_asprintf (g, "%s/explorer.exe", fs->windows_systemroot);
   filename2 = guestfs___case_sensitive_path_silently (g, filename1);
   free (filename1);
   if (filename2 == NULL)
     return NOT_FOUND;
 
-  filename3 = guestfs___download_to_tmp (g, fs, filename2, "explorer",
-                                         MAX_WINDOWS_EXPLORER_SIZE);
-  free (filename2);
-  if (filename3 == NULL)
-    return NOT_FOUND;
+  /* Any failure here just means there is no icon. */
+  guestfs_error_handler_cb old_error_cb = g->error_cb;
+  g->error_cb = NULL;
+  ret = guestfs_internal_pe_icon (g, filename2, resourceid, height, size_r);
+  g->error_cb = old_error_cb;
 
-  ret = fn (g, fs, filename3, size_r);
-  free (filename3);
-  return ret;
-}
-
-/* Read the whole file into a memory buffer and return it.  The file
- * should be a regular, local, trusted file.
- */
-static int
-read_whole_file (guestfs_h *g, const char *filename,
-                 char **data_r, size_t *size_r)
-{
-  int fd;
-  char *data;
-  off_t size;
-  off_t n;
-  ssize_t r;
-  struct stat statbuf;
-
-  fd = open (filename, O_RDONLY);
-  if (fd == -1) {
-    perrorf (g, "open: %s", filename);
-    return -1;
-  }
-
-  if (fstat (fd, &statbuf) == -1) {
-    perrorf (g, "stat: %s", filename);
-    close (fd);
-    return -1;
-  }
-
-  size = statbuf.st_size;
-  data = safe_malloc (g, size);
-
-  n = 0;
-  while (n < size) {
-    r = read (fd, &data[n], size - n);
-    if (r == -1) {
-      perrorf (g, "read: %s", filename);
-      free (data);
-      close (fd);
-      return -1;
-    }
-    if (r == 0) {
-      error (g, _("read: %s: unexpected end of file"), filename);
-      free (data);
-      close (fd);
-      return -1;
-    }
-    n += r;
-  }
-
-  if (close (fd) == -1) {
-    perrorf (g, "close: %s", filename);
-    free (data);
-    return -1;
+  if (ret == NULL) {
+    debug (g, "%s: no icon: %s", filename2, guestfs_last_error (g));
+    ret = NOT_FOUND;
   }
 
-  *data_r = data;
-  *size_r = size;
-
-  return 0;
+  free (filename2);
+  return ret;
 }
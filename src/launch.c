@@ -78,7 +78,10 @@ static int64_t timeval_diff (const struct timeval *x, const struct timeval *y);
 static void print_qemu_command_line (guestfs_h *g, char **argv);
 static int connect_unix_socket (guestfs_h *g, const char *sock);
 static int qemu_supports (guestfs_h *g, const char *option);
-static char *qemu_drive_param (guestfs_h *g, const struct drive *drv);
+static char *qemu_drive_param (guestfs_h *g, const struct drive *drv, size_t index);
+static char *qemu_device_param (guestfs_h *g, const struct drive *drv, size_t index);
+static int drives_need_devices (guestfs_h *g);
+static int check_drives (guestfs_h *g);
 
 #if 0
 static int qemu_supports_re (guestfs_h *g, const pcre *option_regex);
@@ -190,7 +193,7 @@ guestfs__debug_drives (guestfs_h *g)
   ret = safe_malloc (g, sizeof (char *) * (count + 1));
 
   for (i = 0, drv = g->drives; drv; i++, drv = drv->next)
-    ret[i] = qemu_drive_param (g, drv);
+    ret[i] = qemu_drive_param (g, drv, i);
 
   ret[count] = NULL;
 
@@ -295,6 +298,11 @@ guestfs__add_drive_opts (guestfs_h *g, const char *filename,
   char *format;
   char *iface;
   char *name;
+  enum discard discard = DISCARD_DISABLE;
+  char *cachemode = NULL;
+  char *aio = NULL;
+  int iothread;
+  int queues;
   char *abs_path = NULL;
   int use_cache_off;
 
@@ -310,6 +318,56 @@ guestfs__add_drive_opts (guestfs_h *g, const char *filename,
   name = optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_NAME_BITMASK
           ? safe_strdup (g, optargs->name) : NULL;
 
+  if (optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_DISCARD_BITMASK) {
+    if (STREQ (optargs->discard, "disable"))
+      discard = DISCARD_DISABLE;
+    else if (STREQ (optargs->discard, "enable"))
+      discard = DISCARD_ENABLE;
+    else if (STREQ (optargs->discard, "besteffort"))
+      discard = DISCARD_BESTEFFORT;
+    else {
+      error (g, _("discard parameter must be 'disable', 'enable' or 'besteffort'"));
+      goto err_out;
+    }
+  }
+
+  if (optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_CACHEMODE_BITMASK) {
+    if (STRNEQ (optargs->cachemode, "writeback") &&
+        STRNEQ (optargs->cachemode, "writethrough") &&
+        STRNEQ (optargs->cachemode, "none") &&
+        STRNEQ (optargs->cachemode, "directsync") &&
+        STRNEQ (optargs->cachemode, "unsafe")) {
+      error (g, _("cachemode parameter must be 'writeback', 'writethrough', 'none', 'directsync' or 'unsafe'"));
+      goto err_out;
+    }
+    cachemode = safe_strdup (g, optargs->cachemode);
+  }
+
+  if (optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_AIO_BITMASK) {
+    if (STRNEQ (optargs->aio, "threads") && STRNEQ (optargs->aio, "native")) {
+      error (g, _("aio parameter must be 'threads' or 'native'"));
+      goto err_out;
+    }
+    aio = safe_strdup (g, optargs->aio);
+  }
+
+  iothread = optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_IOTHREAD_BITMASK
+             ? optargs->iothread : 0;
+  queues = -1;
+  if (optargs->bitmask & GUESTFS_ADD_DRIVE_OPTS_QUEUES_BITMASK) {
+    if (optargs->queues < 0) {
+      error (g, _("queues parameter must be >= 0"));
+      goto err_out;
+    }
+    queues = optargs->queues;
+  }
+
+  /* iothreads and multiqueue are properties of the virtio-blk device. */
+  if ((iothread || queues >= 0) && STRNEQ (iface, "virtio")) {
+    error (g, _("iothread and queues can only be used with iface 'virtio'"));
+    goto err_out;
+  }
+
   if (format && !valid_format_iface (format)) {
     error (g, _("%s parameter is empty or contains disallowed characters"),
            "format");
@@ -329,6 +387,21 @@ guestfs__add_drive_opts (guestfs_h *g, const char *filename,
   if (use_cache_off == -1)
     goto err_out;
 
+  /* These cache modes, and aio=native, use O_DIRECT. */
+  if (!readonly && cachemode &&
+      (STREQ (cachemode, "none") || STREQ (cachemode, "directsync")) &&
+      !use_cache_off) {
+    error (g, _("%s: cachemode '%s' cannot be used because the file cannot be opened with O_DIRECT"),
+           filename, cachemode);
+    goto err_out;
+  }
+  if (aio && STREQ (aio, "native") &&
+      !(cachemode ? STREQ (cachemode, "none") || STREQ (cachemode, "directsync")
+                  : use_cache_off)) {
+    error (g, _("aio 'native' requires cachemode 'none' or 'directsync'"));
+    goto err_out;
+  }
+
   if (readonly) {
     if (access (filename, R_OK) == -1) {
       perrorf (g, "%s", filename);
@@ -354,6 +427,11 @@ guestfs__add_drive_opts (guestfs_h *g, const char *filename,
   (*i)->iface = iface;
   (*i)->name = name;
   (*i)->use_cache_off = use_cache_off;
+  (*i)->discard = discard;
+  (*i)->cachemode = cachemode;
+  (*i)->aio = aio;
+  (*i)->iothread = iothread;
+  (*i)->queues = queues;
 
   free (abs_path);
   return 0;
@@ -362,6 +440,8 @@ err_out:
   free (format);
   free (iface);
   free (name);
+  free (cachemode);
+  free (aio);
   free (abs_path);
   return -1;
 }
@@ -432,6 +512,8 @@ static int is_openable (guestfs_h *g, const char *path, int flags);
 int
 guestfs__launch (guestfs_h *g)
 {
+  int r;
+
   /* Configured? */
   if (g->state != CONFIG) {
     error (g, _("the libguestfs handle has already been launched"));
@@ -460,14 +542,38 @@ guestfs__launch (guestfs_h *g)
   /* Launch the appliance or attach to an existing daemon. */
   switch (g->attach_method) {
   case ATTACH_METHOD_APPLIANCE:
-    return launch_appliance (g);
+    r = launch_appliance (g);
+    break;
 
   case ATTACH_METHOD_UNIX:
-    return connect_unix_socket (g, g->attach_method_arg);
+    r = connect_unix_socket (g, g->attach_method_arg);
+    break;
 
   default:
     abort ();
   }
+
+  if (r == -1)
+    return -1;
+
+  /* If the caller enabled transfer compression before launching, tell
+   * the daemon now.  This can only fail if the daemon was built
+   * without zlib, in which case carry on with compression disabled.
+   */
+  if (g->transfer_compression) {
+    /* Don't call the caller's error handler for this. */
+    guestfs_error_handler_cb old_error_cb = g->error_cb;
+    g->error_cb = NULL;
+    r = guestfs_internal_transfer_compression (g, 1);
+    g->error_cb = old_error_cb;
+    if (r == -1) {
+      debug (g, "transfer compression could not be enabled in the daemon: %s",
+             guestfs_last_error (g));
+      g->transfer_compression = 0;
+    }
+  }
+
+  return 0;
 }
 
 static int
@@ -508,6 +614,9 @@ launch_appliance (guestfs_h *g)
   if (qemu_supports (g, NULL) == -1)
     goto cleanup0;
 
+  if (check_drives (g) == -1)
+    goto cleanup0;
+
   /* Using virtio-serial, we need to create a local Unix domain socket
    * for qemu to connect to.
    */
@@ -539,6 +648,10 @@ launch_appliance (guestfs_h *g)
     goto cleanup0;
   }
 
+  /* Extra data channels for parallel transfers, if requested. */
+  if (guestfs___listen_data_channels (g) == -1)
+    goto cleanup0;
+
   if (!g->direct) {
     if (pipe (wfd) == -1 || pipe (rfd) == -1) {
       perrorf (g, "pipe");
@@ -563,6 +676,7 @@ launch_appliance (guestfs_h *g)
 
   if (r == 0) {			/* Child (qemu). */
     char buf[256];
+    size_t i;
 
     /* Set up the full command line.  Do this in the subprocess so we
      * don't need to worry about cleaning up.
@@ -587,15 +701,27 @@ launch_appliance (guestfs_h *g)
 
     /* Add drives */
     struct drive *drv = g->drives;
-    while (drv != NULL) {
+    for (i = 0; drv != NULL; ++i, drv = drv->next) {
       /* Construct the final -drive parameter. */
-      char *buf = qemu_drive_param (g, drv);
+      char *param = qemu_drive_param (g, drv, i);
 
       add_cmdline (g, "-drive");
-      add_cmdline (g, buf);
-      free (buf);
+      add_cmdline (g, param);
+      free (param);
+
+      if (drv->iothread) {
+        snprintf (buf, sizeof buf, "iothread,id=iothread%zu", i);
+        add_cmdline (g, "-object");
+        add_cmdline (g, buf);
+      }
 
-      drv = drv->next;
+      /* Some drives need a separate -device parameter. */
+      param = qemu_device_param (g, drv, i);
+      if (param) {
+        add_cmdline (g, "-device");
+        add_cmdline (g, param);
+        free (param);
+      }
     }
 
     if (qemu_supports (g, "-nodefconfig"))
@@ -696,6 +822,18 @@ launch_appliance (guestfs_h *g)
     add_cmdline (g, "-device");
     add_cmdline (g, "virtserialport,chardev=channel0,name=org.libguestfs.channel.0");
 
+    for (i = 1; i <= g->nr_data_socks; ++i) {
+      add_cmdline (g, "-chardev");
+      snprintf (buf, sizeof buf, "socket,path=%s/data%zu.sock,id=data%zu",
+                g->tmpdir, i, i);
+      add_cmdline (g, buf);
+      add_cmdline (g, "-device");
+      snprintf (buf, sizeof buf,
+                "virtserialport,chardev=data%zu,name=org.libguestfs.data.%zu",
+                i, i);
+      add_cmdline (g, buf);
+    }
+
     /* Enable user networking. */
     if (g->enable_network) {
       add_cmdline (g, "-netdev");
@@ -899,6 +1037,7 @@ launch_appliance (guestfs_h *g)
 
   close (g->sock); /* Close the listening socket. */
   g->sock = r; /* This is the accepted data socket. */
+  g->recv_buf_start = g->recv_buf_end = 0;
 
   if (fcntl (g->sock, F_SETFL, O_NONBLOCK) == -1) {
     perrorf (g, "fcntl");
@@ -917,6 +1056,12 @@ launch_appliance (guestfs_h *g)
     goto cleanup1;
   }
 
+  /* qemu connected to the data channel sockets before starting the
+   * guest, so these accepts cannot block.
+   */
+  if (guestfs___accept_data_channels (g) == -1)
+    goto cleanup1;
+
   if (g->verbose)
     guestfs___print_timestamped_message (g, "appliance is up");
 
@@ -956,6 +1101,7 @@ launch_appliance (guestfs_h *g)
     close (g->sock);
     g->sock = -1;
   }
+  guestfs___close_data_channels (g);
   g->state = CONFIG;
   free (kernel);
   free (initrd);
@@ -1333,28 +1479,122 @@ is_openable (guestfs_h *g, const char *path, int flags)
   return 1;
 }
 
+/* Check that qemu supports the drive options which were asked for.
+ * Drives which require discard need a qemu that can pass it through.
+ * (For besteffort, qemu_drive_param quietly drops it instead.)
+ */
+static int
+check_drives (guestfs_h *g)
+{
+  struct drive *drv;
+
+  for (drv = g->drives; drv != NULL; drv = drv->next) {
+    if (drv->discard == DISCARD_ENABLE && qemu_supports (g, "discard=") <= 0) {
+      error (g, _("discard cannot be enabled on %s because this qemu does not support it"),
+             drv->path);
+      return -1;
+    }
+    if (drv->cachemode && qemu_supports (g, drv->cachemode) <= 0) {
+      error (g, _("cachemode '%s' cannot be used on %s because this qemu does not support it"),
+             drv->cachemode, drv->path);
+      return -1;
+    }
+    if (drv->aio && qemu_supports (g, "aio=") <= 0) {
+      error (g, _("aio cannot be set on %s because this qemu does not support it"),
+             drv->path);
+      return -1;
+    }
+    if (drv->iothread && qemu_supports (g, "-object") <= 0) {
+      error (g, _("iothread cannot be used on %s because this qemu does not support it"),
+             drv->path);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Drives which use an iothread or several queues must be attached
+ * with a separate '-device virtio-blk-pci' parameter.  qemu creates
+ * the devices for '-drive if=virtio' after all the '-device'
+ * parameters, so if any drive needs this then all the virtio drives
+ * use it, in order to keep the drives in the order they were added.
+ * (The appliance drive is always last, so it can still use if=virtio.)
+ */
+static int
+drives_need_devices (guestfs_h *g)
+{
+  struct drive *drv;
+
+  for (drv = g->drives; drv != NULL; drv = drv->next) {
+    if (drv->iothread || drv->queues >= 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+static int
+uses_device_param (guestfs_h *g, const struct drive *drv)
+{
+  return STREQ (drv->iface, "virtio") && drives_need_devices (g);
+}
+
 static char *
-qemu_drive_param (guestfs_h *g, const struct drive *drv)
+qemu_drive_param (guestfs_h *g, const struct drive *drv, size_t index)
 {
-  size_t len = 64;
-  char *r;
+  const char *cachemode;
+  const char *iface;
+  char id[64];
 
-  len += strlen (drv->path);
-  len += strlen (drv->iface);
-  if (drv->format)
-    len += strlen (drv->format);
+  /* If no cache mode was chosen, use cache=off where possible (see
+   * test_cache_off).
+   */
+  cachemode = drv->cachemode ? : drv->use_cache_off ? "off" : NULL;
 
-  r = safe_malloc (g, len);
+  if (uses_device_param (g, drv)) {
+    snprintf (id, sizeof id, "none,id=hd%zu", index);
+    iface = id;
+  }
+  else
+    iface = drv->iface;
+
+  return safe_asprintf (g, "file=%s%s%s%s%s%s%s%s%s,if=%s",
+                        drv->path,
+                        drv->readonly ? ",snapshot=on" : "",
+                        cachemode ? ",cache=" : "",
+                        cachemode ? cachemode : "",
+                        drv->aio ? ",aio=" : "",
+                        drv->aio ? drv->aio : "",
+                        drv->format ? ",format=" : "",
+                        drv->format ? drv->format : "",
+                        drv->discard != DISCARD_DISABLE &&
+                        qemu_supports (g, "discard=") > 0
+                        ? ",discard=unmap" : "",
+                        iface);
+}
 
-  snprintf (r, len, "file=%s%s%s%s%s,if=%s",
-            drv->path,
-            drv->readonly ? ",snapshot=on" : "",
-            drv->use_cache_off ? ",cache=off" : "",
-            drv->format ? ",format=" : "",
-            drv->format ? drv->format : "",
-            drv->iface);
+/* The -device parameter for a drive, or NULL if the drive doesn't
+ * need one (see drives_need_devices).
+ */
+static char *
+qemu_device_param (guestfs_h *g, const struct drive *drv, size_t index)
+{
+  char iothread[64] = "", queues[64] = "";
 
-  return r;                     /* caller frees */
+  if (!uses_device_param (g, drv))
+    return NULL;
+
+  if (drv->iothread)
+    snprintf (iothread, sizeof iothread, ",iothread=iothread%zu", index);
+
+  /* queues = 0 means one queue per vCPU. */
+  if (drv->queues >= 0)
+    snprintf (queues, sizeof queues, ",num-queues=%d",
+              drv->queues > 0 ? drv->queues : g->smp);
+
+  return safe_asprintf (g, "virtio-blk-pci,drive=hd%zu%s%s",
+                        index, iothread, queues);
 }
 
 /* You had to call this function after launch in versions <= 1.0.70,
@@ -28,6 +28,7 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -61,6 +62,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "c-ctype.h"
 #include "glthread/lock.h"
 #include "ignore-value.h"
@@ -73,6 +78,9 @@
 /* Size of guestfs_progress message on the wire. */
 #define PROGRESS_MESSAGE_SIZE 24
 
+/* Size of the buffer used to read from the daemon socket. */
+#define RECV_BUF_SIZE 65536
+
 /* This is the code used to send and receive RPC messages and (for
  * certain types of message) to perform file transfers.  This code is
  * driven from the generated actions (src/actions.c).  There
@@ -196,6 +204,8 @@ guestfs___set_busy (guestfs_h *g)
 int
 guestfs___end_busy (guestfs_h *g)
 {
+  guestfs___stats_end (g);
+
   switch (g->state)
     {
     case BUSY:
@@ -227,9 +237,11 @@ child_cleanup (guestfs_h *g)
   if (g->fd[0] >= 0) close (g->fd[0]);
   if (g->fd[1] >= 0) close (g->fd[1]);
   close (g->sock);
+  guestfs___close_data_channels (g);
   g->fd[0] = -1;
   g->fd[1] = -1;
   g->sock = -1;
+  g->recv_buf_start = g->recv_buf_end = 0;
   g->pid = 0;
   g->recoverypid = 0;
   memset (&g->launch_t, 0, sizeof g->launch_t);
@@ -306,6 +318,68 @@ read_log_message_or_eof (guestfs_h *g, int fd, int error_if_eof)
   return 0;
 }
 
+/* Number of bytes read from the daemon socket but not yet consumed. */
+static inline size_t
+recv_buffered (guestfs_h *g)
+{
+  return g->recv_buf_end - g->recv_buf_start;
+}
+
+/* Read up to 'n' bytes from the daemon socket, like read(2).
+ *
+ * Small reads are satisfied from g->recv_buf, which is refilled with
+ * a single large read when it is empty.  During FileOut transfers the
+ * daemon sends a file chunk and often a progress message back to
+ * back, and previously each of them (and each length word) cost a
+ * select(2) and a read(2).  Reads which are at least as big as the
+ * buffer go straight to the socket to avoid the extra copy.
+ */
+static ssize_t
+read_from_daemon (guestfs_h *g, void *buf, size_t n)
+{
+  size_t avail = recv_buffered (g);
+  ssize_t r;
+
+  if (avail == 0) {
+    if (n >= RECV_BUF_SIZE)
+      return read (g->sock, buf, n);
+
+    if (g->recv_buf == NULL)
+      g->recv_buf = safe_malloc (g, RECV_BUF_SIZE);
+
+    r = read (g->sock, g->recv_buf, RECV_BUF_SIZE);
+    if (r <= 0)
+      return r;
+    g->recv_buf_start = 0;
+    g->recv_buf_end = avail = r;
+  }
+
+  if (n > avail)
+    n = avail;
+  memcpy (buf, g->recv_buf + g->recv_buf_start, n);
+  g->recv_buf_start += n;
+  return n;
+}
+
+/* Returns true if the next message waiting in g->recv_buf is a
+ * progress notification.
+ */
+static int
+progress_message_buffered (guestfs_h *g)
+{
+  uint32_t flag;
+  XDR xdr;
+
+  if (recv_buffered (g) < 4)
+    return 0;
+
+  xdrmem_create (&xdr, g->recv_buf + g->recv_buf_start, 4, XDR_DECODE);
+  xdr_uint32_t (&xdr, &flag);
+  xdr_destroy (&xdr);
+
+  return flag == GUESTFS_PROGRESS_FLAG;
+}
+
 /* Read 'n' bytes, setting the socket to blocking temporarily so
  * that we really read the number of bytes requested.
  * Returns:  0 == EOF while reading
@@ -319,6 +393,18 @@ really_read_from_socket (guestfs_h *g, int sock, char *buf, size_t n)
   ssize_t r;
   size_t got;
 
+  /* Anything already buffered from the daemon socket comes first. */
+  got = 0;
+  if (sock == g->sock) {
+    got = MIN (n, recv_buffered (g));
+    if (got > 0) {
+      memcpy (buf, g->recv_buf + g->recv_buf_start, got);
+      g->recv_buf_start += got;
+    }
+    if (got == n)
+      return (ssize_t) got;
+  }
+
   /* Set socket to blocking. */
   flags = fcntl (sock, F_GETFL);
   if (flags == -1) {
@@ -330,7 +416,6 @@ really_read_from_socket (guestfs_h *g, int sock, char *buf, size_t n)
     return -1;
   }
 
-  got = 0;
   while (got < n) {
     r = read (sock, &buf[got], n-got);
     if (r == -1) {
@@ -404,7 +489,8 @@ check_for_daemon_cancellation_or_eof (guestfs_h *g, int fd)
       return -1;
     }
 
-    if (g->state == BUSY) {
+    if (g->state == BUSY && (g->events_mask & GUESTFS_EVENT_PROGRESS) &&
+        !progress_message_buffered (g)) {
       guestfs_progress message;
 
       xdrmem_create (&xdr, buf, PROGRESS_MESSAGE_SIZE, XDR_DECODE);
@@ -449,6 +535,9 @@ guestfs___send_to_daemon (guestfs_h *g, const void *v_buf, size_t n)
   debug (g, "send_to_daemon: %zu bytes: %s", n,
          message_summary (v_buf, n, summary));
 
+  if (g->stats_proc >= 0)
+    g->call_stats[g->stats_proc].bytes_sent += n;
+
   FD_ZERO (&rset);
   FD_ZERO (&wset);
 
@@ -474,7 +563,7 @@ guestfs___send_to_daemon (guestfs_h *g, const void *v_buf, size_t n)
       if (read_log_message_or_eof (g, g->fd[1], 0) == -1)
         return -1;
     }
-    if (FD_ISSET (g->sock, &rset2)) {
+    if (FD_ISSET (g->sock, &rset2) || recv_buffered (g) > 0) {
       r = check_for_daemon_cancellation_or_eof (g, g->sock);
       if (r == -1)
 	return r;
@@ -580,15 +669,24 @@ guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn)
     if (nr >= message_size)
       break;
 
-    rset2 = rset;
-    int r = select (max_fd+1, &rset2, NULL, NULL, NULL);
-    if (r == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-        continue;
-      perrorf (g, "select");
-      free (*buf_rtn);
-      *buf_rtn = NULL;
-      return -1;
+    int r;
+
+    /* If there is buffered data, process it without calling select. */
+    if (recv_buffered (g) > 0) {
+      FD_ZERO (&rset2);
+      FD_SET (g->sock, &rset2);
+    }
+    else {
+      rset2 = rset;
+      r = select (max_fd+1, &rset2, NULL, NULL, NULL);
+      if (r == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        perrorf (g, "select");
+        free (*buf_rtn);
+        *buf_rtn = NULL;
+        return -1;
+      }
     }
 
     if (g->fd[1] >= 0 && FD_ISSET (g->fd[1], &rset2)) {
@@ -600,7 +698,7 @@ guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn)
     }
     if (FD_ISSET (g->sock, &rset2)) {
       if (nr < 0) {    /* Have we read the message length word yet? */
-        r = read (g->sock, lenbuf+nr+4, -nr);
+        r = read_from_daemon (g, lenbuf+nr+4, -nr);
         if (r == -1) {
           if (errno == EINTR || errno == EAGAIN)
             continue;
@@ -666,9 +764,8 @@ guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn)
       }
 
       size_t sizetoread = message_size - nr;
-      if (sizetoread > BUFSIZ) sizetoread = BUFSIZ;
 
-      r = read (g->sock, (char *) (*buf_rtn) + nr, sizetoread);
+      r = read_from_daemon (g, (char *) (*buf_rtn) + nr, sizetoread);
       if (r == -1) {
         if (errno == EINTR || errno == EAGAIN)
           continue;
@@ -689,6 +786,9 @@ guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn)
   }
 
   /* Got the full message, caller can start processing it. */
+  if (g->stats_proc >= 0)
+    g->call_stats[g->stats_proc].bytes_received += nr + 4;
+
 #ifdef ENABLE_PACKET_DUMP
   if (g->verbose) {
     ssize_t i, j;
@@ -713,7 +813,12 @@ guestfs___recv_from_daemon (guestfs_h *g, uint32_t *size_rtn, void **buf_rtn)
 #endif
 
   if (*size_rtn == GUESTFS_PROGRESS_FLAG) {
-    if (g->state == BUSY) {
+    /* Only decode the message if someone is listening for it.  If a
+     * newer progress message has already arrived, this one is stale
+     * and is dropped.
+     */
+    if (g->state == BUSY && (g->events_mask & GUESTFS_EVENT_PROGRESS) &&
+        !progress_message_buffered (g)) {
       guestfs_progress message;
       XDR xdr;
       xdrmem_create (&xdr, *buf_rtn, PROGRESS_MESSAGE_SIZE, XDR_DECODE);
@@ -857,6 +962,8 @@ guestfs___send (guestfs_h *g, int proc_nr,
   xdrmem_create (&xdr, msg_out, 4, XDR_ENCODE);
   xdr_uint32_t (&xdr, &len);
 
+  guestfs___stats_start (g, proc_nr);
+
  again:
   r = guestfs___send_to_daemon (g, msg_out, msg_out_size);
   if (r == -2)                  /* Ignore stray daemon cancellations. */
@@ -872,6 +979,124 @@ guestfs___send (guestfs_h *g, int proc_nr,
   return -1;
 }
 
+#ifdef HAVE_ZLIB
+/* Chunks shorter than this are not worth compressing. */
+#define MIN_DEFLATE_CHUNK 128
+
+/* When a chunk doesn't get smaller, don't bother trying to compress
+ * the next few chunks either, so that sending incompressible data
+ * (eg. disk images) costs very little extra.
+ */
+#define DEFLATE_BACKOFF 16
+
+/* Compress a single chunk into 'out', which must have room for
+ * GUESTFS_MAX_CHUNK_SIZE bytes.  Returns the compressed length, or 0
+ * if the chunk should be sent uncompressed.
+ */
+static size_t
+deflate_chunk (guestfs_h *g, const char *buf, size_t len, char *out)
+{
+  z_stream *zs;
+  int r;
+
+  if (len < MIN_DEFLATE_CHUNK)
+    return 0;
+
+  if (g->deflate_skip > 0) {
+    g->deflate_skip--;
+    return 0;
+  }
+
+  if (!g->deflate_stream) {
+    zs = safe_calloc (g, 1, sizeof *zs);
+    if (deflateInit (zs, Z_BEST_SPEED) != Z_OK) {
+      debug (g, "deflateInit failed, not compressing uploads");
+      free (zs);
+      g->deflate_skip = INT_MAX;
+      return 0;
+    }
+    g->deflate_stream = zs;
+  }
+  else {
+    zs = g->deflate_stream;
+    deflateReset (zs);
+  }
+
+  zs->next_in = (Bytef *) buf;
+  zs->avail_in = len;
+  zs->next_out = (Bytef *) out;
+  /* Only worth sending if it is smaller than the original. */
+  zs->avail_out = len - 1;
+
+  r = deflate (zs, Z_FINISH);
+  if (r != Z_STREAM_END) {
+    g->deflate_skip = DEFLATE_BACKOFF;
+    return 0;
+  }
+
+  return zs->total_out;
+}
+
+/* Inflate a compressed chunk received from the daemon.  Returns a
+ * newly allocated buffer and sets *outlen, or returns NULL on error.
+ */
+static char *
+inflate_chunk (guestfs_h *g, const char *buf, size_t len, size_t *outlen)
+{
+  z_stream *zs;
+  char *out;
+  int r;
+
+  if (!g->inflate_stream) {
+    zs = safe_calloc (g, 1, sizeof *zs);
+    if (inflateInit (zs) != Z_OK) {
+      error (g, _("inflateInit failed"));
+      free (zs);
+      return NULL;
+    }
+    g->inflate_stream = zs;
+  }
+  else {
+    zs = g->inflate_stream;
+    inflateReset (zs);
+  }
+
+  out = safe_malloc (g, GUESTFS_MAX_CHUNK_SIZE);
+
+  zs->next_in = (Bytef *) buf;
+  zs->avail_in = len;
+  zs->next_out = (Bytef *) out;
+  zs->avail_out = GUESTFS_MAX_CHUNK_SIZE;
+
+  r = inflate (zs, Z_FINISH);
+  if (r != Z_STREAM_END) {
+    error (g, _("failed to decompress file chunk (zlib error %d)"), r);
+    free (out);
+    return NULL;
+  }
+
+  *outlen = zs->total_out;
+  return out;
+}
+#endif /* HAVE_ZLIB */
+
+void
+guestfs___free_transfer_compression (guestfs_h *g)
+{
+#ifdef HAVE_ZLIB
+  if (g->deflate_stream) {
+    deflateEnd (g->deflate_stream);
+    free (g->deflate_stream);
+    g->deflate_stream = NULL;
+  }
+  if (g->inflate_stream) {
+    inflateEnd (g->inflate_stream);
+    free (g->inflate_stream);
+    g->inflate_stream = NULL;
+  }
+#endif
+}
+
 static int send_file_chunk (guestfs_h *g, int cancel, const char *buf, size_t len);
 static int send_file_data (guestfs_h *g, const char *buf, size_t len);
 static int send_file_cancellation (guestfs_h *g);
@@ -919,8 +1144,7 @@ guestfs___send_file (guestfs_h *g, const char *filename)
   }
 
   if (g->user_cancel) {
-    error (g, _("operation cancelled by user"));
-    g->last_errnum = EINTR;
+    guestfs_error_errno (g, EINTR, _("operation cancelled by user"));
     send_file_cancellation (g);
     return -1;
   }
@@ -941,6 +1165,18 @@ guestfs___send_file (guestfs_h *g, const char *filename)
 static int
 send_file_data (guestfs_h *g, const char *buf, size_t len)
 {
+#ifdef HAVE_ZLIB
+  char deflated[GUESTFS_MAX_CHUNK_SIZE];
+  size_t deflated_len;
+
+  if (g->transfer_compression) {
+    deflated_len = deflate_chunk (g, buf, len, deflated);
+    if (deflated_len > 0)
+      return send_file_chunk (g, GUESTFS_CHUNK_DEFLATE,
+                              deflated, deflated_len);
+  }
+#endif
+
   return send_file_chunk (g, 0, buf, len);
 }
 
@@ -1059,6 +1295,12 @@ guestfs___recv (guestfs_h *g, const char *fn,
     free (buf);
     return -1;
   }
+  if (g->stats_proc >= 0) {
+    g->call_stats[g->stats_proc].name = fn;
+    if (hdr->status == GUESTFS_STATUS_ERROR)
+      g->call_stats[g->stats_proc].errors++;
+  }
+
   if (hdr->status == GUESTFS_STATUS_ERROR) {
     if (!xdr_guestfs_message_error (&xdr, err)) {
       error (g, "%s: failed to parse reply error", fn);
@@ -1213,11 +1455,9 @@ receive_file_data (guestfs_h *g, void **buf_r)
   /* After decoding, the original buffer is no longer used. */
   free (buf);
 
-  if (chunk.cancel) {
-    if (g->user_cancel) {
-      error (g, _("operation cancelled by user"));
-      g->last_errnum = EINTR;
-    }
+  if (chunk.cancel != 0 && chunk.cancel != GUESTFS_CHUNK_DEFLATE) {
+    if (g->user_cancel)
+      guestfs_error_errno (g, EINTR, _("operation cancelled by user"));
     else
       error (g, _("file receive cancelled by daemon"));
     free (chunk.data.data_val);
@@ -1229,6 +1469,25 @@ receive_file_data (guestfs_h *g, void **buf_r)
     return 0;
   }
 
+  if (chunk.cancel == GUESTFS_CHUNK_DEFLATE) {
+#ifdef HAVE_ZLIB
+    size_t inflated_len;
+    char *inflated;
+
+    inflated = inflate_chunk (g, chunk.data.data_val, chunk.data.data_len,
+                              &inflated_len);
+    free (chunk.data.data_val);
+    if (inflated == NULL)
+      return -1;
+    chunk.data.data_val = inflated;
+    chunk.data.data_len = inflated_len;
+#else
+    error (g, _("received a compressed file chunk, but libguestfs was compiled without zlib"));
+    free (chunk.data.data_val);
+    return -1;
+#endif
+  }
+
   if (buf_r) *buf_r = chunk.data.data_val;
   else free (chunk.data.data_val); /* else caller frees */
 
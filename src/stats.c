@@ -0,0 +1,153 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "guestfs.h"
+#include "guestfs-internal.h"
+#include "guestfs-internal-actions.h"
+#include "guestfs_protocol.h"
+
+/* Per-procedure call statistics (see guestfs_get_stats).
+ *
+ * The library side is collected here: guestfs___send starts the
+ * clock, guestfs___end_busy stops it, and the socket functions in
+ * src/proto.c add the bytes sent and received (including file
+ * chunks and progress messages) to the current call.  The daemon
+ * collects the same counters for the time it spends on each call,
+ * and they are fetched with guestfs_internal_call_stats.
+ */
+
+static int64_t
+now_us (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void
+guestfs___stats_start (guestfs_h *g, int proc_nr)
+{
+  if (proc_nr < 0 || proc_nr >= GUESTFS_PROC_NR_PROCS)
+    return;
+
+  if (g->call_stats == NULL)
+    g->call_stats = safe_calloc (g, GUESTFS_PROC_NR_PROCS,
+                                 sizeof (struct call_stats));
+
+  g->stats_proc = proc_nr;
+  g->stats_start_us = now_us ();
+}
+
+void
+guestfs___stats_end (guestfs_h *g)
+{
+  struct call_stats *s;
+  int64_t elapsed_us, limit;
+  size_t i;
+
+  if (g->stats_proc == -1)
+    return;
+
+  s = &g->call_stats[g->stats_proc];
+  g->stats_proc = -1;
+
+  elapsed_us = now_us () - g->stats_start_us;
+  if (elapsed_us < 0)
+    elapsed_us = 0;
+
+  s->calls++;
+  s->total_us += elapsed_us;
+  if ((uint64_t) elapsed_us > s->max_us)
+    s->max_us = elapsed_us;
+  for (i = 0, limit = 1000; i < 5 && elapsed_us >= limit; ++i, limit *= 10)
+    ;
+  s->hist[i]++;
+}
+
+struct guestfs_call_stats_list *
+guestfs__get_stats (guestfs_h *g)
+{
+  struct guestfs_call_stats_list *ret, *daemon = NULL;
+  struct guestfs_call_stats *v;
+  size_t i, n, nr_daemon = 0;
+
+  /* Fetch the daemon's counters first, so the library counters
+   * include this call too.
+   */
+  if (g->state == READY) {
+    daemon = guestfs_internal_call_stats (g);
+    if (daemon == NULL)
+      return NULL;
+    nr_daemon = daemon->len;
+  }
+
+  n = 0;
+  if (g->call_stats) {
+    for (i = 0; i < GUESTFS_PROC_NR_PROCS; ++i)
+      if (g->call_stats[i].calls > 0)
+        n++;
+  }
+
+  ret = safe_malloc (g, sizeof *ret);
+  ret->len = n + nr_daemon;
+  ret->val = safe_calloc (g, ret->len > 0 ? ret->len : 1, sizeof *v);
+  v = ret->val;
+
+  for (i = n = 0; g->call_stats && i < GUESTFS_PROC_NR_PROCS; ++i) {
+    const struct call_stats *s = &g->call_stats[i];
+
+    if (s->calls == 0)
+      continue;
+
+    v[n].stats_name = safe_strdup (g, s->name ? s->name : "");
+    v[n].stats_side = safe_strdup (g, "library");
+    v[n].stats_calls = s->calls;
+    v[n].stats_errors = s->errors;
+    v[n].stats_total_us = s->total_us;
+    v[n].stats_max_us = s->max_us;
+    v[n].stats_hist_1ms = s->hist[0];
+    v[n].stats_hist_10ms = s->hist[1];
+    v[n].stats_hist_100ms = s->hist[2];
+    v[n].stats_hist_1s = s->hist[3];
+    v[n].stats_hist_10s = s->hist[4];
+    v[n].stats_hist_inf = s->hist[5];
+    v[n].stats_bytes_sent = s->bytes_sent;
+    v[n].stats_bytes_received = s->bytes_received;
+    n++;
+  }
+
+  /* Move the daemon's entries (and their strings) across. */
+  if (daemon) {
+    for (i = 0; i < nr_daemon; ++i)
+      v[n++] = daemon->val[i];
+    free (daemon->val);
+    free (daemon);
+  }
+
+  return ret;
+}
@@ -0,0 +1,268 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+
+#include "guestfs.h"
+#include "guestfs-internal.h"
+#include "guestfs-internal-actions.h"
+
+/* Binary trace ring buffer.
+ *
+ * The ordinary trace (guestfs_set_trace) formats every argument and
+ * return value as text, which is too slow to leave on in production.
+ * Instead the generated wrapper of every call can add one fixed-size
+ * record to a ring buffer in the handle: the start time, duration,
+ * function, procedure number and serial, the total size of the
+ * arguments, and the result.  Adding a record doesn't allocate and
+ * doesn't make any system calls apart from gettimeofday(2).
+ *
+ * The buffer is written to a file on demand (guestfs_dump_trace_buffer)
+ * or automatically when a call fails (guestfs_set_trace_dump_file).
+ * The file is decoded by the guestfish 'trace-decode' command (see
+ * fish/trace.c), which doesn't need the handle or the same version
+ * of libguestfs, since the file contains the function names.
+ *
+ * The file is XDR encoded:
+ *
+ *   uint32 TRACE_MAGIC, uint32 TRACE_VERSION
+ *   uint32 number of function names, followed by the names (string)
+ *   uint64 total number of records ever added
+ *   uint32 number of records in the file, followed by the records,
+ *          oldest first, as: hyper timestamp_us, uint32 duration_us,
+ *          uint32 function, uint32 failed, int proc_nr, int serial,
+ *          uint64 arg_bytes, hyper result
+ */
+
+#define TRACE_MAGIC 0x47465452  /* "GFTR" */
+#define TRACE_VERSION 1
+#define TRACE_MAX_ENTRIES 1000000
+
+int64_t
+guestfs___trace_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint64_t
+guestfs___trace_strings_size (char *const *argv)
+{
+  uint64_t size = 0;
+  size_t i;
+
+  for (i = 0; argv[i] != NULL; ++i)
+    size += strlen (argv[i]) + 1;
+  return size;
+}
+
+int64_t
+guestfs___trace_count_strings (char *const *argv)
+{
+  int64_t n;
+
+  for (n = 0; argv[n] != NULL; ++n)
+    ;
+  return n;
+}
+
+static int write_trace_dump (guestfs_h *g, const char *filename);
+
+void
+guestfs___trace_record (guestfs_h *g, int function, int proc_nr, int serial,
+                        uint64_t arg_bytes, int64_t result, int failed,
+                        int64_t start_us)
+{
+  struct trace_record *r;
+  int64_t duration_us;
+
+  r = &g->trace_ring[g->trace_ring_total % g->trace_ring_size];
+  g->trace_ring_total++;
+
+  duration_us = guestfs___trace_now () - start_us;
+  if (duration_us < 0)
+    duration_us = 0;
+  else if (duration_us > UINT32_MAX)
+    duration_us = UINT32_MAX;
+
+  r->timestamp_us = start_us;
+  r->duration_us = duration_us;
+  r->function = function;
+  r->failed = failed;
+  r->proc_nr = proc_nr;
+  r->serial = serial;
+  r->arg_bytes = arg_bytes;
+  r->result = result;
+
+  /* Don't call error() here: it would replace the error which the
+   * caller is about to report.
+   */
+  if (failed && g->trace_dump_file) {
+    if (write_trace_dump (g, g->trace_dump_file) == -1)
+      debug (g, "trace: could not write %s: %m", g->trace_dump_file);
+  }
+}
+
+void
+guestfs___free_trace_ring (guestfs_h *g)
+{
+  free (g->trace_ring);
+  g->trace_ring = NULL;
+  g->trace_ring_size = 0;
+  g->trace_ring_total = 0;
+  free (g->trace_dump_file);
+  g->trace_dump_file = NULL;
+}
+
+int
+guestfs__set_trace_buffer (guestfs_h *g, int entries)
+{
+  if (entries < 0 || entries > TRACE_MAX_ENTRIES) {
+    error (g, _("number of trace buffer entries must be between 0 and %d"),
+           TRACE_MAX_ENTRIES);
+    return -1;
+  }
+
+  free (g->trace_ring);
+  g->trace_ring = NULL;
+  g->trace_ring_size = 0;
+  g->trace_ring_total = 0;
+
+  if (entries > 0) {
+    g->trace_ring = safe_calloc (g, entries, sizeof (struct trace_record));
+    g->trace_ring_size = entries;
+  }
+
+  return 0;
+}
+
+int
+guestfs__get_trace_buffer (guestfs_h *g)
+{
+  return g->trace_ring_size;
+}
+
+int
+guestfs__set_trace_dump_file (guestfs_h *g, const char *filename)
+{
+  free (g->trace_dump_file);
+  g->trace_dump_file = filename ? safe_strdup (g, filename) : NULL;
+  return 0;
+}
+
+const char *
+guestfs__get_trace_dump_file (guestfs_h *g)
+{
+  return g->trace_dump_file;
+}
+
+static int
+write_trace_dump (guestfs_h *g, const char *filename)
+{
+  FILE *fp;
+  XDR xdr;
+  uint32_t u32, nr_records;
+  uint64_t u64, i, first;
+  size_t j;
+  int ok = 1;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL)
+    return -1;
+
+  xdrstdio_create (&xdr, fp, XDR_ENCODE);
+
+  u32 = TRACE_MAGIC;
+  ok = ok && xdr_uint32_t (&xdr, &u32);
+  u32 = TRACE_VERSION;
+  ok = ok && xdr_uint32_t (&xdr, &u32);
+
+  u32 = guestfs___trace_nr_function_names;
+  ok = ok && xdr_uint32_t (&xdr, &u32);
+  for (j = 0; j < guestfs___trace_nr_function_names; ++j) {
+    char *name = (char *) guestfs___trace_function_names[j];
+    ok = ok && xdr_string (&xdr, &name, ~0);
+  }
+
+  u64 = g->trace_ring_total;
+  ok = ok && xdr_uint64_t (&xdr, &u64);
+
+  if (g->trace_ring_total <= g->trace_ring_size) {
+    first = 0;
+    nr_records = g->trace_ring_total;
+  } else {
+    first = g->trace_ring_total - g->trace_ring_size;
+    nr_records = g->trace_ring_size;
+  }
+  ok = ok && xdr_uint32_t (&xdr, &nr_records);
+
+  for (i = first; ok && i < first + nr_records; ++i) {
+    struct trace_record *r = &g->trace_ring[i % g->trace_ring_size];
+    uint32_t function = r->function, failed = r->failed;
+
+    ok = xdr_int64_t (&xdr, &r->timestamp_us) &&
+      xdr_uint32_t (&xdr, &r->duration_us) &&
+      xdr_uint32_t (&xdr, &function) &&
+      xdr_uint32_t (&xdr, &failed) &&
+      xdr_int32_t (&xdr, &r->proc_nr) &&
+      xdr_int32_t (&xdr, &r->serial) &&
+      xdr_uint64_t (&xdr, &r->arg_bytes) &&
+      xdr_int64_t (&xdr, &r->result);
+  }
+
+  xdr_destroy (&xdr);
+
+  if (!ok) {
+    fclose (fp);
+    errno = EIO;
+    return -1;
+  }
+  if (fclose (fp) == EOF)
+    return -1;
+
+  return 0;
+}
+
+int
+guestfs__dump_trace_buffer (guestfs_h *g, const char *filename)
+{
+  if (g->trace_ring == NULL) {
+    error (g, _("the trace buffer is not enabled, use guestfs_set_trace_buffer"));
+    return -1;
+  }
+
+  if (write_trace_dump (g, filename) == -1) {
+    perrorf (g, "%s", filename);
+    return -1;
+  }
+
+  return 0;
+}
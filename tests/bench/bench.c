@@ -0,0 +1,934 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Benchmark suite.  This is run by 'make bench' and prints the
+ * results as JSON, so that they can be compared between releases.
+ *
+ * The benchmarks are:
+ *
+ *   launch      Time to launch the appliance (and close the handle).
+ *   ping        Round trip time of an empty call (guestfs_ping_daemon).
+ *   transfer    Upload and download throughput.
+ *   lstatlist   Directory listing (guestfs_ls) and guestfs_lstatlist
+ *               throughput on a directory containing many files.
+ *   copy        guestfs_copy_device_to_device throughput.
+ *   iomodes     copy_device_to_device and download throughput with
+ *               each of the drive I/O modes in 'iomodes' below (see
+ *               the cachemode, aio, iothread and queues optional
+ *               arguments of guestfs_add_drive_opts).
+ *   inspect     guestfs_inspect_os time on the images in tests/guests.
+ *   guestmount  Sequential and random read through guestmount.
+ *
+ * All data written is generated from a fixed seed, so each run does
+ * exactly the same work.  The scratch disks are sparse files created
+ * in $TMPDIR and deleted afterwards.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+
+#include "guestfs.h"
+
+#define MB (1024 * 1024)
+
+/* Command line parameters. */
+static int launches = 5;
+static int iterations = 1000;
+static int size_mb = 256;
+static int nr_files = 10000;
+static int random_reads = 1000;
+static int smp = 2;
+static const char *guests_dir = "../guests";
+static const char *guestmount = NULL;
+static const char *output = NULL;
+static char **selected = NULL;
+
+/* Scratch files. */
+static char tmpdir[PATH_MAX];
+static char disk1[PATH_MAX+16];
+static char disk2[PATH_MAX+16];
+static char datafile[PATH_MAX+16];
+static char mountpoint[PATH_MAX+16];
+
+struct result {
+  char *name;
+  const char *unit;
+  double value;                 /* median if there are several samples */
+  size_t samples;
+  double min, mean, max;
+};
+
+static struct result *results = NULL;
+static size_t nr_results = 0;
+
+static void bench_launch (void);
+static void bench_scratch (void);
+static void bench_iomodes (void);
+static void bench_inspect (void);
+static void bench_guestmount (void);
+static void print_results (FILE *fp);
+static void cleanup (void);
+
+static void
+usage (int status)
+{
+  fprintf (status == EXIT_SUCCESS ? stdout : stderr,
+           "libguestfs-bench: libguestfs benchmark suite\n"
+           "Usage:\n"
+           "  libguestfs-bench [--options] [benchmark ...]\n"
+           "Benchmarks:\n"
+           "  launch ping transfer lstatlist copy iomodes inspect guestmount\n"
+           "  (default: all)\n"
+           "Options:\n"
+           "  --files N             Number of files for lstatlist (default %d)\n"
+           "  --guestmount PATH     guestmount binary (default: skip)\n"
+           "  --guests DIR          Directory containing test guests (default %s)\n"
+           "  --help                Display this help\n"
+           "  --iterations N        Number of ping calls (default %d)\n"
+           "  --launches N          Number of launches (default %d)\n"
+           "  -o|--output FILE      Write JSON results to FILE (default stdout)\n"
+           "  --random-reads N      Number of random guestmount reads (default %d)\n"
+           "  --size MB             Size of transfers in megabytes (default %d)\n"
+           "  --smp N               Appliance vCPUs for iomodes (default %d)\n",
+           nr_files, guests_dir, iterations, launches, random_reads, size_mb,
+           smp);
+  exit (status);
+}
+
+static int
+get_int (const char *option, const char *arg)
+{
+  char *end;
+  long l;
+
+  errno = 0;
+  l = strtol (arg, &end, 10);
+  if (errno != 0 || *end != '\0' || l <= 0 || l > 1000000) {
+    fprintf (stderr, "bench: invalid value for --%s: %s\n", option, arg);
+    exit (EXIT_FAILURE);
+  }
+  return (int) l;
+}
+
+static int
+enabled (const char *name)
+{
+  size_t i;
+
+  if (selected == NULL || selected[0] == NULL)
+    return 1;
+  for (i = 0; selected[i] != NULL; ++i)
+    if (strcmp (selected[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static int
+compare_doubles (const void *av, const void *bv)
+{
+  double a = * (const double *) av;
+  double b = * (const double *) bv;
+
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* Record a result.  'samples' is sorted in place. */
+static void
+add_result (const char *name, const char *unit, double *samples, size_t n)
+{
+  struct result *r;
+  size_t i;
+  double sum = 0;
+
+  results = realloc (results, (nr_results+1) * sizeof (struct result));
+  if (results == NULL) {
+    perror ("realloc");
+    exit (EXIT_FAILURE);
+  }
+  r = &results[nr_results++];
+
+  qsort (samples, n, sizeof (double), compare_doubles);
+  for (i = 0; i < n; ++i)
+    sum += samples[i];
+
+  r->name = strdup (name);
+  if (r->name == NULL) {
+    perror ("strdup");
+    exit (EXIT_FAILURE);
+  }
+  r->unit = unit;
+  r->samples = n;
+  r->min = samples[0];
+  r->max = samples[n-1];
+  r->mean = sum / n;
+  r->value = n & 1 ? samples[n/2] : (samples[n/2-1] + samples[n/2]) / 2;
+
+  fprintf (stderr, "bench: %-28s %12.3f %s\n", name, r->value, unit);
+}
+
+static void
+add_result1 (const char *name, const char *unit, double value)
+{
+  add_result (name, unit, &value, 1);
+}
+
+/* The library has already printed the error message. */
+static void
+check (int r, const char *what)
+{
+  if (r == -1) {
+    fprintf (stderr, "bench: %s failed\n", what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static guestfs_h *
+create_handle (void)
+{
+  guestfs_h *g;
+
+  g = guestfs_create ();
+  if (g == NULL) {
+    fprintf (stderr, "bench: failed to create handle\n");
+    exit (EXIT_FAILURE);
+  }
+  return g;
+}
+
+static void
+create_sparse_file (const char *filename, int64_t size)
+{
+  int fd;
+
+  fd = open (filename, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0600);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (ftruncate (fd, size) == -1) {
+    perror ("ftruncate");
+    exit (EXIT_FAILURE);
+  }
+  if (close (fd) == -1) {
+    perror ("close");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* xorshift64: a fast PRNG with a fixed seed, so that every run reads
+ * and writes the same data at the same offsets.
+ */
+static uint64_t
+next_random (uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/* Host file of random (incompressible) data which is uploaded. */
+static void
+create_data_file (void)
+{
+  static uint64_t buf[MB / sizeof (uint64_t)];
+  uint64_t state = 1;
+  size_t i;
+  int fd, n;
+
+  fd = open (datafile, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0600);
+  if (fd == -1) {
+    perror (datafile);
+    exit (EXIT_FAILURE);
+  }
+  for (n = 0; n < size_mb; ++n) {
+    for (i = 0; i < sizeof buf / sizeof buf[0]; ++i)
+      buf[i] = next_random (&state);
+    if (write (fd, buf, sizeof buf) != (ssize_t) sizeof buf) {
+      perror ("write");
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (close (fd) == -1) {
+    perror ("close");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* The scratch disks are big enough for a filesystem containing the
+ * data file.
+ */
+static int64_t
+disk_size (void)
+{
+  return (int64_t) (2 * size_mb + 128) * MB;
+}
+
+static void
+add_disk (guestfs_h *g, const char *filename, int readonly)
+{
+  check (guestfs_add_drive_opts (g, filename,
+                                 GUESTFS_ADD_DRIVE_OPTS_FORMAT, "raw",
+                                 GUESTFS_ADD_DRIVE_OPTS_READONLY, readonly,
+                                 -1),
+         "add_drive_opts");
+}
+
+static void
+bench_launch (void)
+{
+  double launch_s[launches], close_s[launches], t;
+  guestfs_h *g;
+  int i;
+
+  create_sparse_file (disk1, disk_size ());
+
+  for (i = 0; i < launches; ++i) {
+    g = create_handle ();
+    add_disk (g, disk1, 1);
+    t = now ();
+    check (guestfs_launch (g), "launch");
+    launch_s[i] = now () - t;
+    t = now ();
+    guestfs_close (g);
+    close_s[i] = now () - t;
+  }
+
+  add_result ("launch", "s", launch_s, launches);
+  add_result ("close", "s", close_s, launches);
+}
+
+static void
+bench_lstatlist (guestfs_h *g)
+{
+  char path[64], **names;
+  struct guestfs_stat_list *stats;
+  size_t i, n, batch;
+  double t;
+
+  check (guestfs_mkdir (g, "/files"), "mkdir");
+  for (i = 0; i < (size_t) nr_files; ++i) {
+    snprintf (path, sizeof path, "/files/%06zu", i);
+    check (guestfs_touch (g, path), "touch");
+  }
+  check (guestfs_drop_caches (g, 3), "drop_caches");
+
+  t = now ();
+  names = guestfs_ls (g, "/files");
+  if (names == NULL)
+    check (-1, "ls");
+  for (n = 0; names[n] != NULL; ++n)
+    ;
+  add_result1 ("readdir", "entries/s", n / (now () - t));
+
+  check (guestfs_drop_caches (g, 3), "drop_caches");
+
+  /* Batches keep each request well under the maximum message size. */
+  t = now ();
+  for (i = 0; i < n; i += batch) {
+    char *saved;
+
+    batch = n - i < 1000 ? n - i : 1000;
+    saved = names[i+batch];
+    names[i+batch] = NULL;
+    stats = guestfs_lstatlist (g, "/files", &names[i]);
+    names[i+batch] = saved;
+    if (stats == NULL)
+      check (-1, "lstatlist");
+    guestfs_free_stat_list (stats);
+  }
+  add_result1 ("lstatlist", "entries/s", n / (now () - t));
+
+  for (i = 0; i < n; ++i)
+    free (names[i]);
+  free (names);
+}
+
+/* Benchmarks which use a launched handle with two scratch disks.
+ * This also leaves the data file on /dev/sda1 for bench_guestmount.
+ */
+static void
+bench_scratch (void)
+{
+  double *ping_us, t;
+  guestfs_h *g;
+  int i;
+
+  create_sparse_file (disk1, disk_size ());
+  create_sparse_file (disk2, disk_size ());
+  create_data_file ();
+
+  g = create_handle ();
+  add_disk (g, disk1, 0);
+  add_disk (g, disk2, 0);
+  check (guestfs_launch (g), "launch");
+
+  if (enabled ("ping")) {
+    ping_us = malloc (iterations * sizeof (double));
+    if (ping_us == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; i < iterations; ++i) {
+      t = now ();
+      check (guestfs_ping_daemon (g), "ping_daemon");
+      ping_us[i] = (now () - t) * 1000000;
+    }
+    add_result ("ping_daemon", "us", ping_us, iterations);
+    free (ping_us);
+  }
+
+  check (guestfs_part_disk (g, "/dev/sda", "mbr"), "part_disk");
+  check (guestfs_mkfs_opts (g, "ext4", "/dev/sda1", -1), "mkfs_opts");
+  check (guestfs_mount_options (g, "", "/dev/sda1", "/"), "mount_options");
+
+  t = now ();
+  check (guestfs_upload (g, datafile, "/data"), "upload");
+  check (guestfs_sync (g), "sync");
+  if (enabled ("transfer"))
+    add_result1 ("upload", "MB/s", size_mb / (now () - t));
+
+  if (enabled ("transfer")) {
+    check (guestfs_drop_caches (g, 3), "drop_caches");
+    t = now ();
+    check (guestfs_download (g, "/data", "/dev/null"), "download");
+    add_result1 ("download", "MB/s", size_mb / (now () - t));
+  }
+
+  if (enabled ("lstatlist"))
+    bench_lstatlist (g);
+
+  check (guestfs_umount_all (g), "umount_all");
+
+  if (enabled ("copy")) {
+    check (guestfs_drop_caches (g, 3), "drop_caches");
+    t = now ();
+    check (guestfs_copy_device_to_device (g, "/dev/sda", "/dev/sdb", -1),
+           "copy_device_to_device");
+    check (guestfs_sync (g), "sync");
+    add_result1 ("copy_device_to_device", "MB/s",
+                 disk_size () / MB / (now () - t));
+  }
+
+  check (guestfs_close (g), "close");
+}
+
+/* Drive I/O modes compared by bench_iomodes.  NULL and -1 mean the
+ * optional argument is not set.
+ */
+static const struct iomode {
+  const char *name;
+  const char *cachemode;
+  const char *aio;
+  int iothread;
+  int queues;
+} iomodes[] = {
+  { "default",    NULL,     NULL,     0, -1 },
+  { "unsafe",     "unsafe", NULL,     0, -1 },
+  { "native",     "none",   "native", 0, -1 },
+  { "iothread",   NULL,     NULL,     1, -1 },
+  { "multiqueue", NULL,     NULL,     0,  0 },
+  { "all",        "none",   "native", 1,  0 },
+};
+
+/* Add a drive using an I/O mode.  Returns -1 if the mode can't be
+ * used here (eg. O_DIRECT on tmpfs), after printing a message.
+ */
+static int
+add_disk_iomode (guestfs_h *g, const char *filename,
+                 const struct iomode *mode)
+{
+  struct guestfs_add_drive_opts_argv optargs = {
+    .bitmask = GUESTFS_ADD_DRIVE_OPTS_FORMAT_BITMASK
+             | GUESTFS_ADD_DRIVE_OPTS_IFACE_BITMASK,
+    .format = "raw",
+    .iface = "virtio",
+  };
+
+  if (mode->cachemode) {
+    optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_CACHEMODE_BITMASK;
+    optargs.cachemode = mode->cachemode;
+  }
+  if (mode->aio) {
+    optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_AIO_BITMASK;
+    optargs.aio = mode->aio;
+  }
+  if (mode->iothread) {
+    optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_IOTHREAD_BITMASK;
+    optargs.iothread = 1;
+  }
+  if (mode->queues >= 0) {
+    optargs.bitmask |= GUESTFS_ADD_DRIVE_OPTS_QUEUES_BITMASK;
+    optargs.queues = mode->queues;
+  }
+
+  if (guestfs_add_drive_opts_argv (g, filename, &optargs) == -1) {
+    fprintf (stderr, "bench: iomodes/%s: skipped\n", mode->name);
+    return -1;
+  }
+  return 0;
+}
+
+/* For each I/O mode, copy the data between two scratch disks and
+ * download it.  The data is written to the start of /dev/sda
+ * directly, so there is no filesystem overhead.
+ */
+static void
+bench_iomodes (void)
+{
+  char name[64];
+  guestfs_h *g;
+  size_t i;
+  double t;
+
+  create_data_file ();
+
+  for (i = 0; i < sizeof iomodes / sizeof iomodes[0]; ++i) {
+    const struct iomode *mode = &iomodes[i];
+
+    create_sparse_file (disk1, disk_size ());
+    create_sparse_file (disk2, disk_size ());
+
+    g = create_handle ();
+    check (guestfs_set_smp (g, smp), "set_smp");
+    if (add_disk_iomode (g, disk1, mode) == -1 ||
+        add_disk_iomode (g, disk2, mode) == -1) {
+      guestfs_close (g);
+      continue;
+    }
+    /* Launch fails if this qemu doesn't support the mode. */
+    if (guestfs_launch (g) == -1) {
+      fprintf (stderr, "bench: iomodes/%s: skipped\n", mode->name);
+      guestfs_close (g);
+      continue;
+    }
+
+    check (guestfs_upload (g, datafile, "/dev/sda"), "upload");
+    check (guestfs_sync (g), "sync");
+
+    check (guestfs_drop_caches (g, 3), "drop_caches");
+    t = now ();
+    check (guestfs_copy_device_to_device (g, "/dev/sda", "/dev/sdb",
+                                          GUESTFS_COPY_DEVICE_TO_DEVICE_SIZE,
+                                          (int64_t) size_mb * MB,
+                                          -1),
+           "copy_device_to_device");
+    check (guestfs_sync (g), "sync");
+    snprintf (name, sizeof name, "copy_device_to_device/%s", mode->name);
+    add_result1 (name, "MB/s", size_mb / (now () - t));
+
+    check (guestfs_drop_caches (g, 3), "drop_caches");
+    t = now ();
+    check (guestfs_download_offset (g, "/dev/sdb", "/dev/null",
+                                    0, (int64_t) size_mb * MB),
+           "download_offset");
+    snprintf (name, sizeof name, "download/%s", mode->name);
+    add_result1 (name, "MB/s", size_mb / (now () - t));
+
+    check (guestfs_close (g), "close");
+  }
+}
+
+static void
+bench_inspect (void)
+{
+  static const char *guests[][3] = {
+    { "debian", "debian.img", NULL },
+    { "fedora", "fedora.img", NULL },
+    { "fedora-md", "fedora-md1.img", "fedora-md2.img" },
+    { "ubuntu", "ubuntu.img", NULL },
+    { "windows", "windows.img", NULL },
+  };
+  char filename[PATH_MAX], name[64], **roots;
+  guestfs_h *g;
+  size_t i, j;
+  double t;
+
+  for (i = 0; i < sizeof guests / sizeof guests[0]; ++i) {
+    g = create_handle ();
+    for (j = 1; j < 3 && guests[i][j] != NULL; ++j) {
+      snprintf (filename, sizeof filename, "%s/%s", guests_dir, guests[i][j]);
+      if (access (filename, R_OK) == -1) {
+        fprintf (stderr, "bench: %s: skipped, run 'make -C %s check' first\n",
+                 filename, guests_dir);
+        break;
+      }
+      add_disk (g, filename, 1);
+    }
+    if (j < 3 && guests[i][j] != NULL) {
+      guestfs_close (g);
+      continue;
+    }
+
+    check (guestfs_launch (g), "launch");
+    t = now ();
+    roots = guestfs_inspect_os (g);
+    if (roots == NULL)
+      check (-1, "inspect_os");
+    snprintf (name, sizeof name, "inspect_os/%s", guests[i][0]);
+    add_result1 (name, "s", now () - t);
+
+    for (j = 0; roots[j] != NULL; ++j)
+      free (roots[j]);
+    free (roots);
+    guestfs_close (g);
+  }
+}
+
+/* Run a command and wait for it.  Returns the exit status, or -1. */
+static int
+run_command (const char *const *argv)
+{
+  pid_t pid;
+  int status;
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    execvp (argv[0], (char **) argv);
+    perror (argv[0]);
+    _exit (EXIT_FAILURE);
+  }
+  if (waitpid (pid, &status, 0) == -1) {
+    perror ("waitpid");
+    return -1;
+  }
+  return WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+}
+
+static int mounted = 0;
+
+static void
+do_guestmount (void)
+{
+  const char *argv[] = {
+    guestmount, "--ro", "--format=raw", "-a", disk1, "-m", "/dev/sda1",
+    mountpoint, NULL
+  };
+
+  /* guestmount returns once the filesystem is mounted. */
+  if (run_command (argv) != 0) {
+    fprintf (stderr, "bench: %s failed\n", guestmount);
+    exit (EXIT_FAILURE);
+  }
+  mounted = 1;
+}
+
+static void
+do_unmount (void)
+{
+  const char *argv[] = { "fusermount", "-u", mountpoint, NULL };
+  int i;
+
+  /* The mountpoint can be busy for a moment after the last close. */
+  for (i = 0; i < 10; ++i) {
+    if (run_command (argv) == 0) {
+      mounted = 0;
+      return;
+    }
+    sleep (1);
+  }
+  fprintf (stderr, "bench: could not unmount %s\n", mountpoint);
+  exit (EXIT_FAILURE);
+}
+
+static void
+bench_guestmount (void)
+{
+  static char buf[MB];
+  char filename[PATH_MAX+32];
+  uint64_t state = 1, blocks;
+  int fd, i;
+  ssize_t r;
+  double t;
+
+  if (mkdir (mountpoint, 0700) == -1) {
+    perror (mountpoint);
+    exit (EXIT_FAILURE);
+  }
+  snprintf (filename, sizeof filename, "%s/data", mountpoint);
+
+  do_guestmount ();
+  fd = open (filename, O_RDONLY);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  t = now ();
+  while ((r = read (fd, buf, sizeof buf)) > 0)
+    ;
+  if (r == -1) {
+    perror ("read");
+    exit (EXIT_FAILURE);
+  }
+  add_result1 ("guestmount_sequential_read", "MB/s", size_mb / (now () - t));
+  close (fd);
+  do_unmount ();
+
+  /* Remount so the random reads don't hit the host page cache. */
+  do_guestmount ();
+  fd = open (filename, O_RDONLY);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  blocks = (uint64_t) size_mb * MB / 4096;
+  t = now ();
+  for (i = 0; i < random_reads; ++i) {
+    if (pread (fd, buf, 4096, (next_random (&state) % blocks) * 4096) == -1) {
+      perror ("pread");
+      exit (EXIT_FAILURE);
+    }
+  }
+  add_result1 ("guestmount_random_read", "reads/s", random_reads / (now () - t));
+  close (fd);
+  do_unmount ();
+}
+
+static void
+print_json_string (FILE *fp, const char *s)
+{
+  fputc ('"', fp);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf (fp, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf (fp, "\\u%04x", (unsigned char) *s);
+    else
+      fputc (*s, fp);
+  }
+  fputc ('"', fp);
+}
+
+static void
+print_results (FILE *fp)
+{
+  guestfs_h *g;
+  struct guestfs_version *vers;
+  struct utsname uts;
+  char date[64], version[128];
+  time_t tt;
+  size_t i;
+
+  g = create_handle ();
+  vers = guestfs_version (g);
+  if (vers == NULL)
+    check (-1, "version");
+  snprintf (version, sizeof version, "%" PRIi64 ".%" PRIi64 ".%" PRIi64 "%s",
+            vers->major, vers->minor, vers->release, vers->extra);
+  guestfs_free_version (vers);
+  guestfs_close (g);
+
+  time (&tt);
+  strftime (date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", gmtime (&tt));
+
+  if (uname (&uts) == -1) {
+    perror ("uname");
+    exit (EXIT_FAILURE);
+  }
+
+  fprintf (fp, "{\n  \"version\": ");
+  print_json_string (fp, version);
+  fprintf (fp, ",\n  \"date\": ");
+  print_json_string (fp, date);
+  fprintf (fp, ",\n  \"host\": { \"sysname\": ");
+  print_json_string (fp, uts.sysname);
+  fprintf (fp, ", \"release\": ");
+  print_json_string (fp, uts.release);
+  fprintf (fp, ", \"machine\": ");
+  print_json_string (fp, uts.machine);
+  fprintf (fp, " },\n");
+  fprintf (fp, "  \"parameters\": { \"launches\": %d, \"iterations\": %d, "
+           "\"size_mb\": %d, \"files\": %d, \"random_reads\": %d, "
+           "\"smp\": %d },\n",
+           launches, iterations, size_mb, nr_files, random_reads, smp);
+  fprintf (fp, "  \"results\": [");
+  for (i = 0; i < nr_results; ++i) {
+    fprintf (fp, "%s\n    { \"name\": ", i == 0 ? "" : ",");
+    print_json_string (fp, results[i].name);
+    fprintf (fp, ", \"unit\": ");
+    print_json_string (fp, results[i].unit);
+    fprintf (fp, ", \"value\": %.6g, \"samples\": %zu, "
+             "\"min\": %.6g, \"mean\": %.6g, \"max\": %.6g }",
+             results[i].value, results[i].samples,
+             results[i].min, results[i].mean, results[i].max);
+  }
+  fprintf (fp, "\n  ]\n}\n");
+}
+
+static void
+cleanup (void)
+{
+  if (mounted) {
+    const char *argv[] = { "fusermount", "-u", mountpoint, NULL };
+    run_command (argv);
+  }
+  unlink (disk1);
+  unlink (disk2);
+  unlink (datafile);
+  rmdir (mountpoint);
+  rmdir (tmpdir);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *options = "o:";
+  static const struct option long_options[] = {
+    { "files", 1, 0, 0 },
+    { "guestmount", 1, 0, 0 },
+    { "guests", 1, 0, 0 },
+    { "help", 0, 0, 'h' },
+    { "iterations", 1, 0, 0 },
+    { "launches", 1, 0, 0 },
+    { "output", 1, 0, 'o' },
+    { "random-reads", 1, 0, 0 },
+    { "size", 1, 0, 0 },
+    { "smp", 1, 0, 0 },
+    { 0, 0, 0, 0 }
+  };
+  static const char *benchmarks[] = {
+    "launch", "ping", "transfer", "lstatlist", "copy", "iomodes", "inspect",
+    "guestmount", NULL
+  };
+  int c, option_index;
+  size_t i, j;
+  const char *t;
+  FILE *fp;
+
+  for (;;) {
+    c = getopt_long (argc, argv, options, long_options, &option_index);
+    if (c == -1) break;
+
+    switch (c) {
+    case 0:
+      t = long_options[option_index].name;
+      if (strcmp (t, "files") == 0)
+        nr_files = get_int (t, optarg);
+      else if (strcmp (t, "guestmount") == 0)
+        guestmount = optarg;
+      else if (strcmp (t, "guests") == 0)
+        guests_dir = optarg;
+      else if (strcmp (t, "iterations") == 0)
+        iterations = get_int (t, optarg);
+      else if (strcmp (t, "launches") == 0)
+        launches = get_int (t, optarg);
+      else if (strcmp (t, "random-reads") == 0)
+        random_reads = get_int (t, optarg);
+      else if (strcmp (t, "size") == 0)
+        size_mb = get_int (t, optarg);
+      else if (strcmp (t, "smp") == 0)
+        smp = get_int (t, optarg);
+      break;
+
+    case 'o':
+      output = optarg;
+      break;
+
+    case 'h':
+      usage (EXIT_SUCCESS);
+
+    default:
+      usage (EXIT_FAILURE);
+    }
+  }
+
+  selected = &argv[optind];
+  for (i = 0; selected[i] != NULL; ++i) {
+    for (j = 0; benchmarks[j] != NULL; ++j)
+      if (strcmp (selected[i], benchmarks[j]) == 0)
+        break;
+    if (benchmarks[j] == NULL) {
+      fprintf (stderr, "bench: unknown benchmark: %s\n", selected[i]);
+      usage (EXIT_FAILURE);
+    }
+  }
+
+  t = getenv ("TMPDIR");
+  snprintf (tmpdir, sizeof tmpdir, "%s/benchXXXXXX", t ? t : "/tmp");
+  if (mkdtemp (tmpdir) == NULL) {
+    perror (tmpdir);
+    exit (EXIT_FAILURE);
+  }
+  atexit (cleanup);
+  snprintf (disk1, sizeof disk1, "%s/disk1.img", tmpdir);
+  snprintf (disk2, sizeof disk2, "%s/disk2.img", tmpdir);
+  snprintf (datafile, sizeof datafile, "%s/data", tmpdir);
+  snprintf (mountpoint, sizeof mountpoint, "%s/mp", tmpdir);
+
+  if (enabled ("launch"))
+    bench_launch ();
+  if (guestmount == NULL && enabled ("guestmount"))
+    fprintf (stderr, "bench: guestmount: skipped, use --guestmount\n");
+  if (enabled ("ping") || enabled ("transfer") || enabled ("lstatlist") ||
+      enabled ("copy") || (guestmount && enabled ("guestmount")))
+    bench_scratch ();
+  if (enabled ("iomodes"))
+    bench_iomodes ();
+  if (enabled ("inspect"))
+    bench_inspect ();
+  if (guestmount && enabled ("guestmount"))
+    bench_guestmount ();
+
+  if (output) {
+    fp = fopen (output, "w");
+    if (fp == NULL) {
+      perror (output);
+      exit (EXIT_FAILURE);
+    }
+  }
+  else
+    fp = stdout;
+
+  print_results (fp);
+
+  if (fp != stdout && fclose (fp) == EOF) {
+    perror (output);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
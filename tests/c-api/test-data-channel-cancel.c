@@ -0,0 +1,263 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Test user cancellation of a parallel transfer over data channels.
+ *
+ * A progress callback calls guestfs_user_cancel part way through a
+ * download, while every range is still running.  The download must
+ * fail with EINTR, the transfers in the daemon must have been
+ * cancelled, and later uploads and downloads on the same handle must
+ * work and transfer the right data.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "guestfs.h"
+
+static const char *filename = "test-data-channel-cancel.img";
+static const char *datafile = "test-data-channel-cancel.data";
+static const char *outfile = "test-data-channel-cancel.out";
+static const off_t filesize = 100*1024*1024;
+
+/* Larger than the minimum size for a parallel transfer (16 MB). */
+#define DATA_SIZE (32*1024*1024)
+
+#define NR_CHANNELS 4
+
+static int cancel_armed = 0;
+
+static void cleanup (void);
+static void write_file (const char *name, const char *buf, size_t size);
+static char *read_file (const char *name, size_t *size_r);
+static void progress_callback (guestfs_h *g, void *opaque, uint64_t event, int event_handle, int flags, const char *buf, size_t buf_len, const uint64_t *array, size_t array_len);
+
+int
+main (int argc, char *argv[])
+{
+  guestfs_h *g;
+  int fd, i, r, op_errno, errors = 0;
+  char *data, *out;
+  size_t size;
+  guestfs_error_handler_cb old_error_cb;
+  void *old_error_data;
+
+  g = guestfs_create ();
+  if (g == NULL) {
+    fprintf (stderr, "failed to create handle\n");
+    exit (EXIT_FAILURE);
+  }
+
+  atexit (cleanup);
+
+  /* Create a test image and test data. */
+  fd = open (filename, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0666);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (ftruncate (fd, filesize) == -1) {
+    perror ("ftruncate");
+    close (fd);
+    exit (EXIT_FAILURE);
+  }
+  if (close (fd) == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+
+  data = malloc (DATA_SIZE);
+  if (data == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  srand48 (time (NULL));
+  for (i = 0; i < DATA_SIZE; ++i)
+    data[i] = lrand48 ();
+  write_file (datafile, data, DATA_SIZE);
+
+  if (guestfs_set_data_channels (g, NR_CHANNELS) == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_add_drive_opts (g, filename,
+                              GUESTFS_ADD_DRIVE_OPTS_FORMAT, "raw",
+                              -1) == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_launch (g) == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_part_disk (g, "/dev/sda", "mbr") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_mkfs (g, "ext2", "/dev/sda1") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_mount_options (g, "", "/dev/sda1", "/") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_upload_parallel (g, datafile, "/data") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_set_event_callback (g, progress_callback,
+                                  GUESTFS_EVENT_PROGRESS, 0, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  /*----- Cancel a download part way through -----*/
+
+  cancel_armed = 1;
+  r = guestfs_download_parallel (g, "/data", outfile);
+  op_errno = guestfs_last_errno (g);
+  cancel_armed = 0;
+
+  /* We expect to get an error, with errno == EINTR. */
+  if (r == -1 && op_errno == EINTR)
+    printf ("test-data-channel-cancel: download cancellation test passed\n");
+  else {
+    fprintf (stderr, "test-data-channel-cancel: download cancellation test FAILED\n");
+    fprintf (stderr, "download returned %d, errno = %d (%s)\n",
+             r, op_errno, strerror (op_errno));
+    errors++;
+  }
+
+  /* Every range was either waited for or cancelled, so no transfer
+   * is left running in the daemon.
+   */
+  old_error_cb = guestfs_get_error_handler (g, &old_error_data);
+  guestfs_set_error_handler (g, NULL, NULL);
+  for (i = 1; i <= NR_CHANNELS; ++i) {
+    if (guestfs_internal_data_channel_wait (g, i) != -1) {
+      fprintf (stderr, "test-data-channel-cancel: transfer on data channel %d was not cancelled\n",
+               i);
+      errors++;
+    }
+  }
+  guestfs_set_error_handler (g, old_error_cb, old_error_data);
+
+  /*----- The handle must still transfer the right data -----*/
+
+  if (guestfs_upload_parallel (g, datafile, "/data2") == -1)
+    exit (EXIT_FAILURE);
+  if (guestfs_download_parallel (g, "/data2", outfile) == -1)
+    exit (EXIT_FAILURE);
+
+  out = read_file (outfile, &size);
+  if (size == DATA_SIZE && memcmp (data, out, size) == 0)
+    printf ("test-data-channel-cancel: transfers after cancellation passed\n");
+  else {
+    fprintf (stderr, "test-data-channel-cancel: data transferred after cancellation is different\n");
+    errors++;
+  }
+  free (out);
+  free (data);
+
+  guestfs_close (g);
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+cleanup (void)
+{
+  unlink (filename);
+  unlink (datafile);
+  unlink (outfile);
+}
+
+/* Cancel once a quarter of the file has been transferred, so that
+ * every range is still running.
+ */
+static void
+progress_callback (guestfs_h *g, void *opaque,
+                   uint64_t event, int event_handle, int flags,
+                   const char *buf, size_t buf_len,
+                   const uint64_t *array, size_t array_len)
+{
+  if (cancel_armed && array_len >= 4 &&
+      array[2] >= array[3] / 4 && array[2] < array[3])
+    guestfs_user_cancel (g);
+}
+
+static void
+write_file (const char *name, const char *buf, size_t size)
+{
+  int fd;
+  ssize_t r;
+
+  fd = open (name, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY, 0666);
+  if (fd == -1) {
+    perror (name);
+    exit (EXIT_FAILURE);
+  }
+  while (size > 0) {
+    r = write (fd, buf, size);
+    if (r == -1) {
+      perror (name);
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    size -= r;
+  }
+  if (close (fd) == -1) {
+    perror (name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static char *
+read_file (const char *name, size_t *size_r)
+{
+  int fd;
+  char *buf;
+  ssize_t r;
+  size_t size = 0;
+
+  buf = malloc (DATA_SIZE + 1);
+  if (buf == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  fd = open (name, O_RDONLY);
+  if (fd == -1) {
+    perror (name);
+    exit (EXIT_FAILURE);
+  }
+  while (size < DATA_SIZE + 1) {
+    r = read (fd, buf + size, DATA_SIZE + 1 - size);
+    if (r == -1) {
+      perror (name);
+      exit (EXIT_FAILURE);
+    }
+    if (r == 0)
+      break;
+    size += r;
+  }
+  close (fd);
+
+  *size_r = size;
+  return buf;
+}
@@ -0,0 +1,166 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Test that guestfs_list_devices and guestfs_part_list work before
+ * launch, by reading the partition table from the disk image on the
+ * host (see src/host_part.c).  This doesn't need the appliance.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "guestfs.h"
+
+#define STREQ(a,b) (strcmp((a),(b)) == 0)
+
+static void
+set_mbr_entry (unsigned char *sector, int i, int type,
+               uint32_t start, uint32_t nr_sectors)
+{
+  unsigned char *e = &sector[446 + i*16];
+
+  e[4] = type;
+  e[8] = start; e[9] = start >> 8; e[10] = start >> 16; e[11] = start >> 24;
+  e[12] = nr_sectors; e[13] = nr_sectors >> 8;
+  e[14] = nr_sectors >> 16; e[15] = nr_sectors >> 24;
+}
+
+static void
+write_sector (FILE *fp, unsigned char *sector, uint64_t lba)
+{
+  sector[510] = 0x55;
+  sector[511] = 0xaa;
+  if (fseek (fp, lba * 512, SEEK_SET) == -1 ||
+      fwrite (sector, 512, 1, fp) != 1) {
+    perror ("test1.img");
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+check_partition (struct guestfs_partition_list *parts, size_t i,
+                 int part_num, uint64_t start_sector, uint64_t nr_sectors)
+{
+  if (i >= parts->len ||
+      parts->val[i].part_num != part_num ||
+      parts->val[i].part_start != start_sector * 512 ||
+      parts->val[i].part_size != nr_sectors * 512 ||
+      parts->val[i].part_end != (start_sector + nr_sectors) * 512 - 1) {
+    fprintf (stderr, "test-host-part-list: unexpected partition %zu\n", i);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  guestfs_h *g;
+  FILE *fp;
+  unsigned char sector[512];
+  char **devices;
+  struct guestfs_partition_list *parts;
+
+  /* A 16 MB image with one primary partition, and an extended
+   * partition containing one logical partition.
+   */
+  fp = fopen ("test1.img", "w");
+  if (fp == NULL) {
+    perror ("test1.img");
+    exit (EXIT_FAILURE);
+  }
+  if (ftruncate (fileno (fp), 16 * 1024 * 1024) == -1) {
+    perror ("ftruncate");
+    exit (EXIT_FAILURE);
+  }
+  memset (sector, 0, sizeof sector);
+  set_mbr_entry (sector, 0, 0x83, 63, 8000);
+  set_mbr_entry (sector, 1, 0x05, 8192, 16384);
+  write_sector (fp, sector, 0);
+  memset (sector, 0, sizeof sector);
+  set_mbr_entry (sector, 0, 0x83, 2048, 4096);
+  write_sector (fp, sector, 8192);
+  fclose (fp);
+
+  /* An empty image, which doesn't have a partition table. */
+  fp = fopen ("test2.img", "w");
+  if (fp == NULL) {
+    perror ("test2.img");
+    exit (EXIT_FAILURE);
+  }
+  fclose (fp);
+
+  g = guestfs_create ();
+  if (g == NULL) {
+    fprintf (stderr, "failed to create handle\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (guestfs_add_drive_opts (g, "test1.img",
+                              GUESTFS_ADD_DRIVE_OPTS_FORMAT, "raw",
+                              -1) == -1)
+    exit (EXIT_FAILURE);
+  if (guestfs_add_drive_opts (g, "test2.img", -1) == -1)
+    exit (EXIT_FAILURE);
+
+  devices = guestfs_list_devices (g);
+  if (devices == NULL)
+    exit (EXIT_FAILURE);
+  if (devices[0] == NULL || !STREQ (devices[0], "/dev/sda") ||
+      devices[1] == NULL || !STREQ (devices[1], "/dev/sdb") ||
+      devices[2] != NULL) {
+    fprintf (stderr, "test-host-part-list: unexpected list of devices\n");
+    exit (EXIT_FAILURE);
+  }
+  free (devices[0]);
+  free (devices[1]);
+  free (devices);
+
+  parts = guestfs_part_list (g, "/dev/sda");
+  if (parts == NULL)
+    exit (EXIT_FAILURE);
+  if (parts->len != 3) {
+    fprintf (stderr, "test-host-part-list: expected 3 partitions, got %u\n",
+             parts->len);
+    exit (EXIT_FAILURE);
+  }
+  check_partition (parts, 0, 1, 63, 8000);
+  check_partition (parts, 1, 2, 8192, 16384);
+  check_partition (parts, 2, 5, 8192 + 2048, 4096);
+  guestfs_free_partition_list (parts);
+
+  /* This must fail, but not with ENOTSUP since the format is raw. */
+  guestfs_set_error_handler (g, NULL, NULL);
+  parts = guestfs_part_list (g, "/dev/sdb");
+  if (parts != NULL || guestfs_last_errno (g) == ENOTSUP) {
+    fprintf (stderr, "test-host-part-list: part_list /dev/sdb should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  guestfs_close (g);
+
+  unlink ("test1.img");
+  unlink ("test2.img");
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,184 @@
+/* libguestfs
+ * Copyright (C) 2012 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Test sharing one thread-safe handle between several threads.
+ *
+ * Each thread repeatedly writes and reads back its own file, and
+ * makes a call which fails with a thread-specific error message.
+ * The test checks that the calls don't interfere and that every
+ * thread sees its own error from guestfs_last_error.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "guestfs.h"
+
+#define NR_THREADS 4
+#define NR_ITERATIONS 50
+
+static const char *filename = "test-thread-safe.img";
+
+static void *start_thread (void *);
+
+struct thread_data {
+  guestfs_h *g;
+  int n;                        /* thread number */
+  int errors;
+};
+
+int
+main (int argc, char *argv[])
+{
+  guestfs_h *g;
+  int fd, i, errors = 0;
+  pthread_t threads[NR_THREADS];
+  struct thread_data data[NR_THREADS];
+
+  g = guestfs_create ();
+  if (g == NULL) {
+    fprintf (stderr, "failed to create handle\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (guestfs_set_thread_safe (g, 1) == -1)
+    exit (EXIT_FAILURE);
+
+  fd = open (filename, O_WRONLY|O_CREAT|O_NOCTTY|O_TRUNC, 0666);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (ftruncate (fd, 104857600) == -1) {
+    perror (filename);
+    close (fd);
+    unlink (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (close (fd) == -1) {
+    perror (filename);
+    unlink (filename);
+    exit (EXIT_FAILURE);
+  }
+
+  if (guestfs_add_drive_opts (g, filename,
+                              GUESTFS_ADD_DRIVE_OPTS_FORMAT, "raw",
+                              -1) == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_launch (g) == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_part_disk (g, "/dev/sda", "mbr") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_mkfs (g, "ext2", "/dev/sda1") == -1)
+    exit (EXIT_FAILURE);
+
+  if (guestfs_mount_options (g, "", "/dev/sda1", "/") == -1)
+    exit (EXIT_FAILURE);
+
+  /* Don't print the expected errors. */
+  guestfs_set_error_handler (g, NULL, NULL);
+
+  for (i = 0; i < NR_THREADS; ++i) {
+    data[i].g = g;
+    data[i].n = i;
+    data[i].errors = 0;
+    if (pthread_create (&threads[i], NULL, start_thread, &data[i]) != 0) {
+      fprintf (stderr, "pthread_create failed\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < NR_THREADS; ++i) {
+    if (pthread_join (threads[i], NULL) != 0) {
+      fprintf (stderr, "pthread_join failed\n");
+      exit (EXIT_FAILURE);
+    }
+    errors += data[i].errors;
+  }
+
+  guestfs_close (g);
+  unlink (filename);
+
+  exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void *
+start_thread (void *datav)
+{
+  struct thread_data *data = datav;
+  guestfs_h *g = data->g;
+  char path[64], content[64], missing[64];
+  const char *err;
+  char *s;
+  int i;
+
+  snprintf (path, sizeof path, "/thread%d", data->n);
+  snprintf (missing, sizeof missing, "/missing%d", data->n);
+
+  for (i = 0; i < NR_ITERATIONS; ++i) {
+    snprintf (content, sizeof content, "thread %d iteration %d", data->n, i);
+
+    if (guestfs_write (g, path, content, strlen (content)) == -1) {
+      data->errors++;
+      continue;
+    }
+
+    s = guestfs_cat (g, path);
+    if (s == NULL) {
+      data->errors++;
+      continue;
+    }
+    if (strcmp (s, content) != 0) {
+      fprintf (stderr, "thread %d: read '%s', expected '%s'\n",
+               data->n, s, content);
+      data->errors++;
+    }
+    free (s);
+
+    /* This must fail, and the error must be the one from this thread. */
+    if (guestfs_rm (g, missing) != -1) {
+      fprintf (stderr, "thread %d: rm %s did not fail\n", data->n, missing);
+      data->errors++;
+      continue;
+    }
+    err = guestfs_last_error (g);
+    if (err == NULL || strstr (err, missing) == NULL) {
+      fprintf (stderr, "thread %d: unexpected error: %s\n",
+               data->n, err ? err : "(null)");
+      data->errors++;
+    }
+    if (guestfs_last_errno (g) != ENOENT) {
+      fprintf (stderr, "thread %d: unexpected errno: %d\n",
+               data->n, guestfs_last_errno (g));
+      data->errors++;
+    }
+  }
+
+  return NULL;
+}
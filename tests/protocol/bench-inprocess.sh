@@ -0,0 +1,80 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Benchmark the latency of daemon calls which are implemented in the
+# daemon itself (using libblkid, liblvm2app, etc. where the daemon was
+# built with them) against the fallbacks which run external programs.
+# The fallbacks are selected by putting guestfs_noinprocess=1 on the
+# appliance kernel command line.
+#
+# This is not run by 'make check'.  Run it by hand from this directory
+# after building libguestfs:
+#
+#   ../../run ./bench-inprocess.sh
+#
+# Set BENCH_ITERATIONS to the number of times each call is made
+# (default 100).
+
+set -e
+
+iterations=${BENCH_ITERATIONS:-100}
+img=bench-inprocess.img
+file=bench-inprocess.txt
+
+rm -f $img $file
+trap "rm -f $img $file" EXIT
+seq 1 200000 | sed 's/$/ hello world/' > $file
+
+../../fish/guestfish <<EOF
+sparse $img 1G
+run
+part-disk /dev/sda mbr
+pvcreate /dev/sda1
+vgcreate VG /dev/sda1
+lvcreate LV1 VG 256
+lvcreate LV2 VG 256
+mkfs ext4 /dev/VG/LV1
+mount-options "" /dev/VG/LV1 /
+upload $file /file
+EOF
+
+# Run one call many times.  Prints the average time per call in
+# milliseconds.
+bench ()
+{
+    local append="$1"; shift
+    (
+        echo "add-ro $img"
+        echo "append \"$append\""
+        echo "run"
+        echo "mount-ro /dev/VG/LV1 /"
+        for i in $(seq 1 $iterations); do
+            echo "time $@"
+        done
+    ) |
+    ../../fish/guestfish |
+    awk '/^elapsed time:/ { t += $3; n++ }
+         END { if (n > 0) printf "%.2f", 1000 * t / n; else print "-" }'
+}
+
+printf "%-28s %12s %12s\n" "call" "in-process/ms" "command/ms"
+for cmd in "vfs-type /dev/VG/LV1" "vfs-uuid /dev/VG/LV1" \
+           "pvs" "vgs" "lvs" "wc-l /file" "wc-w /file"; do
+    printf "%-28s %12s %12s\n" "$cmd" \
+        $(bench "" $cmd) $(bench "guestfs_noinprocess=1" $cmd)
+done
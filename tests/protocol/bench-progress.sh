@@ -0,0 +1,60 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Benchmark the cost of progress notifications during large file
+# transfers, by timing the same download and upload with progress
+# bars enabled and disabled.  With the progress callback registered
+# every progress message is decoded and delivered; without it the
+# library drops them without decoding.
+#
+# This is not run by 'make check'.  Run it by hand from this directory
+# after building libguestfs:
+#
+#   ../../run ./bench-progress.sh
+#
+# Set BENCH_SIZE to the size of the test disk (default 1G).
+
+set -e
+
+size=${BENCH_SIZE:-1G}
+img=bench-progress.img
+file=bench-progress.data
+
+rm -f $img $file
+trap "rm -f $img $file" EXIT
+truncate -s $size $img
+truncate -s $size $file
+
+# Prints the elapsed time of the transfer in seconds.
+bench ()
+{
+    local progress="$1"; shift
+    (
+        echo "add $img format:raw"
+        echo "run"
+        echo "time $@"
+    ) |
+    ../../fish/guestfish $progress 2>/dev/null |
+    awk '/^elapsed time:/ { printf "%.2f", $3 }'
+}
+
+printf "%-28s %12s %12s\n" "transfer" "progress/s" "none/s"
+for cmd in "download /dev/sda /dev/null" "upload $file /dev/sda"; do
+    printf "%-28s %12s %12s\n" "${cmd%% *}" \
+        $(bench --progress-bars $cmd) $(bench --no-progress-bars $cmd)
+done
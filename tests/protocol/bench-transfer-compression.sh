@@ -0,0 +1,86 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Benchmark file transfers with and without transfer compression
+# (guestfs_set_transfer_compression).
+#
+# This is not run by 'make check'.  Run it by hand from this directory
+# after building libguestfs:
+#
+#   ../../run ./bench-transfer-compression.sh
+#
+# It downloads a text-heavy directory tree (with tar-out) and an
+# incompressible file (with download), and prints the throughput of
+# each with compression off and on.  Set BENCH_SIZE to the size in
+# megabytes of each data set (default 64).
+
+set -e
+
+size=${BENCH_SIZE:-64}
+img=bench-transfer-compression.img
+tmpdir=bench-transfer-compression.d
+
+rm -rf $img $tmpdir
+trap "rm -rf $img $tmpdir" EXIT
+mkdir -p $tmpdir/text
+
+# A text-heavy tree of source-like files, and a file of random data
+# (which does not compress).
+i=0
+while [ $(du -sm $tmpdir/text | cut -f1) -lt $size ]; do
+    for j in $(seq 1 200); do
+        echo "static int function_$j (int arg_$i) { return arg_$i * $j + $((i % 7)); }"
+    done > $tmpdir/text/file$i.c
+    i=$((i+1))
+done
+tar -C $tmpdir/text -cf $tmpdir/text.tar .
+head -c ${size}M /dev/urandom > $tmpdir/random
+
+../../fish/guestfish <<EOF
+alloc $img $((size * 3 + 32))M
+run
+part-disk /dev/sda mbr
+mkfs ext4 /dev/sda1
+mount-options "" /dev/sda1 /
+mkdir /text
+tar-in $tmpdir/text.tar /text
+upload $tmpdir/random /random
+EOF
+
+# Time one operation.  Prints the elapsed time in seconds.
+bench ()
+{
+    local compress="$1"; shift
+    ../../fish/guestfish --ro -a $img -m /dev/sda1 <<EOF | awk '/^elapsed time:/ { print $3 }'
+transfer-compression $compress
+time $@
+EOF
+}
+
+printf "%-10s %-12s %10s %10s\n" "data" "compression" "seconds" "MB/s"
+for data in text random; do
+    case $data in
+        text)   cmd="tar-out /text /dev/null" ;;
+        random) cmd="download /random /dev/null" ;;
+    esac
+    for compress in false true; do
+        secs=$(bench $compress $cmd)
+        printf "%-10s %-12s %10s %10s\n" $data $compress $secs \
+            $(awk "BEGIN { if ($secs > 0) printf \"%.1f\", $size / $secs; else print \"-\" }")
+    done
+done
@@ -0,0 +1,91 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test filesystem-used-extents: write a file, then copy only the
+# extents it returns to a blank disk.  The file and the filesystem
+# must survive the copy, and on a mostly empty filesystem the extents
+# must cover much less than the whole device.
+
+set -e
+export LANG=C
+
+guestfish=../../fish/guestfish
+size=$((100 * 1024 * 1024))
+
+rm -f test1.img test2.img test.data test.extents
+
+truncate -s $size test1.img test2.img
+dd if=/dev/urandom of=test.data bs=1M count=4 2>/dev/null
+
+$guestfish -a test1.img <<EOF > test.extents
+run
+mkfs ext4 /dev/sda
+mount-options "" /dev/sda /
+mkdir /dir
+upload test.data /dir/data
+umount-all
+filesystem-used-extents /dev/sda
+EOF
+
+# Print each extent as "offset length".
+extents=$(awk '/extent_offset:/ { o = $2 }
+               /extent_length:/ { print o, $2 }' test.extents)
+
+if [ -z "$extents" ]; then
+    echo "$0: error: no extents returned"
+    cat test.extents
+    exit 1
+fi
+
+# Copy only the used extents to the blank disk.
+total=0
+while read offset length; do
+    if [ $((offset % 512)) -ne 0 ] || [ $((length % 512)) -ne 0 ]; then
+        echo "$0: error: extent $offset+$length is not sector aligned"
+        exit 1
+    fi
+    dd if=test1.img of=test2.img bs=512 conv=notrunc \
+        skip=$((offset / 512)) seek=$((offset / 512)) \
+        count=$((length / 512)) 2>/dev/null
+    total=$((total + length))
+done <<< "$extents"
+
+# A 4 MB file on a 100 MB filesystem: the extents (file data plus
+# metadata and journal) should be well under a quarter of the device.
+if [ $total -ge $((size / 4)) ]; then
+    echo "$0: error: extents cover $total of $size bytes"
+    exit 1
+fi
+
+output=$(
+$guestfish -a test2.img <<EOF
+run
+fsck ext4 /dev/sda
+mount-options "" /dev/sda /
+checksum md5 /dir/data
+EOF
+)
+
+if [ "$output" != "0
+$(md5sum < test.data | awk '{print $1}')" ]; then
+    echo "$0: error: file or filesystem damaged by copying only the used extents"
+    echo "$output"
+    exit 1
+fi
+
+rm -f test1.img test2.img test.data test.extents
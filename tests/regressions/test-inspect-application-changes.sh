@@ -0,0 +1,119 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test inspect-get-applications-token and
+# inspect-list-application-changes: unchanged, added, removed and
+# changed applications (including one with an empty name), and
+# rejection of an unknown token.
+
+set -e
+export LANG=C
+
+guestfish=../../fish/guestfish
+root=/dev/debian/root
+
+rm -f test1.img test.status1 test.status2 test.out
+
+cp ../guests/debian.img test1.img
+
+cat <<'EOF' > test.status1
+Package: 
+Status: install ok installed
+Version: 1.0-1
+
+Package: test1
+Status: install ok installed
+Version: 1.2.3-1
+
+Package: test2
+Status: install ok installed
+Version: 1.2.3-1
+
+Package: test3
+Status: install ok installed
+Version: 1.2.3-1
+
+EOF
+
+cat <<'EOF' > test.status2
+Package: 
+Status: install ok installed
+Version: 2.0-1
+
+Package: test1
+Status: install ok installed
+Version: 1.2.3-1
+
+Package: test2
+Status: install ok installed
+Version: 1.2.4-1
+
+Package: test4
+Status: install ok installed
+Version: 1.0-1
+
+EOF
+
+# Print each change as "type:name".
+changes ()
+{
+    $guestfish --remote \
+        inspect-list-application-changes $root "$1" > test.out || return 1
+    awk '/change_type:/ { t = $2 }
+         /change_name:/ { sub (/^ *change_name: /, ""); print t ":" $0 }' \
+        test.out
+}
+
+eval `$guestfish --listen -a test1.img -i`
+
+$guestfish --remote upload test.status1 /var/lib/dpkg/status
+token=$($guestfish --remote inspect-get-applications-token $root)
+
+# Unchanged.
+output=$(changes "$token")
+if [ "$output" != "" ]; then
+    echo "$0: error: unexpected changes before the database was modified"
+    echo "$output"
+    $guestfish --remote exit
+    exit 1
+fi
+
+# Added, removed and changed.
+$guestfish --remote upload test.status2 /var/lib/dpkg/status
+output=$(changes "$token")
+if [ "$output" != "changed:
+changed:test2
+removed:test3
+added:test4" ]; then
+    echo "$0: error: unexpected changes after the database was modified"
+    echo "$output"
+    $guestfish --remote exit
+    exit 1
+fi
+
+# A token that this handle did not return is rejected.  The failed
+# command makes the listener exit.
+if $guestfish --remote \
+    inspect-list-application-changes $root "1/0.0.0.0" >/dev/null 2>&1; then
+    echo "$0: error: unknown token was not rejected"
+    $guestfish --remote exit
+    exit 1
+fi
+$guestfish --remote exit 2>/dev/null ||:
+
+rm -f test1.img test.status1 test.status2 test.out
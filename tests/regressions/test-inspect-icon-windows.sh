@@ -0,0 +1,86 @@
+#!/bin/bash -
+# libguestfs
+# Copyright (C) 2012 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Test inspect-get-icon for Windows: put a small PE executable
+# containing a bitmap resource into the phony Windows 7 guest as
+# explorer.exe, and check that the daemon returns it as a PNG of the
+# expected size.
+
+set -e
+export LANG=C
+
+guestfish=../../fish/guestfish
+
+if [ ! -s ../guests/windows.img ]; then
+    echo "$0: test skipped because there is no windows.img"
+    exit 0
+fi
+
+rm -f test1.img test.exe test.png
+
+cp ../guests/windows.img test1.img
+
+# Build a PE executable with a single section containing the
+# resource directory: RT_BITMAP (2) / 6801 / language 1033, whose
+# data is a 48x80 24 bit bottom-up DIB.  For Windows 7 only the top
+# 55 rows are returned (see src/inspect_icon.c).
+perl -e '
+  my ($w, $h) = (48, 80);
+  my $stride = (($w * 24 + 31) >> 5) * 4;
+  my $dib = pack ("VVVvvVVVVVV", 40, $w, $h, 1, 24, 0, 0, 0, 0, 0, 0);
+  for my $y (0 .. $h-1) {
+    my $row = "";
+    $row .= pack ("CCC", $_ * 5, $y * 3, 128) for 0 .. $w-1;
+    $dib .= $row . "\0" x ($stride - length $row);
+  }
+
+  my $rva = 0x2000;
+  my $dir = sub { pack ("VVvvvv", 0, 0, 0, 0, 0, $_[0]) };
+  my $rsrc =
+    $dir->(1) . pack ("VV", 2, 0x80000000 | 24) .
+    $dir->(1) . pack ("VV", 6801, 0x80000000 | 48) .
+    $dir->(1) . pack ("VV", 1033, 72) .
+    pack ("VVVV", $rva + 88, length $dib, 0, 0) .
+    $dib;
+
+  my $mz = "MZ" . "\0" x 58 . pack ("V", 64);
+  my $coff = "PE\0\0" . pack ("vvVVVvv", 0x14c, 1, 0, 0, 0, 224, 0);
+  my $opt = "\0" x 224;
+  substr ($opt, 0, 2) = pack ("v", 0x10b);
+  substr ($opt, 92, 4) = pack ("V", 16);
+  substr ($opt, 112, 8) = pack ("VV", $rva, length $rsrc);
+  my $sec = ".rsrc\0\0\0" .
+    pack ("VVVVVVvvV", length $rsrc, $rva, length $rsrc, 0x400, 0, 0, 0, 0, 0);
+  my $hdr = $mz . $coff . $opt . $sec;
+  print $hdr, "\0" x (0x400 - length $hdr), $rsrc;
+' > test.exe
+
+$guestfish -a test1.img -i upload test.exe /Windows/explorer.exe
+
+$guestfish --ro -a test1.img -i inspect-get-icon /dev/sda2 > test.png
+
+# Check the PNG signature and the width and height in the IHDR chunk.
+output=$(od -A n -t x1 -N 24 test.png | tr -d ' \n')
+if [ "$output" != \
+"89504e470d0a1a0a0000000d494844520000003000000037" ]; then
+    echo "$0: error: unexpected PNG header"
+    echo "$output"
+    exit 1
+fi
+
+rm -f test1.img test.exe test.png